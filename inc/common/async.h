@@ -18,7 +18,32 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
-#if USE_CLIENT
+//
+// job system
+//
+// Jobs run on worker threads and must not print, allocate zone memory or
+// throw errors. Jobs may queue other jobs. Counter must be zero filled
+// before first use and must stay valid until all jobs tied to it are done.
+//
+
+typedef struct {
+    int             pending;    // number of unfinished jobs
+    struct job_s    *waiting;   // jobs to start once pending drops to zero
+} jobcounter_t;
+
+typedef void (*jobfunc_t)(void *);
+
+void Com_QueueJob(jobfunc_t func, void *arg, jobcounter_t *counter, jobcounter_t *after);
+void Com_WaitJobs(jobcounter_t *counter);
+bool Com_JobsDone(jobcounter_t *counter);
+int Com_NumWorkers(void);
+
+//
+// async work
+//
+// Work callback runs on a worker thread, done callback runs on the main
+// thread from Com_CompleteAsyncWork.
+//
 
 typedef struct asyncwork_s {
     void (*work_cb)(void *);
@@ -27,14 +52,28 @@ typedef struct asyncwork_s {
     struct asyncwork_s *next;
 } asyncwork_t;
 
+void Com_InitAsyncWork(void);
 void Com_QueueAsyncWork(asyncwork_t *work);
 void Com_CompleteAsyncWork(void);
 void Com_ShutdownAsyncWork(void);
 
-#else
+//
+// log writer
+//
+// Records are copied into a ring buffer by the main thread and written to
+// file by a background thread in the same order. Records that don't fit
+// are dropped and counted. Writer owns the file handle.
+//
+
+typedef struct logwriter_s logwriter_t;
 
-#define Com_QueueAsyncWork(work)    (void)0
-#define Com_CompleteAsyncWork()     (void)0
-#define Com_ShutdownAsyncWork()     (void)0
+// called on writer thread to write a binary record
+typedef void (*logformat_t)(qhandle_t f, const void *data, size_t len);
 
-#endif
+logwriter_t *Com_OpenLogWriter(qhandle_t f, size_t size, logformat_t format);
+int Com_WriteLog(logwriter_t *w, const void *data, size_t len);
+int Com_WriteLogRecord(logwriter_t *w, const void *head, size_t head_len,
+                       const void *data, size_t len);
+int Com_FlushLog(logwriter_t *w);
+int Com_CloseLogWriter(logwriter_t *w);
+unsigned Com_LogDropped(const logwriter_t *w);
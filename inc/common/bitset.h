@@ -0,0 +1,45 @@
+/*
+Copyright (C) 2023 Andrey Nazarov
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+//
+// bit array operations
+//
+// Bit N is stored in byte N >> 3 as (1 << (N & 7)), same as Q_IsBitSet()
+// and vis rows. Sizes are in bytes and don't need to be word multiples.
+// Arrays may be unaligned. Safe to call from worker threads.
+//
+
+// dst |= src
+void BitSet_Or(byte *dst, const byte *src, size_t size);
+
+// dst &= src
+void BitSet_And(byte *dst, const byte *src, size_t size);
+
+// returns true if (a & b) is not empty
+bool BitSet_Intersects(const byte *a, const byte *b, size_t size);
+
+// returns number of set bits
+size_t BitSet_Count(const byte *bits, size_t size);
+
+// returns index of the first set bit at or after start, -1 if none
+int BitSet_Next(const byte *bits, size_t size, int start);
+
+#define BITSET_FOR_EACH(bits, size, i) \
+    for (i = BitSet_Next(bits, size, 0); i != -1; i = BitSet_Next(bits, size, i + 1))
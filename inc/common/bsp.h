@@ -161,9 +161,15 @@ typedef struct {
     int                 contents;
     int                 numsides;
     mbrushside_t        *firstbrushside;
-    unsigned            checkcount;         // to avoid repeated testings
+    vec3_t              mins, maxs;         // from axial sides, infinite if missing
+    float               *planes;            // sides packed in groups of 4, see below
 } mbrush_t;
 
+// brush sides are packed for SIMD as { nx[4], ny[4], nz[4], dist[4] } groups,
+// last group padded with planes that don't clip anything
+#define BRUSH_GROUP_FLOATS  16
+#define BRUSH_NUM_GROUPS(n) (((n) + 3) >> 2)
+
 typedef struct {
     /* ======> */
     cplane_t            *plane;     // always NULL to differentiate from nodes
@@ -220,6 +226,15 @@ typedef struct mmodel_s {
 #endif
 } mmodel_t;
 
+// uniform grid over world bounds, each cell points to the deepest node
+// that contains the whole cell, or to the leaf if there is just one
+typedef struct {
+    vec3_t          mins;
+    float           scale;          // 1 / cell size
+    int             size[3];
+    mnode_t         **cells;        // NULL if disabled
+} mleafgrid_t;
+
 typedef struct bsp_s {
     list_t      entry;
     int         refcount;
@@ -251,6 +266,9 @@ typedef struct bsp_s {
 
     int             numbrushes;
     mbrush_t        *brushes;
+    float           *brushplanes;   // not part of the hunk
+
+    mleafgrid_t     leafgrid;       // not part of the hunk
 
     int             numvisibility;
     int             visrowsize;
@@ -296,6 +314,7 @@ typedef struct bsp_s {
 
 	byte            *pvs_matrix;
 	byte            *pvs2_matrix;
+    byte            *phs_matrix;
 	bool            pvs_patched;
 
     bool            extended;
@@ -325,12 +344,16 @@ void BSP_TransformedLightPoint(lightpoint_t *point, const vec3_t start, const ve
                                mnode_t *headnode, const vec3_t origin, const vec3_t angles);
 #endif
 
+void BSP_PackBrush(mbrush_t *brush, float *planes);
 byte *BSP_ClusterVis(bsp_t *bsp, byte *mask, int cluster, int vis);
+const byte *BSP_ClusterVisRow(const bsp_t *bsp, int cluster, int vis);
 mleaf_t *BSP_PointLeaf(mnode_t *node, const vec3_t p);
+mleaf_t *BSP_GridPointLeaf(const bsp_t *bsp, const vec3_t p);
 mmodel_t *BSP_InlineModel(bsp_t *bsp, const char *name);
 
 byte* BSP_GetPvs(bsp_t *bsp, int cluster);
 byte* BSP_GetPvs2(bsp_t *bsp, int cluster);
+byte *BSP_GetPhs(bsp_t *bsp, int cluster);
 
 bool BSP_SavePatchedPVS(bsp_t *bsp);
 
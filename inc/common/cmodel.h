@@ -24,6 +24,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAX_MAP_AREA_BYTES      (MAX_MAP_AREAS / 8)
 #define MAX_MAP_PORTAL_BYTES    128
 
+// max number of clusters touched by fat PVS box
+#define MAX_FAT_CLUSTERS        64
+
 typedef struct {
     bsp_t       *cache;
     int         *floodnums;     // if two areas have equal floodnums,
@@ -34,7 +37,44 @@ typedef struct {
     char        *entitystring;
 } cm_t;
 
+//
+// Trace context holds all state of a trace in progress, including the
+// private box hull. Each thread doing traces must use its own context.
+// Functions without context argument use the shared default context and
+// may only be called from the main thread.
+//
+
+#define CM_CHECKED_BRUSHES  512     // must be power of two
+
+typedef struct {
+    vec3_t          start, end;
+    vec3_t          offsets[8];
+    vec3_t          extents;
+    vec3_t          absmins, absmaxs;   // swept box, for brush culling
+    trace_t         *trace;
+    int             contents;
+    bool            ispoint;        // optimized case
+
+    // visited brushes, direct mapped. Collision only makes a brush to be
+    // tested twice during the same trace, which is harmless.
+    unsigned        checkcount;
+    struct {
+        const mbrush_t  *brush;
+        unsigned        checkcount;
+    } checked[CM_CHECKED_BRUSHES];
+
+    cplane_t        box_planes[12];
+    mnode_t         box_nodes[6];
+    mbrush_t        box_brush;
+    float           box_packed[BRUSH_GROUP_FLOATS * 2];
+    mbrush_t        *box_leafbrush;
+    mbrushside_t    box_brushsides[6];
+    mleaf_t         box_leaf;
+    mleaf_t         box_emptyleaf;
+} cm_trace_ctx_t;
+
 void        CM_Init(void);
+void        CM_InitTraceCtx(cm_trace_ctx_t *ctx);
 
 void        CM_FreeMap(cm_t *cm);
 int         CM_LoadMap(cm_t *cm, const char *name);
@@ -50,14 +90,29 @@ mleaf_t     *CM_LeafNum(cm_t *cm, int number);
 
 #define CM_NumNode(cm, node) ((node) ? ((node) - (cm)->cache->nodes) : -1)
 
-// creates a clipping hull for an arbitrary box
-mnode_t     *CM_HeadnodeForBox(const vec3_t mins, const vec3_t maxs);
+// creates a clipping hull for an arbitrary box, valid only for traces
+// using the same context until next call
+mnode_t     *CM_HeadnodeForBoxCtx(cm_trace_ctx_t *ctx, const vec3_t mins, const vec3_t maxs);
 
 // returns an ORed contents mask
 int         CM_PointContents(const vec3_t p, mnode_t *headnode);
+int         CM_TransformedPointContentsCtx(cm_trace_ctx_t *ctx, const vec3_t p, mnode_t *headnode,
+                                           const vec3_t origin, const vec3_t angles);
+
+void        CM_BoxTraceCtx(cm_trace_ctx_t *ctx, trace_t *trace,
+                           const vec3_t start, const vec3_t end,
+                           const vec3_t mins, const vec3_t maxs,
+                           mnode_t *headnode, int brushmask);
+void        CM_TransformedBoxTraceCtx(cm_trace_ctx_t *ctx, trace_t *trace,
+                                      const vec3_t start, const vec3_t end,
+                                      const vec3_t mins, const vec3_t maxs,
+                                      mnode_t *headnode, int brushmask,
+                                      const vec3_t origin, const vec3_t angles);
+
+// same as above, using the default context
+mnode_t     *CM_HeadnodeForBox(const vec3_t mins, const vec3_t maxs);
 int         CM_TransformedPointContents(const vec3_t p, mnode_t *headnode,
                                         const vec3_t origin, const vec3_t angles);
-
 void        CM_BoxTrace(trace_t *trace,
                         const vec3_t start, const vec3_t end,
                         const vec3_t mins, const vec3_t maxs,
@@ -70,12 +125,15 @@ void        CM_TransformedBoxTrace(trace_t *trace,
 void        CM_ClipEntity(trace_t *dst, const trace_t *src, struct edict_s *ent);
 
 // call with topnode set to the headnode, returns with topnode
-// set to the first node that splits the box
+// set to the first node that splits the box. Keeps no global state,
+// may be called from any thread, as may CM_PointContents.
 int         CM_BoxLeafs(cm_t *cm, const vec3_t mins, const vec3_t maxs,
                         mleaf_t **list, int listsize, mnode_t **topnode);
 mleaf_t     *CM_PointLeaf(cm_t *cm, const vec3_t p);
 
 byte        *CM_FatPVS(cm_t *cm, byte *mask, const vec3_t org, int vis);
+int         CM_FatClusters(cm_t *cm, const vec3_t org, int *clusters);
+byte        *CM_ClustersVis(cm_t *cm, byte *mask, const int *clusters, int count, int vis);
 
 void        CM_SetAreaPortalState(cm_t *cm, int portalnum, bool open);
 bool        CM_AreasConnected(cm_t *cm, int area1, int area2);
@@ -132,6 +132,8 @@ void        Com_AddConfigFile(const char *name, unsigned flags);
 extern cvar_t   *z_perturb;
 #endif
 
+extern cvar_t   *z_profile;
+
 #if USE_DEBUG
 extern cvar_t   *developer;
 #endif
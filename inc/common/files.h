@@ -64,6 +64,8 @@ void    FS_AddConfigFiles(bool init);
 int FS_RenameFile(const char *from, const char *to);
 #endif
 
+void FS_FlushPathCache(void);
+
 int FS_CreatePath(char *path);
 
 char    *FS_CopyExtraInfo(const char *name, const file_info_t *info);
@@ -102,6 +104,36 @@ int FS_Seek(qhandle_t f, int64_t offset, int whence);
 
 int64_t FS_Length(qhandle_t f);
 
+int FS_GetFileInfo(qhandle_t f, file_info_t *info);
+
+typedef struct {
+    void    *data;      // file contents
+    size_t  len;
+    void    *base;      // mapped region
+    size_t  size;
+} fs_mapping_t;
+
+int FS_MapHandle(qhandle_t f, fs_mapping_t *map);
+int FS_MapFileEx(const char *path, fs_mapping_t *map, unsigned flags);
+void FS_UnmapFile(fs_mapping_t *map);
+
+#define FS_MapFile(path, map)   FS_MapFileEx(path, map, 0)
+
+// thread safe whole file reads
+typedef struct {
+    FILE    *fp;        // private handle, if any
+    int     fd;         // shared pack descriptor for pread()
+    int64_t pos;
+    int64_t complen;
+    int64_t length;
+    int     compmtd;
+    bool    active;
+} fs_shared_t;
+
+int64_t FS_OpenShared(const char *path, fs_shared_t *f, unsigned mode);
+int FS_ReadShared(fs_shared_t *f, void *buf, size_t len);
+void FS_CloseShared(fs_shared_t *f);
+
 bool FS_WildCmp(const char *filter, const char *string);
 bool FS_ExtCmp(const char *extension, const char *string);
 
@@ -92,7 +92,9 @@ typedef enum {
     MSG_ES_REMOVE       = BIT(8),   // entity is removed (MVD stream only)
 } msgEsFlags_t;
 
-extern sizebuf_t    msg_write;
+// each thread has its own writing buffer, worker threads must
+// point it to their own storage before using any MSG_Write* functions
+extern q_thread_local sizebuf_t msg_write;
 extern byte         msg_write_buffer[MAX_MSGLEN];
 
 extern sizebuf_t    msg_read;
@@ -37,6 +37,7 @@ typedef enum {
     TAG_MVD,
     TAG_SOUND,
     TAG_CMODEL,
+    TAG_TEST,       // for test commands only
 
     TAG_MAX
 } memtag_t;
@@ -45,15 +46,33 @@ void    Z_Init(void);
 void    Z_Free(void *ptr);
 // Frees the memory block pointed at by (*ptr), if that's nonzero, and sets (*ptr) to zero.
 void    Z_Freep(void **ptr);
-void    *Z_Realloc(void *ptr, size_t size);
-void    *Z_Malloc(size_t size) q_malloc;
-void    *Z_Mallocz(size_t size) q_malloc;
-void    *Z_TagMalloc(size_t size, memtag_t tag) q_malloc;
-void    *Z_TagMallocz(size_t size, memtag_t tag) q_malloc;
-char    *Z_TagCopyString(const char *in, memtag_t tag) q_malloc;
+void    *Z_ReallocAt(void *ptr, size_t size, const char *file, int line);
+void    *Z_TagMallocAt(size_t size, memtag_t tag, const char *file, int line) q_malloc;
+void    *Z_TagMalloczAt(size_t size, memtag_t tag, const char *file, int line) q_malloc;
+char    *Z_TagCopyStringAt(const char *in, memtag_t tag, const char *file, int line) q_malloc;
 void    Z_FreeTags(memtag_t tag);
 void    Z_LeakTest(memtag_t tag);
+// returns number of live blocks and bytes, including headers
+void    Z_TagStats(memtag_t tag, size_t *count, size_t *bytes);
+// allows using engine tag from worker threads
+void    Z_SetThreadSafe(memtag_t tag);
 void    Z_Stats_f(void);
+void    Z_Profile_f(void);
 
 // may return pointer to static memory
-char    *Z_CvarCopyString(const char *in);
+char    *Z_CvarCopyStringAt(const char *in, const char *file, int line);
+
+// allocations record their call site when z_profile is enabled
+#define Z_Realloc(ptr, size)        Z_ReallocAt(ptr, size, __FILE__, __LINE__)
+#define Z_Malloc(size)              Z_TagMallocAt(size, TAG_GENERAL, __FILE__, __LINE__)
+#define Z_Mallocz(size)             Z_TagMalloczAt(size, TAG_GENERAL, __FILE__, __LINE__)
+#define Z_TagMalloc(size, tag)      Z_TagMallocAt(size, tag, __FILE__, __LINE__)
+#define Z_TagMallocz(size, tag)     Z_TagMalloczAt(size, tag, __FILE__, __LINE__)
+#define Z_TagCopyString(in, tag)    Z_TagCopyStringAt(in, tag, __FILE__, __LINE__)
+#define Z_CvarCopyString(in)        Z_CvarCopyStringAt(in, __FILE__, __LINE__)
+
+// allocation site profiler, also used by hunk allocator.
+// site 0 means allocation is not tracked.
+unsigned Z_ProfileSite(const char *file, int line);
+void    Z_ProfileAlloc(unsigned site, unsigned tag, size_t size, int blocks);
+void    Z_ProfileFree(unsigned site, size_t size, int blocks);
@@ -68,6 +68,7 @@ typedef enum {
 #define GMF_IPV6_ADDRESS_AWARE      BIT(13)     // game supports IPv6 addresses
 #define GMF_ALLOW_INDEX_OVERFLOW    BIT(14)     // game wants PF_FindIndex() to return 0 on overflow
 #define GMF_PROTOCOL_EXTENSIONS     BIT(15)     // game supports protocol extensions
+#define GMF_BATCH_TRACES            BIT(16)     // game uses game_import_ex_t TraceBatch()
 
 //===============================================================
 
@@ -277,7 +278,15 @@ typedef game_export_t *(*game_entry_t)(game_import_t *);
  * game_export_ex_t structures, provided GAME_API_VERSION_EX is also bumped.
  */
 
-#define GAME_API_VERSION_EX     1
+#define GAME_API_VERSION_EX     2
+
+// one move for TraceBatch(), same arguments as trace()
+typedef struct {
+    vec3_t      start, end;
+    vec3_t      mins, maxs;     // zero for point traces
+    edict_t     *passent;
+    int         contentmask;
+} trace_request_t;
 
 typedef struct {
     int     apiversion;
@@ -298,6 +307,10 @@ typedef struct {
 
     const char *(*ErrorString)(int error);
     void    *(*TagRealloc)(void *ptr, size_t size);
+
+    // API version 2
+    // same as calling trace() for each request, but may be much faster
+    void    (*TraceBatch)(const trace_request_t *requests, trace_t *results, int count);
 } game_import_ex_t;
 
 typedef struct {
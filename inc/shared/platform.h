@@ -122,6 +122,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define q_unused            __attribute__((unused))
 
+#define q_thread_local      __thread
+
 #else /* __GNUC__ */
 
 #define q_printf(f, a)
@@ -149,4 +151,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define q_unused
 
+#ifdef _MSC_VER
+#define q_thread_local      __declspec(thread)
+#else
+#define q_thread_local      _Thread_local
+#endif
+
 #endif /* !__GNUC__ */
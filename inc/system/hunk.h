@@ -23,14 +23,17 @@ typedef struct {
     size_t  maxsize;
     size_t  cursize;
     size_t  mapped;
+    unsigned    site;   // for profiling
 } memhunk_t;
 
 // hunk allocation alignment is rounded to cacheline
 #define HUNK_ALIGN      64
 
 void    Hunk_Init(void);
-void    Hunk_Begin(memhunk_t *hunk, size_t maxsize);
+void    Hunk_BeginAt(memhunk_t *hunk, size_t maxsize, const char *file, int line);
 void    *Hunk_TryAlloc(memhunk_t *hunk, size_t size);
 void    *Hunk_Alloc(memhunk_t *hunk, size_t size);
 void    Hunk_End(memhunk_t *hunk);
 void    Hunk_Free(memhunk_t *hunk);
+
+#define Hunk_Begin(hunk, maxsize)   Hunk_BeginAt(hunk, maxsize, __FILE__, __LINE__)
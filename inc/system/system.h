@@ -34,7 +34,9 @@ void    Sys_FreeLibrary(void *handle);
 void    *Sys_GetProcAddress(void *handle, const char *sym);
 
 unsigned Sys_Milliseconds(void);
+uint64_t Sys_Microseconds(void);
 void     Sys_Sleep(int msec);
+int      Sys_NumCpus(void);
 
 void    Sys_Init(void);
 void    Sys_AddDefaultConfig(void);
@@ -59,6 +61,11 @@ void    Sys_Error(const char *error, ...) q_noreturn q_printf(1, 2);
 void    Sys_Quit(void) q_noreturn;
 
 void    Sys_ListFiles_r(listfiles_t *list, const char *path, int depth);
+
+// maps len bytes of file starting at offset read-only, returns pointer to
+// data. base and size receive the region to be passed to Sys_UnmapFile.
+void    *Sys_MapFile(int fd, int64_t offset, size_t len, void **base, size_t *size);
+void    Sys_UnmapFile(void *base, size_t size);
 bool    Sys_IsDir(const char *path);
 bool    Sys_IsFile(const char *path);
 
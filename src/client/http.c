@@ -863,6 +863,8 @@ fail2:
                             dl->path, dl->queue->path, strerror(errno));
             dl->path[0] = 0;
 
+            FS_FlushPathCache();
+
             //a pak file is very special...
             if (dl->queue->type == DL_PAK) {
                 CL_RestartFilesystem(!*fs_game->string);
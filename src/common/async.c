@@ -17,102 +17,713 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "shared/shared.h"
+#include "shared/atomic.h"
 #include "common/async.h"
+#include "common/common.h"
+#include "common/cvar.h"
+#include "common/files.h"
 #include "common/zone.h"
+#include "system/system.h"
 #include "system/pthread.h"
 
-static bool work_initialized;
-static bool work_terminate;
-static pthread_mutex_t work_lock;
-static pthread_cond_t work_cond;
-static pthread_t work_thread;
-static asyncwork_t *pend_head;
-static asyncwork_t *done_head;
+/*
+==============================================================================
+
+JOB SYSTEM
+
+Each worker thread has its own deque of jobs. A worker pushes jobs it
+queues itself to the tail of its own deque and pops them from there. When
+its own deque is empty, an idle worker steals jobs from the head of other
+workers' deques. Jobs queued from other threads are distributed between
+workers in round-robin order. Threads waiting for jobs to complete help
+executing them.
+
+==============================================================================
+*/
+
+#define MAX_WORKERS     32
+#define MAX_JOBS        4096    // must be power of two
+
+typedef struct job_s {
+    jobfunc_t       func;
+    void            *arg;
+    jobcounter_t    *counter;
+    struct job_s    *next;      // free or waiting list
+} job_t;
 
-static void append_work(asyncwork_t **head, asyncwork_t *work)
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t       thread;
+    unsigned        head;       // steal from here
+    unsigned        tail;       // owner pushes and pops here
+    job_t           *jobs[MAX_JOBS];
+} worker_t;
+
+static cvar_t   *com_workers;
+
+static worker_t     *workers;
+static int          numworkers;
+static q_thread_local int   worker_index;   // 1..numworkers for workers, 0 otherwise
+
+static bool             job_initialized;
+static bool             job_terminate;
+static pthread_mutex_t  job_lock;   // protects everything below and job counters
+static pthread_cond_t   job_cond;
+static job_t            job_pool[MAX_JOBS];
+static job_t            *job_free;
+static int              job_queued;     // number of jobs in deques
+static unsigned         job_rover;
+
+// async work
+static pthread_mutex_t  done_lock;
+static asyncwork_t      *done_head;
+static asyncwork_t      **done_tail;
+static jobcounter_t     done_counter;
+
+// must be called with job_lock held
+static void push_job(job_t *job)
 {
-    asyncwork_t *c, **p;
-    for (p = head, c = *head; c; p = &c->next, c = c->next)
-        ;
-    work->next = NULL;
-    *p = work;
+    worker_t *w;
+
+    if (worker_index)
+        w = &workers[worker_index - 1];
+    else
+        w = &workers[job_rover++ % numworkers];
+
+    pthread_mutex_lock(&w->lock);
+    w->jobs[w->tail++ & (MAX_JOBS - 1)] = job;
+    pthread_mutex_unlock(&w->lock);
+
+    job_queued++;
+    pthread_cond_signal(&job_cond);
+}
+
+static job_t *take_job(void)
+{
+    worker_t *w;
+    job_t *job = NULL;
+    int i, start;
+
+    // pop own job first
+    if (worker_index) {
+        w = &workers[worker_index - 1];
+        pthread_mutex_lock(&w->lock);
+        if (w->tail != w->head)
+            job = w->jobs[--w->tail & (MAX_JOBS - 1)];
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    // steal oldest job from others
+    start = worker_index;
+    for (i = 0; i < numworkers && !job; i++) {
+        w = &workers[(start + i) % numworkers];
+        pthread_mutex_lock(&w->lock);
+        if (w->tail != w->head)
+            job = w->jobs[w->head++ & (MAX_JOBS - 1)];
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (job) {
+        pthread_mutex_lock(&job_lock);
+        job_queued--;
+        pthread_mutex_unlock(&job_lock);
+    }
+
+    return job;
+}
+
+static void run_job(job_t *job)
+{
+    jobcounter_t *counter = job->counter;
+    job_t *next;
+
+    job->func(job->arg);
+
+    pthread_mutex_lock(&job_lock);
+
+    if (counter && !--counter->pending) {
+        // start dependent jobs
+        for (job_t *dep = counter->waiting; dep; dep = next) {
+            next = dep->next;
+            push_job(dep);
+        }
+        counter->waiting = NULL;
+        pthread_cond_broadcast(&job_cond);
+    }
+
+    job->next = job_free;
+    job_free = job;
+
+    pthread_mutex_unlock(&job_lock);
 }
 
-static void *work_func(void *arg)
+static void *worker_func(void *arg)
 {
-    pthread_mutex_lock(&work_lock);
+    job_t *job;
+    bool terminate;
+
+    worker_index = (intptr_t)arg;
+
     while (1) {
-        while (!pend_head && !work_terminate)
-            pthread_cond_wait(&work_cond, &work_lock);
+        job = take_job();
+        if (job) {
+            run_job(job);
+            continue;
+        }
 
-        asyncwork_t *work = pend_head;
-        if (!work)
+        pthread_mutex_lock(&job_lock);
+        while (!job_queued && !job_terminate)
+            pthread_cond_wait(&job_cond, &job_lock);
+        terminate = job_terminate && !job_queued;
+        pthread_mutex_unlock(&job_lock);
+
+        if (terminate)
             break;
-        pend_head = work->next;
+    }
+
+    return NULL;
+}
 
-        pthread_mutex_unlock(&work_lock);
-        work->work_cb(work->cb_arg);
-        pthread_mutex_lock(&work_lock);
+static void start_workers(void)
+{
+    int i, count;
 
-        append_work(&done_head, work);
+    // default to one worker per core, leaving one core for main thread.
+    // zero runs all jobs on the calling thread.
+    count = com_workers->integer;
+    if (count < 0) {
+        count = Sys_NumCpus() - 1;
+        count = max(count, 1);
     }
-    pthread_mutex_unlock(&work_lock);
+    count = min(count, MAX_WORKERS);
 
-    return NULL;
+    pthread_mutex_init(&job_lock, NULL);
+    pthread_cond_init(&job_cond, NULL);
+    pthread_mutex_init(&done_lock, NULL);
+
+    job_free = NULL;
+    for (i = MAX_JOBS - 1; i >= 0; i--) {
+        job_pool[i].next = job_free;
+        job_free = &job_pool[i];
+    }
+
+    job_terminate = false;
+    job_queued = 0;
+    job_rover = 0;
+
+    done_head = NULL;
+    done_tail = &done_head;
+
+    if (count)
+        workers = Z_Mallocz(sizeof(workers[0]) * count);
+
+    for (i = 0; i < count; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (pthread_create(&workers[i].thread, NULL, worker_func, (void *)(intptr_t)(i + 1))) {
+            Com_WPrintf("Couldn't create worker thread\n");
+            pthread_mutex_destroy(&workers[i].lock);
+            break;
+        }
+    }
+
+    numworkers = i;
+    if (!numworkers)
+        Z_Freep((void **)&workers);
+
+    job_initialized = true;
 }
 
-void Com_QueueAsyncWork(asyncwork_t *work)
+static void stop_workers(void)
+{
+    int i;
+
+    pthread_mutex_lock(&job_lock);
+    job_terminate = true;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    for (i = 0; i < numworkers; i++) {
+        Q_assert(!pthread_join(workers[i].thread, NULL));
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+
+    Z_Freep((void **)&workers);
+    numworkers = 0;
+
+    pthread_mutex_destroy(&job_lock);
+    pthread_cond_destroy(&job_cond);
+    pthread_mutex_destroy(&done_lock);
+
+    job_initialized = false;
+}
+
+/*
+==================
+Com_QueueJob
+
+Queues func to be called with arg on a worker thread. If counter is not
+NULL, it is incremented now and decremented once job is finished. If after
+is not NULL, job doesn't start until all jobs tied to that counter are
+finished. With no worker threads jobs are run immediately.
+==================
+*/
+void Com_QueueJob(jobfunc_t func, void *arg, jobcounter_t *counter, jobcounter_t *after)
+{
+    job_t *job;
+
+    if (!job_initialized)
+        start_workers();
+
+    if (!numworkers) {
+        func(arg);
+        return;
+    }
+
+    pthread_mutex_lock(&job_lock);
+
+    job = job_free;
+    if (!job) {
+        // out of jobs, run it now
+        pthread_mutex_unlock(&job_lock);
+        Com_WaitJobs(after);
+        func(arg);
+        return;
+    }
+    job_free = job->next;
+
+    job->func = func;
+    job->arg = arg;
+    job->counter = counter;
+    if (counter)
+        counter->pending++;
+
+    if (after && after->pending) {
+        job->next = after->waiting;
+        after->waiting = job;
+    } else {
+        push_job(job);
+    }
+
+    pthread_mutex_unlock(&job_lock);
+}
+
+/*
+==================
+Com_WaitJobs
+
+Blocks until all jobs tied to counter are finished, executing queued jobs
+in the meantime.
+==================
+*/
+void Com_WaitJobs(jobcounter_t *counter)
 {
-    if (!work_initialized) {
-        pthread_mutex_init(&work_lock, NULL);
-        pthread_cond_init(&work_cond, NULL);
-        if (pthread_create(&work_thread, NULL, work_func, NULL))
-            Com_Error(ERR_FATAL, "Couldn't create async work thread");
-        work_initialized = true;
+    job_t *job;
+
+    if (!counter || !numworkers)
+        return;
+
+    while (1) {
+        pthread_mutex_lock(&job_lock);
+        if (!counter->pending) {
+            pthread_mutex_unlock(&job_lock);
+            return;
+        }
+        pthread_mutex_unlock(&job_lock);
+
+        job = take_job();
+        if (job) {
+            run_job(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&job_lock);
+        while (counter->pending && !job_queued)
+            pthread_cond_wait(&job_cond, &job_lock);
+        pthread_mutex_unlock(&job_lock);
     }
+}
+
+bool Com_JobsDone(jobcounter_t *counter)
+{
+    bool done;
+
+    if (!numworkers)
+        return true;
+
+    pthread_mutex_lock(&job_lock);
+    done = !counter->pending;
+    pthread_mutex_unlock(&job_lock);
+
+    return done;
+}
+
+int Com_NumWorkers(void)
+{
+    if (!job_initialized)
+        start_workers();
+
+    return numworkers;
+}
+
+/*
+==============================================================================
+
+ASYNC WORK
+
+==============================================================================
+*/
 
-    pthread_mutex_lock(&work_lock);
-    append_work(&pend_head, Z_CopyStruct(work));
-    pthread_mutex_unlock(&work_lock);
+static void async_work_func(void *arg)
+{
+    asyncwork_t *work = arg;
+
+    work->work_cb(work->cb_arg);
+
+    work->next = NULL;
+    pthread_mutex_lock(&done_lock);
+    *done_tail = work;
+    done_tail = &work->next;
+    pthread_mutex_unlock(&done_lock);
+}
+
+void Com_InitAsyncWork(void)
+{
+    // worker threads are started on first use
+    com_workers = Cvar_Get("com_workers", "-1", CVAR_NOSET);
+}
 
-    pthread_cond_signal(&work_cond);
+void Com_QueueAsyncWork(asyncwork_t *work)
+{
+    Com_QueueJob(async_work_func, Z_CopyStruct(work), &done_counter, NULL);
 }
 
 void Com_CompleteAsyncWork(void)
 {
     asyncwork_t *work, *next;
 
-    if (!work_initialized)
+    if (!job_initialized)
         return;
-    if (pthread_mutex_trylock(&work_lock))
+    if (pthread_mutex_trylock(&done_lock))
         return;
-    if (q_unlikely(done_head)) {
-        for (work = done_head; work; work = next) {
-            next = work->next;
-            if (work->done_cb)
-                work->done_cb(work->cb_arg);
-            Z_Free(work);
-        }
-        done_head = NULL;
+    work = done_head;
+    done_head = NULL;
+    done_tail = &done_head;
+    pthread_mutex_unlock(&done_lock);
+
+    for (; work; work = next) {
+        next = work->next;
+        if (work->done_cb)
+            work->done_cb(work->cb_arg);
+        Z_Free(work);
     }
-    pthread_mutex_unlock(&work_lock);
 }
 
 void Com_ShutdownAsyncWork(void)
 {
-    if (!work_initialized)
+    if (!job_initialized)
         return;
 
-    pthread_mutex_lock(&work_lock);
-    work_terminate = true;
-    pthread_mutex_unlock(&work_lock);
+    Com_WaitJobs(&done_counter);
+    Com_CompleteAsyncWork();
+
+    stop_workers();
+}
+
+/*
+==============================================================================
 
-    pthread_cond_signal(&work_cond);
+LOG WRITER
 
-    Q_assert(!pthread_join(work_thread, NULL));
-    Com_CompleteAsyncWork();
+Single producer, single consumer ring buffer. Producer only advances head
+and consumer only advances tail, so no locking is needed to pass records.
+Lock is only taken to wake up sleeping writer and to wait for flushes.
+
+==============================================================================
+*/
+
+#define LOG_HDR     8       // record header size, also alignment
+#define LOG_WRAP    UINT32_MAX
+
+#define LOG_TEXT    0
+#define LOG_RECORD  1
+
+struct logwriter_s {
+    qhandle_t       file;
+    logformat_t     format;
+    byte            *buffer;
+    unsigned        size;       // power of two
+    atomic_int      head;       // advanced by producer
+    atomic_int      tail;       // advanced by writer
+    atomic_int      error;
+    atomic_int      sleeping;
+    unsigned        dropped;    // since last drop notice
+    unsigned        total_dropped;
+    pthread_t       thread;
+    pthread_mutex_t lock;       // protects fields below
+    pthread_cond_t  cond;
+    pthread_cond_t  done_cond;
+    unsigned        flush_req;
+    unsigned        flush_done;
+    bool            terminate;
+};
+
+static void write_records(logwriter_t *w)
+{
+    unsigned tail = atomic_load(&w->tail);
+    unsigned head = atomic_load(&w->head);
+    uint32_t *hdr;
+    int ret;
+
+    while (tail != head) {
+        hdr = (uint32_t *)(w->buffer + (tail & (w->size - 1)));
+        if (hdr[0] == LOG_WRAP) {
+            tail += w->size - (tail & (w->size - 1));
+            continue;
+        }
+
+        // keep draining after error to not block producer
+        if (!atomic_load(&w->error)) {
+            if (hdr[1] == LOG_RECORD) {
+                w->format(w->file, hdr + 2, hdr[0]);
+            } else {
+                ret = FS_Write(hdr + 2, hdr[0], w->file);
+                if (ret < 0)
+                    atomic_store(&w->error, ret);
+            }
+        }
+
+        tail += LOG_HDR + ALIGN(hdr[0], LOG_HDR);
+        atomic_store(&w->tail, tail);
+    }
+}
+
+static void *log_writer_func(void *arg)
+{
+    logwriter_t *w = arg;
+    unsigned seq;
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        seq = w->flush_req;
+        pthread_mutex_unlock(&w->lock);
+
+        write_records(w);
+
+        if (seq != w->flush_done && !atomic_load(&w->error)) {
+            ret = FS_Flush(w->file);
+            if (ret < 0)
+                atomic_store(&w->error, ret);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (seq != w->flush_done) {
+            w->flush_done = seq;
+            pthread_cond_broadcast(&w->done_cond);
+        }
+
+        if (seq != w->flush_req)
+            continue;
+        if (w->terminate)
+            break;
+
+        // recheck after announcing sleep to not miss new records
+        atomic_store(&w->sleeping, 1);
+        if (atomic_load(&w->head) == atomic_load(&w->tail))
+            pthread_cond_wait(&w->cond, &w->lock);
+        atomic_store(&w->sleeping, 0);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/*
+==================
+Com_OpenLogWriter
+
+Starts writer thread for file f with ring buffer of given size rounded up
+to power of two. Returns NULL if thread can't be created, in which case
+file is left open.
+==================
+*/
+logwriter_t *Com_OpenLogWriter(qhandle_t f, size_t size, logformat_t format)
+{
+    logwriter_t *w;
+
+    size = Q_npot32(max(min(size, 0x4000000), 0x1000));
+
+    w = Z_Mallocz(sizeof(*w));
+    w->file = f;
+    w->format = format;
+    w->buffer = Z_Malloc(size);
+    w->size = size;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_cond_init(&w->done_cond, NULL);
 
-    pthread_mutex_destroy(&work_lock);
-    pthread_cond_destroy(&work_cond);
-    work_initialized = false;
+    if (pthread_create(&w->thread, NULL, log_writer_func, w)) {
+        Com_WPrintf("Couldn't create log writer thread\n");
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        pthread_cond_destroy(&w->done_cond);
+        Z_Free(w->buffer);
+        Z_Free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+static bool put_record(logwriter_t *w, const void *head_data, size_t head_len,
+                       const void *data, size_t data_len, uint32_t type)
+{
+    size_t len = head_len + data_len;
+    unsigned head = atomic_load(&w->head);
+    unsigned tail = atomic_load(&w->tail);
+    unsigned pos = head & (w->size - 1);
+    unsigned need, pad = 0;
+    uint32_t *hdr;
+
+    if (len > w->size - LOG_HDR)
+        return false;
+
+    // records are contiguous, skip the rest of buffer if needed
+    need = LOG_HDR + ALIGN(len, LOG_HDR);
+    if (pos + need > w->size)
+        pad = w->size - pos;
+
+    if (pad + need > w->size - (head - tail))
+        return false;
+
+    if (pad) {
+        *(uint32_t *)(w->buffer + pos) = LOG_WRAP;
+        head += pad;
+        pos = 0;
+    }
+
+    hdr = (uint32_t *)(w->buffer + pos);
+    hdr[0] = len;
+    hdr[1] = type;
+    memcpy(hdr + 2, head_data, head_len);
+    if (data_len)
+        memcpy((byte *)(hdr + 2) + head_len, data, data_len);
+
+    atomic_store(&w->head, head + need);
+    return true;
+}
+
+static void wake_writer(logwriter_t *w)
+{
+    if (atomic_load(&w->sleeping)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static int write_log(logwriter_t *w, const void *head, size_t head_len,
+                     const void *data, size_t len, uint32_t type)
+{
+    char buf[64];
+    size_t n;
+    int ret;
+
+    ret = atomic_load(&w->error);
+    if (ret)
+        return ret;
+
+    if (w->dropped) {
+        n = Q_snprintf(buf, sizeof(buf), "*** %u log records dropped ***\n", w->dropped);
+        if (put_record(w, buf, n, NULL, 0, LOG_TEXT))
+            w->dropped = 0;
+    }
+
+    if (w->dropped || !put_record(w, head, head_len, data, len, type)) {
+        w->dropped++;
+        w->total_dropped++;
+    }
+
+    wake_writer(w);
+    return Q_ERR_SUCCESS;
+}
+
+/*
+==================
+Com_WriteLog
+
+Queues text to be written. Returns error if writer thread failed to write
+previous records.
+==================
+*/
+int Com_WriteLog(logwriter_t *w, const void *data, size_t len)
+{
+    return write_log(w, data, len, NULL, 0, LOG_TEXT);
+}
+
+// queues binary record made of head and data to be passed to format callback
+int Com_WriteLogRecord(logwriter_t *w, const void *head, size_t head_len,
+                       const void *data, size_t len)
+{
+    Q_assert(w->format);
+    return write_log(w, head, head_len, data, len, LOG_RECORD);
+}
+
+/*
+==================
+Com_FlushLog
+
+Blocks until all queued records are written and file is flushed.
+==================
+*/
+int Com_FlushLog(logwriter_t *w)
+{
+    unsigned seq;
+
+    pthread_mutex_lock(&w->lock);
+    seq = ++w->flush_req;
+    pthread_cond_signal(&w->cond);
+    while (w->flush_done != seq)
+        pthread_cond_wait(&w->done_cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+
+    return atomic_load(&w->error);
+}
+
+/*
+==================
+Com_CloseLogWriter
+
+Writes all queued records, stops writer thread and closes the file.
+==================
+*/
+int Com_CloseLogWriter(logwriter_t *w)
+{
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    w->flush_req++;
+    w->terminate = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    Q_assert(!pthread_join(w->thread, NULL));
+
+    ret = FS_CloseFile(w->file);
+    if (atomic_load(&w->error))
+        ret = atomic_load(&w->error);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    pthread_cond_destroy(&w->done_cond);
+    Z_Free(w->buffer);
+    Z_Free(w);
+
+    return ret;
+}
+
+unsigned Com_LogDropped(const logwriter_t *w)
+{
+    return w->total_dropped;
 }
@@ -0,0 +1,165 @@
+/*
+Copyright (C) 2023 Andrey Nazarov
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "shared/shared.h"
+#include "common/bitset.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2    1
+#elif defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+#include <arm_neon.h>
+#define USE_NEON    1
+#endif
+
+// unaligned word access, compiles to a single load or store
+static inline uint64_t load64(const byte *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store64(byte *p, uint64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline int popcount64(uint64_t v)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (v * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+static inline int ctz64(uint64_t v)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+void BitSet_Or(byte *dst, const byte *src, size_t size)
+{
+    size_t i = 0;
+
+#if USE_SSE2
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+    }
+#elif USE_NEON
+    for (; i + 16 <= size; i += 16)
+        vst1q_u8(dst + i, vorrq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+#endif
+    for (; i + 8 <= size; i += 8)
+        store64(dst + i, load64(dst + i) | load64(src + i));
+    for (; i < size; i++)
+        dst[i] |= src[i];
+}
+
+void BitSet_And(byte *dst, const byte *src, size_t size)
+{
+    size_t i = 0;
+
+#if USE_SSE2
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(a, b));
+    }
+#elif USE_NEON
+    for (; i + 16 <= size; i += 16)
+        vst1q_u8(dst + i, vandq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+#endif
+    for (; i + 8 <= size; i += 8)
+        store64(dst + i, load64(dst + i) & load64(src + i));
+    for (; i < size; i++)
+        dst[i] &= src[i];
+}
+
+bool BitSet_Intersects(const byte *a, const byte *b, size_t size)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+        if (load64(a + i) & load64(b + i))
+            return true;
+    for (; i < size; i++)
+        if (a[i] & b[i])
+            return true;
+
+    return false;
+}
+
+size_t BitSet_Count(const byte *bits, size_t size)
+{
+    size_t i = 0, count = 0;
+
+#if USE_NEON
+    for (; i + 16 <= size; i += 16)
+        count += vaddvq_u8(vcntq_u8(vld1q_u8(bits + i)));
+#endif
+    for (; i + 8 <= size; i += 8)
+        count += popcount64(load64(bits + i));
+    for (; i < size; i++)
+        count += popcount64(bits[i]);
+
+    return count;
+}
+
+int BitSet_Next(const byte *bits, size_t size, int start)
+{
+    size_t i = start >> 3;
+    uint64_t v;
+
+    if (start < 0 || i >= size)
+        return -1;
+
+    // partial first byte
+    v = bits[i] >> (start & 7);
+    if (v)
+        return start + ctz64(v);
+    i++;
+
+#if USE_LITTLE_ENDIAN
+    for (; i + 8 <= size; i += 8) {
+        v = load64(bits + i);
+        if (v)
+            return i * 8 + ctz64(v);
+    }
+#endif
+    for (; i < size; i++)
+        if (bits[i])
+            return i * 8 + ctz64(bits[i]);
+
+    return -1;
+}
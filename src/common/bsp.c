@@ -33,9 +33,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/utils.h"
 #include "system/hunk.h"
 
+#include <float.h>
+
 extern mtexinfo_t nulltexinfo;
 
 static cvar_t *map_visibility_patch;
+static cvar_t *map_leaf_grid;
+static cvar_t *map_vis_matrix;
 
 /*
 ===============================================================================
@@ -251,7 +255,6 @@ LOAD(Brushes)
         out->firstbrushside = bsp->brushsides + firstside;
         out->numsides = numsides;
         out->contents = BSP_Long();
-        out->checkcount = 0;
     }
 
     return Q_ERR_SUCCESS;
@@ -1002,37 +1005,245 @@ void BSP_Free(bsp_t *bsp)
     }
     Q_assert(bsp->refcount > 0);
     if (--bsp->refcount == 0) {
-		if (bsp->pvs2_matrix)
-		{
-			// free the PVS2 matrix separately - it's not part of the hunk
-			Z_Free(bsp->pvs2_matrix);
-			bsp->pvs2_matrix = NULL;
-		}
+		// free the vis matrices separately - they are not part of the hunk
+		Z_Free(bsp->pvs_matrix);
+		Z_Free(bsp->pvs2_matrix);
+		Z_Free(bsp->phs_matrix);
 
+        Z_Free(bsp->brushplanes);
+        Z_Free(bsp->leafgrid.cells);
         Hunk_Free(&bsp->hunk);
         List_Remove(&bsp->entry);
         Z_Free(bsp);
     }
 }
 
-static void BSP_BuildPvsMatrix(bsp_t *bsp)
+/*
+==================
+BSP_PackBrush
+
+Calculates brush bounds and packs brush sides for SIMD clipping. Unused
+slots in the last group get zero normal and huge distance, so that both
+trace points are always behind them.
+==================
+*/
+void BSP_PackBrush(mbrush_t *brush, float *planes)
 {
-	if (!bsp->vis)
-		return;
+    const mbrushside_t *side = brush->firstbrushside;
+    const cplane_t *plane;
+    int i, j, k;
+
+    VectorSet(brush->mins, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+    VectorSet(brush->maxs, FLT_MAX, FLT_MAX, FLT_MAX);
+
+    for (i = 0; i < BRUSH_NUM_GROUPS(brush->numsides) * 4; i++) {
+        float *g = planes + (i >> 2) * BRUSH_GROUP_FLOATS + (i & 3);
+
+        if (i >= brush->numsides) {
+            g[0] = g[4] = g[8] = 0;
+            g[12] = FLT_MAX;
+            continue;
+        }
+
+        plane = side[i].plane;
+        g[0] = plane->normal[0];
+        g[4] = plane->normal[1];
+        g[8] = plane->normal[2];
+        g[12] = plane->dist;
+
+        // axial sides define bounds
+        for (j = 0; j < 3; j++) {
+            k = (j + 1) % 3;
+            if (plane->normal[k] || plane->normal[(j + 2) % 3])
+                continue;
+            if (plane->normal[j] == 1)
+                brush->maxs[j] = min(brush->maxs[j], plane->dist);
+            else if (plane->normal[j] == -1)
+                brush->mins[j] = max(brush->mins[j], -plane->dist);
+        }
+    }
+
+    brush->planes = planes;
+}
+
+static void BSP_PackBrushes(bsp_t *bsp)
+{
+    mbrush_t *brush;
+    size_t size = 0;
+    float *planes;
+    int i;
+
+    for (i = 0, brush = bsp->brushes; i < bsp->numbrushes; i++, brush++)
+        size += BRUSH_NUM_GROUPS(brush->numsides);
+
+    if (!size)
+        return;
+
+    planes = bsp->brushplanes = Z_Malloc(size * BRUSH_GROUP_FLOATS * sizeof(float));
+
+    for (i = 0, brush = bsp->brushes; i < bsp->numbrushes; i++, brush++) {
+        BSP_PackBrush(brush, planes);
+        planes += BRUSH_NUM_GROUPS(brush->numsides) * BRUSH_GROUP_FLOATS;
+    }
+}
+
+/*
+===============================================================================
+
+LEAF GRID
+
+===============================================================================
+*/
+
+#define LEAFGRID_MIN_CELL   16
+#define LEAFGRID_MAX_CELL   65536
+#define LEAFGRID_MAX_EXTENT 131072
+
+// cells are expanded by this much when classified, so that points
+// rounded into the wrong cell still end up on the right side of planes
+#define LEAFGRID_EPSILON    0.5f
+
+static void BSP_BuildLeafGrid_r(mleafgrid_t *grid, mnode_t *node, const int *lo, const int *hi)
+{
+    vec3_t  mins, maxs;
+    int     i, x, y, z, axis, side, mid[3];
+    float   cellsize = 1.0f / grid->scale;
+
+    for (i = 0; i < 3; i++) {
+        mins[i] = grid->mins[i] + lo[i] * cellsize - LEAFGRID_EPSILON;
+        maxs[i] = grid->mins[i] + hi[i] * cellsize + LEAFGRID_EPSILON;
+    }
+
+    // go down while the whole range is on one side
+    while (node->plane) {
+        side = BoxOnPlaneSideFast(mins, maxs, node->plane);
+        if (side == BOX_INFRONT)
+            node = node->children[0];
+        else if (side == BOX_BEHIND)
+            node = node->children[1];
+        else
+            break;
+    }
+
+    // split the range along the longest axis
+    axis = 0;
+    for (i = 1; i < 3; i++)
+        if (hi[i] - lo[i] > hi[axis] - lo[axis])
+            axis = i;
+
+    if (!node->plane || hi[axis] - lo[axis] == 1) {
+        for (z = lo[2]; z < hi[2]; z++)
+            for (y = lo[1]; y < hi[1]; y++)
+                for (x = lo[0]; x < hi[0]; x++)
+                    grid->cells[(z * grid->size[1] + y) * grid->size[0] + x] = node;
+        return;
+    }
+
+    VectorCopy(hi, mid);
+    mid[axis] = (lo[axis] + hi[axis]) / 2;
+    BSP_BuildLeafGrid_r(grid, node, lo, mid);
+
+    VectorCopy(lo, mid);
+    mid[axis] = (lo[axis] + hi[axis]) / 2;
+    BSP_BuildLeafGrid_r(grid, node, mid, hi);
+}
+
+/*
+==================
+BSP_BuildLeafGrid
+
+Picks the smallest power of two cell size that fits the grid within
+map_leaf_grid kilobytes. The cvar is read at map load, so it can be set
+per map.
+==================
+*/
+static void BSP_BuildLeafGrid(bsp_t *bsp)
+{
+    mleafgrid_t *grid = &bsp->leafgrid;
+    static const int lo[3];
+    const mmodel_t *world;
+    uint64_t cap, numcells;
+    int     i, cellsize;
+    float   extent;
+
+    if (map_leaf_grid->integer <= 0 || bsp->nummodels < 1)
+        return;
+
+    world = &bsp->models[0];
+    for (i = 0; i < 3; i++) {
+        extent = world->maxs[i] - world->mins[i];
+        if (!(extent > 0 && extent <= LEAFGRID_MAX_EXTENT))
+            return;
+    }
+
+    cap = (size_t)map_leaf_grid->integer * 1024;
+    for (cellsize = LEAFGRID_MIN_CELL; cellsize <= LEAFGRID_MAX_CELL; cellsize *= 2) {
+        numcells = 1;
+        for (i = 0; i < 3; i++) {
+            extent = world->maxs[i] - world->mins[i];
+            grid->size[i] = max((int)ceilf(extent / cellsize), 1);
+            numcells *= grid->size[i];
+        }
+        if (numcells * sizeof(grid->cells[0]) <= cap)
+            break;
+    }
+
+    if (cellsize > LEAFGRID_MAX_CELL)
+        return;
+
+    VectorCopy(world->mins, grid->mins);
+    grid->scale = 1.0f / cellsize;
+    grid->cells = Z_Malloc(numcells * sizeof(grid->cells[0]));
+
+    BSP_BuildLeafGrid_r(grid, bsp->nodes, lo, grid->size);
+
+    Com_DPrintf("%s: %dx%dx%d leaf grid, %d unit cells\n", bsp->name,
+                grid->size[0], grid->size[1], grid->size[2], cellsize);
+}
 
+static byte *BSP_BuildVisMatrix(bsp_t *bsp, int vis)
+{
 	// a typical map with 2K clusters will take half a megabyte of memory for the matrix
 	size_t matrix_size = bsp->visrowsize * bsp->vis->numclusters;
 
 	// allocate the matrix but don't set it in the BSP structure yet: 
-	// we want BSP_CluterVis to use the old PVS data here, and not the new empty matrix
-	byte* pvs_matrix = Z_Mallocz(matrix_size);
+	// we want BSP_CluterVis to use the old compressed data here, and not the new empty matrix
+	byte* matrix = Z_Mallocz(matrix_size);
 	
 	for (int cluster = 0; cluster < bsp->vis->numclusters; cluster++)
 	{
-		BSP_ClusterVis(bsp, pvs_matrix + bsp->visrowsize * cluster, cluster, DVIS_PVS);
+		BSP_ClusterVis(bsp, matrix + bsp->visrowsize * cluster, cluster, vis);
 	}
 
-	bsp->pvs_matrix = pvs_matrix;
+	return matrix;
+}
+
+/*
+==================
+BSP_BuildVisMatrices
+
+Decompresses PVS and PHS rows for all clusters. PVS matrix is always built,
+since the path tracer works on it directly. PHS matrix is built if both
+fit within map_vis_matrix kilobytes, otherwise PHS rows are decompressed
+on every request.
+==================
+*/
+static void BSP_BuildVisMatrices(bsp_t *bsp)
+{
+    size_t matrix_size, budget;
+
+    if (!bsp->vis)
+        return;
+
+    matrix_size = (size_t)bsp->visrowsize * bsp->vis->numclusters;
+    budget = (size_t)max(map_vis_matrix->integer, 0) * 1024;
+
+    // patched PVS may be loaded already
+    if (!bsp->pvs_matrix)
+        bsp->pvs_matrix = BSP_BuildVisMatrix(bsp, DVIS_PVS);
+
+    if (matrix_size * 2 <= budget)
+        bsp->phs_matrix = BSP_BuildVisMatrix(bsp, DVIS_PHS);
 }
 
 byte* BSP_GetPvs(bsp_t *bsp, int cluster)
@@ -1057,6 +1268,17 @@ byte* BSP_GetPvs2(bsp_t *bsp, int cluster)
 	return bsp->pvs2_matrix + bsp->visrowsize * cluster;
 }
 
+byte *BSP_GetPhs(bsp_t *bsp, int cluster)
+{
+    if (!bsp->vis || !bsp->phs_matrix)
+        return NULL;
+
+    if (cluster < 0 || cluster >= bsp->vis->numclusters)
+        return NULL;
+
+    return bsp->phs_matrix + bsp->visrowsize * cluster;
+}
+
 // Converts `maps/<name>.bsp` into `maps/pvs/<name>.bin`
 static bool BSP_GetPatchedPVSFileName(const char* map_path, char pvs_path[MAX_QPATH])
 {
@@ -1084,6 +1306,9 @@ static bool BSP_LoadPatchedPVS(bsp_t *bsp)
 {
 	char pvs_path[MAX_QPATH];
 
+	if (!bsp->vis)
+		return false;
+
 	if (!BSP_GetPatchedPVSFileName(bsp->name, pvs_path))
 		return false;
 
@@ -1094,8 +1319,17 @@ static bool BSP_LoadPatchedPVS(bsp_t *bsp)
 	if (filebuf == 0)
 		return false;
 
+	// newer files end with the checksum of the BSP they were built for
 	size_t matrix_size = bsp->visrowsize * bsp->vis->numclusters;
-	if (filelen != matrix_size * 2)
+	if (filelen == matrix_size * 2 + 4)
+	{
+		if (RL32(filebuf + matrix_size * 2) != bsp->checksum)
+		{
+			FS_FreeFile(filebuf);
+			return false;
+		}
+	}
+	else if (filelen != matrix_size * 2)
 	{
 		FS_FreeFile(filebuf);
 		return false;
@@ -1126,12 +1360,13 @@ bool BSP_SavePatchedPVS(bsp_t *bsp)
 		return false;
 
 	size_t matrix_size = bsp->visrowsize * bsp->vis->numclusters;
-	unsigned char* filebuf = Z_Malloc(matrix_size * 2);
+	unsigned char* filebuf = Z_Malloc(matrix_size * 2 + 4);
 
 	memcpy(filebuf, bsp->pvs_matrix, matrix_size);
 	memcpy(filebuf + matrix_size, bsp->pvs2_matrix, matrix_size);
+	WL32(filebuf + matrix_size * 2, bsp->checksum);
 
-	int err = FS_WriteFile(pvs_path, filebuf, matrix_size * 2);
+	int err = FS_WriteFile(pvs_path, filebuf, matrix_size * 2 + 4);
 
 	Z_Free(filebuf);
 
@@ -1353,8 +1588,9 @@ Loads in the map and all submodels
 int BSP_Load(const char *name, bsp_t **bsp_p)
 {
     bsp_t           *bsp;
-    byte            *buf;
-    dheader_t       *header;
+    fs_mapping_t    map;
+    const byte      *buf;
+    const dheader_t *header;
     const lump_info_t *info;
     uint32_t        filelen, ofs, len, end, count, maxpos;
     int             i, ret;
@@ -1381,10 +1617,11 @@ int BSP_Load(const char *name, bsp_t **bsp_p)
     //
     // load the file
     //
-    filelen = FS_LoadFile(name, (void **)&buf);
-    if (!buf) {
+    filelen = FS_MapFile(name, &map);
+    if (!map.data) {
         return filelen;
     }
+    buf = map.data;
 
     if (filelen < sizeof(dheader_t)) {
         ret = Q_ERR_FILE_TOO_SMALL;
@@ -1392,7 +1629,7 @@ int BSP_Load(const char *name, bsp_t **bsp_p)
     }
 
     // byte swap and validate the header
-    header = (dheader_t *)buf;
+    header = (const dheader_t *)buf;
     switch (LittleLong(header->ident)) {
     case IDBSPHEADER:
         break;
@@ -1471,15 +1708,17 @@ int BSP_Load(const char *name, bsp_t **bsp_p)
         goto fail1;
     }
 
-	if (!BSP_LoadPatchedPVS(bsp))
-	{
-		BSP_BuildPvsMatrix(bsp);
-	}
-	else
+    BSP_PackBrushes(bsp);
+
+    BSP_BuildLeafGrid(bsp);
+
+	if (BSP_LoadPatchedPVS(bsp))
 	{
 		bsp->pvs_patched = true;
 	}
 
+    BSP_BuildVisMatrices(bsp);
+
 #if USE_REF
     // load extension lumps
     for (i = 0; i < q_countof(bspx_lumps); i++) {
@@ -1493,7 +1732,7 @@ int BSP_Load(const char *name, bsp_t **bsp_p)
 
     List_Append(&bsp_cache, &bsp->entry);
 
-    FS_FreeFile(buf);
+    FS_UnmapFile(&map);
 
     *bsp_p = bsp;
     return Q_ERR_SUCCESS;
@@ -1502,7 +1741,7 @@ fail1:
     Hunk_Free(&bsp->hunk);
     Z_Free(bsp);
 fail2:
-    FS_FreeFile(buf);
+    FS_UnmapFile(&map);
     return ret;
 }
 
@@ -1666,6 +1905,11 @@ byte *BSP_ClusterVis(bsp_t *bsp, byte *mask, int cluster, int vis)
 		return mask;
 	}
 
+    if (vis == DVIS_PHS && bsp->phs_matrix) {
+        memcpy(mask, BSP_GetPhs(bsp, cluster), bsp->visrowsize);
+        return mask;
+    }
+
     // decompress vis
     in_end = (byte *)bsp->vis + bsp->numvisibility;
     in = (byte *)bsp->vis + bsp->vis->bitofs[cluster][vis];
@@ -1736,6 +1980,39 @@ overrun:
     return mask;
 }
 
+/*
+==================
+BSP_ClusterVisRow
+
+Returns decompressed row for the cluster without copying it, or NULL if
+there is no matrix for this kind of visibility. PVS2 falls back to PVS,
+same as in BSP_ClusterVis.
+==================
+*/
+const byte *BSP_ClusterVisRow(const bsp_t *bsp, int cluster, int vis)
+{
+    const byte *matrix;
+
+    if (!bsp || !bsp->vis || cluster < 0 || cluster >= bsp->vis->numclusters)
+        return NULL;
+
+    switch (vis) {
+    case DVIS_PVS2:
+        matrix = bsp->pvs2_matrix ? bsp->pvs2_matrix : bsp->pvs_matrix;
+        break;
+    case DVIS_PVS:
+        matrix = bsp->pvs_matrix;
+        break;
+    case DVIS_PHS:
+        matrix = bsp->phs_matrix;
+        break;
+    default:
+        return NULL;
+    }
+
+    return matrix ? matrix + bsp->visrowsize * cluster : NULL;
+}
+
 mleaf_t *BSP_PointLeaf(mnode_t *node, const vec3_t p)
 {
     float d;
@@ -1751,6 +2028,33 @@ mleaf_t *BSP_PointLeaf(mnode_t *node, const vec3_t p)
     return (mleaf_t *)node;
 }
 
+/*
+==================
+BSP_GridPointLeaf
+
+Same as BSP_PointLeaf on world nodes, but starts from the leaf grid.
+==================
+*/
+mleaf_t *BSP_GridPointLeaf(const bsp_t *bsp, const vec3_t p)
+{
+    const mleafgrid_t *grid = &bsp->leafgrid;
+    int     i, c[3];
+    float   f;
+
+    if (grid->cells) {
+        for (i = 0; i < 3; i++) {
+            f = (p[i] - grid->mins[i]) * grid->scale;
+            if (!(f >= 0 && f < grid->size[i]))
+                break;      // outside of the grid, or NaN
+            c[i] = f;
+        }
+        if (i == 3)
+            return BSP_PointLeaf(grid->cells[(c[2] * grid->size[1] + c[1]) * grid->size[0] + c[0]], p);
+    }
+
+    return BSP_PointLeaf(bsp->nodes, p);
+}
+
 /*
 ==================
 BSP_InlineModel
@@ -1775,6 +2079,8 @@ mmodel_t *BSP_InlineModel(bsp_t *bsp, const char *name)
 void BSP_Init(void)
 {
     map_visibility_patch = Cvar_Get("map_visibility_patch", "1", 0);
+    map_leaf_grid = Cvar_Get("map_leaf_grid", "2048", 0);
+    map_vis_matrix = Cvar_Get("map_vis_matrix", "65536", 0);
 
     Cmd_AddCommand("bsplist", BSP_List_f);
 
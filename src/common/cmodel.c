@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // cmodel.c -- model loading
 
 #include "shared/shared.h"
+#include "common/bitset.h"
 #include "common/bsp.h"
 #include "common/cmd.h"
 #include "common/cmodel.h"
@@ -29,15 +30,27 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/zone.h"
 #include "system/hunk.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define USE_SIMD    1
+#elif defined(__ARM_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+#include <arm_neon.h>
+#define USE_SIMD    1
+#else
+#define USE_SIMD    0
+#endif
+
 mtexinfo_t nulltexinfo;
 
 static mleaf_t      nullleaf;
 
 static unsigned     floodvalid;
-static unsigned     checkcount;
+
+static cm_trace_ctx_t   cm_default_ctx;
 
 static cvar_t       *map_noareas;
 static cvar_t       *map_allsolid_bug;
+static cvar_t       *map_fast_trace;
 static cvar_t       *map_override_path;
 
 static void    FloodAreaConnections(cm_t *cm);
@@ -240,24 +253,15 @@ mleaf_t *CM_LeafNum(cm_t *cm, int number)
 
 //=======================================================================
 
-static cplane_t box_planes[12];
-static mnode_t  box_nodes[6];
-static mnode_t  *box_headnode;
-static mbrush_t box_brush;
-static mbrush_t *box_leafbrush;
-static mbrushside_t box_brushsides[6];
-static mleaf_t  box_leaf;
-static mleaf_t  box_emptyleaf;
-
 /*
 ===================
-CM_InitBoxHull
+CM_InitTraceCtx
 
 Set up the planes and nodes so that the six floats of a bounding box
 can just be stored out and get a proper clipping hull structure.
 ===================
 */
-static void CM_InitBoxHull(void)
+void CM_InitTraceCtx(cm_trace_ctx_t *ctx)
 {
     int         i;
     int         side;
@@ -265,41 +269,42 @@ static void CM_InitBoxHull(void)
     cplane_t    *p;
     mbrushside_t    *s;
 
-    box_headnode = &box_nodes[0];
+    memset(ctx, 0, sizeof(*ctx));
 
-    box_brush.numsides = 6;
-    box_brush.firstbrushside = &box_brushsides[0];
-    box_brush.contents = CONTENTS_MONSTER;
+    ctx->box_brush.numsides = 6;
+    ctx->box_brush.firstbrushside = &ctx->box_brushsides[0];
+    ctx->box_brush.contents = CONTENTS_MONSTER;
 
-    box_leaf.contents = CONTENTS_MONSTER;
-    box_leaf.firstleafbrush = &box_leafbrush;
-    box_leaf.numleafbrushes = 1;
+    ctx->box_leaf.contents = CONTENTS_MONSTER;
+    ctx->box_leaf.firstleafbrush = &ctx->box_leafbrush;
+    ctx->box_leaf.numleafbrushes = 1;
 
-    box_leafbrush = &box_brush;
+    ctx->box_leafbrush = &ctx->box_brush;
+    ctx->box_brush.planes = ctx->box_packed;
 
     for (i = 0; i < 6; i++) {
         side = i & 1;
 
         // brush sides
-        s = &box_brushsides[i];
-        s->plane = &box_planes[i * 2 + side];
+        s = &ctx->box_brushsides[i];
+        s->plane = &ctx->box_planes[i * 2 + side];
         s->texinfo = &nulltexinfo;
 
         // nodes
-        c = &box_nodes[i];
-        c->plane = &box_planes[i * 2];
-        c->children[side] = (mnode_t *)&box_emptyleaf;
+        c = &ctx->box_nodes[i];
+        c->plane = &ctx->box_planes[i * 2];
+        c->children[side] = (mnode_t *)&ctx->box_emptyleaf;
         if (i != 5)
-            c->children[side ^ 1] = &box_nodes[i + 1];
+            c->children[side ^ 1] = &ctx->box_nodes[i + 1];
         else
-            c->children[side ^ 1] = (mnode_t *)&box_leaf;
+            c->children[side ^ 1] = (mnode_t *)&ctx->box_leaf;
 
         // planes
-        p = &box_planes[i * 2];
+        p = &ctx->box_planes[i * 2];
         p->type = i >> 1;
         p->normal[i >> 1] = 1;
 
-        p = &box_planes[i * 2 + 1];
+        p = &ctx->box_planes[i * 2 + 1];
         p->type = 3 + (i >> 1);
         p->signbits = 1 << (i >> 1);
         p->normal[i >> 1] = -1;
@@ -308,14 +313,16 @@ static void CM_InitBoxHull(void)
 
 /*
 ===================
-CM_HeadnodeForBox
+CM_HeadnodeForBoxCtx
 
 To keep everything totally uniform, bounding boxes are turned into small
 BSP trees instead of being compared directly.
 ===================
 */
-mnode_t *CM_HeadnodeForBox(const vec3_t mins, const vec3_t maxs)
+mnode_t *CM_HeadnodeForBoxCtx(cm_trace_ctx_t *ctx, const vec3_t mins, const vec3_t maxs)
 {
+    cplane_t *box_planes = ctx->box_planes;
+
     box_planes[0].dist = maxs[0];
     box_planes[1].dist = -maxs[0];
     box_planes[2].dist = mins[0];
@@ -329,7 +336,14 @@ mnode_t *CM_HeadnodeForBox(const vec3_t mins, const vec3_t maxs)
     box_planes[10].dist = mins[2];
     box_planes[11].dist = -mins[2];
 
-    return box_headnode;
+    BSP_PackBrush(&ctx->box_brush, ctx->box_packed);
+
+    return ctx->box_nodes;
+}
+
+mnode_t *CM_HeadnodeForBox(const vec3_t mins, const vec3_t maxs)
+{
+    return CM_HeadnodeForBoxCtx(&cm_default_ctx, mins, maxs);
 }
 
 mleaf_t *CM_PointLeaf(cm_t *cm, const vec3_t p)
@@ -337,7 +351,7 @@ mleaf_t *CM_PointLeaf(cm_t *cm, const vec3_t p)
     if (!cm->cache) {
         return &nullleaf;       // server may call this without map loaded
     }
-    return BSP_PointLeaf(cm->cache->nodes, p);
+    return BSP_GridPointLeaf(cm->cache, p);
 }
 
 /*
@@ -347,54 +361,58 @@ CM_BoxLeafnums
 Fills in a list of all the leafs touched
 =============
 */
-static int          leaf_count, leaf_maxcount;
-static mleaf_t      **leaf_list;
-static const vec_t  *leaf_mins, *leaf_maxs;
-static mnode_t      *leaf_topnode;
-
-static void CM_BoxLeafs_r(mnode_t *node)
+typedef struct {
+    int             count, maxcount;
+    mleaf_t         **list;
+    const vec_t     *mins, *maxs;
+    mnode_t         *topnode;
+} boxleafs_t;
+
+static void CM_BoxLeafs_r(boxleafs_t *bl, mnode_t *node)
 {
     int     s;
 
     while (node->plane) {
-        s = BoxOnPlaneSideFast(leaf_mins, leaf_maxs, node->plane);
+        s = BoxOnPlaneSideFast(bl->mins, bl->maxs, node->plane);
         if (s == BOX_INFRONT) {
             node = node->children[0];
         } else if (s == BOX_BEHIND) {
             node = node->children[1];
         } else {
             // go down both
-            if (!leaf_topnode) {
-                leaf_topnode = node;
+            if (!bl->topnode) {
+                bl->topnode = node;
             }
-            CM_BoxLeafs_r(node->children[0]);
+            CM_BoxLeafs_r(bl, node->children[0]);
             node = node->children[1];
         }
     }
 
-    if (leaf_count < leaf_maxcount) {
-        leaf_list[leaf_count++] = (mleaf_t *)node;
+    if (bl->count < bl->maxcount) {
+        bl->list[bl->count++] = (mleaf_t *)node;
     }
 }
 
+// state is kept on stack, so this can be called from multiple threads
 static int CM_BoxLeafs_headnode(const vec3_t mins, const vec3_t maxs,
                                 mleaf_t **list, int listsize,
                                 mnode_t *headnode, mnode_t **topnode)
 {
-    leaf_list = list;
-    leaf_count = 0;
-    leaf_maxcount = listsize;
-    leaf_mins = mins;
-    leaf_maxs = maxs;
+    boxleafs_t  bl;
 
-    leaf_topnode = NULL;
+    bl.list = list;
+    bl.count = 0;
+    bl.maxcount = listsize;
+    bl.mins = mins;
+    bl.maxs = maxs;
+    bl.topnode = NULL;
 
-    CM_BoxLeafs_r(headnode);
+    CM_BoxLeafs_r(&bl, headnode);
 
     if (topnode)
-        *topnode = leaf_topnode;
+        *topnode = bl.topnode;
 
-    return leaf_count;
+    return bl.count;
 }
 
 int CM_BoxLeafs(cm_t *cm, const vec3_t mins, const vec3_t maxs,
@@ -419,13 +437,14 @@ int CM_PointContents(const vec3_t p, mnode_t *headnode)
 
 /*
 ==================
-CM_TransformedPointContents
+CM_TransformedPointContentsCtx
 
 Handles offseting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-int CM_TransformedPointContents(const vec3_t p, mnode_t *headnode, const vec3_t origin, const vec3_t angles)
+int CM_TransformedPointContentsCtx(cm_trace_ctx_t *ctx, const vec3_t p, mnode_t *headnode,
+                                   const vec3_t origin, const vec3_t angles)
 {
     vec3_t      p_l;
     vec3_t      axis[3];
@@ -438,7 +457,7 @@ int CM_TransformedPointContents(const vec3_t p, mnode_t *headnode, const vec3_t
     VectorSubtract(p, origin, p_l);
 
     // rotate start and end into the models frame of reference
-    if (headnode != box_headnode && !VectorEmpty(angles)) {
+    if (headnode != ctx->box_nodes && !VectorEmpty(angles)) {
         AnglesToAxis(angles, axis);
         RotatePoint(p_l, axis);
     }
@@ -446,6 +465,11 @@ int CM_TransformedPointContents(const vec3_t p, mnode_t *headnode, const vec3_t
     return BSP_PointLeaf(headnode, p_l)->contents;
 }
 
+int CM_TransformedPointContents(const vec3_t p, mnode_t *headnode, const vec3_t origin, const vec3_t angles)
+{
+    return CM_TransformedPointContentsCtx(&cm_default_ctx, p, headnode, origin, angles);
+}
+
 /*
 ===============================================================================
 
@@ -457,20 +481,15 @@ BOX TRACING
 // 1/32 epsilon to keep floating point happy
 #define DIST_EPSILON    0.03125f
 
-static vec3_t   trace_start, trace_end;
-static vec3_t   trace_offsets[8];
-static vec3_t   trace_extents;
-
-static trace_t  *trace_trace;
-static int      trace_contents;
-static bool     trace_ispoint;      // optimized case
+// brushes further than this from swept box can't affect the trace
+#define CULL_EPSILON    1.0f
 
 /*
 ================
 CM_ClipBoxToBrush
 ================
 */
-static void CM_ClipBoxToBrush(const vec3_t p1, const vec3_t p2, trace_t *trace, mbrush_t *brush)
+static void CM_ClipBoxToBrush(const cm_trace_ctx_t *ctx, const vec3_t p1, const vec3_t p2, trace_t *trace, mbrush_t *brush)
 {
     int         i;
     cplane_t    *plane, *clipplane;
@@ -497,10 +516,10 @@ static void CM_ClipBoxToBrush(const vec3_t p1, const vec3_t p2, trace_t *trace,
         plane = side->plane;
 
         // FIXME: special case for axial
-        if (!trace_ispoint) {
+        if (!ctx->ispoint) {
             // general box case
             // push the plane out apropriately for mins/maxs
-            dist = DotProduct(trace_offsets[plane->signbits], plane->normal);
+            dist = DotProduct(ctx->offsets[plane->signbits], plane->normal);
             dist = plane->dist - dist;
         } else {
             // special point case
@@ -569,7 +588,7 @@ static void CM_ClipBoxToBrush(const vec3_t p1, const vec3_t p2, trace_t *trace,
 CM_TestBoxInBrush
 ================
 */
-static void CM_TestBoxInBrush(const vec3_t p1, trace_t *trace, mbrush_t *brush)
+static void CM_TestBoxInBrush(const cm_trace_ctx_t *ctx, const vec3_t p1, trace_t *trace, mbrush_t *brush)
 {
     int         i;
     cplane_t    *plane;
@@ -587,7 +606,7 @@ static void CM_TestBoxInBrush(const vec3_t p1, trace_t *trace, mbrush_t *brush)
         // FIXME: special case for axial
         // general box case
         // push the plane out apropriately for mins/maxs
-        dist = DotProduct(trace_offsets[plane->signbits], plane->normal);
+        dist = DotProduct(ctx->offsets[plane->signbits], plane->normal);
         dist = plane->dist - dist;
 
         d1 = DotProduct(p1, plane->normal) - dist;
@@ -603,30 +622,270 @@ static void CM_TestBoxInBrush(const vec3_t p1, trace_t *trace, mbrush_t *brush)
     trace->contents = brush->contents;
 }
 
+#if USE_SIMD
+
+/*
+===============================================================================
+
+SIMD BRUSH CLIPPING
+
+Same math as above, done for 4 sides at once on packed brush planes.
+Produces the same results as scalar code, including choice of the clip
+plane when several sides give equal enter fraction.
+
+===============================================================================
+*/
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+typedef float32x4_t v4f;
+typedef uint32x4_t  v4m;
+#define V_Load(p)           vld1q_f32(p)
+#define V_Store(p, a)       vst1q_f32(p, a)
+#define V_Set1(x)           vdupq_n_f32(x)
+#define V_Add(a, b)         vaddq_f32(a, b)
+#define V_Sub(a, b)         vsubq_f32(a, b)
+#define V_Mul(a, b)         vmulq_f32(a, b)
+#define V_Div(a, b)         vdivq_f32(a, b)
+#define V_Min(a, b)         vminq_f32(a, b)
+#define V_Gt(a, b)          vcgtq_f32(a, b)
+#define V_Ge(a, b)          vcgeq_f32(a, b)
+#define V_Lt(a, b)          vcltq_f32(a, b)
+#define V_And(a, b)         vandq_u32(a, b)
+#define V_Or(a, b)          vorrq_u32(a, b)
+#define V_Select(m, a, b)   vbslq_f32(m, a, b)
+#define V_Any(m)            (vmaxvq_u32(m) != 0)
+#define V_None()            vdupq_n_u32(0)
+#else
+typedef __m128 v4f;
+typedef __m128 v4m;
+#define V_Load(p)           _mm_loadu_ps(p)
+#define V_Store(p, a)       _mm_storeu_ps(p, a)
+#define V_Set1(x)           _mm_set1_ps(x)
+#define V_Add(a, b)         _mm_add_ps(a, b)
+#define V_Sub(a, b)         _mm_sub_ps(a, b)
+#define V_Mul(a, b)         _mm_mul_ps(a, b)
+#define V_Div(a, b)         _mm_div_ps(a, b)
+#define V_Min(a, b)         _mm_min_ps(a, b)
+#define V_Gt(a, b)          _mm_cmpgt_ps(a, b)
+#define V_Ge(a, b)          _mm_cmpge_ps(a, b)
+#define V_Lt(a, b)          _mm_cmplt_ps(a, b)
+#define V_And(a, b)         _mm_and_ps(a, b)
+#define V_Or(a, b)          _mm_or_ps(a, b)
+#define V_Select(m, a, b)   _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define V_Any(m)            (_mm_movemask_ps(m) != 0)
+#define V_None()            _mm_setzero_ps()
+#endif
+
+// offsets[signbits] picks maxs for negative normal components
+static inline v4f CM_AxisOffset(const cm_trace_ctx_t *ctx, const float *g, int j)
+{
+    v4f n = V_Load(g + j * 4);
+
+    return V_Select(V_Lt(n, V_Set1(0)),
+                    V_Mul(V_Set1(ctx->offsets[7][j]), n),
+                    V_Mul(V_Set1(ctx->offsets[0][j]), n));
+}
+
+// returns plane distances adjusted for box size, same as scalar code
+static inline v4f CM_GroupDist(const cm_trace_ctx_t *ctx, const float *g)
+{
+    v4f dist = V_Load(g + 12);
+
+    if (ctx->ispoint)
+        return dist;
+
+    return V_Sub(dist, V_Add(V_Add(CM_AxisOffset(ctx, g, 0),
+                                   CM_AxisOffset(ctx, g, 1)),
+                                   CM_AxisOffset(ctx, g, 2)));
+}
+
+static inline v4f CM_GroupDot(const float *g, const vec3_t p)
+{
+    v4f d = V_Mul(V_Set1(p[0]), V_Load(g + 0));
+    d = V_Add(d, V_Mul(V_Set1(p[1]), V_Load(g + 4)));
+    return V_Add(d, V_Mul(V_Set1(p[2]), V_Load(g + 8)));
+}
+
+static void CM_ClipBoxToBrushSIMD(const cm_trace_ctx_t *ctx, const vec3_t p1, const vec3_t p2, trace_t *trace, mbrush_t *brush)
+{
+    const float *g = brush->planes;
+    int         i, numgroups = BRUSH_NUM_GROUPS(brush->numsides);
+    v4f         zero = V_Set1(0), epsilon = V_Set1(DIST_EPSILON);
+    v4f         one = V_Set1(1), minus_one = V_Set1(-1), four = V_Set1(4);
+    v4f         enter = minus_one, leave = one;
+    v4f         index, enterindex = minus_one;
+    v4m         getout = V_None(), startout = V_None();
+    float       lane_enter[4], lane_index[4], lane_leave[4];
+    float       enterfrac, leavefrac;
+    int         leadside;
+
+    if (!numgroups)
+        return;
+
+    lane_index[0] = 0; lane_index[1] = 1; lane_index[2] = 2; lane_index[3] = 3;
+    index = V_Load(lane_index);
+
+    for (i = 0; i < numgroups; i++, g += BRUSH_GROUP_FLOATS) {
+        v4f dist = CM_GroupDist(ctx, g);
+        v4f d1 = V_Sub(CM_GroupDot(g, p1), dist);
+        v4f d2 = V_Sub(CM_GroupDot(g, p2), dist);
+        v4m out1 = V_Gt(d1, zero);
+        v4m out2 = V_Gt(d2, zero);
+
+        // if completely in front of face, no intersection
+        if (V_Any(V_And(out1, V_Ge(d2, d1))))
+            return;
+
+        getout = V_Or(getout, out2);
+        startout = V_Or(startout, out1);
+
+        v4f denom = V_Sub(d1, d2);
+        v4m entering = V_And(V_Gt(d1, d2), out1);
+        v4m leaving = V_And(V_Gt(d2, d1), out2);
+        v4f f1 = V_Select(entering, V_Div(V_Sub(d1, epsilon), denom), minus_one);
+        v4f f2 = V_Select(leaving, V_Div(V_Add(d1, epsilon), denom), one);
+
+        // keep first side with the largest enter fraction in each lane
+        v4m better = V_Gt(f1, enter);
+        enter = V_Select(better, f1, enter);
+        enterindex = V_Select(better, index, enterindex);
+        leave = V_Min(leave, f2);
+        index = V_Add(index, four);
+    }
+
+    V_Store(lane_enter, enter);
+    V_Store(lane_index, enterindex);
+    V_Store(lane_leave, leave);
+
+    enterfrac = -1;
+    leavefrac = 1;
+    leadside = -1;
+    for (i = 0; i < 4; i++) {
+        if (lane_enter[i] > enterfrac || (lane_enter[i] == enterfrac && lane_index[i] < leadside)) {
+            enterfrac = lane_enter[i];
+            leadside = lane_index[i];
+        }
+        if (lane_leave[i] < leavefrac)
+            leavefrac = lane_leave[i];
+    }
+
+    if (!V_Any(startout)) {
+        // original point was inside brush
+        trace->startsolid = true;
+        if (!V_Any(getout)) {
+            trace->allsolid = true;
+            if (!map_allsolid_bug->integer) {
+                // original Q2 didn't set these
+                trace->fraction = 0;
+                trace->contents = brush->contents;
+            }
+        }
+        return;
+    }
+    if (enterfrac < leavefrac) {
+        if (enterfrac > -1 && enterfrac < trace->fraction) {
+            if (enterfrac < 0)
+                enterfrac = 0;
+            trace->fraction = enterfrac;
+            trace->plane = *brush->firstbrushside[leadside].plane;
+            trace->surface = &(brush->firstbrushside[leadside].texinfo->c);
+            trace->contents = brush->contents;
+        }
+    }
+}
+
+static void CM_TestBoxInBrushSIMD(const cm_trace_ctx_t *ctx, const vec3_t p1, trace_t *trace, mbrush_t *brush)
+{
+    const float *g = brush->planes;
+    int         i, numgroups = BRUSH_NUM_GROUPS(brush->numsides);
+    v4f         zero = V_Set1(0);
+
+    if (!numgroups)
+        return;
+
+    for (i = 0; i < numgroups; i++, g += BRUSH_GROUP_FLOATS) {
+        v4f d1 = V_Sub(CM_GroupDot(g, p1), CM_GroupDist(ctx, g));
+
+        // if completely in front of face, no intersection
+        if (V_Any(V_Gt(d1, zero)))
+            return;
+    }
+
+    // inside this brush
+    trace->startsolid = trace->allsolid = true;
+    trace->fraction = 0;
+    trace->contents = brush->contents;
+}
+
+#endif // USE_SIMD
+
+/*
+================
+CM_CullBrush
+
+Returns true if brush is too far from the swept box to affect the trace.
+Only bounds from axial sides are used, so this is exact.
+================
+*/
+static inline bool CM_CullBrush(const cm_trace_ctx_t *ctx, const mbrush_t *brush)
+{
+    return brush->mins[0] > ctx->absmaxs[0] || brush->maxs[0] < ctx->absmins[0] ||
+           brush->mins[1] > ctx->absmaxs[1] || brush->maxs[1] < ctx->absmins[1] ||
+           brush->mins[2] > ctx->absmaxs[2] || brush->maxs[2] < ctx->absmins[2];
+}
+
+/*
+================
+CM_CheckBrush
+
+Returns true if brush was already checked during this trace.
+================
+*/
+static bool CM_CheckBrush(cm_trace_ctx_t *ctx, const mbrush_t *brush)
+{
+    unsigned hash = ((uintptr_t)brush / sizeof(*brush)) & (CM_CHECKED_BRUSHES - 1);
+
+    if (ctx->checked[hash].brush == brush && ctx->checked[hash].checkcount == ctx->checkcount)
+        return true;
+
+    ctx->checked[hash].brush = brush;
+    ctx->checked[hash].checkcount = ctx->checkcount;
+    return false;
+}
+
 /*
 ================
 CM_TraceToLeaf
 ================
 */
-static void CM_TraceToLeaf(mleaf_t *leaf)
+static void CM_TraceToLeaf(cm_trace_ctx_t *ctx, mleaf_t *leaf)
 {
     int         k;
     mbrush_t    *b, **leafbrush;
 
-    if (!(leaf->contents & trace_contents))
+    if (!(leaf->contents & ctx->contents))
         return;
     // trace line against all brushes in the leaf
     leafbrush = leaf->firstleafbrush;
     for (k = 0; k < leaf->numleafbrushes; k++, leafbrush++) {
         b = *leafbrush;
-        if (b->checkcount == checkcount)
+        if (CM_CheckBrush(ctx, b))
             continue;   // already checked this brush in another leaf
-        b->checkcount = checkcount;
 
-        if (!(b->contents & trace_contents))
+        if (!(b->contents & ctx->contents))
             continue;
-        CM_ClipBoxToBrush(trace_start, trace_end, trace_trace, b);
-        if (!trace_trace->fraction)
+        if (map_fast_trace->integer) {
+            if (CM_CullBrush(ctx, b))
+                continue;
+#if USE_SIMD
+            CM_ClipBoxToBrushSIMD(ctx, ctx->start, ctx->end, ctx->trace, b);
+#else
+            CM_ClipBoxToBrush(ctx, ctx->start, ctx->end, ctx->trace, b);
+#endif
+        } else {
+            CM_ClipBoxToBrush(ctx, ctx->start, ctx->end, ctx->trace, b);
+        }
+        if (!ctx->trace->fraction)
             return;
     }
 }
@@ -636,25 +895,34 @@ static void CM_TraceToLeaf(mleaf_t *leaf)
 CM_TestInLeaf
 ================
 */
-static void CM_TestInLeaf(mleaf_t *leaf)
+static void CM_TestInLeaf(cm_trace_ctx_t *ctx, mleaf_t *leaf)
 {
     int         k;
     mbrush_t    *b, **leafbrush;
 
-    if (!(leaf->contents & trace_contents))
+    if (!(leaf->contents & ctx->contents))
         return;
     // trace line against all brushes in the leaf
     leafbrush = leaf->firstleafbrush;
     for (k = 0; k < leaf->numleafbrushes; k++, leafbrush++) {
         b = *leafbrush;
-        if (b->checkcount == checkcount)
+        if (CM_CheckBrush(ctx, b))
             continue;   // already checked this brush in another leaf
-        b->checkcount = checkcount;
 
-        if (!(b->contents & trace_contents))
+        if (!(b->contents & ctx->contents))
             continue;
-        CM_TestBoxInBrush(trace_start, trace_trace, b);
-        if (!trace_trace->fraction)
+        if (map_fast_trace->integer) {
+            if (CM_CullBrush(ctx, b))
+                continue;
+#if USE_SIMD
+            CM_TestBoxInBrushSIMD(ctx, ctx->start, ctx->trace, b);
+#else
+            CM_TestBoxInBrush(ctx, ctx->start, ctx->trace, b);
+#endif
+        } else {
+            CM_TestBoxInBrush(ctx, ctx->start, ctx->trace, b);
+        }
+        if (!ctx->trace->fraction)
             return;
     }
 }
@@ -665,7 +933,7 @@ CM_RecursiveHullCheck
 
 ==================
 */
-static void CM_RecursiveHullCheck(mnode_t *node, float p1f, float p2f, const vec3_t p1, const vec3_t p2)
+static void CM_RecursiveHullCheck(cm_trace_ctx_t *ctx, mnode_t *node, float p1f, float p2f, const vec3_t p1, const vec3_t p2)
 {
     cplane_t    *plane;
     float       t1, t2, offset;
@@ -675,14 +943,14 @@ static void CM_RecursiveHullCheck(mnode_t *node, float p1f, float p2f, const vec
     int         side;
     float       midf;
 
-    if (trace_trace->fraction <= p1f)
+    if (ctx->trace->fraction <= p1f)
         return;     // already hit something nearer
 
 recheck:
     // if plane is NULL, we are in a leaf node
     plane = node->plane;
     if (!plane) {
-        CM_TraceToLeaf((mleaf_t *)node);
+        CM_TraceToLeaf(ctx, (mleaf_t *)node);
         return;
     }
 
@@ -693,16 +961,16 @@ recheck:
     if (plane->type < 3) {
         t1 = p1[plane->type] - plane->dist;
         t2 = p2[plane->type] - plane->dist;
-        offset = trace_extents[plane->type];
+        offset = ctx->extents[plane->type];
     } else {
         t1 = PlaneDiff(p1, plane);
         t2 = PlaneDiff(p2, plane);
-        if (trace_ispoint)
+        if (ctx->ispoint)
             offset = 0;
         else
-            offset = fabsf(trace_extents[0] * plane->normal[0]) +
-                     fabsf(trace_extents[1] * plane->normal[1]) +
-                     fabsf(trace_extents[2] * plane->normal[2]);
+            offset = fabsf(ctx->extents[0] * plane->normal[0]) +
+                     fabsf(ctx->extents[1] * plane->normal[1]) +
+                     fabsf(ctx->extents[2] * plane->normal[2]);
     }
 
     // see which sides we need to consider
@@ -739,48 +1007,70 @@ recheck:
     midf = p1f + (p2f - p1f) * frac;
     LerpVector(p1, p2, frac, mid);
 
-    CM_RecursiveHullCheck(node->children[side], p1f, midf, p1, mid);
+    CM_RecursiveHullCheck(ctx, node->children[side], p1f, midf, p1, mid);
 
     // go past the node
     midf = p1f + (p2f - p1f) * frac2;
     LerpVector(p1, p2, frac2, mid);
 
-    CM_RecursiveHullCheck(node->children[side ^ 1], midf, p2f, mid, p2);
+    CM_RecursiveHullCheck(ctx, node->children[side ^ 1], midf, p2f, mid, p2);
 }
 
 //======================================================================
 
 /*
 ==================
-CM_BoxTrace
+CM_BoxTraceCtx
 ==================
 */
-void CM_BoxTrace(trace_t *trace,
-                 const vec3_t start, const vec3_t end,
-                 const vec3_t mins, const vec3_t maxs,
-                 mnode_t *headnode, int brushmask)
+void CM_BoxTraceCtx(cm_trace_ctx_t *ctx, trace_t *trace,
+                    const vec3_t start, const vec3_t end,
+                    const vec3_t mins, const vec3_t maxs,
+                    mnode_t *headnode, int brushmask)
 {
     const vec_t *bounds[2] = { mins, maxs };
     int i, j;
 
-    checkcount++;       // for multi-check avoidance
+    // for multi-check avoidance
+    if (!++ctx->checkcount) {
+        memset(ctx->checked, 0, sizeof(ctx->checked));
+        ctx->checkcount = 1;
+    }
 
     // fill in a default trace
-    trace_trace = trace;
-    memset(trace_trace, 0, sizeof(*trace_trace));
-    trace_trace->fraction = 1;
-    trace_trace->surface = &(nulltexinfo.c);
+    ctx->trace = trace;
+    memset(trace, 0, sizeof(*trace));
+    trace->fraction = 1;
+    trace->surface = &(nulltexinfo.c);
 
     if (!headnode) {
         return;
     }
 
-    trace_contents = brushmask;
-    VectorCopy(start, trace_start);
-    VectorCopy(end, trace_end);
+    ctx->contents = brushmask;
+    VectorCopy(start, ctx->start);
+    VectorCopy(end, ctx->end);
     for (i = 0; i < 8; i++)
         for (j = 0; j < 3; j++)
-            trace_offsets[i][j] = bounds[(i >> j) & 1][j];
+            ctx->offsets[i][j] = bounds[(i >> j) & 1][j];
+
+    for (i = 0; i < 3; i++) {
+        ctx->absmins[i] = min(start[i], end[i]) + mins[i] - CULL_EPSILON;
+        ctx->absmaxs[i] = max(start[i], end[i]) + maxs[i] + CULL_EPSILON;
+    }
+
+    //
+    // check for point special case, position test needs it too
+    //
+    if (VectorEmpty(mins) && VectorEmpty(maxs)) {
+        ctx->ispoint = true;
+        VectorClear(ctx->extents);
+    } else {
+        ctx->ispoint = false;
+        ctx->extents[0] = max(-mins[0], maxs[0]);
+        ctx->extents[1] = max(-mins[1], maxs[1]);
+        ctx->extents[2] = max(-mins[2], maxs[2]);
+    }
 
     //
     // check for position test special case
@@ -799,51 +1089,46 @@ void CM_BoxTrace(trace_t *trace,
 
         numleafs = CM_BoxLeafs_headnode(c1, c2, leafs, q_countof(leafs), headnode, NULL);
         for (i = 0; i < numleafs; i++) {
-            CM_TestInLeaf(leafs[i]);
-            if (trace_trace->allsolid)
+            CM_TestInLeaf(ctx, leafs[i]);
+            if (trace->allsolid)
                 break;
         }
-        VectorCopy(start, trace_trace->endpos);
+        VectorCopy(start, trace->endpos);
         return;
     }
 
-    //
-    // check for point special case
-    //
-    if (VectorEmpty(mins) && VectorEmpty(maxs)) {
-        trace_ispoint = true;
-        VectorClear(trace_extents);
-    } else {
-        trace_ispoint = false;
-        trace_extents[0] = max(-mins[0], maxs[0]);
-        trace_extents[1] = max(-mins[1], maxs[1]);
-        trace_extents[2] = max(-mins[2], maxs[2]);
-    }
-
     //
     // general sweeping through world
     //
-    CM_RecursiveHullCheck(headnode, 0, 1, start, end);
+    CM_RecursiveHullCheck(ctx, headnode, 0, 1, start, end);
 
-    if (trace_trace->fraction == 1)
-        VectorCopy(end, trace_trace->endpos);
+    if (trace->fraction == 1)
+        VectorCopy(end, trace->endpos);
     else
-        LerpVector(start, end, trace_trace->fraction, trace_trace->endpos);
+        LerpVector(start, end, trace->fraction, trace->endpos);
+}
+
+void CM_BoxTrace(trace_t *trace,
+                 const vec3_t start, const vec3_t end,
+                 const vec3_t mins, const vec3_t maxs,
+                 mnode_t *headnode, int brushmask)
+{
+    CM_BoxTraceCtx(&cm_default_ctx, trace, start, end, mins, maxs, headnode, brushmask);
 }
 
 /*
 ==================
-CM_TransformedBoxTrace
+CM_TransformedBoxTraceCtx
 
 Handles offseting and rotation of the end points for moving and
 rotating entities
 ==================
 */
-void CM_TransformedBoxTrace(trace_t *trace,
-                            const vec3_t start, const vec3_t end,
-                            const vec3_t mins, const vec3_t maxs,
-                            mnode_t *headnode, int brushmask,
-                            const vec3_t origin, const vec3_t angles)
+void CM_TransformedBoxTraceCtx(cm_trace_ctx_t *ctx, trace_t *trace,
+                               const vec3_t start, const vec3_t end,
+                               const vec3_t mins, const vec3_t maxs,
+                               mnode_t *headnode, int brushmask,
+                               const vec3_t origin, const vec3_t angles)
 {
     vec3_t      start_l, end_l;
     vec3_t      axis[3];
@@ -854,7 +1139,7 @@ void CM_TransformedBoxTrace(trace_t *trace,
     VectorSubtract(end, origin, end_l);
 
     // rotate start and end into the models frame of reference
-    rotated = headnode != box_headnode && !VectorEmpty(angles);
+    rotated = headnode != ctx->box_nodes && !VectorEmpty(angles);
     if (rotated) {
         AnglesToAxis(angles, axis);
         RotatePoint(start_l, axis);
@@ -862,7 +1147,7 @@ void CM_TransformedBoxTrace(trace_t *trace,
     }
 
     // sweep the box through the model
-    CM_BoxTrace(trace, start_l, end_l, mins, maxs, headnode, brushmask);
+    CM_BoxTraceCtx(ctx, trace, start_l, end_l, mins, maxs, headnode, brushmask);
 
     // rotate plane normal into the worlds frame of reference
     if (rotated && trace->fraction != 1.0f) {
@@ -875,6 +1160,16 @@ void CM_TransformedBoxTrace(trace_t *trace,
     LerpVector(start, end, trace->fraction, trace->endpos);
 }
 
+void CM_TransformedBoxTrace(trace_t *trace,
+                            const vec3_t start, const vec3_t end,
+                            const vec3_t mins, const vec3_t maxs,
+                            mnode_t *headnode, int brushmask,
+                            const vec3_t origin, const vec3_t angles)
+{
+    CM_TransformedBoxTraceCtx(&cm_default_ctx, trace, start, end, mins, maxs,
+                              headnode, brushmask, origin, angles);
+}
+
 void CM_ClipEntity(trace_t *dst, const trace_t *src, struct edict_s *ent)
 {
     dst->allsolid |= src->allsolid;
@@ -1089,26 +1384,20 @@ bool CM_HeadnodeVisible(mnode_t *node, byte *visbits)
 
 /*
 ============
-CM_FatPVS
+CM_FatClusters
 
-The client will interpolate the view position,
-so we can't use a single PVS point
+Returns the sorted list of unique clusters touched by the fat PVS box
+around the view position.
 ===========
 */
-byte *CM_FatPVS(cm_t *cm, byte *mask, const vec3_t org, int vis)
+int CM_FatClusters(cm_t *cm, const vec3_t org, int *clusters)
 {
-    byte    temp[VIS_MAX_BYTES];
-    mleaf_t *leafs[64];
-    int     clusters[64];
-    int     i, j, count, longs;
-    size_t  *src, *dst;
+    mleaf_t *leafs[MAX_FAT_CLUSTERS];
+    int     i, j, c, count, numclusters;
     vec3_t  mins, maxs;
 
     if (!cm->cache) {   // map not loaded
-        return memset(mask, 0, VIS_MAX_BYTES);
-    }
-    if (!cm->cache->vis) {
-        return memset(mask, 0xff, VIS_MAX_BYTES);
+        return 0;
     }
 
     for (i = 0; i < 3; i++) {
@@ -1119,33 +1408,77 @@ byte *CM_FatPVS(cm_t *cm, byte *mask, const vec3_t org, int vis)
     count = CM_BoxLeafs(cm, mins, maxs, leafs, q_countof(leafs), NULL);
     Q_assert(count > 0);
 
-    // convert leafs to clusters
+    // convert leafs to clusters, neighbour leafs often share the
+    // cluster, so insert from the end
+    numclusters = 0;
     for (i = 0; i < count; i++) {
-        clusters[i] = leafs[i]->cluster;
+        c = leafs[i]->cluster;
+        for (j = numclusters; j > 0 && clusters[j - 1] > c; j--)
+            ;
+        if (j > 0 && clusters[j - 1] == c)
+            continue;   // already have the cluster we want
+        memmove(clusters + j + 1, clusters + j, sizeof(clusters[0]) * (numclusters - j));
+        clusters[j] = c;
+        numclusters++;
+    }
+
+    return numclusters;
+}
+
+/*
+============
+CM_ClustersVis
+
+Merges visibility of all clusters in the list. Rows are read directly from
+vis matrices when available.
+===========
+*/
+byte *CM_ClustersVis(cm_t *cm, byte *mask, const int *clusters, int count, int vis)
+{
+    byte        temp[VIS_MAX_BYTES];
+    const byte  *row;
+    int         i;
+
+    if (!cm->cache || !count) {   // map not loaded
+        return memset(mask, 0, VIS_MAX_BYTES);
+    }
+    if (!cm->cache->vis) {
+        return memset(mask, 0xff, VIS_MAX_BYTES);
     }
 
     BSP_ClusterVis(cm->cache, mask, clusters[0], vis);
-    longs = VIS_FAST_LONGS(cm->cache);
 
-    // or in all the other leaf bits
+    // or in all the other cluster bits
     for (i = 1; i < count; i++) {
-        for (j = 0; j < i; j++) {
-            if (clusters[i] == clusters[j]) {
-                goto nextleaf; // already have the cluster we want
-            }
-        }
-        src = (size_t *)BSP_ClusterVis(cm->cache, temp, clusters[i], vis);
-        dst = (size_t *)mask;
-        for (j = 0; j < longs; j++) {
-            *dst++ |= *src++;
-        }
-
-nextleaf:;
+        if (clusters[i] == -1)
+            continue;
+        row = BSP_ClusterVisRow(cm->cache, clusters[i], vis);
+        if (!row)
+            row = BSP_ClusterVis(cm->cache, temp, clusters[i], vis);
+        BitSet_Or(mask, row, cm->cache->visrowsize);
     }
 
     return mask;
 }
 
+/*
+============
+CM_FatPVS
+
+The client will interpolate the view position,
+so we can't use a single PVS point
+===========
+*/
+byte *CM_FatPVS(cm_t *cm, byte *mask, const vec3_t org, int vis)
+{
+    int     clusters[MAX_FAT_CLUSTERS];
+    int     count;
+
+    count = CM_FatClusters(cm, org, clusters);
+
+    return CM_ClustersVis(cm, mask, clusters, count, vis);
+}
+
 /*
 =============
 CM_Init
@@ -1153,12 +1486,13 @@ CM_Init
 */
 void CM_Init(void)
 {
-    CM_InitBoxHull();
+    CM_InitTraceCtx(&cm_default_ctx);
 
     nullleaf.cluster = -1;
 
     map_noareas = Cvar_Get("map_noareas", "0", 0);
     map_allsolid_bug = Cvar_Get("map_allsolid_bug", "1", 0);
+    map_fast_trace = Cvar_Get("map_fast_trace", "1", 0);
     map_override_path = Cvar_Get("map_override_path", "", 0);
 }
 
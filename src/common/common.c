@@ -96,6 +96,7 @@ static char     com_errorMsg[MAXERRORMSG]; // from Com_Printf/Com_Error
 static int      com_printEntered;
 
 static qhandle_t    com_logFile;
+static logwriter_t  *com_logWriter;
 static bool         com_logNewline;
 static bool         com_conNewline;
 
@@ -106,6 +107,8 @@ static int      com_argc;
 cvar_t  *z_perturb;
 #endif
 
+cvar_t  *z_profile;
+
 #if USE_DEBUG
 cvar_t  *developer;
 #endif
@@ -119,6 +122,7 @@ cvar_t  *logfile_enable;    // 1 = create new, 2 = append to existing
 cvar_t  *logfile_flush;     // 1 = flush after each print
 cvar_t  *logfile_name;
 cvar_t  *logfile_prefix;
+cvar_t  *logfile_buffer;    // KiB, 0 = write from main thread
 cvar_t  *console_prefix;
 
 #if USE_CLIENT
@@ -237,14 +241,35 @@ static void Com_Redirect(const char *msg, size_t total)
 
 static void logfile_close(void)
 {
+    unsigned dropped = 0;
+
     if (!com_logFile) {
         return;
     }
 
     Com_Printf("Closing console log.\n");
 
-    FS_CloseFile(com_logFile);
+    if (com_logWriter) {
+        dropped = Com_LogDropped(com_logWriter);
+        Com_CloseLogWriter(com_logWriter);
+        com_logWriter = NULL;
+    } else {
+        FS_CloseFile(com_logFile);
+    }
     com_logFile = 0;
+
+    if (dropped) {
+        Com_WPrintf("%u console log records dropped\n", dropped);
+    }
+}
+
+static void logfile_sync(void)
+{
+    if (com_logWriter) {
+        Com_FlushLog(com_logWriter);
+    } else if (com_logFile) {
+        FS_Flush(com_logFile);
+    }
 }
 
 static void logfile_open(void)
@@ -271,6 +296,9 @@ static void logfile_open(void)
 
     com_logFile = f;
     com_logNewline = false;
+    if (logfile_buffer->integer > 0) {
+        com_logWriter = Com_OpenLogWriter(f, logfile_buffer->integer * 1024, NULL);
+    }
     Com_Printf("Logging console to %s\n", buffer);
 }
 
@@ -351,15 +379,31 @@ static void logfile_write(print_type_t type, const char *text)
     format_prefix(type, prefix, sizeof(prefix));
 
     size_t len = prefix_lines(buf, sizeof(buf), text, prefix, &com_logNewline);
-    int ret = FS_Write(buf, len, com_logFile);
-    if (ret == len) {
-        return;
+    int ret;
+
+    // prefix timestamp is taken now, even if writing is deferred
+    if (com_logWriter) {
+        ret = Com_WriteLog(com_logWriter, buf, len);
+        if (!ret) {
+            return;
+        }
+    } else {
+        ret = FS_Write(buf, len, com_logFile);
+        if (ret == len) {
+            return;
+        }
     }
 
     // zero handle BEFORE doing anything else to avoid recursion
     qhandle_t tmp = com_logFile;
+    logwriter_t *w = com_logWriter;
     com_logFile = 0;
-    FS_CloseFile(tmp);
+    com_logWriter = NULL;
+    if (w) {
+        Com_CloseLogWriter(w);
+    } else {
+        FS_CloseFile(tmp);
+    }
     Com_EPrintf("Couldn't write console log: %s\n", Q_ErrorString(ret));
     Cvar_Set("logfile", "0");
 }
@@ -583,7 +627,14 @@ void Com_Error(error_type_t code, const char *fmt, ...)
         goto abort;
     }
 
-    if (com_logFile) {
+    if (com_logWriter) {
+        // empty the ring first so that this line can't be dropped, and
+        // get it on disk before shutting anything down
+        Com_FlushLog(com_logWriter);
+        len = Q_snprintf(msg, sizeof(msg), "FATAL: %s\n", com_errorMsg);
+        Com_WriteLog(com_logWriter, msg, min(len, sizeof(msg) - 1));
+        Com_FlushLog(com_logWriter);
+    } else if (com_logFile) {
         FS_FPrintf(com_logFile, "FATAL: %s\n", com_errorMsg);
     }
 
@@ -597,9 +648,7 @@ void Com_Error(error_type_t code, const char *fmt, ...)
     // doesn't get there
 
 abort:
-    if (com_logFile) {
-        FS_Flush(com_logFile);
-    }
+    logfile_sync();
     com_errorEntered = false;
     longjmp(com_abortframe, -1);
 }
@@ -904,6 +953,7 @@ void Qcommon_Init(int argc, char **argv)
 #if USE_TESTS
     z_perturb = Cvar_Get("z_perturb", "0", 0);
 #endif
+    z_profile = Cvar_Get("z_profile", "0", 0);
 #if USE_CLIENT
     host_speeds = Cvar_Get("host_speeds", "0", 0);
 #endif
@@ -916,6 +966,7 @@ void Qcommon_Init(int argc, char **argv)
     logfile_flush = Cvar_Get("logfile_flush", "1", 0);
     logfile_name = Cvar_Get("logfile_name", "console", 0);
     logfile_prefix = Cvar_Get("logfile_prefix", "[%Y-%m-%d %H:%M] ", 0);
+    logfile_buffer = Cvar_Get("logfile_buffer", "64", 0);
     console_prefix = Cvar_Get("console_prefix", "", 0);
 #if USE_CLIENT
     dedicated = Cvar_Get("dedicated", "0", CVAR_NOSET);
@@ -952,6 +1003,7 @@ void Qcommon_Init(int argc, char **argv)
     rcon_password = Cvar_Get("rcon_password", "", CVAR_PRIVATE);
 
     Cmd_AddCommand("z_stats", Z_Stats_f);
+    Cmd_AddCommand("z_sites", Z_Profile_f);
 
     //Cmd_AddCommand("setenv", Com_Setenv_f);
 
@@ -975,6 +1027,8 @@ void Qcommon_Init(int argc, char **argv)
 
     Sys_RunConsole();
 
+    Com_InitAsyncWork();
+
     FS_Init();
 
     Sys_RunConsole();
@@ -986,6 +1040,7 @@ void Qcommon_Init(int argc, char **argv)
     logfile_enable->changed = logfile_enable_changed;
     logfile_flush->changed = logfile_param_changed;
     logfile_name->changed = logfile_param_changed;
+    logfile_buffer->changed = logfile_param_changed;
     logfile_enable_changed(logfile_enable);
 
     FS_AddConfigFiles(true);
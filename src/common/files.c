@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "client/client.h"
 #include "server/server.h"
 #include "format/pak.h"
+#include "system/pthread.h"
 
 #include <fcntl.h>
 
@@ -120,6 +121,18 @@ typedef struct {
     int64_t     rest_in;
     byte        buffer[ZIP_BUFSIZE];
 } zipstream_t;
+
+#define ZCACHE_HASH_SIZE    256
+
+typedef struct zcache_s {
+    list_t      entry;      // LRU order, most recent first
+    list_t      hash;
+    const void  *pack;
+    const void  *file;
+    unsigned    refcount;   // number of handles reading from it
+    size_t      size;
+    byte        data[1];
+} zcache_t;
 #endif
 
 typedef struct packfile_s {
@@ -144,6 +157,8 @@ typedef struct {
     packfile_t  *files;
     packfile_t  **file_hash;
     char        *names;
+    void        *map_base;  // names are in mapped index cache if set
+    size_t      map_size;
     char        filename[1];
 } pack_t;
 
@@ -151,15 +166,36 @@ typedef struct searchpath_s {
     struct searchpath_s *next;
     pack_t      *pack;        // only one of filename / pack will be used
     unsigned    mode;
+    int         dirnum;       // loose directory number in path index, or -1
     char        filename[1];
 } searchpath_t;
 
+// path index entries
+typedef struct pathhit_s {
+    struct pathhit_s *next;
+    pack_t      *pack;
+    packfile_t  *entry;
+} pathhit_t;
+
+typedef struct pathent_s {
+    struct pathent_s *hash_next;
+    struct pathent_s *lazy_next;    // for entries added on lookup
+    pathhit_t   *hits;      // pack entries, in search order
+    unsigned    gen;        // loose directory bits are valid if equal to fs_path_gen
+    uint64_t    absent;     // loose directories known not to contain the file
+    uint64_t    lower;      // loose directories containing lower case name
+    unsigned    hash;
+    unsigned    namelen;
+    const char  *name;
+} pathent_t;
+
 typedef struct {
     filetype_t  type;
     unsigned    mode;
     FILE        *fp;
 #if USE_ZLIB
     void        *zfp;       // gzFile for FS_GZ or zipstream_t for FS_ZIP
+    struct zcache_s *zcache;    // inflated contents for FS_ZIP
 #endif
     packfile_t  *entry;     // pack entry this handle is tied to
     pack_t      *pack;      // points to the pack entry is from
@@ -191,23 +227,58 @@ static int          fs_num_files;
 
 static bool         fs_non_uniq_open;
 
+// shared reads may run concurrently with the main thread. fs_lock protects
+// path index insertions and pack entry fixups. Search paths are changed
+// only after all shared reads are finished.
+static pthread_mutex_t  fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   fs_cond = PTHREAD_COND_INITIALIZER;
+static int              fs_readers;
+static bool             fs_restarting;
+
+#if USE_ZLIB
+// zip directory load times since last restart
+static unsigned     fs_mount_cached, fs_mount_parsed;
+static uint64_t     fs_mount_cached_usec, fs_mount_parsed_usec;
+#endif
+
+// unified index of pack entries from all search paths, plus negative
+// lookup cache for loose directories
+static pathent_t    **fs_path_hash;
+static unsigned     fs_path_hash_size;
+static pathent_t    *fs_path_ents;
+static pathhit_t    *fs_path_hits;
+static pathent_t    *fs_path_lazy;
+static unsigned     fs_path_lazy_count;
+static unsigned     fs_path_gen;
+
+#define MAX_PATH_DIRS       64
+#define MAX_PATH_LAZY       0x10000
+
 #if USE_DEBUG
 static int          fs_count_read;
 static int          fs_count_open;
 static int          fs_count_strcmp;
 static int          fs_count_strlwr;
+static int          fs_count_saved;
 #define FS_COUNT_READ       fs_count_read++
 #define FS_COUNT_OPEN       fs_count_open++
 #define FS_COUNT_STRCMP     fs_count_strcmp++
 #define FS_COUNT_STRLWR     fs_count_strlwr++
+#define FS_COUNT_SAVED      fs_count_saved++
 #else
 #define FS_COUNT_READ       (void)0
 #define FS_COUNT_OPEN       (void)0
 #define FS_COUNT_STRCMP     (void)0
 #define FS_COUNT_STRLWR     (void)0
+#define FS_COUNT_SAVED      (void)0
 #endif
 
 static cvar_t       *fs_autoexec;
+static cvar_t       *fs_path_cache;
+#if USE_ZLIB
+static cvar_t       *fs_pack_cache;
+static cvar_t       *fs_zip_cache;
+#endif
 
 #if USE_DEBUG
 static cvar_t       *fs_debug;
@@ -221,6 +292,13 @@ cvar_t              *fs_shareware;
 // local stream used for all file loads
 static zipstream_t  fs_zipstream;
 
+// inflated contents of recently used compressed pack entries
+static list_t       fs_zcache_lru;
+static list_t       fs_zcache_hash[ZCACHE_HASH_SIZE];
+static size_t       fs_zcache_bytes;
+static unsigned     fs_zcache_count;
+static unsigned     fs_zcache_hits, fs_zcache_misses, fs_zcache_evictions;
+
 static void open_zip_file(file_t *file);
 static void close_zip_file(file_t *file);
 static int read_zip_file(file_t *file, void *buf, size_t len);
@@ -232,6 +310,8 @@ static int seek_zip_file(file_t *file, int64_t offset, int whence);
 static pack_t *pack_get(pack_t *pack);
 static void pack_put(pack_t *pack);
 
+static int get_fp_info(FILE *fp, file_info_t *info);
+
 /*
 
 All of Quake's data access is through a hierchal file system,
@@ -587,6 +667,96 @@ int FS_Seek(qhandle_t f, int64_t offset, int whence)
     }
 }
 
+/*
+============
+FS_GetFileInfo
+
+Returns length of the open file and modification time of the file it is
+backed by (pack file for pack entries).
+============
+*/
+int FS_GetFileInfo(qhandle_t f, file_info_t *info)
+{
+    file_t *file = file_for_handle(f);
+    int ret;
+
+    if (!file)
+        return Q_ERR(EBADF);
+
+    // entries read from memory still report pack info
+    if (file->fp)
+        ret = get_fp_info(file->fp, info);
+    else if (file->pack)
+        ret = get_fp_info(file->pack->fp, info);
+    else
+        return Q_ERR(ENOSYS);
+    if (ret)
+        return ret;
+
+    info->size = file->length;
+    return Q_ERR_SUCCESS;
+}
+
+/*
+============
+FS_MapHandle
+
+Maps contents of the file opened for reading into memory, without copying.
+Only uncompressed pack entries (or raw deflate streams opened with
+FS_FLAG_DEFLATE) can be mapped. Loose files are not mapped, they may be
+modified or truncated while in use. Mapping stays valid after the file is
+closed, and must be released with FS_UnmapFile.
+============
+*/
+int FS_MapHandle(qhandle_t f, fs_mapping_t *map)
+{
+    file_t *file = file_for_handle(f);
+    int64_t offset;
+
+    memset(map, 0, sizeof(*map));
+
+    if (!file)
+        return Q_ERR(EBADF);
+
+    if ((file->mode & FS_MODE_MASK) != FS_MODE_READ)
+        return Q_ERR(EBADF);
+
+    if (file->type != FS_PAK)
+        return Q_ERR(ENOSYS);
+
+    offset = file->entry->filepos;
+
+    if (file->length <= 0)
+        return Q_ERR(EINVAL);
+    if (file->length > SIZE_MAX)
+        return Q_ERR(EFBIG);
+
+    map->data = Sys_MapFile(os_fileno(file->fp), offset, file->length,
+                            &map->base, &map->size);
+    if (!map->data)
+        return Q_ERR_FAILURE;
+
+    map->len = file->length;
+    return Q_ERR_SUCCESS;
+}
+
+/*
+============
+FS_UnmapFile
+
+Releases file mapped with FS_MapHandle or FS_MapFile.
+============
+*/
+void FS_UnmapFile(fs_mapping_t *map)
+{
+    if (map->base)
+        Sys_UnmapFile(map->base, map->size);
+    else
+        Z_Free(map->data);
+
+    memset(map, 0, sizeof(*map));
+}
+
 /*
 ============
 FS_CreatePath
@@ -673,10 +843,15 @@ int FS_CloseFile(qhandle_t f)
             ret = Q_ERR_LIBRARY_ERROR;
         break;
     case FS_ZIP:
+        if (file->zcache) {
+            file->zcache->refcount--;
+        }
         if (IS_UNIQUE(file)) {
-            close_zip_file(file);
+            if (file->zfp) {
+                close_zip_file(file);
+            }
             pack_put(file->pack);
-        } else {
+        } else if (file->fp) {
             fs_non_uniq_open = false;
         }
         break;
@@ -884,6 +1059,9 @@ static int64_t open_file_write(file_t *file, const char *name)
         goto fail;
     }
 
+    // file may be created
+    FS_FlushPathCache();
+
     switch (file->mode & FS_MODE_MASK) {
     case FS_MODE_APPEND:
         strcpy(mode_str, "a");
@@ -925,12 +1103,48 @@ fail:
     return ret;
 }
 
+// reads from given position, using pread() if fp is NULL
+static int read_at(FILE *fp, int fd, void *buf, size_t len, int64_t pos)
+{
+#ifndef _WIN32
+    if (!fp) {
+        byte *p = buf;
+        ssize_t r;
+
+        while (len) {
+            r = pread(fd, p, len, pos);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                return Q_ERRNO;
+            }
+            if (r == 0)
+                return Q_ERR_UNEXPECTED_EOF;
+            p += r;
+            pos += r;
+            len -= r;
+        }
+
+        return Q_ERR_SUCCESS;
+    }
+#endif
+
+    if (os_fseek(fp, pos, SEEK_SET))
+        return Q_ERRNO;
+    if (len && !fread(buf, len, 1, fp))
+        return FS_ERR_READ(fp);
+
+    return Q_ERR_SUCCESS;
+}
+
 #if USE_ZLIB
 
-static int check_header_coherency(FILE *fp, packfile_t *entry)
+// must be called with fs_lock held, fp is NULL for shared reads
+static int check_header_coherency(FILE *fp, int fd, packfile_t *entry)
 {
     unsigned ofs, flags, comp_mtd, comp_len, file_len, name_size, xtra_size;
     byte header[ZIP_SIZELOCALHEADER];
+    int ret;
 
     if (entry->coherent)
         return Q_ERR_SUCCESS;
@@ -942,10 +1156,9 @@ static int check_header_coherency(FILE *fp, packfile_t *entry)
     if (entry->compmtd != 0 && entry->compmtd != Z_DEFLATED)
         return Q_ERR_BAD_COMPRESSION;
 
-    if (os_fseek(fp, entry->filepos, SEEK_SET))
-        return Q_ERRNO;
-    if (!fread(header, sizeof(header), 1, fp))
-        return FS_ERR_READ(fp);
+    ret = read_at(fp, fd, header, sizeof(header), entry->filepos);
+    if (ret)
+        return ret;
 
     // check the magic
     if (RL32(&header[0]) != ZIP_LOCALHEADERMAGIC)
@@ -979,6 +1192,138 @@ static int check_header_coherency(FILE *fp, packfile_t *entry)
     return Q_ERR_SUCCESS;
 }
 
+/*
+============================================================
+
+INFLATED ENTRY CACHE
+
+Keeps inflated contents of compressed pack entries that were loaded in full,
+so that loading them again, or seeking backwards in them, is a memory copy
+instead of inflating the entry again. Cache size is limited by fs_zip_cache
+(in MB), least recently used entries not being read from are freed first.
+
+============================================================
+*/
+
+#define ZCACHE_HASH(file) \
+    (((uintptr_t)(file) / sizeof(packfile_t)) & (ZCACHE_HASH_SIZE - 1))
+
+#define FOR_EACH_ZCACHE_LRU(c) \
+    LIST_FOR_EACH(zcache_t, c, &fs_zcache_lru, entry)
+
+#define FOR_EACH_ZCACHE_LRU_SAFE(c, next) \
+    LIST_FOR_EACH_SAFE(zcache_t, c, next, &fs_zcache_lru, entry)
+
+static size_t zcache_limit(void)
+{
+    if (!fs_zip_cache || fs_zip_cache->value <= 0)
+        return 0;
+
+    return fs_zip_cache->value * 0x100000;
+}
+
+static void free_zcache(zcache_t *c)
+{
+    Q_assert(!c->refcount);
+    List_Remove(&c->entry);
+    List_Remove(&c->hash);
+    fs_zcache_bytes -= c->size;
+    fs_zcache_count--;
+    Z_Free(c);
+}
+
+// frees least recently used entries until size fits into limit
+static void trim_zcache(size_t limit)
+{
+    zcache_t *c, *prev;
+
+    if (!fs_zcache_count)
+        return;
+
+    c = LIST_LAST(zcache_t, &fs_zcache_lru, entry);
+    while (!LIST_TERM(c, &fs_zcache_lru, entry) && fs_zcache_bytes > limit) {
+        prev = LIST_PREV(zcache_t, c, entry);
+        if (!c->refcount) {
+            free_zcache(c);
+            fs_zcache_evictions++;
+        }
+        c = prev;
+    }
+}
+
+// called when pack is freed
+static void flush_zcache(const pack_t *pack)
+{
+    zcache_t *c, *next;
+
+    if (!fs_zcache_count)
+        return;
+
+    FOR_EACH_ZCACHE_LRU_SAFE(c, next) {
+        if (c->pack == pack)
+            free_zcache(c);
+    }
+}
+
+static zcache_t *find_zcache(const pack_t *pack, const packfile_t *entry)
+{
+    zcache_t *c;
+    list_t *bucket;
+
+    if (!fs_zcache_count)
+        return NULL;
+
+    bucket = &fs_zcache_hash[ZCACHE_HASH(entry)];
+    LIST_FOR_EACH(zcache_t, c, bucket, hash) {
+        if (c->file == entry && c->pack == pack) {
+            List_Remove(&c->entry);
+            List_Insert(&fs_zcache_lru, &c->entry);
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+// allocates new entry, caller must fill it in
+static zcache_t *alloc_zcache(const pack_t *pack, const packfile_t *entry)
+{
+    size_t limit = zcache_limit();
+    zcache_t *c;
+
+    // don't let single entry flush most of the cache
+    if (entry->filelen <= 0 || entry->filelen > limit / 4)
+        return NULL;
+
+    trim_zcache(limit - entry->filelen);
+
+    c = FS_Malloc(sizeof(*c) + entry->filelen - 1);
+    c->pack = pack;
+    c->file = entry;
+    c->refcount = 0;
+    c->size = entry->filelen;
+    List_Insert(&fs_zcache_lru, &c->entry);
+    List_Insert(&fs_zcache_hash[ZCACHE_HASH(entry)], &c->hash);
+    fs_zcache_bytes += c->size;
+    fs_zcache_count++;
+
+    return c;
+}
+
+static void fs_zip_cache_changed(cvar_t *self)
+{
+    trim_zcache(zcache_limit());
+}
+
+static void init_zcache(void)
+{
+    int i;
+
+    List_Init(&fs_zcache_lru);
+    for (i = 0; i < ZCACHE_HASH_SIZE; i++)
+        List_Init(&fs_zcache_hash[i]);
+}
+
 static voidpf FS_zalloc(voidpf opaque, uInt items, uInt size)
 {
     return FS_Malloc(items * size);
@@ -1029,18 +1374,13 @@ static void close_zip_file(file_t *file)
     fclose(file->fp);
 }
 
-static int read_zip_file(file_t *file, void *buf, size_t len)
+static int inflate_zip_file(file_t *file, void *buf, size_t len)
 {
     zipstream_t *s = file->zfp;
     z_streamp z = &s->stream;
     size_t block, result;
     int ret;
 
-    len = min(len, file->length - file->position);
-    if (!len) {
-        return 0;
-    }
-
     z->next_out = buf;
     z->avail_out = (uInt)len;
 
@@ -1088,34 +1428,83 @@ static int read_zip_file(file_t *file, void *buf, size_t len)
     return len;
 }
 
+static int read_zip_file(file_t *file, void *buf, size_t len)
+{
+    zcache_t *c;
+    int ret;
+
+    len = min(len, file->length - file->position);
+    if (!len) {
+        return 0;
+    }
+
+    if (file->zcache) {
+        memcpy(buf, file->zcache->data + file->position, len);
+        file->position += len;
+        return len;
+    }
+
+    ret = inflate_zip_file(file, buf, len);
+
+    // remember contents of entries read in one go
+    if (ret == file->length && !file->error &&
+        (c = alloc_zcache(file->pack, file->entry))) {
+        memcpy(c->data, buf, ret);
+        c->refcount++;
+        file->zcache = c;
+    }
+
+    return ret;
+}
+
 static int seek_zip_file(file_t *file, int64_t offset, int whence)
 {
     packfile_t *entry = file->entry;
     zipstream_t *s = file->zfp;
-    z_streamp z = &s->stream;
+    zcache_t *c;
+    int ret;
 
     offset = get_seek_offset(file, offset, whence);
     if (offset < 0)
         return offset;
 
+    if (file->zcache) {
+        file->position = offset;
+        return Q_ERR_SUCCESS;
+    }
+
     if (offset < file->position) {
         if (os_fseek(file->fp, entry->filepos, SEEK_SET))
             return Q_ERRNO;
 
-        inflateReset(z);
+        inflateReset(&s->stream);
 
-        z->avail_in = z->avail_out = 0;
-        z->next_in = z->next_out = NULL;
+        s->stream.avail_in = s->stream.avail_out = 0;
+        s->stream.next_in = s->stream.next_out = NULL;
 
         s->rest_in = entry->complen;
         file->position = 0;
+
+        // inflate whole entry once, further seeks are memory copies
+        if ((c = alloc_zcache(file->pack, entry))) {
+            c->refcount++;
+            ret = inflate_zip_file(file, c->data, c->size);
+            if (ret != c->size) {
+                c->refcount--;
+                free_zcache(c);
+                return ret < 0 ? ret : Q_ERR_UNEXPECTED_EOF;
+            }
+            file->zcache = c;
+            file->position = offset;
+            return Q_ERR_SUCCESS;
+        }
     }
 
     while (file->position < offset) {
         byte buf[ZIP_BUFSIZE];
 
         int len = min(offset - file->position, sizeof(buf));
-        int ret = read_zip_file(file, buf, len);
+        ret = read_zip_file(file, buf, len);
         if (ret < 0)
             return ret;
         if (ret == 0)
@@ -1130,12 +1519,50 @@ static int seek_zip_file(file_t *file, int64_t offset, int whence)
 #define entry_compmtd(entry)  0
 #endif
 
+#if USE_ZLIB
+// reads go from memory, pack file is not touched
+static int64_t open_from_zcache(file_t *file, pack_t *pack, packfile_t *entry, zcache_t *c)
+{
+    c->refcount++;
+
+    file->type = FS_ZIP;
+    file->fp = NULL;
+    file->zfp = NULL;
+    file->zcache = c;
+    file->entry = entry;
+    file->pack = pack;
+    file->error = Q_ERR_SUCCESS;
+    file->position = 0;
+    file->length = c->size;
+
+    if (IS_UNIQUE(file)) {
+        pack_get(pack);
+    }
+
+    FS_DPrintf("%s: %s/%s: %"PRId64" bytes\n",
+               __func__, pack->filename, pack->names + entry->nameofs, file->length);
+
+    return file->length;
+}
+#endif
+
 // open a new file on the pakfile
 static int64_t open_from_pack(file_t *file, pack_t *pack, packfile_t *entry)
 {
     FILE *fp;
     int ret;
 
+#if USE_ZLIB
+    if (entry_compmtd(entry) && !(file->mode & FS_FLAG_DEFLATE)) {
+        zcache_t *c = find_zcache(pack, entry);
+        if (c) {
+            fs_zcache_hits++;
+            return open_from_zcache(file, pack, entry, c);
+        }
+        fs_zcache_misses++;
+    }
+#endif
+
     if (IS_UNIQUE(file)) {
         fp = fopen(pack->filename, "rb");
         if (!fp) {
@@ -1153,7 +1580,9 @@ static int64_t open_from_pack(file_t *file, pack_t *pack, packfile_t *entry)
 
 #if USE_ZLIB
     if (pack->type == FS_ZIP) {
-        ret = check_header_coherency(fp, entry);
+        pthread_mutex_lock(&fs_lock);
+        ret = check_header_coherency(fp, -1, entry);
+        pthread_mutex_unlock(&fs_lock);
         if (ret) {
             goto fail2;
         }
@@ -1315,6 +1744,17 @@ fail:
     return ret;
 }
 
+#ifndef _WIN32
+static int64_t open_from_disk_lower(file_t *file, const char *fullpath, size_t dirlen)
+{
+    char buffer[MAX_OSPATH];
+
+    strcpy(buffer, fullpath);
+    Q_strlwr(buffer + dirlen + 1);
+    return open_from_disk(file, buffer);
+}
+#endif
+
 int FS_LastModified(char const * file, uint64_t * last_modified)
 {
 #ifndef NO_TEXTURE_RELOADS
@@ -1361,6 +1801,201 @@ int FS_LastModified(char const * file, uint64_t * last_modified)
     return Q_ERR_INVALID_PATH;
 }
 
+/*
+============================================================
+
+PATH INDEX
+
+Maps normalized paths to entries of all packs in the search path, so that
+lookups don't need to probe each pack in turn. Also remembers which loose
+directories don't contain the file (or contain it under lower case name),
+avoiding repeated failed open() calls when precaching. Loose directory
+information is discarded whenever anything is written through the
+filesystem, links change or the search path is rebuilt.
+
+============================================================
+*/
+
+// waits for shared reads to finish and blocks new ones from starting
+static void lock_search_paths(void)
+{
+    pthread_mutex_lock(&fs_lock);
+    fs_restarting = true;
+    while (fs_readers)
+        pthread_cond_wait(&fs_cond, &fs_lock);
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void unlock_search_paths(void)
+{
+    pthread_mutex_lock(&fs_lock);
+    fs_restarting = false;
+    pthread_cond_broadcast(&fs_cond);
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void free_path_index(void)
+{
+    pathent_t *ent, *next;
+
+    for (ent = fs_path_lazy; ent; ent = next) {
+        next = ent->lazy_next;
+        Z_Free(ent);
+    }
+
+    Z_Freep((void**)&fs_path_hash);
+    Z_Freep((void**)&fs_path_ents);
+    Z_Freep((void**)&fs_path_hits);
+    fs_path_hash_size = 0;
+    fs_path_lazy = NULL;
+    fs_path_lazy_count = 0;
+}
+
+static pathent_t *find_path_entry(const char *name, size_t namelen, unsigned hash)
+{
+    pathent_t *ent;
+
+    ent = fs_path_hash[hash & (fs_path_hash_size - 1)];
+    for (; ent; ent = ent->hash_next) {
+        if (ent->hash != hash || ent->namelen != namelen)
+            continue;
+        FS_COUNT_STRCMP;
+        if (!FS_pathcmp(ent->name, name))
+            return ent;
+    }
+
+    return NULL;
+}
+
+static void link_path_entry(pathent_t *ent, const char *name, size_t namelen, unsigned hash)
+{
+    pathent_t **bucket = &fs_path_hash[hash & (fs_path_hash_size - 1)];
+
+    ent->name = name;
+    ent->namelen = namelen;
+    ent->hash = hash;
+    ent->hash_next = *bucket;
+    *bucket = ent;
+}
+
+// allocates entry for path not found in any pack
+static pathent_t *add_path_entry(const char *name, size_t namelen, unsigned hash)
+{
+    pathent_t *ent;
+
+    if (!fs_path_hash || fs_path_lazy_count >= MAX_PATH_LAZY)
+        return NULL;
+
+    ent = FS_Mallocz(sizeof(*ent) + namelen + 1);
+    memcpy(ent + 1, name, namelen + 1);
+    ent->gen = fs_path_gen;
+
+    // shared readers may be walking the hash chain
+    pthread_mutex_lock(&fs_lock);
+    link_path_entry(ent, (char *)(ent + 1), namelen, hash);
+    pthread_mutex_unlock(&fs_lock);
+
+    ent->lazy_next = fs_path_lazy;
+    fs_path_lazy = ent;
+    fs_path_lazy_count++;
+
+    return ent;
+}
+
+// (re)builds index of all pack entries, must be called
+// whenever search path changes
+static void build_path_index(void)
+{
+    searchpath_t *search;
+    pack_t *pack;
+    packfile_t *file;
+    pathent_t *ent;
+    pathhit_t *hit, **tail;
+    const char *name;
+    unsigned i, hash, total = 0, numents = 0, numhits = 0;
+    int numdirs = 0;
+
+    free_path_index();
+    fs_path_gen++;
+
+    for (search = fs_searchpaths; search; search = search->next) {
+        search->dirnum = -1;
+        if (search->pack)
+            total += search->pack->num_files;
+        else if (numdirs < MAX_PATH_DIRS)
+            search->dirnum = numdirs++;
+    }
+
+    if (!fs_path_cache->integer)
+        return;
+
+    fs_path_hash_size = Q_npot32(total / 2 + 256);
+    fs_path_hash = FS_Mallocz(fs_path_hash_size * sizeof(fs_path_hash[0]));
+    fs_path_ents = FS_Mallocz(total * sizeof(fs_path_ents[0]));
+    fs_path_hits = FS_Malloc(total * sizeof(fs_path_hits[0]));
+
+    for (search = fs_searchpaths; search; search = search->next) {
+        if (!(pack = search->pack))
+            continue;
+
+        for (i = 0, file = pack->files; i < pack->num_files; i++, file++) {
+            name = pack->names + file->nameofs;
+            hash = FS_HashPath(name, 0);
+
+            ent = find_path_entry(name, file->namelen, hash);
+            if (!ent) {
+                ent = &fs_path_ents[numents++];
+                link_path_entry(ent, name, file->namelen, hash);
+            }
+
+            // append to keep search order
+            for (tail = &ent->hits; *tail; tail = &(*tail)->next)
+                ;
+
+            hit = &fs_path_hits[numhits++];
+            hit->next = NULL;
+            hit->pack = pack;
+            hit->entry = file;
+            *tail = hit;
+        }
+    }
+
+    FS_DPrintf("%s: %u unique paths, %u pack entries\n", __func__, numents, numhits);
+}
+
+static packfile_t *find_path_hit(const pathent_t *ent, const pack_t *pack)
+{
+    pathhit_t *hit;
+
+    for (hit = ent->hits; hit; hit = hit->next)
+        if (hit->pack == pack)
+            return hit->entry;
+
+    return NULL;
+}
+
+/*
+================
+FS_FlushPathCache
+
+Forgets everything known about contents of loose directories. Must be called
+when files are created without using the filesystem API.
+================
+*/
+void FS_FlushPathCache(void)
+{
+    fs_path_gen++;
+}
+
+static void fs_path_cache_changed(cvar_t *self)
+{
+    if (fs_searchpaths) {
+        lock_search_paths();
+        build_path_index();
+        unlock_search_paths();
+    }
+}
+
 // Finds the file in the search path.
 // Fills file_t and returns file length.
 // Used for streaming data out of either a pak file or a seperate file.
@@ -1371,8 +2006,11 @@ static int64_t open_file_read(file_t *file, const char *normalized, size_t namel
     pack_t          *pak;
     unsigned        hash;
     packfile_t      *entry;
+    pathent_t       *ent;
+    uint64_t        bit;
     int64_t         ret;
     int             valid;
+    bool            lower;
 
     FS_COUNT_READ;
 
@@ -1383,6 +2021,16 @@ static int64_t open_file_read(file_t *file, const char *normalized, size_t namel
 
     valid = PATH_NOT_CHECKED;
 
+    ent = NULL;
+    if (fs_path_hash) {
+        ent = find_path_entry(normalized, namelen, hash);
+        // discard stale loose directory info
+        if (ent && ent->gen != fs_path_gen) {
+            ent->gen = fs_path_gen;
+            ent->absent = ent->lower = 0;
+        }
+    }
+
 // search through the path, one element at a time
     for (search = fs_searchpaths; search; search = search->next) {
         if (file->mode & FS_PATH_MASK) {
@@ -1401,6 +2049,12 @@ static int64_t open_file_read(file_t *file, const char *normalized, size_t namel
                 continue;
             }
             pak = search->pack;
+            // all pack entries are indexed
+            if (fs_path_hash) {
+                if (ent && (entry = find_path_hit(ent, pak)))
+                    return open_from_pack(file, pak, entry);
+                continue;
+            }
             // look through all the pak file elements
             entry = pak->file_hash[hash & (pak->hash_size - 1)];
             for (; entry; entry = entry->hash_next) {
@@ -1417,6 +2071,12 @@ static int64_t open_file_read(file_t *file, const char *normalized, size_t namel
             if ((file->mode & FS_TYPE_MASK) == FS_TYPE_PAK) {
                 continue;
             }
+            bit = search->dirnum >= 0 ? BIT_ULL(search->dirnum) : 0;
+            if (ent && (ent->absent & bit)) {
+                // known not to be there
+                FS_COUNT_SAVED;
+                continue;
+            }
             // don't error out immediately if the path is found to be invalid,
             // just stop looking for it in directory tree but continue to search
             // for it in packs, to give broken maps or mods a chance to work
@@ -1433,20 +2093,40 @@ static int64_t open_file_read(file_t *file, const char *normalized, size_t namel
                 goto fail;
             }
 
+            lower = false;
+#ifndef _WIN32
+            if (valid == PATH_MIXED_CASE && ent && (ent->lower & bit)) {
+                // known to exist under lower case name
+                ret = open_from_disk_lower(file, fullpath, strlen(search->filename));
+                if (ret != Q_ERR(ENOENT)) {
+                    FS_COUNT_SAVED;
+                    return ret;
+                }
+                ent->lower &= ~bit;
+                lower = true;
+            }
+#endif
+
             ret = open_from_disk(file, fullpath);
             if (ret != Q_ERR(ENOENT))
                 return ret;
 
 #ifndef _WIN32
-            if (valid == PATH_MIXED_CASE) {
+            if (valid == PATH_MIXED_CASE && !lower) {
                 // convert to lower case and retry
                 FS_COUNT_STRLWR;
-                Q_strlwr(fullpath + strlen(search->filename) + 1);
-                ret = open_from_disk(file, fullpath);
-                if (ret != Q_ERR(ENOENT))
+                ret = open_from_disk_lower(file, fullpath, strlen(search->filename));
+                if (ret != Q_ERR(ENOENT)) {
+                    if (ret >= 0 && bit && (ent || (ent = add_path_entry(normalized, namelen, hash))))
+                        ent->lower |= bit;
                     return ret;
+                }
             }
 #endif
+
+            // remember it's not there
+            if (bit && (ent || (ent = add_path_entry(normalized, namelen, hash))))
+                ent->absent |= bit;
         }
     }
 
@@ -1465,30 +2145,366 @@ static int64_t expand_open_file_read(file_t *file, const char *name)
     int64_t     ret;
     size_t      namelen;
 
-// normalize path
+// normalize path
+    namelen = FS_NormalizePathBuffer(normalized, name, MAX_OSPATH);
+    if (namelen >= MAX_OSPATH) {
+        return Q_ERR(ENAMETOOLONG);
+    }
+
+// expand hard symlinks
+    if (expand_links(&fs_hard_links, normalized, &namelen) && namelen >= MAX_OSPATH) {
+        return Q_ERR(ENAMETOOLONG);
+    }
+
+    ret = open_file_read(file, normalized, namelen);
+    if (ret == Q_ERR(ENOENT)) {
+// expand soft symlinks
+        if (expand_links(&fs_soft_links, normalized, &namelen)) {
+            if (namelen >= MAX_OSPATH) {
+                return Q_ERR(ENAMETOOLONG);
+            }
+            ret = open_file_read(file, normalized, namelen);
+        }
+    }
+
+    return ret;
+}
+
+/*
+============================================================
+
+SHARED READS
+
+Reentrant read path that doesn't use file handles, zone memory or printing,
+and thus can be used from worker threads concurrently with each other and
+with the main thread. Pack entries are read with pread() from the shared
+pack file descriptor (or through a private pack handle on Windows), and
+compressed entries are inflated with a per-call stream. Search paths and
+links are not changed while any shared reads are in progress.
+
+============================================================
+*/
+
+static void begin_shared_read(void)
+{
+    pthread_mutex_lock(&fs_lock);
+    while (fs_restarting)
+        pthread_cond_wait(&fs_cond, &fs_lock);
+    fs_readers++;
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void end_shared_read(void)
+{
+    pthread_mutex_lock(&fs_lock);
+    if (!--fs_readers)
+        pthread_cond_broadcast(&fs_cond);
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static int64_t open_shared_disk(fs_shared_t *f, const char *fullpath)
+{
+    FILE *fp;
+    file_info_t info;
+    int ret;
+
+    fp = fopen(fullpath, "rb");
+    if (!fp)
+        return Q_ERRNO;
+
+    ret = get_fp_info(fp, &info);
+    if (ret) {
+        fclose(fp);
+        return ret;
+    }
+
+    f->fp = fp;
+    f->fd = -1;
+    f->pos = 0;
+    f->complen = f->length = info.size;
+    f->compmtd = 0;
+    return f->length;
+}
+
+static int64_t open_shared_pack(fs_shared_t *f, pack_t *pack, packfile_t *entry)
+{
+    FILE *fp = NULL;
+    int fd = -1;
+    int ret = Q_ERR_SUCCESS;
+
+#ifdef _WIN32
+    fp = fopen(pack->filename, "rb");
+    if (!fp)
+        return Q_ERRNO;
+#else
+    fd = os_fileno(pack->fp);
+#endif
+
+#if USE_ZLIB
+    if (pack->type == FS_ZIP) {
+        pthread_mutex_lock(&fs_lock);
+        ret = check_header_coherency(fp, fd, entry);
+        pthread_mutex_unlock(&fs_lock);
+    }
+#endif
+
+    if (ret) {
+        if (fp)
+            fclose(fp);
+        return ret;
+    }
+
+    f->fp = fp;
+    f->fd = fd;
+    f->pos = entry->filepos;
+    f->complen = entry->complen;
+    f->length = entry->filelen;
+    f->compmtd = entry_compmtd(entry);
+    return f->length;
+}
+
+// like open_file_read, but doesn't touch loose directory cache
+static int64_t open_shared(fs_shared_t *f, const char *normalized, size_t namelen, unsigned mode)
+{
+    char            fullpath[MAX_OSPATH];
+    searchpath_t    *search;
+    pack_t          *pak;
+    packfile_t      *entry;
+    pathent_t       *ent;
+    unsigned        hash;
+    int64_t         ret;
+    int             valid;
+
+    if (!namelen)
+        return Q_ERR_INVALID_PATH;
+
+    hash = FS_HashPath(normalized, 0);
+
+    valid = FS_ValidatePath(normalized);
+
+    ent = NULL;
+    if (fs_path_hash) {
+        pthread_mutex_lock(&fs_lock);
+        ent = find_path_entry(normalized, namelen, hash);
+        pthread_mutex_unlock(&fs_lock);
+    }
+
+    for (search = fs_searchpaths; search; search = search->next) {
+        if (mode & FS_PATH_MASK) {
+            if ((mode & search->mode & FS_PATH_MASK) == 0) {
+                continue;
+            }
+        }
+
+        if (search->pack) {
+            if ((mode & FS_TYPE_MASK) == FS_TYPE_REAL) {
+                continue;
+            }
+            if (namelen >= MAX_QPATH) {
+                continue;
+            }
+            pak = search->pack;
+            if (fs_path_hash) {
+                if (ent && (entry = find_path_hit(ent, pak)))
+                    return open_shared_pack(f, pak, entry);
+                continue;
+            }
+            entry = pak->file_hash[hash & (pak->hash_size - 1)];
+            for (; entry; entry = entry->hash_next) {
+                if (entry->namelen != namelen) {
+                    continue;
+                }
+                if (!FS_pathcmp(pak->names + entry->nameofs, normalized)) {
+                    return open_shared_pack(f, pak, entry);
+                }
+            }
+        } else {
+            if ((mode & FS_TYPE_MASK) == FS_TYPE_PAK) {
+                continue;
+            }
+            if (valid == PATH_INVALID) {
+                continue;
+            }
+            if (Q_concat(fullpath, sizeof(fullpath), search->filename,
+                         "/", normalized) >= sizeof(fullpath)) {
+                return Q_ERR(ENAMETOOLONG);
+            }
+
+            ret = open_shared_disk(f, fullpath);
+            if (ret != Q_ERR(ENOENT))
+                return ret;
+
+#ifndef _WIN32
+            if (valid == PATH_MIXED_CASE) {
+                Q_strlwr(fullpath + strlen(search->filename) + 1);
+                ret = open_shared_disk(f, fullpath);
+                if (ret != Q_ERR(ENOENT))
+                    return ret;
+            }
+#endif
+        }
+    }
+
+    return valid ? Q_ERR(ENOENT) : Q_ERR_INVALID_PATH;
+}
+
+/*
+================
+FS_OpenShared
+
+Finds the file for shared reading. Only FS_PATH_* and FS_TYPE_* mode bits are
+supported. Returns file length, which is the amount of memory to allocate
+for FS_ReadShared. File must be closed with FS_CloseShared.
+================
+*/
+int64_t FS_OpenShared(const char *name, fs_shared_t *f, unsigned mode)
+{
+    char        normalized[MAX_OSPATH];
+    int64_t     ret;
+    size_t      namelen;
+
+    Q_assert(name);
+    Q_assert(f);
+
+    memset(f, 0, sizeof(*f));
+
+    if (mode & ~(FS_PATH_MASK | FS_TYPE_MASK))
+        return Q_ERR(EINVAL);
+
     namelen = FS_NormalizePathBuffer(normalized, name, MAX_OSPATH);
-    if (namelen >= MAX_OSPATH) {
+    if (namelen >= MAX_OSPATH)
         return Q_ERR(ENAMETOOLONG);
-    }
 
-// expand hard symlinks
+    begin_shared_read();
+
     if (expand_links(&fs_hard_links, normalized, &namelen) && namelen >= MAX_OSPATH) {
-        return Q_ERR(ENAMETOOLONG);
+        ret = Q_ERR(ENAMETOOLONG);
+        goto fail;
     }
 
-    ret = open_file_read(file, normalized, namelen);
+    ret = open_shared(f, normalized, namelen, mode);
     if (ret == Q_ERR(ENOENT)) {
-// expand soft symlinks
         if (expand_links(&fs_soft_links, normalized, &namelen)) {
             if (namelen >= MAX_OSPATH) {
-                return Q_ERR(ENAMETOOLONG);
+                ret = Q_ERR(ENAMETOOLONG);
+                goto fail;
             }
-            ret = open_file_read(file, normalized, namelen);
+            ret = open_shared(f, normalized, namelen, mode);
+        }
+    }
+
+    if (ret >= 0) {
+        f->active = true;
+        return ret;
+    }
+
+fail:
+    end_shared_read();
+    return ret;
+}
+
+#if USE_ZLIB
+static int inflate_shared(fs_shared_t *f, byte *buf, size_t len)
+{
+    byte        in[0x4000];
+    z_stream    z;
+    int64_t     pos = f->pos;
+    int64_t     rest = f->complen;
+    size_t      chunk;
+    int         ret;
+
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+        return Q_ERR(ENOMEM);
+
+    z.next_out = buf;
+    z.avail_out = len;
+
+    ret = Q_ERR_SUCCESS;
+    while (z.avail_out) {
+        if (!z.avail_in) {
+            if (!rest) {
+                ret = Q_ERR_UNEXPECTED_EOF;
+                break;
+            }
+            chunk = min(rest, sizeof(in));
+            ret = read_at(f->fp, f->fd, in, chunk, pos);
+            if (ret)
+                break;
+            pos += chunk;
+            rest -= chunk;
+            z.next_in = in;
+            z.avail_in = chunk;
+        }
+
+        ret = inflate(&z, Z_SYNC_FLUSH);
+        if (ret == Z_STREAM_END) {
+            ret = z.avail_out ? Q_ERR_UNEXPECTED_EOF : Q_ERR_SUCCESS;
+            break;
+        }
+        if (ret != Z_OK) {
+            ret = Q_ERR_INFLATE_FAILED;
+            break;
         }
+        ret = Q_ERR_SUCCESS;
     }
 
+    inflateEnd(&z);
     return ret;
 }
+#endif
+
+/*
+================
+FS_ReadShared
+
+Reads the whole file into buf, which must be at least as large as the length
+returned by FS_OpenShared. Returns number of bytes read or error code.
+================
+*/
+int FS_ReadShared(fs_shared_t *f, void *buf, size_t len)
+{
+    int ret;
+
+    Q_assert(f->active);
+
+    if (len < f->length)
+        return Q_ERR(EINVAL);
+    if (f->length > INT_MAX)
+        return Q_ERR(EFBIG);
+
+    len = f->length;
+    if (!len)
+        return 0;
+
+    switch (f->compmtd) {
+    case 0:
+        ret = read_at(f->fp, f->fd, buf, len, f->pos);
+        break;
+#if USE_ZLIB
+    case Z_DEFLATED:
+        ret = inflate_shared(f, buf, len);
+        break;
+#endif
+    default:
+        ret = Q_ERR_BAD_COMPRESSION;
+        break;
+    }
+
+    return ret ? ret : len;
+}
+
+void FS_CloseShared(fs_shared_t *f)
+{
+    if (!f->active)
+        return;
+
+    if (f->fp)
+        fclose(f->fp);
+
+    memset(f, 0, sizeof(*f));
+    end_shared_read();
+}
 
 static int read_pak_file(file_t *file, void *buf, size_t len)
 {
@@ -1914,6 +2930,75 @@ done:
     return len;
 }
 
+/*
+============
+FS_MapFileEx
+
+Like FS_LoadFileEx, but returns read-only pointer directly into memory
+mapped pack file if the file is stored uncompressed in a pack. Loose and
+compressed files are loaded into a buffer. Unlike FS_LoadFileEx, data is
+not NUL terminated. Must be released with FS_UnmapFile.
+============
+*/
+int FS_MapFileEx(const char *path, fs_mapping_t *map, unsigned flags)
+{
+    file_t *file;
+    qhandle_t f;
+    byte *buf;
+    int64_t len;
+    int read;
+
+    Q_assert(path);
+    Q_assert(map);
+
+    memset(map, 0, sizeof(*map));
+
+    if (!fs_searchpaths) {
+        return Q_ERR(EAGAIN); // not yet initialized
+    }
+
+    // allocate new file handle
+    file = alloc_handle(&f);
+    if (!file) {
+        return Q_ERR(EMFILE);
+    }
+
+    file->mode = (flags & ~FS_MODE_MASK) | FS_MODE_READ | FS_FLAG_LOADFILE;
+
+    // look for it in the filesystem or pack files
+    len = expand_open_file_read(file, path);
+    if (len < 0) {
+        return len;
+    }
+
+    // sanity check file size
+    if (len > MAX_LOADFILE) {
+        len = Q_ERR(EFBIG);
+        goto done;
+    }
+
+    if (FS_MapHandle(f, map) == Q_ERR_SUCCESS) {
+        goto done;
+    }
+
+    buf = FS_Malloc(len + 1);
+
+    read = FS_Read(buf, len, f);
+    if (read != len) {
+        len = read < 0 ? read : Q_ERR_UNEXPECTED_EOF;
+        Z_Free(buf);
+        goto done;
+    }
+
+    buf[len] = 0;
+    map->data = buf;
+    map->len = len;
+
+done:
+    FS_CloseFile(f);
+    return len;
+}
+
 static int write_and_close(const void *data, size_t len, qhandle_t f)
 {
     int ret1 = FS_Write(data, len, f);
@@ -2006,6 +3091,7 @@ int FS_RenameFile(const char *from, const char *to)
     if (rename(frompath, topath))
         return Q_ERRNO;
 
+    FS_FlushPathCache();
     return Q_ERR_SUCCESS;
 }
 
@@ -2035,8 +3121,14 @@ int FS_FPrintf(qhandle_t f, const char *format, ...)
 
 static void pack_free(pack_t *pack)
 {
+#if USE_ZLIB
+    flush_zcache(pack);
+#endif
     fclose(pack->fp);
-    Z_Free(pack->names);
+    if (pack->map_base)
+        Sys_UnmapFile(pack->map_base, pack->map_size);
+    else
+        Z_Free(pack->names);
     Z_Free(pack->file_hash);
     Z_Free(pack->files);
     Z_Free(pack);
@@ -2076,7 +3168,9 @@ static pack_t *pack_alloc(FILE *fp, filetype_t type, const char *name,
     pack->files = FS_Malloc(num_files * sizeof(pack->files[0]));
     pack->hash_size = 0;
     pack->file_hash = NULL;
-    pack->names = FS_Malloc(names_len);
+    pack->names = names_len ? FS_Malloc(names_len) : NULL;
+    pack->map_base = NULL;
+    pack->map_size = 0;
     strcpy(pack->filename, name);
 
     return pack;
@@ -2383,6 +3477,235 @@ skip:
     return true;
 }
 
+/*
+============================================================
+
+PACK INDEX CACHE
+
+Parsing central directory of a large zip archive entry by entry is slow, so
+parsed directory is saved into a sidecar file keyed by archive size,
+modification time and CRC of the central directory. Next time the archive is
+mounted the sidecar is mapped, names are used in place and only the hash
+chains are rebuilt from stored hash values.
+
+============================================================
+*/
+
+#define PACKINDEX_IDENT     MakeLittleLong('P','K','I','X')
+#define PACKINDEX_VERSION   1
+
+typedef struct {
+    uint32_t    ident;
+    uint32_t    version;
+    int64_t     filesize;
+    int64_t     mtime;
+    uint32_t    dircrc;
+    uint32_t    num_files;
+    uint32_t    names_len;
+    uint32_t    pad;
+} dpackindex_t;
+
+typedef struct {
+    int64_t     filepos;
+    int64_t     filelen;
+    int64_t     complen;
+    uint32_t    nameofs;
+    uint32_t    hash;       // FS_HashPath(name, 0)
+    uint16_t    compmtd;
+    uint8_t     namelen;
+    uint8_t     pad[5];
+} dpackindexfile_t;
+
+static size_t pack_index_path(char *buffer, size_t size, const char *packfile)
+{
+    const char *dir = sys_homedir->string[0] ? sys_homedir->string : sys_basedir->string;
+    unsigned crc = crc32(0, (const byte *)packfile, strlen(packfile));
+
+    return Q_snprintf(buffer, size, "%s/"BASEGAME"/cache/%s-%08x.idx",
+                      dir, COM_SkipPath(packfile), crc);
+}
+
+static bool calc_dir_crc(FILE *fp, int64_t pos, uint64_t size, uint32_t *crc)
+{
+    byte buf[0x10000];
+    size_t len;
+
+    *crc = crc32(0, NULL, 0);
+
+    while (size) {
+        len = min(size, sizeof(buf));
+        if (read_at(fp, -1, buf, len, pos))
+            return false;
+        *crc = crc32(*crc, buf, len);
+        pos += len;
+        size -= len;
+    }
+
+    return true;
+}
+
+// returns pack with directory loaded from index cache, or NULL
+static pack_t *load_pack_index(FILE *fp, const char *packfile,
+                               const file_info_t *info, uint32_t dircrc)
+{
+    char path[MAX_OSPATH];
+    const dpackindex_t *header;
+    const dpackindexfile_t *in;
+    const char *names;
+    packfile_t *out;
+    pack_t *pack;
+    FILE *ifp;
+    void *data, *base;
+    size_t size, mapsize;
+    file_info_t iinfo;
+    unsigned i, mask;
+
+    if (pack_index_path(path, sizeof(path), packfile) >= sizeof(path))
+        return NULL;
+
+    ifp = fopen(path, "rb");
+    if (!ifp)
+        return NULL;
+
+    data = NULL;
+    if (!get_fp_info(ifp, &iinfo) && iinfo.size >= sizeof(*header) && iinfo.size <= INT_MAX) {
+        size = iinfo.size;
+        data = Sys_MapFile(os_fileno(ifp), 0, size, &base, &mapsize);
+    }
+
+    // mapping stays valid after closing the file
+    fclose(ifp);
+
+    if (!data)
+        return NULL;
+
+    header = data;
+    if (header->ident != PACKINDEX_IDENT || header->version != PACKINDEX_VERSION)
+        goto fail;
+    if (header->filesize != info->size || header->mtime != info->mtime || header->dircrc != dircrc)
+        goto fail;
+    if (header->num_files < 1 || header->num_files > ZIP_MAXFILES || !header->names_len)
+        goto fail;
+    if (size != sizeof(*header) + header->num_files * sizeof(*in) + header->names_len)
+        goto fail;
+
+    in = (const dpackindexfile_t *)(header + 1);
+    names = (const char *)(in + header->num_files);
+    for (i = 0; i < header->num_files; i++) {
+        if (in[i].namelen >= header->names_len || in[i].nameofs >= header->names_len - in[i].namelen)
+            break;
+        if (names[in[i].nameofs + in[i].namelen])
+            break;
+    }
+    if (i < header->num_files) {
+        Com_WPrintf("Ignoring corrupted index cache %s\n", path);
+        goto fail;
+    }
+
+    pack = pack_alloc(fp, FS_ZIP, packfile, header->num_files, 0);
+    pack->names = (char *)names;
+    pack->map_base = base;
+    pack->map_size = mapsize;
+    pack->hash_size = Q_npot32(pack->num_files / 3);
+    pack->file_hash = FS_Mallocz(pack->hash_size * sizeof(pack->file_hash[0]));
+
+    mask = pack->hash_size - 1;
+    for (i = 0, out = pack->files; i < pack->num_files; i++, in++, out++) {
+        out->filepos = in->filepos;
+        out->filelen = in->filelen;
+        out->complen = in->complen;
+        out->compmtd = in->compmtd;
+        out->coherent = false;
+        out->namelen = in->namelen;
+        out->nameofs = in->nameofs;
+        out->hash_next = pack->file_hash[in->hash & mask];
+        pack->file_hash[in->hash & mask] = out;
+    }
+
+    return pack;
+
+fail:
+    Sys_UnmapFile(base, mapsize);
+    return NULL;
+}
+
+static void save_pack_index(const pack_t *pack, const file_info_t *info, uint32_t dircrc)
+{
+    char path[MAX_OSPATH], temp[MAX_OSPATH];
+    dpackindex_t header;
+    dpackindexfile_t out;
+    const packfile_t *in;
+    size_t names_len;
+    unsigned i;
+    FILE *fp;
+    int err;
+
+    if (pack_index_path(path, sizeof(path), pack->filename) >= sizeof(path))
+        return;
+
+    // other processes may have the old index mapped, so never truncate it
+    // in place. write a temporary file and rename it over.
+    if (Q_snprintf(temp, sizeof(temp), "%s.%08x", path, Sys_Milliseconds()) >= sizeof(temp))
+        return;
+
+    if (FS_CreatePath(temp))
+        return;
+
+    fp = fopen(temp, "wb");
+    if (!fp)
+        return;
+
+    // names are packed one after another
+    in = &pack->files[pack->num_files - 1];
+    names_len = in->nameofs + in->namelen + 1;
+
+    memset(&header, 0, sizeof(header));
+    header.ident = PACKINDEX_IDENT;
+    header.version = PACKINDEX_VERSION;
+    header.filesize = info->size;
+    header.mtime = info->mtime;
+    header.dircrc = dircrc;
+    header.num_files = pack->num_files;
+    header.names_len = names_len;
+
+    if (!fwrite(&header, sizeof(header), 1, fp))
+        goto fail;
+
+    memset(&out, 0, sizeof(out));
+    for (i = 0, in = pack->files; i < pack->num_files; i++, in++) {
+        out.filepos = in->filepos;
+        out.filelen = in->filelen;
+        out.complen = in->complen;
+        out.nameofs = in->nameofs;
+        out.hash = FS_HashPath(pack->names + in->nameofs, 0);
+        out.compmtd = in->compmtd;
+        out.namelen = in->namelen;
+        if (!fwrite(&out, sizeof(out), 1, fp))
+            goto fail;
+    }
+
+    if (!fwrite(pack->names, names_len, 1, fp))
+        goto fail;
+
+    err = fclose(fp);
+    fp = NULL;
+    if (err)
+        goto fail;
+
+#ifdef _WIN32
+    // rename doesn't replace existing files
+    os_unlink(path);
+#endif
+    if (!rename(temp, path))
+        return;
+
+fail:
+    if (fp)
+        fclose(fp);
+    os_unlink(temp);
+    Com_WPrintf("Couldn't write index cache %s\n", path);
+}
+
 static pack_t *load_zip_file(const char *packfile)
 {
     packfile_t      *file;
@@ -2395,6 +3718,10 @@ static pack_t *load_zip_file(const char *packfile)
     FILE            *fp;
     byte            header[ZIP_SIZECENTRALHEADER64];
     int             i, header_size;
+    file_info_t     info;
+    uint32_t        dircrc;
+    bool            cache;
+    uint64_t        start = Sys_Microseconds();
 
     fp = fopen(packfile, "rb");
     if (!fp) {
@@ -2466,6 +3793,19 @@ static pack_t *load_zip_file(const char *packfile)
         Com_WPrintf("%s has %"PRId64" extra bytes at the beginning\n", packfile, extra_bytes);
     }
 
+// try the index cache
+    cache = fs_pack_cache->integer && !get_fp_info(fp, &info) &&
+        calc_dir_crc(fp, central_ofs + extra_bytes, central_size, &dircrc);
+    if (cache) {
+        pack = load_pack_index(fp, packfile, &info, dircrc);
+        if (pack) {
+            FS_DPrintf("%s: %u files from index cache\n", packfile, pack->num_files);
+            fs_mount_cached++;
+            fs_mount_cached_usec += Sys_Microseconds() - start;
+            return pack;
+        }
+    }
+
     if (os_fseek(fp, central_ofs + extra_bytes, SEEK_SET)) {
         Com_SetLastError("seeking to central directory failed");
         goto fail2;
@@ -2515,6 +3855,12 @@ static pack_t *load_zip_file(const char *packfile)
                packfile, pack->num_files, (int)(num_files_cd - num_files),
                pack->hash_size, zip64 ? ", zip64" : "");
 
+    if (cache)
+        save_pack_index(pack, &info, dircrc);
+
+    fs_mount_parsed++;
+    fs_mount_parsed_usec += Sys_Microseconds() - start;
+
     return pack;
 
 fail1:
@@ -3300,6 +4646,19 @@ static void FS_Stats_f(void)
     Com_Printf("Total path comparsions: %d\n", fs_count_strcmp);
     Com_Printf("Total calls to open_from_disk: %d\n", fs_count_open);
     Com_Printf("Total mixed-case reopens: %d\n", fs_count_strlwr);
+    Com_Printf("Total disk lookups avoided by path index: %d\n", fs_count_saved);
+    if (fs_path_hash) {
+        Com_Printf("Path index: %u hash slots, %u loose directory entries\n",
+                   fs_path_hash_size, fs_path_lazy_count);
+    }
+#if USE_ZLIB
+    Com_Printf("Zip directories parsed: %u in %"PRIu64" usec\n",
+               fs_mount_parsed, fs_mount_parsed_usec);
+    Com_Printf("Zip directories from index cache: %u in %"PRIu64" usec\n",
+               fs_mount_cached, fs_mount_cached_usec);
+    Com_Printf("Inflated entry cache: %u entries, %zu bytes, %u hits, %u misses, %u evictions\n",
+               fs_zcache_count, fs_zcache_bytes, fs_zcache_hits, fs_zcache_misses, fs_zcache_evictions);
+#endif
 
     if (!totalHashSize) {
         Com_Printf("No stats to display\n");
@@ -3374,7 +4733,9 @@ static void FS_UnLink_f(void)
             Cmd_PrintHelp(options);
             return;
         case 'a':
+            lock_search_paths();
             free_all_links(list);
+            unlock_search_paths();
             Com_Printf("Deleted all symbolic links.\n");
             return;
         default:
@@ -3391,7 +4752,9 @@ static void FS_UnLink_f(void)
 
     FOR_EACH_SYMLINK(link, list) {
         if (!FS_pathcmp(link->name, name)) {
+            lock_search_paths();
             List_Remove(&link->entry);
+            unlock_search_paths();
             Z_Free(link->target);
             Z_Free(link);
             return;
@@ -3448,6 +4811,8 @@ static void FS_Link_f(void)
         return;
     }
 
+    lock_search_paths();
+
     // search for existing link with this name
     FOR_EACH_SYMLINK(link, list) {
         if (!FS_pathcmp(link->name, name)) {
@@ -3465,6 +4830,10 @@ static void FS_Link_f(void)
 update:
     link->target = FS_CopyString(target);
     link->targlen = targlen;
+
+    unlock_search_paths();
+
+    FS_FlushPathCache();
 }
 
 static void free_search_path(searchpath_t *path)
@@ -3568,6 +4937,16 @@ void FS_Restart(bool total)
 {
     Com_Printf("----- FS_Restart -----\n");
 
+    lock_search_paths();
+
+    // index points to packs being freed
+    free_path_index();
+
+#if USE_ZLIB
+    fs_mount_cached = fs_mount_parsed = 0;
+    fs_mount_cached_usec = fs_mount_parsed_usec = 0;
+#endif
+
     if (total) {
         // perform full reset
         free_all_paths();
@@ -3580,6 +4959,10 @@ void FS_Restart(bool total)
 
     setup_game_paths();
 
+    build_path_index();
+
+    unlock_search_paths();
+
     SV_RestartFilesystem();
 
     FS_Path_f();
@@ -3639,13 +5022,18 @@ void FS_Shutdown(void)
     }
     fs_num_files = 0;
 
+    lock_search_paths();
+
     // free symbolic links
     free_all_links(&fs_hard_links);
     free_all_links(&fs_soft_links);
 
     // free search paths
+    free_path_index();
     free_all_paths();
 
+    unlock_search_paths();
+
 #if USE_ZLIB
     inflateEnd(&fs_zipstream.stream);
 #endif
@@ -3702,12 +5090,18 @@ static void fs_game_changed(cvar_t *self)
 
     // check for the first time startup
     if (!fs_base_searchpaths) {
+        lock_search_paths();
+
         // start up with baseq2 by default
         setup_base_paths();
 
         // check for game override
         setup_game_paths();
 
+        build_path_index();
+
+        unlock_search_paths();
+
         FS_Path_f();
 
 		// Detect if we're running full version of the game.
@@ -3781,6 +5175,14 @@ void FS_Init(void)
     Cmd_Register(c_fs);
 
     fs_autoexec = Cvar_Get("fs_autoexec", "1", 0);
+    fs_path_cache = Cvar_Get("fs_path_cache", "1", 0);
+    fs_path_cache->changed = fs_path_cache_changed;
+#if USE_ZLIB
+    fs_pack_cache = Cvar_Get("fs_pack_cache", "1", 0);
+    fs_zip_cache = Cvar_Get("fs_zip_cache", "16", 0);
+    fs_zip_cache->changed = fs_zip_cache_changed;
+    init_zcache();
+#endif
 
 #if USE_DEBUG
     fs_debug = Cvar_Get("fs_debug", "0", 0);
@@ -32,7 +32,7 @@ Handles byte ordering and avoids alignment errors
 ==============================================================================
 */
 
-sizebuf_t   msg_write;
+q_thread_local sizebuf_t msg_write;
 byte        msg_write_buffer[MAX_MSGLEN];
 
 sizebuf_t   msg_read;
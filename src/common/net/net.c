@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 //
 
 #include "shared/shared.h"
+#include "common/async.h"
 #include "common/common.h"
 #include "common/cvar.h"
 #include "common/fifo.h"
@@ -102,6 +103,7 @@ static cvar_t   *net_dropsim;
 static cvar_t   *net_log_enable;
 static cvar_t   *net_log_name;
 static cvar_t   *net_log_flush;
+static cvar_t   *net_log_buffer;
 #endif
 
 static cvar_t   *net_enable_ipv6;
@@ -121,6 +123,7 @@ static struct pollfd    *tcp6_socket;
 
 #if USE_DEBUG
 static qhandle_t    net_logFile;
+static logwriter_t  *net_logWriter;
 #endif
 
 #define MAX_POLL_FDS    1024
@@ -359,16 +362,77 @@ bool NET_StringToAdr(const char *s, netadr_t *a, int default_port)
 
 #if USE_DEBUG
 
+typedef struct {
+    unsigned    time;
+    const char  *prefix;
+    char        address[MAX_QPATH];
+    size_t      length;
+} netlogrecord_t;
+
 static void logfile_close(void)
 {
+    unsigned dropped = 0;
+
     if (!net_logFile) {
         return;
     }
 
     Com_Printf("Closing network log.\n");
 
-    FS_CloseFile(net_logFile);
+    if (net_logWriter) {
+        dropped = Com_LogDropped(net_logWriter);
+        Com_CloseLogWriter(net_logWriter);
+        net_logWriter = NULL;
+    } else {
+        FS_CloseFile(net_logFile);
+    }
     net_logFile = 0;
+
+    if (dropped) {
+        Com_WPrintf("%u network log records dropped\n", dropped);
+    }
+}
+
+static void logfile_dump(qhandle_t f, const netlogrecord_t *rec, const byte *data)
+{
+    size_t length = rec->length;
+    int numRows;
+    int i, j, c;
+
+    FS_FPrintf(f, "%u : %s : %s : %zu bytes\n",
+               rec->time, rec->prefix, rec->address, length);
+
+    numRows = (length + 15) / 16;
+    for (i = 0; i < numRows; i++) {
+        FS_FPrintf(f, "%04x : ", i * 16);
+        for (j = 0; j < 16; j++) {
+            if (i * 16 + j < length) {
+                FS_FPrintf(f, "%02x ", data[i * 16 + j]);
+            } else {
+                FS_FPrintf(f, "   ");
+            }
+        }
+        FS_FPrintf(f, ": ");
+        for (j = 0; j < 16; j++) {
+            if (i * 16 + j < length) {
+                c = data[i * 16 + j];
+                FS_FPrintf(f, "%c", Q_isprint(c) ? c : '.');
+            } else {
+                FS_FPrintf(f, " ");
+            }
+        }
+        FS_FPrintf(f, "\n");
+    }
+
+    FS_FPrintf(f, "\n");
+}
+
+// called on log writer thread
+static void logfile_format(qhandle_t f, const void *data, size_t len)
+{
+    const netlogrecord_t *rec = data;
+
+    logfile_dump(f, rec, (const byte *)(rec + 1));
 }
 
 static void logfile_open(void)
@@ -394,6 +458,9 @@ static void logfile_open(void)
     }
 
     net_logFile = f;
+    if (net_log_buffer->integer > 0) {
+        net_logWriter = Com_OpenLogWriter(f, net_log_buffer->integer * 1024, logfile_format);
+    }
     Com_Printf("Logging network packets to %s\n", buffer);
 }
 
@@ -421,39 +488,23 @@ NET_LogPacket
 static void NET_LogPacket(const netadr_t *address, const char *prefix,
                           const byte *data, size_t length)
 {
-    int numRows;
-    int i, j, c;
+    netlogrecord_t rec;
 
     if (!net_logFile) {
         return;
     }
 
-    FS_FPrintf(net_logFile, "%u : %s : %s : %zu bytes\n",
-               com_localTime, prefix, NET_AdrToString(address), length);
+    // time and address are captured now, formatting is deferred
+    rec.time = com_localTime;
+    rec.prefix = prefix;
+    Q_strlcpy(rec.address, NET_AdrToString(address), sizeof(rec.address));
+    rec.length = length;
 
-    numRows = (length + 15) / 16;
-    for (i = 0; i < numRows; i++) {
-        FS_FPrintf(net_logFile, "%04x : ", i * 16);
-        for (j = 0; j < 16; j++) {
-            if (i * 16 + j < length) {
-                FS_FPrintf(net_logFile, "%02x ", data[i * 16 + j]);
-            } else {
-                FS_FPrintf(net_logFile, "   ");
-            }
-        }
-        FS_FPrintf(net_logFile, ": ");
-        for (j = 0; j < 16; j++) {
-            if (i * 16 + j < length) {
-                c = data[i * 16 + j];
-                FS_FPrintf(net_logFile, "%c", Q_isprint(c) ? c : '.');
-            } else {
-                FS_FPrintf(net_logFile, " ");
-            }
-        }
-        FS_FPrintf(net_logFile, "\n");
+    if (net_logWriter) {
+        Com_WriteLogRecord(net_logWriter, &rec, sizeof(rec), data, length);
+    } else {
+        logfile_dump(net_logFile, &rec, data);
     }
-
-    FS_FPrintf(net_logFile, "\n");
 }
 
 #else
@@ -638,6 +689,15 @@ static void NET_ErrorEvent(qsocket_t sock, netadr_t *from,
 
 //=============================================================================
 
+// max number of packets received or sent with a single syscall
+#define MAX_BATCH_PACKETS   64
+
+typedef struct {
+    netadr_t    adr;
+    size_t      len;
+    byte        data[MAX_PACKETLEN];
+} udppacket_t;
+
 // include our wrappers to hide platfrom-specific details
 #ifdef _WIN32
 #include "win.h"
@@ -645,6 +705,21 @@ static void NET_ErrorEvent(qsocket_t sock, netadr_t *from,
 #include "unix.h"
 #endif
 
+#ifndef USE_MMSG
+#define USE_MMSG    0
+#endif
+
+#if USE_MMSG
+static cvar_t       *net_batch;
+
+static udppacket_t  *net_recv_packets;
+static udppacket_t  *net_send_packets;
+static int          net_send_count;
+static int          net_batch_sock = -1;    // netsrc_t being batched
+static bool         net_recv_busy;          // net_recv_packets in use
+static unsigned     net_recv_frame;         // com_framenum when last used
+#endif
+
 /*
 =============
 NET_ErrorString
@@ -746,6 +821,65 @@ int NET_Sleep1(int msec, struct pollfd *e)
 
 //=============================================================================
 
+static void NET_DispatchUdpPacket(const byte *data, int len, void (*packet_cb)(void))
+{
+    NET_LogPacket(&net_from, "UDP recv", data, len);
+
+    net_rate_rcvd += len;
+    net_bytes_rcvd += len;
+    net_packets_rcvd++;
+
+    if (data != msg_read_buffer)
+        memcpy(msg_read_buffer, data, len);
+
+    SZ_Init(&msg_read, msg_read_buffer, sizeof(msg_read_buffer));
+    msg_read.cursize = len;
+
+    (*packet_cb)();
+}
+
+#if USE_MMSG
+
+// drains the socket with recvmmsg, then dispatches each packet in order
+static void NET_GetUdpPacketsBatched(struct pollfd *sock, void (*packet_cb)(void))
+{
+    int i, ret;
+
+    if (!net_recv_packets)
+        net_recv_packets = Z_Malloc(sizeof(*net_recv_packets) * MAX_BATCH_PACKETS);
+
+    net_recv_busy = true;
+    net_recv_frame = com_framenum;
+    while (1) {
+        ret = os_udp_recv_many(sock->fd, net_recv_packets, MAX_BATCH_PACKETS);
+        if (ret == NET_AGAIN) {
+            sock->revents = 0;
+            break;
+        }
+
+        if (ret == NET_ERROR) {
+            Com_DPrintf("%s: %s\n", __func__, NET_ErrorString());
+            net_recv_errors++;
+            break;
+        }
+
+        for (i = 0; i < ret; i++) {
+            net_from = net_recv_packets[i].adr;
+            NET_DispatchUdpPacket(net_recv_packets[i].data,
+                                  net_recv_packets[i].len, packet_cb);
+        }
+
+        // socket is drained if the batch wasn't filled
+        if (ret < MAX_BATCH_PACKETS) {
+            sock->revents = 0;
+            break;
+        }
+    }
+    net_recv_busy = false;
+}
+
+#endif // USE_MMSG
+
 static void NET_GetUdpPackets(struct pollfd *sock, void (*packet_cb)(void))
 {
     int ret;
@@ -758,6 +892,15 @@ static void NET_GetUdpPackets(struct pollfd *sock, void (*packet_cb)(void))
     if (!(sock->revents & (POLLIN | POLLERR)))
         return;
 
+#if USE_MMSG
+    // packet callback may end up here again, fall back to per-packet path
+    // in that case. busy flag left over by an error is ignored next frame.
+    if (net_batch->integer && !(net_recv_busy && net_recv_frame == com_framenum)) {
+        NET_GetUdpPacketsBatched(sock, packet_cb);
+        return;
+    }
+#endif
+
     while (1) {
         ret = os_udp_recv(sock->fd, msg_read_buffer, MAX_PACKETLEN, &net_from);
         if (ret == NET_AGAIN) {
@@ -772,16 +915,7 @@ static void NET_GetUdpPackets(struct pollfd *sock, void (*packet_cb)(void))
             break;
         }
 
-        NET_LogPacket(&net_from, "UDP recv", msg_read_buffer, ret);
-
-        net_rate_rcvd += ret;
-        net_bytes_rcvd += ret;
-        net_packets_rcvd++;
-
-        SZ_Init(&msg_read, msg_read_buffer, sizeof(msg_read_buffer));
-        msg_read.cursize = ret;
-
-        (*packet_cb)();
+        NET_DispatchUdpPacket(msg_read_buffer, ret, packet_cb);
     }
 }
 
@@ -810,6 +944,82 @@ void NET_GetPackets(netsrc_t sock, void (*packet_cb)(void))
     NET_GetUdpPackets(udp6_sockets[sock], packet_cb);
 }
 
+static void NET_PacketSent(const netadr_t *to, const void *data,
+                           size_t len, size_t sent)
+{
+    if (sent < len)
+        Com_WPrintf("%s: short send to %s\n", __func__,
+                    NET_AdrToString(to));
+
+    NET_LogPacket(to, "UDP send", data, sent);
+
+    net_rate_sent += sent;
+    net_bytes_sent += sent;
+    net_packets_sent++;
+}
+
+#if USE_MMSG
+
+static struct pollfd *NET_UdpSocket(netsrc_t sock, netadrtype_t type)
+{
+    switch (type) {
+    case NA_IP:
+    case NA_BROADCAST:
+        return udp_sockets[sock];
+    case NA_IP6:
+        return udp6_sockets[sock];
+    default:
+        return NULL;
+    }
+}
+
+// sends queued packets, grouping consecutive packets to the same socket
+// into single sendmmsg call
+static void NET_FlushSendQueue(void)
+{
+    udppacket_t *p = net_send_packets;
+    int count = net_send_count;
+    struct pollfd *s;
+    int i, n, ret;
+
+    net_send_count = 0;
+
+    while (count > 0) {
+        s = NET_UdpSocket(net_batch_sock, p->adr.type);
+        for (n = 1; n < count; n++)
+            if (NET_UdpSocket(net_batch_sock, p[n].adr.type) != s)
+                break;
+
+        if (!s) {
+            // socket has been closed since packets were queued
+            p += n;
+            count -= n;
+            continue;
+        }
+
+        ret = os_udp_send_many(s->fd, p, n);
+        if (ret <= 0) {
+            if (ret == NET_ERROR) {
+                Com_DPrintf("%s: %s to %s\n", __func__,
+                            NET_ErrorString(), NET_AdrToString(&p->adr));
+                net_send_errors++;
+            }
+            // skip offending packet
+            p++;
+            count--;
+            continue;
+        }
+
+        for (i = 0; i < ret; i++)
+            NET_PacketSent(&p[i].adr, p[i].data, p[i].len, p[i].len);
+
+        p += ret;
+        count -= ret;
+    }
+}
+
+#endif // USE_MMSG
+
 /*
 =============
 NET_SendPacket
@@ -852,6 +1062,21 @@ bool NET_SendPacket(netsrc_t sock, const void *data,
     if (!s)
         return false;
 
+#if USE_MMSG
+    if (net_batch_sock == sock) {
+        udppacket_t *p;
+
+        if (net_send_count == MAX_BATCH_PACKETS)
+            NET_FlushSendQueue();
+
+        p = &net_send_packets[net_send_count++];
+        p->adr = *to;
+        p->len = len;
+        memcpy(p->data, data, len);
+        return true;
+    }
+#endif
+
     ret = os_udp_send(s->fd, data, len, to);
     if (ret == NET_AGAIN)
         return false;
@@ -863,17 +1088,49 @@ bool NET_SendPacket(netsrc_t sock, const void *data,
         return false;
     }
 
-    if (ret < len)
-        Com_WPrintf("%s: short send to %s\n", __func__,
-                    NET_AdrToString(to));
+    NET_PacketSent(to, data, len, ret);
+    return true;
+}
 
-    NET_LogPacket(to, "UDP send", data, ret);
+/*
+=============
+NET_BeginBatch
 
-    net_rate_sent += ret;
-    net_bytes_sent += ret;
-    net_packets_sent++;
+Starts queueing UDP packets sent to the given socket, so that they can be
+sent with a single syscall by NET_EndBatch. Packets that fail to send are
+dropped silently. No-op if batching is not supported or disabled.
+=============
+*/
+void NET_BeginBatch(netsrc_t sock)
+{
+#if USE_MMSG
+    // flush anything left over by an aborted batch
+    NET_FlushSendQueue();
+    net_batch_sock = -1;
 
-    return true;
+    if (!net_batch->integer)
+        return;
+
+    if (!net_send_packets)
+        net_send_packets = Z_Malloc(sizeof(*net_send_packets) * MAX_BATCH_PACKETS);
+
+    net_batch_sock = sock;
+#endif
+}
+
+/*
+=============
+NET_EndBatch
+
+Sends all packets queued since NET_BeginBatch.
+=============
+*/
+void NET_EndBatch(void)
+{
+#if USE_MMSG
+    NET_FlushSendQueue();
+    net_batch_sock = -1;
+#endif
 }
 
 //=============================================================================
@@ -1800,6 +2057,117 @@ static void NET_Restart_f(void)
 #endif
 }
 
+static int NET_BenchSend(qsocket_t sock, udppacket_t *pkts, int count, bool batch)
+{
+    int i;
+
+#if USE_MMSG
+    if (batch) {
+        i = os_udp_send_many(sock, pkts, count);
+        return max(i, 0);
+    }
+#endif
+
+    for (i = 0; i < count; i++)
+        if (os_udp_send(sock, pkts[i].data, pkts[i].len, &pkts[i].adr) < 0)
+            break;
+
+    return i;
+}
+
+static int NET_BenchRecv(qsocket_t sock, udppacket_t *pkts, bool batch)
+{
+    int ret, total = 0;
+
+    while (1) {
+#if USE_MMSG
+        if (batch) {
+            ret = os_udp_recv_many(sock, pkts, MAX_BATCH_PACKETS);
+            if (ret < 0)
+                break;
+            total += ret;
+            continue;
+        }
+#endif
+        ret = os_udp_recv(sock, pkts->data, sizeof(pkts->data), &pkts->adr);
+        if (ret < 0)
+            break;
+        total++;
+    }
+
+    return total;
+}
+
+/*
+====================
+NET_Bench_f
+
+Measures UDP packet rate over a pair of loopback sockets, comparing
+per-packet and batched syscalls.
+====================
+*/
+static void NET_Bench_f(void)
+{
+    static const char *const modes[] = { "single", "batched" };
+    struct pollfd *a, *b;
+    netadr_t to;
+    udppacket_t *tx, *rx;
+    int i, n, mode, count, size, sent, rcvd;
+    uint64_t usec;
+
+    if (Cmd_Argc() > 3) {
+        Com_Printf("Usage: %s [count] [size]\n", Cmd_Argv(0));
+        return;
+    }
+
+    count = Cmd_Argc() > 1 ? Q_clip(atoi(Cmd_Argv(1)), 1, 10000000) : 100000;
+    size = Cmd_Argc() > 2 ? Q_clip(atoi(Cmd_Argv(2)), 1, MAX_PACKETLEN) : 1024;
+
+    a = UDP_OpenSocket("127.0.0.1", PORT_ANY, AF_INET);
+    b = UDP_OpenSocket("127.0.0.1", PORT_ANY, AF_INET);
+    if (!a || !b || os_getsockname(b->fd, &to)) {
+        Com_EPrintf("Couldn't open loopback sockets\n");
+        goto fail;
+    }
+
+    tx = Z_Malloc(sizeof(*tx) * MAX_BATCH_PACKETS * 2);
+    rx = tx + MAX_BATCH_PACKETS;
+    for (i = 0; i < MAX_BATCH_PACKETS; i++) {
+        tx[i].adr = to;
+        tx[i].len = size;
+        memset(tx[i].data, i, size);
+    }
+
+    for (mode = 0; mode < 1 + USE_MMSG; mode++) {
+        sent = rcvd = 0;
+        usec = Sys_Microseconds();
+
+        // send in bursts, draining the receiving socket after each burst
+        // so that its buffer doesn't overflow
+        while (sent < count) {
+            n = NET_BenchSend(a->fd, tx, min(count - sent, MAX_BATCH_PACKETS), mode);
+            if (!n) {
+                Com_EPrintf("%s: %s\n", modes[mode], NET_ErrorString());
+                break;
+            }
+            sent += n;
+            rcvd += NET_BenchRecv(b->fd, rx, mode);
+        }
+
+        usec = max(Sys_Microseconds() - usec, 1);
+        Com_Printf("%-8s %d/%d packets of %d bytes in %.3f sec, %.0f packets/sec\n",
+                   modes[mode], rcvd, sent, size, usec * 1e-6, (sent + rcvd) * 1e6 / usec);
+    }
+
+    Z_Free(tx);
+
+fail:
+    if (a)
+        NET_CloseSocket(a);
+    if (b)
+        NET_CloseSocket(b);
+}
+
 static void net_udp_param_changed(cvar_t *self)
 {
     NET_Restart_f();
@@ -1844,7 +2212,9 @@ void NET_Init(void)
     net_log_name = Cvar_Get("net_log_name", "network", 0);
     net_log_name->changed = net_log_param_changed;
     net_log_flush = Cvar_Get("net_log_flush", "0", 0);
+    net_log_buffer = Cvar_Get("net_log_buffer", "1024", 0);
     net_log_flush->changed = net_log_param_changed;
+    net_log_buffer->changed = net_log_param_changed;
 #endif
 
     net_enable_ipv6 = Cvar_Get("net_enable_ipv6", NET_EnableIP6(), 0);
@@ -1854,6 +2224,10 @@ void NET_Init(void)
     net_ignore_icmp = Cvar_Get("net_ignore_icmp", "0", 0);
 #endif
 
+#if USE_MMSG
+    net_batch = Cvar_Get("net_batch", "1", 0);
+#endif
+
 #if USE_DEBUG
     net_log_enable_changed(net_log_enable);
 #endif
@@ -1864,6 +2238,7 @@ void NET_Init(void)
     Cmd_AddCommand("net_stats", NET_Stats_f);
     Cmd_AddCommand("showip", NET_ShowIP_f);
     Cmd_AddCommand("dns", NET_Dns_f);
+    Cmd_AddCommand("net_bench", NET_Bench_f);
 
     Cmd_AddMacro("net_uprate", NET_UpRate_m);
     Cmd_AddMacro("net_dnrate", NET_DnRate_m);
@@ -1876,6 +2251,9 @@ NET_Shutdown
 */
 void NET_Shutdown(void)
 {
+    // send anything left over by an aborted batch while sockets are open
+    NET_EndBatch();
+
 #if USE_DEBUG
     logfile_close();
 #endif
@@ -1888,5 +2266,13 @@ void NET_Shutdown(void)
     Cmd_RemoveCommand("net_stats");
     Cmd_RemoveCommand("showip");
     Cmd_RemoveCommand("dns");
+    Cmd_RemoveCommand("net_bench");
+
+#if USE_MMSG
+    Z_Freep((void**)&net_recv_packets);
+    Z_Freep((void**)&net_send_packets);
+    net_send_count = 0;
+    net_batch_sock = -1;
+#endif
 }
 
@@ -163,6 +163,99 @@ static int os_udp_send(qsocket_t sock, const void *data,
     return NET_ERROR;
 }
 
+#ifdef __linux__
+
+#define USE_MMSG    1
+
+// receives up to count packets with a single syscall.
+// returns number of packets received, NET_AGAIN or NET_ERROR.
+static int os_udp_recv_many(qsocket_t sock, udppacket_t *pkts, int count)
+{
+    struct mmsghdr msgs[MAX_BATCH_PACKETS];
+    struct iovec iovs[MAX_BATCH_PACKETS];
+    struct sockaddr_storage addrs[MAX_BATCH_PACKETS];
+    int i, ret;
+    int tries;
+
+    Q_assert(count > 0 && count <= MAX_BATCH_PACKETS);
+
+    for (tries = 0; tries < MAX_ERROR_RETRIES; tries++) {
+        memset(msgs, 0, sizeof(msgs[0]) * count);
+        memset(addrs, 0, sizeof(addrs[0]) * count);
+        for (i = 0; i < count; i++) {
+            iovs[i].iov_base = pkts[i].data;
+            iovs[i].iov_len = sizeof(pkts[i].data);
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = recvmmsg(sock, msgs, count, 0, NULL);
+        if (ret >= 0) {
+            for (i = 0; i < ret; i++) {
+                NET_SockadrToNetadr(&addrs[i], &pkts[i].adr);
+                pkts[i].len = msgs[i].msg_len;
+            }
+            return ret;
+        }
+
+        net_error = errno;
+
+        // wouldblock is silent
+        if (net_error == EWOULDBLOCK)
+            return NET_AGAIN;
+
+        if (!process_error_queue(sock, NULL))
+            break;
+    }
+
+    return NET_ERROR;
+}
+
+// sends up to count packets with a single syscall.
+// returns number of packets sent. if the first packet couldn't be sent,
+// returns NET_AGAIN or NET_ERROR.
+static int os_udp_send_many(qsocket_t sock, const udppacket_t *pkts, int count)
+{
+    struct mmsghdr msgs[MAX_BATCH_PACKETS];
+    struct iovec iovs[MAX_BATCH_PACKETS];
+    struct sockaddr_storage addrs[MAX_BATCH_PACKETS];
+    int i, ret;
+    int tries;
+
+    Q_assert(count > 0 && count <= MAX_BATCH_PACKETS);
+
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = (void *)pkts[i].data;
+        iovs[i].iov_len = pkts[i].len;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = NET_NetadrToSockadr(&pkts[i].adr, &addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (tries = 0; tries < MAX_ERROR_RETRIES; tries++) {
+        ret = sendmmsg(sock, msgs, count, 0);
+        if (ret >= 0)
+            return ret;
+
+        net_error = errno;
+
+        // wouldblock is silent
+        if (net_error == EWOULDBLOCK)
+            return NET_AGAIN;
+
+        if (!process_error_queue(sock, &pkts[0].adr))
+            break;
+    }
+
+    return NET_ERROR;
+}
+
+#endif // __linux__
+
 static neterr_t os_get_error(void)
 {
     net_error = errno;
@@ -17,14 +17,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "shared/shared.h"
+#include "common/async.h"
+#include "common/bitset.h"
 #include "common/bsp.h"
 #include "common/cmd.h"
+#include "common/cmodel.h"
 #include "common/common.h"
 #include "common/files.h"
 #include "common/mdfour.h"
 #include "common/tests.h"
 #include "refresh/refresh.h"
 #include "system/system.h"
+#include "system/pthread.h"
 #include "client/sound/sound.h"
 
 // test error shutdown procedures
@@ -679,6 +683,795 @@ static void Com_ExtCmpTest_f(void)
     Com_Printf("%d failures, %d strings tested\n", errors, numextcmptests);
 }
 
+typedef struct {
+    pthread_t   thread;
+    int         index;
+    int         errors;
+} fsthread_t;
+
+static char     **fsthread_names;
+static uint32_t *fsthread_sums;
+static int      fsthread_count;
+
+static void *fsthread_func(void *arg)
+{
+    fsthread_t *t = arg;
+    fs_shared_t f;
+    int64_t len;
+    void *buf;
+    int i, j, ret;
+
+    // stagger start so that threads read different files at the same time
+    for (i = 0; i < fsthread_count; i++) {
+        j = (i + t->index * fsthread_count / 8) % fsthread_count;
+
+        len = FS_OpenShared(fsthread_names[j], &f, FS_TYPE_PAK);
+        if (len < 0) {
+            t->errors++;
+            continue;
+        }
+
+        buf = malloc(len + 1);
+        if (!buf) {
+            FS_CloseShared(&f);
+            t->errors++;
+            continue;
+        }
+
+        ret = FS_ReadShared(&f, buf, len);
+        FS_CloseShared(&f);
+
+        if (ret != len || Com_BlockChecksum(buf, len) != fsthread_sums[j])
+            t->errors++;
+
+        free(buf);
+    }
+
+    return NULL;
+}
+
+// load all pack files from multiple threads and verify checksums
+static void Com_FsThreadTest_f(void)
+{
+    fsthread_t threads[64];
+    int i, numthreads, numstarted, errors;
+    unsigned start, end;
+    void *buf;
+    int len;
+
+    numthreads = Cmd_Argc() > 1 ? Q_atoi(Cmd_Argv(1)) : 8;
+    numthreads = Q_clip(numthreads, 1, q_countof(threads));
+
+    fsthread_names = (char **)FS_ListFiles(NULL, "*", FS_SEARCH_BYFILTER | FS_SEARCH_SAVEPATH | FS_TYPE_PAK, &fsthread_count);
+    if (!fsthread_names) {
+        Com_Printf("No pack files found\n");
+        return;
+    }
+
+    // reference checksums are computed through the regular path
+    fsthread_sums = Z_Malloc(fsthread_count * sizeof(fsthread_sums[0]));
+    errors = 0;
+    for (i = 0; i < fsthread_count; i++) {
+        len = FS_LoadFileFlags(fsthread_names[i], &buf, FS_TYPE_PAK);
+        if (len < 0) {
+            Com_EPrintf("Couldn't load %s: %s\n", fsthread_names[i], Q_ErrorString(len));
+            fsthread_sums[i] = 0;
+            errors++;
+            continue;
+        }
+        fsthread_sums[i] = Com_BlockChecksum(buf, len);
+        FS_FreeFile(buf);
+    }
+
+    start = Sys_Milliseconds();
+
+    for (i = 0; i < numthreads; i++) {
+        threads[i].index = i;
+        threads[i].errors = 0;
+        if (pthread_create(&threads[i].thread, NULL, fsthread_func, &threads[i])) {
+            Com_EPrintf("Couldn't create thread\n");
+            break;
+        }
+    }
+
+    numstarted = i;
+    for (i = 0; i < numstarted; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+
+    end = Sys_Milliseconds();
+
+    Com_Printf("%d msec, %d failures, %d files tested by %d threads\n",
+               end - start, errors, fsthread_count, numstarted);
+
+    Z_Freep((void **)&fsthread_sums);
+    FS_FreeList((void **)fsthread_names);
+    fsthread_names = NULL;
+    fsthread_count = 0;
+}
+
+#define JOBTEST_COUNT   1000
+
+typedef struct {
+    jobcounter_t    *counter;   // counter to verify, if any
+    int             *runs;
+    int             index;
+    int             order;
+} jobtest_t;
+
+static jobcounter_t jobtest_nested;
+
+static void jobtest_func(void *arg)
+{
+    jobtest_t *t = arg;
+
+    t->runs[t->index]++;
+}
+
+static void jobtest_dep_func(void *arg)
+{
+    jobtest_t *t = arg;
+
+    // all jobs of the first batch must be finished
+    t->order = Com_JobsDone(t->counter);
+}
+
+static void jobtest_spawn_func(void *arg)
+{
+    jobtest_t *t = arg;
+
+    // queue more jobs from worker thread
+    for (int i = 0; i < 10; i++)
+        Com_QueueJob(jobtest_func, &t[i + 1], &jobtest_nested, NULL);
+}
+
+static void jobtest_work_cb(void *arg)
+{
+    (*(int *)arg)++;
+}
+
+static void jobtest_done_cb(void *arg)
+{
+    (*(int *)arg) += 10;
+}
+
+// tests job system correctness
+static void Com_JobTest_f(void)
+{
+    static jobtest_t jobs[JOBTEST_COUNT];
+    static int runs[JOBTEST_COUNT];
+    jobcounter_t first, second;
+    asyncwork_t work;
+    int i, errors = 0, async_result = 0;
+
+    Com_Printf("Testing with %d worker threads\n", Com_NumWorkers());
+
+    // every job must run exactly once
+    memset(&first, 0, sizeof(first));
+    memset(runs, 0, sizeof(runs));
+    for (i = 0; i < JOBTEST_COUNT; i++) {
+        jobs[i] = (jobtest_t){ .runs = runs, .index = i };
+        Com_QueueJob(jobtest_func, &jobs[i], &first, NULL);
+    }
+    Com_WaitJobs(&first);
+    for (i = 0; i < JOBTEST_COUNT; i++) {
+        if (runs[i] != 1) {
+            Com_EPrintf("Job %d ran %d times\n", i, runs[i]);
+            errors++;
+        }
+    }
+    if (!Com_JobsDone(&first)) {
+        Com_EPrintf("Counter not zero after wait\n");
+        errors++;
+    }
+
+    // dependent jobs must not start before all jobs they depend on finish
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    memset(runs, 0, sizeof(runs));
+    for (i = 0; i < JOBTEST_COUNT / 2; i++) {
+        jobs[i] = (jobtest_t){ .runs = runs, .index = i };
+        Com_QueueJob(jobtest_func, &jobs[i], &first, NULL);
+    }
+    for (; i < JOBTEST_COUNT; i++) {
+        jobs[i] = (jobtest_t){ .counter = &first, .index = i };
+        Com_QueueJob(jobtest_dep_func, &jobs[i], &second, &first);
+    }
+    Com_WaitJobs(&second);
+    for (i = JOBTEST_COUNT / 2; i < JOBTEST_COUNT; i++) {
+        if (!jobs[i].order) {
+            Com_EPrintf("Dependent job %d started too early\n", i);
+            errors++;
+        }
+    }
+    for (i = 0; i < JOBTEST_COUNT / 2; i++) {
+        if (runs[i] != 1) {
+            Com_EPrintf("Job %d ran %d times\n", i, runs[i]);
+            errors++;
+        }
+    }
+
+    // jobs queued from jobs
+    memset(&jobtest_nested, 0, sizeof(jobtest_nested));
+    memset(runs, 0, sizeof(runs));
+    for (i = 0; i < 11; i++)
+        jobs[i] = (jobtest_t){ .runs = runs, .index = i };
+    Com_QueueJob(jobtest_spawn_func, &jobs[0], &jobtest_nested, NULL);
+    Com_WaitJobs(&jobtest_nested);
+    for (i = 1; i < 11; i++) {
+        if (runs[i] != 1) {
+            Com_EPrintf("Nested job %d ran %d times\n", i, runs[i]);
+            errors++;
+        }
+    }
+
+    // async work callbacks
+    work = (asyncwork_t){ .work_cb = jobtest_work_cb, .done_cb = jobtest_done_cb, .cb_arg = &async_result };
+    Com_QueueAsyncWork(&work);
+    for (i = 0; i < 1000 && async_result != 11; i++) {
+        Sys_Sleep(1);
+        Com_CompleteAsyncWork();
+    }
+    if (async_result != 11) {
+        Com_EPrintf("Async work result %d, expected 11\n", async_result);
+        errors++;
+    }
+
+    Com_Printf("%d failures\n", errors);
+}
+
+static void jobbench_func(void *arg)
+{
+    volatile unsigned *p = arg;
+    unsigned x = *p;
+
+    for (int i = 0; i < 1000; i++)
+        x = x * 1664525 + 1013904223;
+
+    *p = x;
+}
+
+// measures job throughput
+static void Com_JobBench_f(void)
+{
+    static unsigned data[1024];
+    jobcounter_t counter;
+    uint64_t start, serial, parallel;
+    int i, count;
+
+    count = Cmd_Argc() > 1 ? Q_atoi(Cmd_Argv(1)) : 100000;
+    count = max(count, 1);
+
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i++)
+        jobbench_func(&data[i & 1023]);
+    serial = Sys_Microseconds() - start;
+
+    // each job writes its own slot, at most 1024 jobs in flight
+    memset(&counter, 0, sizeof(counter));
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i++) {
+        if (!(i & 1023))
+            Com_WaitJobs(&counter);
+        Com_QueueJob(jobbench_func, &data[i & 1023], &counter, NULL);
+    }
+    Com_WaitJobs(&counter);
+    parallel = Sys_Microseconds() - start;
+
+    Com_Printf("%d jobs, %d workers: serial %"PRIu64" usec, jobs %"PRIu64" usec, %.0f jobs/sec\n",
+               count, Com_NumWorkers(), serial, parallel, count * 1e6 / max(parallel, 1));
+}
+
+#define ZONETEST_TAG    (TAG_MAX + 1000)
+#define ZONETEST_COUNT  20000
+
+typedef struct {
+    byte    *ptr;
+    size_t  size;
+    byte    seed;   // pattern of last fill
+} zonetest_t;
+
+static bool zonetest_check(const zonetest_t *t)
+{
+    for (size_t i = 0; i < t->size; i++)
+        if (t->ptr[i] != (byte)(t->seed + i))
+            return false;
+    return true;
+}
+
+static void zonetest_fill(zonetest_t *t)
+{
+    t->seed = Q_rand();
+    for (size_t i = 0; i < t->size; i++)
+        t->ptr[i] = t->seed + i;
+}
+
+static void zonetest_job(void *arg)
+{
+    unsigned seed = (uintptr_t)arg;
+
+    for (int i = 0; i < 1000; i++) {
+        seed = seed * 1664525 + 1013904223;
+        size_t size = 1 + (seed >> 22);
+        byte *p = Z_TagMalloc(size, TAG_TEST);
+        memset(p, i, size);
+        Z_Free(p);
+    }
+}
+
+// checks that arena counters match expected number of live blocks
+static int zonetest_stats(const char *what, memtag_t tag, size_t expected)
+{
+    size_t count, bytes;
+
+    Z_TagStats(tag, &count, &bytes);
+    if (count == expected && !bytes == !expected)
+        return 0;
+
+    Com_EPrintf("After %s: %zu blocks, %zu bytes, expected %zu blocks\n",
+                what, count, bytes, expected);
+    return 1;
+}
+
+// tests zone allocator consistency
+static void Com_ZoneTest_f(void)
+{
+    static zonetest_t blocks[ZONETEST_COUNT];
+    jobcounter_t counter;
+    uint64_t start;
+    size_t size;
+    int i, errors = 0;
+
+    start = Sys_Microseconds();
+
+    for (i = 0; i < ZONETEST_COUNT; i++) {
+        blocks[i].size = 1 + Q_rand() % (i & 7 ? 600 : 4000);
+        blocks[i].ptr = Z_TagMalloc(blocks[i].size, ZONETEST_TAG);
+        zonetest_fill(&blocks[i]);
+    }
+
+    // resize across size classes and between slabs and heap, data that
+    // fits must be preserved
+    for (i = 0; i < ZONETEST_COUNT; i += 3) {
+        size = 1 + Q_rand() % 1000;
+        blocks[i].ptr = Z_Realloc(blocks[i].ptr, size);
+        blocks[i].size = min(size, blocks[i].size);
+        if (!zonetest_check(&blocks[i])) {
+            Com_EPrintf("Block %d not preserved by Z_Realloc\n", i);
+            errors++;
+        }
+        blocks[i].size = size;
+        zonetest_fill(&blocks[i]);
+    }
+
+    for (i = 0; i < ZONETEST_COUNT; i += 2) {
+        if (!zonetest_check(&blocks[i])) {
+            Com_EPrintf("Block %d corrupted\n", i);
+            errors++;
+        }
+        Z_Free(blocks[i].ptr);
+    }
+
+    // zeroed memory must be zeroed even if slab block is reused
+    for (i = 0; i < ZONETEST_COUNT; i += 2) {
+        blocks[i].size = 1 + Q_rand() % 600;
+        blocks[i].ptr = Z_TagMallocz(blocks[i].size, ZONETEST_TAG);
+        for (size = 0; size < blocks[i].size; size++)
+            if (blocks[i].ptr[size])
+                break;
+        if (size < blocks[i].size) {
+            Com_EPrintf("Block %d not zeroed\n", i);
+            errors++;
+        }
+        zonetest_fill(&blocks[i]);
+    }
+
+    for (i = 0; i < ZONETEST_COUNT; i++) {
+        if (!zonetest_check(&blocks[i])) {
+            Com_EPrintf("Block %d corrupted\n", i);
+            errors++;
+        }
+    }
+
+    Z_FreeTags(ZONETEST_TAG);
+
+    Com_Printf("%d blocks in %"PRIu64" usec\n", ZONETEST_COUNT, Sys_Microseconds() - start);
+
+    errors += zonetest_stats("Z_FreeTags", ZONETEST_TAG, 0);
+
+    blocks[0].ptr = Z_TagMalloc(1, ZONETEST_TAG);
+    errors += zonetest_stats("Z_TagMalloc", ZONETEST_TAG, 1);
+    Z_Free(blocks[0].ptr);
+    errors += zonetest_stats("Z_Free", ZONETEST_TAG, 0);
+
+    // allocate from worker threads
+    Z_SetThreadSafe(TAG_TEST);
+    memset(&counter, 0, sizeof(counter));
+    for (i = 0; i < 64; i++)
+        Com_QueueJob(zonetest_job, (void *)(uintptr_t)i, &counter, NULL);
+    Com_WaitJobs(&counter);
+    errors += zonetest_stats("zonetest_job", TAG_TEST, 0);
+
+    Com_Printf("%d failures\n", errors);
+}
+
+#define TRACETEST_JOBS  16
+
+typedef struct {
+    vec3_t  start, end, mins, maxs;
+    vec3_t  origin, boxmins, boxmaxs;   // entity box
+    trace_t trace[2];                   // world, entity
+} tracetest_t;
+
+typedef struct {
+    cm_trace_ctx_t  ctx;
+    tracetest_t     *tests;
+    int             count;
+    mnode_t         *headnode;
+} tracetest_job_t;
+
+static void tracetest_run(cm_trace_ctx_t *ctx, mnode_t *headnode, tracetest_t *t)
+{
+    mnode_t *box = CM_HeadnodeForBoxCtx(ctx, t->boxmins, t->boxmaxs);
+
+    CM_BoxTraceCtx(ctx, &t->trace[0], t->start, t->end, t->mins, t->maxs, headnode, MASK_PLAYERSOLID);
+    CM_TransformedBoxTraceCtx(ctx, &t->trace[1], t->start, t->end, t->mins, t->maxs,
+                              box, CONTENTS_MONSTER, t->origin, vec3_origin);
+}
+
+static void tracetest_job(void *arg)
+{
+    tracetest_job_t *job = arg;
+
+    for (int i = 0; i < job->count; i++)
+        tracetest_run(&job->ctx, job->headnode, &job->tests[i]);
+}
+
+static bool tracetest_equal(const trace_t *a, const trace_t *b)
+{
+    return a->allsolid == b->allsolid && a->startsolid == b->startsolid &&
+        a->fraction == b->fraction && VectorCompare(a->endpos, b->endpos) &&
+        VectorCompare(a->plane.normal, b->plane.normal) && a->plane.dist == b->plane.dist &&
+        a->surface == b->surface && a->contents == b->contents;
+}
+
+static void tracetest_random(const mmodel_t *world, tracetest_t *t, int i)
+{
+    static const vec3_t sizes[4][2] = {
+        { { 0, 0, 0 }, { 0, 0, 0 } },
+        { { -16, -16, -24 }, { 16, 16, 32 } },
+        { { -4, -4, -4 }, { 4, 4, 4 } },
+        { { -32, -8, 0 }, { 8, 48, 16 } },
+    };
+    int j;
+
+    memset(t, 0, sizeof(*t));
+
+    for (j = 0; j < 3; j++) {
+        t->start[j] = world->mins[j] + frand() * (world->maxs[j] - world->mins[j]);
+        t->end[j] = t->start[j] + crand() * (i & 4 ? 2048 : 256);
+        t->origin[j] = t->start[j] + crand() * 128;
+        t->boxmins[j] = -8 - frand() * 64;
+        t->boxmaxs[j] = 8 + frand() * 64;
+    }
+
+    // position tests, boxes right after a point trace on the same context
+    switch (i & 15) {
+    case 1:
+    case 2:
+    case 8:
+        VectorCopy(t->start, t->end);
+        break;
+    }
+
+    VectorCopy(sizes[i & 3][0], t->mins);
+    VectorCopy(sizes[i & 3][1], t->maxs);
+}
+
+// compares traces done from worker threads with serial results
+static void Com_TraceTest_f(void)
+{
+    cm_t cm = { 0 };
+    tracetest_t *tests, *t;
+    tracetest_job_t *jobs;
+    jobcounter_t counter;
+    trace_t *serial, fast[2];
+    char fastmode[MAX_QPATH];
+    uint64_t start, time_serial, time_fast, time_jobs;
+    int i, j, ret, count, errors = 0, hits = 0;
+
+    if (Cmd_Argc() < 2) {
+        Com_Printf("Usage: %s <map> [count]\n", Cmd_Argv(0));
+        return;
+    }
+
+    count = Cmd_Argc() > 2 ? Q_atoi(Cmd_Argv(2)) : 100000;
+    count = max(count, TRACETEST_JOBS);
+
+    ret = CM_LoadMap(&cm, va("maps/%s.bsp", Cmd_Argv(1)));
+    if (ret) {
+        Com_EPrintf("Couldn't load %s: %s\n", Cmd_Argv(1), BSP_ErrorString(ret));
+        return;
+    }
+
+    tests = Z_Malloc(sizeof(*tests) * count);
+    serial = Z_Malloc(sizeof(*serial) * 2 * count);
+    jobs = Z_Malloc(sizeof(*jobs) * TRACETEST_JOBS);
+
+    for (i = 0; i < count; i++)
+        tracetest_random(&cm.cache->models[0], &tests[i], i);
+
+    // serial reference, scalar code with default context
+    Q_strlcpy(fastmode, Cvar_VariableString("map_fast_trace"), sizeof(fastmode));
+    Cvar_Set("map_fast_trace", "0");
+    start = Sys_Microseconds();
+    for (i = 0, t = tests; i < count; i++, t++) {
+        CM_BoxTrace(&serial[i * 2], t->start, t->end, t->mins, t->maxs,
+                    cm.cache->nodes, MASK_PLAYERSOLID);
+        CM_TransformedBoxTrace(&serial[i * 2 + 1], t->start, t->end, t->mins, t->maxs,
+                               CM_HeadnodeForBox(t->boxmins, t->boxmaxs),
+                               CONTENTS_MONSTER, t->origin, vec3_origin);
+        hits += serial[i * 2].fraction < 1;
+    }
+    time_serial = Sys_Microseconds() - start;
+    Cvar_Set("map_fast_trace", "1");
+
+    // serial, culled and SIMD
+    start = Sys_Microseconds();
+    for (i = 0, t = tests; i < count; i++, t++) {
+        CM_BoxTrace(&fast[0], t->start, t->end, t->mins, t->maxs,
+                    cm.cache->nodes, MASK_PLAYERSOLID);
+        CM_TransformedBoxTrace(&fast[1], t->start, t->end, t->mins, t->maxs,
+                               CM_HeadnodeForBox(t->boxmins, t->boxmaxs),
+                               CONTENTS_MONSTER, t->origin, vec3_origin);
+        for (j = 0; j < 2; j++) {
+            if (tracetest_equal(&serial[i * 2 + j], &fast[j]))
+                continue;
+            if (errors++ < 10)
+                Com_EPrintf("Fast trace %d/%d mismatch: fraction %f vs %f\n", i, j,
+                            serial[i * 2 + j].fraction, fast[j].fraction);
+        }
+    }
+    time_fast = Sys_Microseconds() - start;
+
+    // same traces from jobs, each with private context
+    for (i = 0; i < TRACETEST_JOBS; i++) {
+        CM_InitTraceCtx(&jobs[i].ctx);
+        jobs[i].tests = tests + count * i / TRACETEST_JOBS;
+        jobs[i].count = count * (i + 1) / TRACETEST_JOBS - count * i / TRACETEST_JOBS;
+        jobs[i].headnode = cm.cache->nodes;
+    }
+
+    memset(&counter, 0, sizeof(counter));
+    start = Sys_Microseconds();
+    for (i = 0; i < TRACETEST_JOBS; i++)
+        Com_QueueJob(tracetest_job, &jobs[i], &counter, NULL);
+    Com_WaitJobs(&counter);
+    time_jobs = Sys_Microseconds() - start;
+    Cvar_Set("map_fast_trace", fastmode);
+
+    for (i = 0, t = tests; i < count; i++, t++) {
+        for (j = 0; j < 2; j++) {
+            if (tracetest_equal(&serial[i * 2 + j], &t->trace[j]))
+                continue;
+            if (errors++ < 10)
+                Com_EPrintf("Trace %d/%d mismatch: fraction %f vs %f\n", i, j,
+                            serial[i * 2 + j].fraction, t->trace[j].fraction);
+        }
+    }
+
+    Com_Printf("%d traces (%d hits), %d workers: reference %"PRIu64" usec, "
+               "fast %"PRIu64" usec, jobs %"PRIu64" usec\n",
+               count, hits, Com_NumWorkers(), time_serial, time_fast, time_jobs);
+    Com_Printf("%d failures\n", errors);
+
+    Z_Free(jobs);
+    Z_Free(serial);
+    Z_Free(tests);
+    CM_FreeMap(&cm);
+}
+
+// compares leaf grid lookups with tree walks
+static void Com_LeafTest_f(void)
+{
+    bsp_t *bsp;
+    const mmodel_t *world;
+    vec3_t *points;
+    mleaf_t **leafs;
+    uint64_t start, time_tree, time_grid;
+    int i, j, ret, count, errors = 0;
+
+    if (Cmd_Argc() < 2) {
+        Com_Printf("Usage: %s <map> [count]\n", Cmd_Argv(0));
+        return;
+    }
+
+    count = Cmd_Argc() > 2 ? Q_atoi(Cmd_Argv(2)) : 1000000;
+    count = max(count, 1);
+
+    ret = BSP_Load(va("maps/%s.bsp", Cmd_Argv(1)), &bsp);
+    if (ret) {
+        Com_EPrintf("Couldn't load %s: %s\n", Cmd_Argv(1), BSP_ErrorString(ret));
+        return;
+    }
+
+    if (!bsp->leafgrid.cells)
+        Com_WPrintf("%s has no leaf grid\n", bsp->name);
+
+    points = Z_Malloc(sizeof(*points) * count);
+    leafs = Z_Malloc(sizeof(*leafs) * count * 2);
+
+    // some points are slightly outside, some on integer planes
+    world = &bsp->models[0];
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 3; j++) {
+            points[i][j] = world->mins[j] - 16 + frand() * (world->maxs[j] - world->mins[j] + 32);
+            if (i & 1)
+                points[i][j] = Q_rint(points[i][j]);
+        }
+    }
+
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i++)
+        leafs[i] = BSP_PointLeaf(bsp->nodes, points[i]);
+    time_tree = Sys_Microseconds() - start;
+
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i++)
+        leafs[count + i] = BSP_GridPointLeaf(bsp, points[i]);
+    time_grid = Sys_Microseconds() - start;
+
+    for (i = 0; i < count; i++) {
+        if (leafs[count + i] != leafs[i] && errors++ < 10)
+            Com_EPrintf("Point %d (%s) mismatch: leaf %d vs %d\n", i, vtos(points[i]),
+                        (int)(leafs[count + i] - bsp->leafs), (int)(leafs[i] - bsp->leafs));
+    }
+
+    Com_Printf("%d points: tree %"PRIu64" usec, grid %"PRIu64" usec\n", count, time_tree, time_grid);
+    Com_Printf("%d failures\n", errors);
+
+    Z_Free(leafs);
+    Z_Free(points);
+    BSP_Free(bsp);
+}
+
+// operands start at given byte offsets to test unaligned access
+static bool bitsettest_check(size_t size, int ofs_a, int ofs_b)
+{
+    byte buf_a[256 + 16], buf_b[256 + 16], buf_out[256 + 16], ref[256];
+    byte *a = buf_a + ofs_a, *b = buf_b + ofs_b, *out = buf_out + ofs_a;
+    int i, next, count;
+    bool ok = true;
+
+    for (i = 0; i < size; i++) {
+        a[i] = Q_rand() & Q_rand();
+        b[i] = Q_rand() & Q_rand();
+    }
+
+    // reference versions, bit by bit
+    for (i = 0; i < size; i++)
+        ref[i] = a[i] | b[i];
+    memcpy(out, a, size);
+    BitSet_Or(out, b, size);
+    ok &= !memcmp(out, ref, size);
+
+    for (i = 0; i < size; i++)
+        ref[i] = a[i] & b[i];
+    memcpy(out, a, size);
+    BitSet_And(out, b, size);
+    ok &= !memcmp(out, ref, size);
+
+    for (i = count = 0; i < size * 8; i++)
+        count += Q_IsBitSet(ref, i) != 0;
+    ok &= BitSet_Intersects(a, b, size) == (count > 0);
+
+    memcpy(out, ref, size);
+    ok &= BitSet_Count(out, size) == count;
+
+    next = -1;
+    for (i = 0; i < size * 8; i++) {
+        if (!Q_IsBitSet(ref, i))
+            continue;
+        ok &= BitSet_Next(out, size, next + 1) == i;
+        next = i;
+    }
+    ok &= BitSet_Next(out, size, next + 1) == -1;
+
+    return ok;
+}
+
+// checks bitset operations against bytewise versions, benchmarks them
+// and compares vis matrices with compressed data if map is given
+static void Com_BitSetTest_f(void)
+{
+    byte *rows, mask[VIS_MAX_BYTES], temp[VIS_MAX_BYTES];
+    int i, j, k, size, ret, errors = 0;
+    uint64_t start, time_bytes, time_words;
+    size_t count;
+    bsp_t *bsp;
+    byte *matrix;
+
+    // all sizes at all offsets within 16 bytes
+    for (i = 0; i < 256 * 16; i++) {
+        size = i % 256;
+        j = i / 256;
+        if (!bitsettest_check(size, j, (j * 7) & 15) && errors++ < 10)
+            Com_EPrintf("Mismatch for size %d at offset %d\n", size, j);
+    }
+
+    // OR 64 rows of 4096 clusters together, like building PVS2
+    size = 4096 / 8;
+    rows = Z_Malloc(size * 64);
+    for (i = 0; i < size * 64; i++)
+        rows[i] = Q_rand() & Q_rand() & Q_rand();
+
+    memset(mask, 0, size);
+    start = Sys_Microseconds();
+    for (k = 0; k < 1000; k++)
+        for (i = 0; i < 64; i++)
+            for (j = 0; j < size; j++)
+                mask[j] |= rows[i * size + j];
+    time_bytes = Sys_Microseconds() - start;
+
+    memset(temp, 0, size);
+    start = Sys_Microseconds();
+    for (k = 0; k < 1000; k++)
+        for (i = 0; i < 64; i++)
+            BitSet_Or(temp, rows + i * size, size);
+    time_words = Sys_Microseconds() - start;
+
+    if (memcmp(mask, temp, size))
+        errors++;
+
+    Com_Printf("64000 ORs of %d bytes: bytewise %"PRIu64" usec, bitset %"PRIu64" usec\n",
+               size, time_bytes, time_words);
+
+    start = Sys_Microseconds();
+    for (k = count = 0; k < 1000; k++)
+        for (i = 0; i < 64; i++)
+            BITSET_FOR_EACH(rows + i * size, size, j)
+                count++;
+    Com_Printf("%zu set bits iterated in %"PRIu64" usec\n", count, Sys_Microseconds() - start);
+
+    Z_Free(rows);
+
+    if (Cmd_Argc() > 1) {
+        ret = BSP_Load(va("maps/%s.bsp", Cmd_Argv(1)), &bsp);
+        if (ret) {
+            Com_EPrintf("Couldn't load %s: %s\n", Cmd_Argv(1), BSP_ErrorString(ret));
+        } else if (!bsp->vis || !bsp->phs_matrix) {
+            Com_Printf("%s has no PHS matrix\n", bsp->name);
+            BSP_Free(bsp);
+        } else {
+            // compare with compressed rows and time both
+            start = Sys_Microseconds();
+            for (i = 0; i < bsp->vis->numclusters; i++)
+                BSP_ClusterVis(bsp, mask, i, DVIS_PHS);
+            time_words = Sys_Microseconds() - start;
+
+            matrix = bsp->phs_matrix;
+            bsp->phs_matrix = NULL;
+            start = Sys_Microseconds();
+            for (i = 0; i < bsp->vis->numclusters; i++)
+                BSP_ClusterVis(bsp, mask, i, DVIS_PHS);
+            time_bytes = Sys_Microseconds() - start;
+            for (i = 0; i < bsp->vis->numclusters; i++) {
+                BSP_ClusterVis(bsp, mask, i, DVIS_PHS);
+                if (memcmp(mask, matrix + bsp->visrowsize * i, bsp->visrowsize) && errors++ < 10)
+                    Com_EPrintf("PHS row %d mismatch\n", i);
+            }
+            bsp->phs_matrix = matrix;
+
+            Com_Printf("%d PHS rows: compressed %"PRIu64" usec, matrix %"PRIu64" usec\n",
+                       bsp->vis->numclusters, time_bytes, time_words);
+            BSP_Free(bsp);
+        }
+    }
+
+    Com_Printf("%d failures\n", errors);
+}
+
 void TST_Init(void)
 {
     Cmd_AddCommand("error", Com_Error_f);
@@ -699,5 +1492,12 @@ void TST_Init(void)
 #endif
     Cmd_AddCommand("mdfourtest", Com_MdfourTest_f);
     Cmd_AddCommand("extcmptest", Com_ExtCmpTest_f);
+    Cmd_AddCommand("fsthreadtest", Com_FsThreadTest_f);
+    Cmd_AddCommand("jobtest", Com_JobTest_f);
+    Cmd_AddCommand("jobbench", Com_JobBench_f);
+    Cmd_AddCommand("zonetest", Com_ZoneTest_f);
+    Cmd_AddCommand("tracetest", Com_TraceTest_f);
+    Cmd_AddCommand("leaftest", Com_LeafTest_f);
+    Cmd_AddCommand("bitsettest", Com_BitSetTest_f);
 }
 
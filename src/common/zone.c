@@ -20,14 +20,40 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "shared/list.h"
 #include "common/common.h"
 #include "common/zone.h"
+#include "system/pthread.h"
 
-#define Z_MAGIC     0x1d0d
+/*
+==============================================================================
 
-typedef struct {
+Each tag has its own arena. Small blocks are carved from slabs that hold
+blocks of a single size class, large blocks are allocated with malloc.
+Freeing a tag releases whole slabs at once instead of walking every block.
+
+Arenas are not thread safe unless marked so with Z_SetThreadSafe. Only
+engine tags can be marked.
+
+==============================================================================
+*/
+
+#define Z_MAGIC         0x1d0d
+#define Z_MAGIC_POOL    0x1d0e
+
+#define Z_SLAB_SIZE     0x4000
+#define Z_MAX_POOLED    512
+#define Z_NUM_CLASSES   9
+
+typedef struct zhead_s {
     uint16_t        magic;
     uint16_t        tag;        // for group free
+    uint32_t        site;       // for profiling
     size_t          size;
-    list_t          entry;
+    union {
+        list_t      entry;      // large blocks
+        struct {
+            struct zslab_s  *slab;  // pooled blocks
+            struct zhead_s  *next;  // free list
+        };
+    };
 } zhead_t;
 
 typedef struct {
@@ -35,13 +61,38 @@ typedef struct {
     char        data[2];
 } zstatic_t;
 
-typedef struct {
-    size_t      count;
-    size_t      bytes;
-} zstats_t;
+typedef struct zslab_s {
+    list_t          entry;      // on partial or full list of arena
+    zhead_t         *free;
+    uint16_t        cls;
+    uint16_t        used;
+} zslab_t;
+
+#define Z_SLAB_HEAD     ALIGN(sizeof(zslab_t), 16)
+
+typedef struct zarena_s {
+    struct zarena_s *next;      // game arenas
+    unsigned        tag;
+    bool            threadsafe;
+    pthread_mutex_t lock;
+    list_t          large;
+    list_t          partial[Z_NUM_CLASSES];
+    list_t          full[Z_NUM_CLASSES];
+    size_t          count;      // live blocks
+    size_t          bytes;      // live bytes, including headers
+    size_t          peak;       // maximum of bytes
+    size_t          pooled;     // bytes reserved by slabs
+    size_t          pooled_bytes;   // live bytes in slabs
+} zarena_t;
+
+static zarena_t     z_arenas[TAG_MAX];
+static zarena_t     *z_game_arenas;
+
+static const uint16_t z_classes[Z_NUM_CLASSES] = {
+    16, 32, 64, 96, 128, 192, 256, 384, 512
+};
 
-static list_t       z_chain;
-static zstats_t     z_stats[TAG_MAX];
+static uint8_t      z_class_lookup[Z_MAX_POOLED / 16 + 1];
 
 #define S(d) \
     { .z = { .magic = Z_MAGIC, .tag = TAG_STATIC, .size = sizeof(zstatic_t) }, .data = d }
@@ -64,39 +115,216 @@ static const char *const z_tagnames[TAG_MAX] = {
     "server",
     "mvd",
     "sound",
-    "cmodel"
+    "cmodel",
+    "test"
 };
 
 #define TAG_INDEX(tag)  ((tag) < TAG_MAX ? (tag) : TAG_FREE)
 
-static inline void Z_CountFree(const zhead_t *z)
+static void Z_InitArena(zarena_t *a, unsigned tag)
+{
+    int i;
+
+    a->tag = tag;
+    List_Init(&a->large);
+    for (i = 0; i < Z_NUM_CLASSES; i++) {
+        List_Init(&a->partial[i]);
+        List_Init(&a->full[i]);
+    }
+}
+
+static zarena_t *Z_FindArena(unsigned tag, bool create)
+{
+    zarena_t *a;
+
+    if (tag < TAG_MAX)
+        return &z_arenas[tag];
+
+    for (a = z_game_arenas; a; a = a->next)
+        if (a->tag == tag)
+            return a;
+
+    if (!create)
+        return NULL;
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        Com_Error(ERR_FATAL, "%s: couldn't allocate arena", __func__);
+    Z_InitArena(a, tag);
+    a->next = z_game_arenas;
+    z_game_arenas = a;
+    return a;
+}
+
+static inline void Z_LockArena(zarena_t *a)
 {
-    zstats_t *s = &z_stats[TAG_INDEX(z->tag)];
-    s->count--;
-    s->bytes -= z->size;
+    if (a->threadsafe)
+        pthread_mutex_lock(&a->lock);
 }
 
-static inline void Z_CountAlloc(const zhead_t *z)
+static inline void Z_UnlockArena(zarena_t *a)
 {
-    zstats_t *s = &z_stats[TAG_INDEX(z->tag)];
-    s->count++;
-    s->bytes += z->size;
+    if (a->threadsafe)
+        pthread_mutex_unlock(&a->lock);
+}
+
+static inline void Z_CountFree(zarena_t *a, const zhead_t *z)
+{
+    a->count--;
+    a->bytes -= z->size;
+    if (z->magic == Z_MAGIC_POOL)
+        a->pooled_bytes -= z->size;
+}
+
+static inline void Z_CountAlloc(zarena_t *a, const zhead_t *z)
+{
+    a->count++;
+    a->bytes += z->size;
+    if (z->magic == Z_MAGIC_POOL)
+        a->pooled_bytes += z->size;
+    if (a->bytes > a->peak)
+        a->peak = a->bytes;
 }
 
 #define Z_Validate(z) \
-    Q_assert((z)->magic == Z_MAGIC && (z)->tag != TAG_FREE)
+    Q_assert(((z)->magic == Z_MAGIC || (z)->magic == Z_MAGIC_POOL) && (z)->tag != TAG_FREE)
 
-void Z_LeakTest(memtag_t tag)
+/*
+==============================================================================
+
+SLABS
+
+==============================================================================
+*/
+
+static inline int Z_SizeClass(size_t size)
+{
+    return z_class_lookup[(size + 15) >> 4];
+}
+
+static zslab_t *Z_AllocSlab(zarena_t *a, int cls)
 {
+    size_t stride = sizeof(zhead_t) + z_classes[cls];
+    byte *p, *end;
+    zslab_t *slab;
     zhead_t *z;
+
+    slab = malloc(Z_SLAB_SIZE);
+    if (!slab)
+        return NULL;
+
+    slab->free = NULL;
+    slab->cls = cls;
+    slab->used = 0;
+
+    // thread blocks in address order
+    p = (byte *)slab + Z_SLAB_HEAD;
+    end = (byte *)slab + Z_SLAB_SIZE - stride;
+    for (; p <= end; p += stride) {
+        z = (zhead_t *)p;
+        z->magic = 0xdead;
+        z->tag = TAG_FREE;
+        z->slab = slab;
+        z->next = slab->free;
+        slab->free = z;
+    }
+
+    List_Insert(&a->partial[cls], &slab->entry);
+    a->pooled += Z_SLAB_SIZE;
+    return slab;
+}
+
+static zhead_t *Z_AllocPooled(zarena_t *a, int cls)
+{
+    zslab_t *slab;
+    zhead_t *z;
+
+    if (LIST_EMPTY(&a->partial[cls])) {
+        slab = Z_AllocSlab(a, cls);
+        if (!slab)
+            return NULL;
+    } else {
+        slab = LIST_FIRST(zslab_t, &a->partial[cls], entry);
+    }
+
+    z = slab->free;
+    slab->free = z->next;
+    slab->used++;
+
+    if (!slab->free) {
+        List_Remove(&slab->entry);
+        List_Insert(&a->full[cls], &slab->entry);
+    }
+
+    z->magic = Z_MAGIC_POOL;
+    return z;
+}
+
+static void Z_FreePooled(zarena_t *a, zhead_t *z)
+{
+    zslab_t *slab = z->slab;
+    int cls = slab->cls;
+
+    if (!slab->free) {
+        List_Remove(&slab->entry);
+        List_Insert(&a->partial[cls], &slab->entry);
+    }
+
+    z->magic = 0xdead;
+    z->tag = TAG_FREE;
+    z->next = slab->free;
+    slab->free = z;
+    slab->used--;
+
+    // keep one empty slab around to avoid thrashing
+    if (!slab->used && !LIST_SINGLE(&a->partial[cls])) {
+        List_Remove(&slab->entry);
+        free(slab);
+        a->pooled -= Z_SLAB_SIZE;
+    }
+}
+
+static void Z_ProfileFreeSlabs(const list_t *list);
+
+static void Z_FreeSlabs(list_t *list)
+{
+    zslab_t *slab, *next;
+
+    LIST_FOR_EACH_SAFE(zslab_t, slab, next, list, entry)
+        free(slab);
+
+    List_Init(list);
+}
+
+/*
+==============================================================================
+
+ALLOCATION
+
+==============================================================================
+*/
+
+void Z_LeakTest(memtag_t tag)
+{
     size_t numLeaks = 0, numBytes = 0;
+    zarena_t *a;
+    zhead_t *z;
 
-    LIST_FOR_EACH(zhead_t, z, &z_chain, entry) {
-        Z_Validate(z);
-        if (z->tag == tag || (tag == TAG_FREE && z->tag >= TAG_MAX)) {
-            numLeaks++;
-            numBytes += z->size;
+    if (tag == TAG_FREE) {
+        for (a = z_game_arenas; a; a = a->next) {
+            LIST_FOR_EACH(zhead_t, z, &a->large, entry)
+                Z_Validate(z);
+            numLeaks += a->count;
+            numBytes += a->bytes;
         }
+    } else {
+        a = Z_FindArena(tag, false);
+        Z_LockArena(a);
+        LIST_FOR_EACH(zhead_t, z, &a->large, entry)
+            Z_Validate(z);
+        numLeaks = a->count;
+        numBytes = a->bytes;
+        Z_UnlockArena(a);
     }
 
     if (numLeaks) {
@@ -108,6 +336,25 @@ void Z_LeakTest(memtag_t tag)
     }
 }
 
+/*
+========================
+Z_TagStats
+========================
+*/
+void Z_TagStats(memtag_t tag, size_t *count, size_t *bytes)
+{
+    zarena_t *a = Z_FindArena(tag, false);
+
+    *count = *bytes = 0;
+    if (!a)
+        return;
+
+    Z_LockArena(a);
+    *count = a->count;
+    *bytes = a->bytes;
+    Z_UnlockArena(a);
+}
+
 /*
 ========================
 Z_Free
@@ -115,7 +362,10 @@ Z_Free
 */
 void Z_Free(void *ptr)
 {
+    zarena_t *a;
     zhead_t *z;
+    unsigned site;
+    size_t size;
 
     if (!ptr) {
         return;
@@ -125,14 +375,28 @@ void Z_Free(void *ptr)
 
     Z_Validate(z);
 
-    Z_CountFree(z);
+    a = Z_FindArena(z->tag, false);
+    Q_assert(a);
+
+    site = z->site;
+    size = z->size - sizeof(*z);
+
+    Z_LockArena(a);
 
-    if (z->tag != TAG_STATIC) {
+    Z_CountFree(a, z);
+
+    if (z->magic == Z_MAGIC_POOL) {
+        Z_FreePooled(a, z);
+    } else if (z->tag != TAG_STATIC) {
         List_Remove(&z->entry);
         z->magic = 0xdead;
         z->tag = TAG_FREE;
         free(z);
     }
+
+    Z_UnlockArena(a);
+
+    Z_ProfileFree(site, size, 1);
 }
 
 /*
@@ -149,17 +413,25 @@ void Z_Freep(void **ptr)
     }
 }
 
+#define Z_SITE(file, line) \
+    (z_profile && z_profile->integer ? Z_ProfileSite(file, line) : 0)
+
+static void *Z_TagMallocInternal(size_t size, memtag_t tag, bool init, unsigned site);
+
 /*
 ========================
 Z_Realloc
 ========================
 */
-void *Z_Realloc(void *ptr, size_t size)
+void *Z_ReallocAt(void *ptr, size_t size, const char *file, int line)
 {
+    zarena_t *a;
     zhead_t *z;
+    unsigned site;
+    void *p;
 
     if (!ptr) {
-        return Z_Malloc(size);
+        return Z_TagMallocInternal(size, TAG_GENERAL, false, Z_SITE(file, line));
     }
 
     if (!size) {
@@ -180,21 +452,73 @@ void *Z_Realloc(void *ptr, size_t size)
 
     Q_assert(z->tag != TAG_STATIC);
 
-    Z_CountFree(z);
+    a = Z_FindArena(z->tag, false);
+    Q_assert(a);
+
+    site = Z_SITE(file, line);
+    Z_ProfileFree(z->site, z->size - sizeof(*z), 1);
+
+    // resize in place if still in the same size class
+    if (z->magic == Z_MAGIC_POOL && size - sizeof(*z) <= Z_MAX_POOLED &&
+        Z_SizeClass(size - sizeof(*z)) == z->slab->cls) {
+        Z_LockArena(a);
+        Z_CountFree(a, z);
+        z->size = size;
+        z->site = site;
+        Z_CountAlloc(a, z);
+        Z_UnlockArena(a);
+        Z_ProfileAlloc(site, z->tag, size - sizeof(*z), 1);
+        return z + 1;
+    }
+
+    // move between slabs and heap
+    if (z->magic == Z_MAGIC_POOL || size - sizeof(*z) <= Z_MAX_POOLED) {
+        p = Z_TagMallocInternal(size - sizeof(*z), z->tag, false, site);
+        memcpy(p, z + 1, min(size, z->size) - sizeof(*z));
+        z->site = 0;    // already accounted
+        Z_Free(z + 1);
+        return p;
+    }
+
+    Z_LockArena(a);
+
+    Z_CountFree(a, z);
 
     z = realloc(z, size);
     if (!z) {
+        Z_UnlockArena(a);
         Com_Error(ERR_FATAL, "%s: couldn't realloc %zu bytes", __func__, size);
     }
 
     z->size = size;
+    z->site = site;
     List_Relink(&z->entry);
 
-    Z_CountAlloc(z);
+    Z_CountAlloc(a, z);
+
+    Z_UnlockArena(a);
+
+    Z_ProfileAlloc(site, z->tag, size - sizeof(*z), 1);
 
     return z + 1;
 }
 
+static void Z_ArenaStats(const zarena_t *a, size_t *s)
+{
+    s[0] += a->bytes;
+    s[1] += a->count;
+    s[2] += a->peak;
+    s[3] += a->pooled;
+    s[4] += a->pooled_bytes;
+}
+
+static void Z_PrintStats(const size_t *s, const char *name)
+{
+    // fragmentation is the share of slab memory not holding live data
+    Com_Printf("%9zu %6zu %9zu %9zu %4zu%% %s\n", s[0], s[1], s[2], s[3],
+               s[3] ? (s[3] - s[4]) * 100 / s[3] : 0, name);
+}
+
 /*
 ========================
 Z_Stats_f
@@ -202,25 +526,32 @@ Z_Stats_f
 */
 void Z_Stats_f(void)
 {
-    size_t bytes = 0, count = 0;
-    zstats_t *s;
+    size_t total[5] = { 0 };
+    size_t s[5];
+    zarena_t *a;
     int i;
 
-    Com_Printf("    bytes blocks name\n"
-               "--------- ------ -------\n");
+    Com_Printf("    bytes blocks      peak      slab frag name\n"
+               "--------- ------ --------- --------- ----- -------\n");
 
-    for (i = 0, s = z_stats; i < TAG_MAX; i++, s++) {
-        if (!s->count) {
+    for (i = 0; i < TAG_MAX; i++) {
+        memset(s, 0, sizeof(s));
+        if (i == TAG_FREE) {
+            for (a = z_game_arenas; a; a = a->next)
+                Z_ArenaStats(a, s);
+        } else {
+            Z_ArenaStats(&z_arenas[i], s);
+        }
+        if (!s[1] && !s[3]) {
             continue;
         }
-        Com_Printf("%9zu %6zu %s\n", s->bytes, s->count, z_tagnames[i]);
-        bytes += s->bytes;
-        count += s->count;
+        Z_PrintStats(s, z_tagnames[i]);
+        for (int j = 0; j < 5; j++)
+            total[j] += s[j];
     }
 
-    Com_Printf("--------- ------ -------\n"
-               "%9zu %6zu total\n",
-               bytes, count);
+    Com_Printf("--------- ------ --------- --------- ----- -------\n");
+    Z_PrintStats(total, "total");
 }
 
 /*
@@ -231,13 +562,38 @@ Z_FreeTags
 void Z_FreeTags(memtag_t tag)
 {
     zhead_t *z, *n;
+    zarena_t *a;
+    int i;
+
+    a = Z_FindArena(tag, false);
+    if (!a) {
+        return;
+    }
 
-    LIST_FOR_EACH_SAFE(zhead_t, z, n, &z_chain, entry) {
+    Q_assert(tag != TAG_STATIC);
+
+    Z_LockArena(a);
+
+    LIST_FOR_EACH_SAFE(zhead_t, z, n, &a->large, entry) {
         Z_Validate(z);
-        if (z->tag == tag) {
-            Z_Free(z + 1);
-        }
+        Z_ProfileFree(z->site, z->size - sizeof(*z), 1);
+        z->magic = 0xdead;
+        z->tag = TAG_FREE;
+        free(z);
+    }
+    List_Init(&a->large);
+
+    for (i = 0; i < Z_NUM_CLASSES; i++) {
+        Z_ProfileFreeSlabs(&a->partial[i]);
+        Z_ProfileFreeSlabs(&a->full[i]);
+        Z_FreeSlabs(&a->partial[i]);
+        Z_FreeSlabs(&a->full[i]);
     }
+
+    a->count = a->bytes = 0;
+    a->pooled = a->pooled_bytes = 0;
+
+    Z_UnlockArena(a);
 }
 
 /*
@@ -245,8 +601,9 @@ void Z_FreeTags(memtag_t tag)
 Z_TagMalloc
 ========================
 */
-static void *Z_TagMallocInternal(size_t size, memtag_t tag, bool init)
+static void *Z_TagMallocInternal(size_t size, memtag_t tag, bool init, unsigned site)
 {
+    zarena_t *a;
     zhead_t *z;
 
     if (!size) {
@@ -254,48 +611,78 @@ static void *Z_TagMallocInternal(size_t size, memtag_t tag, bool init)
     }
 
     Q_assert(size <= INT_MAX);
-    Q_assert(tag > TAG_FREE && tag <= UINT16_MAX);
+    Q_assert(tag > TAG_FREE && tag != TAG_STATIC && tag <= UINT16_MAX);
+
+    a = Z_FindArena(tag, true);
+
+    Z_LockArena(a);
+
+    if (size <= Z_MAX_POOLED) {
+        z = Z_AllocPooled(a, Z_SizeClass(size));
+        if (z && init) {
+            memset(z + 1, 0, size);
+        }
+    } else {
+        z = init ? calloc(1, size + sizeof(*z)) : malloc(size + sizeof(*z));
+        if (z) {
+            z->magic = Z_MAGIC;
+            List_Insert(&a->large, &z->entry);
+        }
+    }
 
     size += sizeof(*z);
-    z = init ? calloc(1, size) : malloc(size);
     if (!z) {
+        Z_UnlockArena(a);
         Com_Error(ERR_FATAL, "%s: couldn't allocate %zu bytes", __func__, size);
     }
-    z->magic = Z_MAGIC;
     z->tag = tag;
+    z->site = site;
     z->size = size;
 
-    List_Insert(&z_chain, &z->entry);
-
 #if USE_TESTS
     if (!init && z_perturb && z_perturb->integer) {
         memset(z + 1, z_perturb->integer, size - sizeof(*z));
     }
 #endif
 
-    Z_CountAlloc(z);
+    Z_CountAlloc(a, z);
+
+    Z_UnlockArena(a);
+
+    Z_ProfileAlloc(site, tag, size - sizeof(*z), 1);
 
     return z + 1;
 }
 
-void *Z_TagMalloc(size_t size, memtag_t tag)
+void *Z_TagMallocAt(size_t size, memtag_t tag, const char *file, int line)
 {
-    return Z_TagMallocInternal(size, tag, false);
+    return Z_TagMallocInternal(size, tag, false, Z_SITE(file, line));
 }
 
-void *Z_TagMallocz(size_t size, memtag_t tag)
+void *Z_TagMalloczAt(size_t size, memtag_t tag, const char *file, int line)
 {
-    return Z_TagMallocInternal(size, tag, true);
+    return Z_TagMallocInternal(size, tag, true, Z_SITE(file, line));
 }
 
-void *Z_Malloc(size_t size)
-{
-    return Z_TagMalloc(size, TAG_GENERAL);
-}
+/*
+========================
+Z_SetThreadSafe
 
-void *Z_Mallocz(size_t size)
+Allows allocating and freeing memory with given engine tag from worker
+threads. Must be called from main thread before workers use the tag.
+========================
+*/
+void Z_SetThreadSafe(memtag_t tag)
 {
-    return Z_TagMallocz(size, TAG_GENERAL);
+    zarena_t *a;
+
+    Q_assert(tag > TAG_STATIC && tag < TAG_MAX);
+
+    a = &z_arenas[tag];
+    if (!a->threadsafe) {
+        pthread_mutex_init(&a->lock, NULL);
+        a->threadsafe = true;
+    }
 }
 
 /*
@@ -305,7 +692,18 @@ Z_Init
 */
 void Z_Init(void)
 {
-    List_Init(&z_chain);
+    int i, cls;
+
+    for (i = 0; i < TAG_MAX; i++) {
+        Z_InitArena(&z_arenas[i], i);
+    }
+
+    for (i = cls = 0; i <= Z_MAX_POOLED / 16; i++) {
+        while (z_classes[cls] < i * 16) {
+            cls++;
+        }
+        z_class_lookup[i] = cls;
+    }
 }
 
 /*
@@ -313,7 +711,7 @@ void Z_Init(void)
 Z_TagCopyString
 ================
 */
-char *Z_TagCopyString(const char *in, memtag_t tag)
+char *Z_TagCopyStringAt(const char *in, memtag_t tag, const char *file, int line)
 {
     size_t len;
 
@@ -322,7 +720,7 @@ char *Z_TagCopyString(const char *in, memtag_t tag)
     }
 
     len = strlen(in) + 1;
-    return memcpy(Z_TagMalloc(len, tag), in, len);
+    return memcpy(Z_TagMallocAt(len, tag, file, line), in, len);
 }
 
 /*
@@ -330,7 +728,7 @@ char *Z_TagCopyString(const char *in, memtag_t tag)
 Z_CvarCopyString
 ================
 */
-char *Z_CvarCopyString(const char *in)
+char *Z_CvarCopyStringAt(const char *in, const char *file, int line)
 {
     const zstatic_t *z;
     int i;
@@ -344,11 +742,487 @@ char *Z_CvarCopyString(const char *in)
     } else if (!in[1] && Q_isdigit(in[0])) {
         i = in[0] - '0';
     } else {
-        return Z_TagCopyString(in, TAG_CVAR);
+        return Z_TagCopyStringAt(in, TAG_CVAR, file, line);
     }
 
     // return static storage
     z = &z_static[i];
-    Z_CountAlloc(&z->z);
+    Z_CountAlloc(&z_arenas[TAG_STATIC], &z->z);
     return (char *)z->data;
 }
+
+/*
+==============================================================================
+
+ALLOCATION SITE PROFILER
+
+Records call site of each allocation made while z_profile is enabled.
+Blocks remember their site, so live bytes stay correct after profiling is
+turned off. Hunk sites are the places hunks are started from; each hunk
+counts as a single block.
+
+==============================================================================
+*/
+
+#define Z_MAX_SITES     8192
+#define Z_SITE_HASH     (Z_MAX_SITES * 2)   // must be power of two
+#define Z_NUM_SIZES     16
+#define Z_MAX_SNAPSHOTS 8
+
+typedef struct {
+    const char  *file;
+    int         line;
+    unsigned    tag;
+    size_t      allocs;     // total allocations
+    size_t      total;      // total bytes allocated
+    size_t      live;       // live bytes
+    size_t      blocks;     // live blocks
+    size_t      peak;       // maximum of live
+    size_t      mark_allocs;
+    size_t      mark_total;
+    unsigned    sizes[Z_NUM_SIZES];
+} zsite_t;
+
+typedef struct {
+    char        name[MAX_QPATH];
+    unsigned    numsites;
+    size_t      *live;
+    size_t      *blocks;
+} zsnapshot_t;
+
+static pthread_mutex_t  z_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static zsite_t      *z_sites;
+static uint16_t     *z_site_hash;
+static unsigned     z_numsites;     // including dummy site 0
+static unsigned     z_mark_frame;
+static zsnapshot_t  z_snapshots[Z_MAX_SNAPSHOTS];
+
+unsigned Z_ProfileSite(const char *file, int line)
+{
+    unsigned hash, site;
+
+    if (!z_profile || !z_profile->integer)
+        return 0;
+
+    pthread_mutex_lock(&z_prof_lock);
+
+    if (!z_sites) {
+        z_sites = calloc(Z_MAX_SITES, sizeof(z_sites[0]));
+        z_site_hash = calloc(Z_SITE_HASH, sizeof(z_site_hash[0]));
+        if (!z_sites || !z_site_hash)
+            Com_Error(ERR_FATAL, "%s: couldn't allocate site table", __func__);
+        z_sites[0].file = "untracked";
+        z_numsites = 1;
+        z_mark_frame = com_framenum;
+    }
+
+    hash = ((uintptr_t)file >> 3) ^ (line * 0x9e3779b1);
+    while (1) {
+        hash &= Z_SITE_HASH - 1;
+        site = z_site_hash[hash];
+        if (!site)
+            break;
+        if (z_sites[site].file == file && z_sites[site].line == line)
+            goto done;
+        hash++;
+    }
+
+    // table full, stop tracking new sites
+    if (z_numsites == Z_MAX_SITES)
+        goto done;
+
+    site = z_numsites++;
+    z_sites[site].file = file;
+    z_sites[site].line = line;
+    z_site_hash[hash] = site;
+
+done:
+    pthread_mutex_unlock(&z_prof_lock);
+    return site;
+}
+
+void Z_ProfileAlloc(unsigned site, unsigned tag, size_t size, int blocks)
+{
+    zsite_t *s;
+    int i;
+
+    if (!site)
+        return;
+
+    pthread_mutex_lock(&z_prof_lock);
+
+    s = &z_sites[site];
+    s->tag = tag;
+    s->live += size;
+    s->blocks += blocks;
+    if (s->live > s->peak)
+        s->peak = s->live;
+
+    if (size) {
+        s->allocs++;
+        s->total += size;
+        for (i = 0; i < Z_NUM_SIZES - 1 && size >= (16 << i); i++)
+            ;
+        s->sizes[i]++;
+    }
+
+    pthread_mutex_unlock(&z_prof_lock);
+}
+
+void Z_ProfileFree(unsigned site, size_t size, int blocks)
+{
+    zsite_t *s;
+
+    if (!site)
+        return;
+
+    pthread_mutex_lock(&z_prof_lock);
+
+    s = &z_sites[site];
+    s->live -= size;
+    s->blocks -= blocks;
+
+    pthread_mutex_unlock(&z_prof_lock);
+}
+
+// slab blocks are released without walking them, except when profiling
+static void Z_ProfileFreeSlabs(const list_t *list)
+{
+    const zslab_t *slab;
+    const zhead_t *z;
+    const byte *p, *end;
+    size_t stride;
+
+    if (!z_sites)
+        return;
+
+    LIST_FOR_EACH(zslab_t, slab, list, entry) {
+        stride = sizeof(zhead_t) + z_classes[slab->cls];
+        p = (const byte *)slab + Z_SLAB_HEAD;
+        end = (const byte *)slab + Z_SLAB_SIZE - stride;
+        for (; p <= end; p += stride) {
+            z = (const zhead_t *)p;
+            if (z->magic == Z_MAGIC_POOL)
+                Z_ProfileFree(z->site, z->size - sizeof(*z), 1);
+        }
+    }
+}
+
+static const char *Z_SiteTag(const zsite_t *s)
+{
+    if (s->tag == TAG_FREE)
+        return "hunk";
+    return z_tagnames[TAG_INDEX(s->tag)];
+}
+
+static const char *Z_SiteName(const zsite_t *s)
+{
+    return va("%s:%d", COM_SkipPath(s->file), s->line);
+}
+
+static const size_t     *z_sort_keys;
+
+static int Z_SiteCmp(const void *p1, const void *p2)
+{
+    size_t a = z_sort_keys[*(const uint16_t *)p1];
+    size_t b = z_sort_keys[*(const uint16_t *)p2];
+
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+// returns site indices sorted by key in descending order
+static int Z_SortSites(uint16_t *order, const size_t *keys, unsigned numsites)
+{
+    int i, count = 0;
+
+    for (i = 1; i < numsites; i++)
+        if (keys[i])
+            order[count++] = i;
+
+    z_sort_keys = keys;
+    qsort(order, count, sizeof(order[0]), Z_SiteCmp);
+    return count;
+}
+
+static void Z_ListSites(int argc, bool live)
+{
+    unsigned numsites = z_numsites;
+    uint16_t *order = Z_Malloc(numsites * sizeof(order[0]));
+    size_t *keys = Z_Malloc(numsites * sizeof(keys[0]));
+    const zsite_t *s;
+    int i, count, limit;
+
+    limit = argc > 2 ? Q_atoi(Cmd_Argv(2)) : 20;
+
+    pthread_mutex_lock(&z_prof_lock);
+    for (i = 0; i < numsites; i++)
+        keys[i] = live ? z_sites[i].live : z_sites[i].total;
+    pthread_mutex_unlock(&z_prof_lock);
+
+    count = Z_SortSites(order, keys, numsites);
+
+    Com_Printf("site    allocs     total      live blocks      peak tag     location\n"
+               "---- --------- --------- --------- ------ --------- ------- --------\n");
+    for (i = 0; i < count && i < limit; i++) {
+        s = &z_sites[order[i]];
+        Com_Printf("%4d %9zu %9zu %9zu %6zu %9zu %-7s %s\n", order[i],
+                   s->allocs, s->total, s->live, s->blocks, s->peak,
+                   Z_SiteTag(s), Z_SiteName(s));
+    }
+
+    Z_Free(order);
+    Z_Free(keys);
+}
+
+static void Z_ListRates(int argc)
+{
+    unsigned numsites = z_numsites;
+    uint16_t *order = Z_Malloc(numsites * sizeof(order[0]));
+    size_t *keys = Z_Malloc(numsites * sizeof(keys[0]));
+    size_t *bytes = Z_Malloc(numsites * sizeof(bytes[0]));
+    unsigned frames;
+    zsite_t *s;
+    int i, count, limit;
+
+    limit = argc > 2 ? Q_atoi(Cmd_Argv(2)) : 20;
+
+    pthread_mutex_lock(&z_prof_lock);
+    frames = max(com_framenum - z_mark_frame, 1);
+    z_mark_frame = com_framenum;
+    for (i = 0; i < numsites; i++) {
+        s = &z_sites[i];
+        keys[i] = s->allocs - s->mark_allocs;
+        bytes[i] = s->total - s->mark_total;
+        s->mark_allocs = s->allocs;
+        s->mark_total = s->total;
+    }
+    pthread_mutex_unlock(&z_prof_lock);
+
+    count = Z_SortSites(order, keys, numsites);
+
+    Com_Printf("Allocations per frame over last %u frames:\n"
+               "site   allocs     bytes tag     location\n"
+               "---- -------- --------- ------- --------\n", frames);
+    for (i = 0; i < count && i < limit; i++) {
+        s = &z_sites[order[i]];
+        Com_Printf("%4d %8.2f %9.0f %-7s %s\n", order[i],
+                   (double)keys[order[i]] / frames,
+                   (double)bytes[order[i]] / frames,
+                   Z_SiteTag(s), Z_SiteName(s));
+    }
+
+    Z_Free(order);
+    Z_Free(keys);
+    Z_Free(bytes);
+}
+
+static void Z_ListSizes(int argc)
+{
+    const zsite_t *s;
+    int i, site;
+
+    if (argc < 3) {
+        Com_Printf("Usage: %s sizes <site>\n", Cmd_Argv(0));
+        return;
+    }
+
+    site = Q_atoi(Cmd_Argv(2));
+    if (site < 1 || site >= z_numsites) {
+        Com_Printf("Bad site number\n");
+        return;
+    }
+
+    s = &z_sites[site];
+    Com_Printf("%s (%s), %zu allocations:\n", Z_SiteName(s), Z_SiteTag(s), s->allocs);
+    for (i = 0; i < Z_NUM_SIZES; i++) {
+        if (!s->sizes[i])
+            continue;
+        if (i == Z_NUM_SIZES - 1)
+            Com_Printf("%7d+        %9u\n", 16 << (i - 1), s->sizes[i]);
+        else
+            Com_Printf("%7d..%-7d %9u\n", i ? 16 << (i - 1) : 1, (16 << i) - 1, s->sizes[i]);
+    }
+}
+
+static zsnapshot_t *Z_FindSnapshot(const char *name)
+{
+    int i;
+
+    for (i = 0; i < Z_MAX_SNAPSHOTS; i++)
+        if (z_snapshots[i].live && !strcmp(z_snapshots[i].name, name))
+            return &z_snapshots[i];
+
+    return NULL;
+}
+
+static void Z_FreeSnapshot(zsnapshot_t *snap)
+{
+    Z_Freep((void **)&snap->live);
+    Z_Freep((void **)&snap->blocks);
+}
+
+static void Z_TakeSnapshot(zsnapshot_t *snap, const char *name)
+{
+    unsigned i, numsites = z_numsites;
+
+    Q_strlcpy(snap->name, name, sizeof(snap->name));
+    snap->live = Z_Malloc(numsites * sizeof(snap->live[0]));
+    snap->blocks = Z_Malloc(numsites * sizeof(snap->blocks[0]));
+
+    pthread_mutex_lock(&z_prof_lock);
+    for (i = 0; i < numsites; i++) {
+        snap->live[i] = z_sites[i].live;
+        snap->blocks[i] = z_sites[i].blocks;
+    }
+    snap->numsites = numsites;
+    pthread_mutex_unlock(&z_prof_lock);
+}
+
+static void Z_Snapshot(int argc)
+{
+    zsnapshot_t *snap;
+    int i;
+
+    if (argc < 3) {
+        for (i = 0; i < Z_MAX_SNAPSHOTS; i++)
+            if (z_snapshots[i].live)
+                Com_Printf("%s\n", z_snapshots[i].name);
+        return;
+    }
+
+    snap = Z_FindSnapshot(Cmd_Argv(2));
+    if (snap) {
+        Z_FreeSnapshot(snap);
+    } else {
+        for (i = 0; i < Z_MAX_SNAPSHOTS; i++)
+            if (!z_snapshots[i].live)
+                break;
+        if (i == Z_MAX_SNAPSHOTS) {
+            Com_Printf("Too many snapshots\n");
+            return;
+        }
+        snap = &z_snapshots[i];
+    }
+
+    Z_TakeSnapshot(snap, Cmd_Argv(2));
+}
+
+#define SNAP_VALUE(snap, field, i) \
+    ((i) < (snap)->numsites ? (int64_t)(snap)->field[i] : 0)
+
+static void Z_Diff(int argc)
+{
+    zsnapshot_t *from, *to, current;
+    uint16_t *order;
+    size_t *keys;
+    int64_t bytes, blocks, total = 0;
+    int i, count, limit;
+
+    if (argc < 3) {
+        Com_Printf("Usage: %s diff <from> [to] [count]\n", Cmd_Argv(0));
+        return;
+    }
+
+    from = Z_FindSnapshot(Cmd_Argv(2));
+    if (!from) {
+        Com_Printf("No such snapshot: %s\n", Cmd_Argv(2));
+        return;
+    }
+
+    // compare with current state if second snapshot is not given
+    if (argc > 3 && !Q_isdigit(*Cmd_Argv(3))) {
+        to = Z_FindSnapshot(Cmd_Argv(3));
+        if (!to) {
+            Com_Printf("No such snapshot: %s\n", Cmd_Argv(3));
+            return;
+        }
+        limit = argc > 4 ? Q_atoi(Cmd_Argv(4)) : 20;
+    } else {
+        to = &current;
+        Z_TakeSnapshot(to, "current");
+        limit = argc > 3 ? Q_atoi(Cmd_Argv(3)) : 20;
+    }
+
+    order = Z_Malloc(to->numsites * sizeof(order[0]));
+    keys = Z_Malloc(to->numsites * sizeof(keys[0]));
+    for (i = 0; i < to->numsites; i++) {
+        bytes = SNAP_VALUE(to, live, i) - SNAP_VALUE(from, live, i);
+        keys[i] = bytes < 0 ? -bytes : bytes;
+        total += bytes;
+    }
+
+    count = Z_SortSites(order, keys, to->numsites);
+
+    Com_Printf("Live memory change from %s to %s: %+"PRId64" bytes\n"
+               "site       bytes  blocks tag     location\n"
+               "---- ----------- ------- ------- --------\n",
+               from->name, to->name, total);
+    for (i = 0; i < count && i < limit; i++) {
+        bytes = SNAP_VALUE(to, live, order[i]) - SNAP_VALUE(from, live, order[i]);
+        blocks = SNAP_VALUE(to, blocks, order[i]) - SNAP_VALUE(from, blocks, order[i]);
+        Com_Printf("%4d %+11"PRId64" %+7"PRId64" %-7s %s\n", order[i], bytes, blocks,
+                   Z_SiteTag(&z_sites[order[i]]), Z_SiteName(&z_sites[order[i]]));
+    }
+
+    if (to == &current)
+        Z_FreeSnapshot(to);
+    Z_Free(order);
+    Z_Free(keys);
+}
+
+static void Z_ResetSites(void)
+{
+    zsite_t *s;
+    int i;
+
+    // live counters are kept, blocks are still out there
+    pthread_mutex_lock(&z_prof_lock);
+    for (i = 0; i < z_numsites; i++) {
+        s = &z_sites[i];
+        s->allocs = s->total = 0;
+        s->mark_allocs = s->mark_total = 0;
+        s->peak = s->live;
+        memset(s->sizes, 0, sizeof(s->sizes));
+    }
+    z_mark_frame = com_framenum;
+    pthread_mutex_unlock(&z_prof_lock);
+}
+
+/*
+========================
+Z_Profile_f
+========================
+*/
+void Z_Profile_f(void)
+{
+    int argc = Cmd_Argc();
+    char *cmd = Cmd_Argv(1);
+
+    if (!z_sites) {
+        Com_Printf("No allocations recorded. Set z_profile to 1 to enable profiling.\n");
+        return;
+    }
+
+    if (argc < 2 || !strcmp(cmd, "top")) {
+        Z_ListSites(argc, false);
+    } else if (!strcmp(cmd, "live")) {
+        Z_ListSites(argc, true);
+    } else if (!strcmp(cmd, "rate")) {
+        Z_ListRates(argc);
+    } else if (!strcmp(cmd, "sizes")) {
+        Z_ListSizes(argc);
+    } else if (!strcmp(cmd, "snap")) {
+        Z_Snapshot(argc);
+    } else if (!strcmp(cmd, "diff")) {
+        Z_Diff(argc);
+    } else if (!strcmp(cmd, "reset")) {
+        Z_ResetSites();
+    } else {
+        Com_Printf("Usage: %s <top|live|rate> [count]\n"
+                   "       %s sizes <site>\n"
+                   "       %s snap [name]\n"
+                   "       %s diff <from> [to] [count]\n"
+                   "       %s reset\n",
+                   Cmd_Argv(0), Cmd_Argv(0), Cmd_Argv(0), Cmd_Argv(0), Cmd_Argv(0));
+    }
+}
@@ -813,6 +813,9 @@ void ai_run(edict_t *self, float dist)
     vec3_t      v_forward, v_right;
     float       left, center, right;
     vec3_t      left_target, right_target;
+    trace_request_t req[2];
+    trace_t     probe[2];
+    int         i;
 
     // if we're going to a combat point, just proceed
     if (self->monsterinfo.aiflags & AI_COMBAT_POINT) {
@@ -923,13 +926,21 @@ void ai_run(edict_t *self, float dist)
 
             VectorSet(v, d2, -16, 0);
             G_ProjectSource(self->s.origin, v, v_forward, v_right, left_target);
-            tr = gi.trace(self->s.origin, self->mins, self->maxs, left_target, self, MASK_PLAYERSOLID);
-            left = tr.fraction;
-
             VectorSet(v, d2, 16, 0);
             G_ProjectSource(self->s.origin, v, v_forward, v_right, right_target);
-            tr = gi.trace(self->s.origin, self->mins, self->maxs, right_target, self, MASK_PLAYERSOLID);
-            right = tr.fraction;
+
+            // probe both sides at once
+            for (i = 0; i < 2; i++) {
+                VectorCopy(self->s.origin, req[i].start);
+                VectorCopy(i ? right_target : left_target, req[i].end);
+                VectorCopy(self->mins, req[i].mins);
+                VectorCopy(self->maxs, req[i].maxs);
+                req[i].passent = self;
+                req[i].contentmask = MASK_PLAYERSOLID;
+            }
+            G_TraceBatch(req, probe, 2);
+            left = probe[0].fraction;
+            right = probe[1].fraction;
 
             center = (d1 * center) / d2;
             if (left >= center && left > right) {
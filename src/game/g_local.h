@@ -432,6 +432,8 @@ extern  game_locals_t   game;
 extern  level_locals_t  level;
 extern  game_import_t   gi;
 extern  game_export_t   globals;
+extern  const game_import_ex_t  *gix;
+extern  bool            g_batch_traces;
 extern  spawn_temp_t    st;
 
 extern  int sm_meat_index;
@@ -620,6 +622,8 @@ void    G_TouchSolids(edict_t *ent);
 
 char    *G_CopyString(char *in);
 
+void    G_TraceBatch(const trace_request_t *requests, trace_t *results, int count);
+
 float vectoyaw(vec3_t vec);
 void vectoangles(vec3_t vec, vec3_t angles);
 
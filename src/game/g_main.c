@@ -22,6 +22,8 @@ game_locals_t   game;
 level_locals_t  level;
 game_import_t   gi;
 game_export_t   globals;
+const game_import_ex_t  *gix;
+bool            g_batch_traces;
 spawn_temp_t    st;
 
 int sm_meat_index;
@@ -194,6 +196,12 @@ void InitGame(void)
         game.csr = cs_remap_old;
     }
 
+    // trace many rays at once if supported
+    g_batch_traces = sv_features && (int)sv_features->value & GMF_BATCH_TRACES &&
+                     gix && gix->apiversion >= 2;
+    if (g_batch_traces)
+        features |= GMF_BATCH_TRACES;
+
     // export our own features
     gi.cvar_forceset("g_features", va("%d", features));
 
@@ -253,6 +261,24 @@ q_exported game_export_t *GetGameAPI(game_import_t *import)
     return &globals;
 }
 
+/*
+=================
+GetExtendedGameAPI
+
+Called after GetGameAPI, if supported by the server
+=================
+*/
+q_exported const game_export_ex_t *GetExtendedGameAPI(const game_import_ex_t *import)
+{
+    static const game_export_ex_t gex = {
+        .apiversion = GAME_API_VERSION_EX,
+    };
+
+    gix = import;
+
+    return &gex;
+}
+
 #ifndef GAME_HARD_LINKED
 // this is only here so the functions in q_shared.c can link
 void Com_LPrintf(print_type_t type, const char *fmt, ...)
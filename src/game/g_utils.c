@@ -329,6 +329,28 @@ void vectoangles(vec3_t value1, vec3_t angles)
     angles[ROLL] = 0;
 }
 
+/*
+=============
+G_TraceBatch
+
+Traces all requests, with a single server call if supported.
+=============
+*/
+void G_TraceBatch(const trace_request_t *requests, trace_t *results, int count)
+{
+    const trace_request_t *r;
+    int i;
+
+    if (g_batch_traces) {
+        gix->TraceBatch(requests, results, count);
+        return;
+    }
+
+    for (i = 0, r = requests; i < count; i++, r++)
+        results[i] = gi.trace((float *)r->start, (float *)r->mins, (float *)r->maxs,
+                              (float *)r->end, r->passent, r->contentmask);
+}
+
 char *G_CopyString(char *in)
 {
     char *out;
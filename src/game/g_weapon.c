@@ -120,82 +120,9 @@ fire_lead
 This is an internal support routine used for bullet/pellet based weapons.
 =================
 */
-static void fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick, int te_impact, int hspread, int vspread, int mod)
+static void fire_lead_impact(edict_t *self, vec3_t aimdir, int damage, int kick, int te_impact, int mod, trace_t tr, bool water, vec3_t water_start)
 {
-    trace_t     tr;
     vec3_t      dir;
-    vec3_t      forward, right, up;
-    vec3_t      end;
-    float       r;
-    float       u;
-    vec3_t      water_start;
-    bool        water = false;
-    int         content_mask = MASK_SHOT | MASK_WATER;
-
-    tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
-    if (!(tr.fraction < 1.0f)) {
-        vectoangles(aimdir, dir);
-        AngleVectors(dir, forward, right, up);
-
-        r = crandom() * hspread;
-        u = crandom() * vspread;
-        VectorMA(start, 8192, forward, end);
-        VectorMA(end, r, right, end);
-        VectorMA(end, u, up, end);
-
-        if (gi.pointcontents(start) & MASK_WATER) {
-            water = true;
-            VectorCopy(start, water_start);
-            content_mask &= ~MASK_WATER;
-        }
-
-        tr = gi.trace(start, NULL, NULL, end, self, content_mask);
-
-        // see if we hit water
-        if (tr.contents & MASK_WATER) {
-            int     color;
-
-            water = true;
-            VectorCopy(tr.endpos, water_start);
-
-            if (!VectorCompare(start, tr.endpos)) {
-                if (tr.contents & CONTENTS_WATER) {
-                    if (strcmp(tr.surface->name, "*brwater") == 0)
-                        color = SPLASH_BROWN_WATER;
-                    else
-                        color = SPLASH_BLUE_WATER;
-                } else if (tr.contents & CONTENTS_SLIME)
-                    color = SPLASH_SLIME;
-                else if (tr.contents & CONTENTS_LAVA)
-                    color = SPLASH_LAVA;
-                else
-                    color = SPLASH_UNKNOWN;
-
-                if (color != SPLASH_UNKNOWN) {
-                    gi.WriteByte(svc_temp_entity);
-                    gi.WriteByte(TE_SPLASH);
-                    gi.WriteByte(8);
-                    gi.WritePosition(tr.endpos);
-                    gi.WriteDir(tr.plane.normal);
-                    gi.WriteByte(color);
-                    gi.multicast(tr.endpos, MULTICAST_PVS);
-                }
-
-                // change bullet's course when it enters water
-                VectorSubtract(end, start, dir);
-                vectoangles(dir, dir);
-                AngleVectors(dir, forward, right, up);
-                r = crandom() * hspread * 2;
-                u = crandom() * vspread * 2;
-                VectorMA(water_start, 8192, forward, end);
-                VectorMA(end, r, right, end);
-                VectorMA(end, u, up, end);
-            }
-
-            // re-trace ignoring water this time
-            tr = gi.trace(water_start, NULL, NULL, end, self, MASK_SHOT);
-        }
-    }
 
     // send gun puff / flash
     if (!((tr.surface) && (tr.surface->flags & SURF_SKY))) {
@@ -240,6 +167,103 @@ static void fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, in
     }
 }
 
+static void fire_lead_end(vec3_t start, vec3_t aimdir, int hspread, int vspread, vec3_t end)
+{
+    vec3_t      dir;
+    vec3_t      forward, right, up;
+    float       r;
+    float       u;
+
+    vectoangles(aimdir, dir);
+    AngleVectors(dir, forward, right, up);
+
+    r = crandom() * hspread;
+    u = crandom() * vspread;
+    VectorMA(start, 8192, forward, end);
+    VectorMA(end, r, right, end);
+    VectorMA(end, u, up, end);
+}
+
+// tr is the result of tracing from start to end, with MASK_WATER
+// excluded if start is in water
+static void fire_lead_finish(edict_t *self, vec3_t start, vec3_t end, vec3_t aimdir, int damage, int kick, int te_impact, int hspread, int vspread, int mod, bool water, trace_t tr)
+{
+    vec3_t      dir;
+    vec3_t      forward, right, up;
+    float       r;
+    float       u;
+    vec3_t      water_start;
+
+    if (water)
+        VectorCopy(start, water_start);
+
+    // see if we hit water
+    if (tr.contents & MASK_WATER) {
+        int     color;
+
+        water = true;
+        VectorCopy(tr.endpos, water_start);
+
+        if (!VectorCompare(start, tr.endpos)) {
+            if (tr.contents & CONTENTS_WATER) {
+                if (strcmp(tr.surface->name, "*brwater") == 0)
+                    color = SPLASH_BROWN_WATER;
+                else
+                    color = SPLASH_BLUE_WATER;
+            } else if (tr.contents & CONTENTS_SLIME)
+                color = SPLASH_SLIME;
+            else if (tr.contents & CONTENTS_LAVA)
+                color = SPLASH_LAVA;
+            else
+                color = SPLASH_UNKNOWN;
+
+            if (color != SPLASH_UNKNOWN) {
+                gi.WriteByte(svc_temp_entity);
+                gi.WriteByte(TE_SPLASH);
+                gi.WriteByte(8);
+                gi.WritePosition(tr.endpos);
+                gi.WriteDir(tr.plane.normal);
+                gi.WriteByte(color);
+                gi.multicast(tr.endpos, MULTICAST_PVS);
+            }
+
+            // change bullet's course when it enters water
+            VectorSubtract(end, start, dir);
+            vectoangles(dir, dir);
+            AngleVectors(dir, forward, right, up);
+            r = crandom() * hspread * 2;
+            u = crandom() * vspread * 2;
+            VectorMA(water_start, 8192, forward, end);
+            VectorMA(end, r, right, end);
+            VectorMA(end, u, up, end);
+        }
+
+        // re-trace ignoring water this time
+        tr = gi.trace(water_start, NULL, NULL, end, self, MASK_SHOT);
+    }
+
+    fire_lead_impact(self, aimdir, damage, kick, te_impact, mod, tr, water, water_start);
+}
+
+static void fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick, int te_impact, int hspread, int vspread, int mod)
+{
+    trace_t     tr;
+    vec3_t      end;
+    bool        water;
+
+    tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
+    if (tr.fraction < 1.0f) {
+        fire_lead_impact(self, aimdir, damage, kick, te_impact, mod, tr, false, NULL);
+        return;
+    }
+
+    fire_lead_end(start, aimdir, hspread, vspread, end);
+    water = gi.pointcontents(start) & MASK_WATER;
+    tr = gi.trace(start, NULL, NULL, end, self, water ? MASK_SHOT : MASK_SHOT | MASK_WATER);
+
+    fire_lead_finish(self, start, end, aimdir, damage, kick, te_impact, hspread, vspread, mod, water, tr);
+}
+
 /*
 =================
 fire_bullet
@@ -260,12 +284,59 @@ fire_shotgun
 Shoots shotgun pellets.  Used by shotgun and super shotgun.
 =================
 */
+#define MAX_PELLETS     32
+
 void fire_shotgun(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick, int hspread, int vspread, int count, int mod)
 {
-    int     i;
+    trace_request_t req[MAX_PELLETS];
+    trace_t     results[MAX_PELLETS], tr;
+    int         linkcount[MAX_PELLETS];
+    bool        water;
+    int         i;
+
+    if (!g_batch_traces || count > MAX_PELLETS) {
+        for (i = 0; i < count; i++)
+            fire_lead(self, start, aimdir, damage, kick, TE_SHOTGUN, hspread, vspread, mod);
+        return;
+    }
+
+    // muzzle check is the same for all pellets
+    tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
+    if (tr.fraction < 1.0f) {
+        for (i = 0; i < count; i++)
+            fire_lead_impact(self, aimdir, damage, kick, TE_SHOTGUN, mod, tr, false, NULL);
+        return;
+    }
+
+    water = gi.pointcontents(start) & MASK_WATER;
+
+    memset(req, 0, sizeof(req[0]) * count);
+    for (i = 0; i < count; i++) {
+        VectorCopy(start, req[i].start);
+        fire_lead_end(start, aimdir, hspread, vspread, req[i].end);
+        req[i].passent = self;
+        req[i].contentmask = water ? MASK_SHOT : MASK_SHOT | MASK_WATER;
+    }
+
+    G_TraceBatch(req, results, count);
 
     for (i = 0; i < count; i++)
-        fire_lead(self, start, aimdir, damage, kick, TE_SHOTGUN, hspread, vspread, mod);
+        linkcount[i] = results[i].ent ? results[i].ent->linkcount : 0;
+
+    // Known differences from firing pellets one by one with fire_lead:
+    // - all spread offsets are drawn from the RNG before any pellet is
+    //   resolved, so random numbers used by impacts come later in sequence
+    // - a pellet is only re-traced if the entity it hit was freed or
+    //   relinked by earlier pellets. Other changes along its path, like an
+    //   entity spawned by an earlier impact, are not seen.
+    for (i = 0; i < count; i++) {
+        // earlier pellets may have killed or gibbed what this one hit
+        tr = results[i];
+        if (tr.ent && tr.ent != world && (!tr.ent->inuse || tr.ent->linkcount != linkcount[i]))
+            tr = gi.trace(req[i].start, NULL, NULL, req[i].end, self, req[i].contentmask);
+
+        fire_lead_finish(self, start, req[i].end, aimdir, damage, kick, TE_SHOTGUN, hspread, vspread, mod, water, tr);
+    }
 }
 
 /*
@@ -34,9 +34,10 @@ int c_yes, c_no;
 
 bool M_CheckBottom(edict_t *ent)
 {
-    vec3_t  mins, maxs, start, stop;
-    trace_t trace;
-    int     x, y;
+    vec3_t  mins, maxs, start;
+    trace_request_t req[5];
+    trace_t trace[5];
+    int     i, x, y;
     float   mid, bottom;
 
     VectorAdd(ent->s.origin, ent->mins, mins);
@@ -62,31 +63,38 @@ realcheck:
 //
 // check it for real...
 //
-    start[2] = mins[2];
+// midpoint first, then the corners
+    memset(req, 0, sizeof(req));
+    req[0].start[0] = (mins[0] + maxs[0]) * 0.5f;
+    req[0].start[1] = (mins[1] + maxs[1]) * 0.5f;
+    for (i = 1, x = 0; x <= 1; x++)
+        for (y = 0; y <= 1; y++, i++) {
+            req[i].start[0] = x ? maxs[0] : mins[0];
+            req[i].start[1] = y ? maxs[1] : mins[1];
+        }
+    for (i = 0; i < 5; i++) {
+        req[i].start[2] = mins[2];
+        VectorCopy(req[i].start, req[i].end);
+        req[i].end[2] = mins[2] - 2 * STEPSIZE;
+        req[i].passent = ent;
+        req[i].contentmask = MASK_MONSTERSOLID;
+    }
 
-// the midpoint must be within 16 of the bottom
-    start[0] = stop[0] = (mins[0] + maxs[0]) * 0.5f;
-    start[1] = stop[1] = (mins[1] + maxs[1]) * 0.5f;
-    stop[2] = start[2] - 2 * STEPSIZE;
-    trace = gi.trace(start, vec3_origin, vec3_origin, stop, ent, MASK_MONSTERSOLID);
+    // all at once, with a single server call if supported
+    G_TraceBatch(req, trace, 5);
 
-    if (trace.fraction == 1.0f)
+// the midpoint must be within 16 of the bottom
+    if (trace[0].fraction == 1.0f)
         return false;
-    mid = bottom = trace.endpos[2];
+    mid = bottom = trace[0].endpos[2];
 
 // the corners must be within 16 of the midpoint
-    for (x = 0; x <= 1; x++)
-        for (y = 0; y <= 1; y++) {
-            start[0] = stop[0] = x ? maxs[0] : mins[0];
-            start[1] = stop[1] = y ? maxs[1] : mins[1];
-
-            trace = gi.trace(start, vec3_origin, vec3_origin, stop, ent, MASK_MONSTERSOLID);
-
-            if (trace.fraction != 1.0f && trace.endpos[2] > bottom)
-                bottom = trace.endpos[2];
-            if (trace.fraction == 1.0f || mid - trace.endpos[2] > STEPSIZE)
-                return false;
-        }
+    for (i = 1; i < 5; i++) {
+        if (trace[i].fraction != 1.0f && trace[i].endpos[2] > bottom)
+            bottom = trace[i].endpos[2];
+        if (trace[i].fraction == 1.0f || mid - trace[i].endpos[2] > STEPSIZE)
+            return false;
+    }
 
     c_yes++;
     return true;
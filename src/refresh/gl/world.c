@@ -17,6 +17,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "gl.h"
+#include "common/bitset.h"
 
 void GL_SampleLightPoint(vec3_t color)
 {
@@ -265,8 +266,7 @@ static void GL_MarkLeaves(void)
     byte vis2[VIS_MAX_BYTES];
     mleaf_t *leaf;
     mnode_t *node;
-    uint_fast32_t *src1, *src2;
-    int cluster1, cluster2, longs;
+    int cluster1, cluster2;
     vec3_t tmp;
     int i;
     bsp_t *bsp = gl_static.world.cache;
@@ -311,12 +311,7 @@ static void GL_MarkLeaves(void)
     BSP_ClusterVis(bsp, vis1, cluster1, DVIS_PVS);
     if (cluster1 != cluster2) {
         BSP_ClusterVis(bsp, vis2, cluster2, DVIS_PVS);
-        longs = VIS_FAST_LONGS(bsp);
-        src1 = (uint_fast32_t *)vis1;
-        src2 = (uint_fast32_t *)vis2;
-        while (longs--) {
-            *src1++ |= *src2++;
-        }
+        BitSet_Or(vis1, vis2, bsp->visrowsize);
     }
 
     lastNodesVisible = 0;
@@ -40,7 +40,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define R_COLORMAP_PCX    "pics/colormap.pcx"
 
 #define IMG_LOAD(x) \
-    static int IMG_Load##x(byte *rawdata, size_t rawlen, \
+    static int IMG_Load##x(const byte *rawdata, size_t rawlen, \
         image_t *image, byte **pic)
 
 void stbi_write(void *context, void *data, int size)
@@ -128,11 +128,11 @@ PCX LOADING
 =================================================================
 */
 
-static int IMG_DecodePCX(byte *rawdata, size_t rawlen, byte *pixels,
+static int IMG_DecodePCX(const byte *rawdata, size_t rawlen, byte *pixels,
                          byte *palette, int *width, int *height)
 {
-    byte    *raw, *end;
-    dpcx_t  *pcx;
+    const byte      *raw, *end;
+    const dpcx_t    *pcx;
     int     x, y, w, h, scan;
     int     dataByte, runLength;
 
@@ -143,7 +143,7 @@ static int IMG_DecodePCX(byte *rawdata, size_t rawlen, byte *pixels,
         return Q_ERR_FILE_TOO_SMALL;
     }
 
-    pcx = (dpcx_t *)rawdata;
+    pcx = (const dpcx_t *)rawdata;
 
     if (pcx->manufacturer != 10 || pcx->version != 5) {
         return Q_ERR_UNKNOWN_FORMAT;
@@ -179,7 +179,7 @@ static int IMG_DecodePCX(byte *rawdata, size_t rawlen, byte *pixels,
         if (rawlen < 768) {
             return Q_ERR_FILE_TOO_SMALL;
         }
-        memcpy(palette, (byte *)pcx + rawlen - 768, 768);
+        memcpy(palette, rawdata + rawlen - 768, 768);
     }
 
     //
@@ -187,7 +187,7 @@ static int IMG_DecodePCX(byte *rawdata, size_t rawlen, byte *pixels,
     //
     if (pixels) {
         raw = pcx->data;
-        end = (byte *)pcx + rawlen;
+        end = rawdata + rawlen;
         for (y = 0; y < h; y++, pixels += w) {
             for (x = 0; x < scan;) {
                 if (raw >= end)
@@ -306,14 +306,14 @@ WAL LOADING
 
 IMG_LOAD(WAL)
 {
-    miptex_t    *mt;
+    const miptex_t  *mt;
     unsigned    w, h, offset, size, endpos;
 
     if (rawlen < sizeof(miptex_t)) {
         return Q_ERR_FILE_TOO_SMALL;
     }
 
-    mt = (miptex_t *)rawdata;
+    mt = (const miptex_t *)rawdata;
 
     w = LittleLong(mt->width);
     h = LittleLong(mt->height);
@@ -335,7 +335,7 @@ IMG_LOAD(WAL)
 
     image->upload_width = image->width = w;
     image->upload_height = image->height = h;
-    image->flags |= IMG_Unpack8((uint32_t *)*pic, (uint8_t *)mt + offset, w, h);
+    image->flags |= IMG_Unpack8((uint32_t *)*pic, rawdata + offset, w, h);
 
     return Q_ERR_SUCCESS;
 }
@@ -876,7 +876,7 @@ uint32_t    d_8to24table[256];
 
 static const struct {
     char    ext[4];
-    int     (*load)(byte *, size_t, image_t *, byte **);
+    int     (*load)(const byte *, size_t, image_t *, byte **);
 } img_loaders[IM_MAX] = {
     { "pcx", IMG_LoadPCX },
     { "wal", IMG_LoadWAL },
@@ -1076,7 +1076,7 @@ static image_t *lookup_image(const char *name,
 
 static int _try_image_format(imageformat_t fmt, image_t *image, int try_src, byte **pic)
 {
-    byte        *data;
+    fs_mapping_t    map;
     int         len;
     int         ret;
 
@@ -1084,15 +1084,15 @@ static int _try_image_format(imageformat_t fmt, image_t *image, int try_src, byt
     int fs_flags = 0;
     if (try_src > 0)
         fs_flags = try_src == TRY_IMAGE_SRC_GAME ? FS_PATH_GAME : FS_PATH_BASE;
-    len = FS_LoadFileFlags(image->name, (void **)&data, fs_flags);
-    if (!data) {
+    len = FS_MapFileEx(image->name, &map, fs_flags);
+    if (!map.data) {
         return len;
     }
 
     // decompress the image
-    ret = img_loaders[fmt].load(data, len, image, pic);
+    ret = img_loaders[fmt].load(map.data, len, image, pic);
 
-    FS_FreeFile(data);
+    FS_UnmapFile(&map);
 
     image->filepath[0] = 0;
     if (ret >= 0) {
@@ -306,7 +306,8 @@ qhandle_t R_RegisterModel(const char *name)
     size_t namelen;
     int filelen = 0;
     model_t *model;
-    byte *rawdata = NULL;
+    fs_mapping_t map = { 0 };
+    const byte *rawdata;
     uint32_t ident;
     mod_load_t load;
     int ret;
@@ -364,22 +365,22 @@ qhandle_t R_RegisterModel(const char *name)
         {
             memcpy(extension, ".md3", 4);
 
-            filelen = FS_LoadFileFlags(normalized, (void **)&rawdata, fs_flags);
+            filelen = FS_MapFileEx(normalized, &map, fs_flags);
 
             memcpy(extension, ".md2", 4);
         }
-        if (!rawdata)
+        if (!map.data)
         {
-            filelen = FS_LoadFileFlags(normalized, (void **)&rawdata, fs_flags);
+            filelen = FS_MapFileEx(normalized, &map, fs_flags);
         }
-        if (rawdata)
+        if (map.data)
             break;
     }
 
-	if (!rawdata)
+	if (!map.data)
 	{
-		filelen = FS_LoadFile(normalized, (void **)&rawdata);
-		if (!rawdata) {
+		filelen = FS_MapFile(normalized, &map);
+		if (!map.data) {
 			// don't spam about missing models
 			if (filelen == Q_ERR(ENOENT)) {
 				return 0;
@@ -395,8 +396,10 @@ qhandle_t R_RegisterModel(const char *name)
         goto fail2;
     }
 
+    rawdata = map.data;
+
     // check ident
-    ident = LittleLong(*(uint32_t *)rawdata);
+    ident = LittleLong(*(const uint32_t *)rawdata);
     switch (ident) {
     case MD2_IDENT:
         load = MOD_LoadMD2;
@@ -434,7 +437,7 @@ qhandle_t R_RegisterModel(const char *name)
 
     ret = load(model, rawdata, filelen, name);
 
-    FS_FreeFile(rawdata);
+    FS_UnmapFile(&map);
 
     if (ret) {
         memset(model, 0, sizeof(*model));
@@ -448,7 +451,7 @@ done:
     return index;
 
 fail2:
-    FS_FreeFile(rawdata);
+    FS_UnmapFile(&map);
 fail1:
     Com_EPrintf("Couldn't load %s: %s\n", normalized,
                 ret == Q_ERR_INVALID_FORMAT ?
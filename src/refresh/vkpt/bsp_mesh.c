@@ -18,6 +18,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "vkpt.h"
+#include "common/async.h"
+#include "common/bitset.h"
+#include "common/mdfour.h"
 #include "shader/global_textures.h"
 #include "material.h"
 #include "cameras.h"
@@ -553,20 +556,13 @@ is_sky_or_lava_cluster(bsp_mesh_t* wm, mface_t* surf, int cluster, int material_
 
 static void merge_pvs_rows(bsp_t* bsp, byte* src, byte* dst)
 {
-	for (int i = 0; i < bsp->visrowsize; i++)
-	{
-		dst[i] |= src[i];
-	}
+	BitSet_Or(dst, src, bsp->visrowsize);
 }
 
 #define FOREACH_BIT_BEGIN(SET,ROWSIZE,VAR) \
-	for (int _byte_idx = 0; _byte_idx < (ROWSIZE); _byte_idx++) { \
-	if (SET[_byte_idx]) { \
-		for (int _bit_idx = 0; _bit_idx < 8; _bit_idx++) { \
-			if (SET[_byte_idx] & (1 << _bit_idx)) { \
-				int VAR = (_byte_idx << 3) | _bit_idx;
+	{ int VAR; BITSET_FOR_EACH(SET, ROWSIZE, VAR) {
 
-#define FOREACH_BIT_END  } } } }
+#define FOREACH_BIT_END  } }
 
 static void connect_pvs(bsp_t* bsp, int cluster_a, byte* pvs_a, int cluster_b, byte* pvs_b)
 {
@@ -588,29 +584,111 @@ static void connect_pvs(bsp_t* bsp, int cluster_a, byte* pvs_a, int cluster_b, b
 	merge_pvs_rows(bsp, pvs_b, pvs_a);
 }
 
-static void make_pvs_symmetric(bsp_t* bsp)
+// Map load stages below are split into ranges of clusters or lights and run
+// as jobs. Jobs only write to their own range and don't allocate memory.
+#define MAX_LOAD_JOBS 16
+
+typedef struct {
+	bsp_t* bsp;
+	bsp_mesh_t* wm;
+	byte* matrix;
+	int first, last;
+	int* counts;    // per-cluster light counts of this job
+	int* offsets;   // per-cluster index of the first light of this job
+	const int* cluster_offsets;
+} load_job_t;
+
+// splits [0, count) into ranges aligned to `align` items, returns number of jobs
+static int split_load_jobs(load_job_t* jobs, bsp_mesh_t* wm, bsp_t* bsp, int count, int align)
 {
-	for (int cluster = 0; cluster < bsp->vis->numclusters; cluster++)
+	int num_jobs = Q_clip(Com_NumWorkers(), 1, MAX_LOAD_JOBS);
+	int first = 0;
+
+	memset(jobs, 0, sizeof(jobs[0]) * MAX_LOAD_JOBS);
+
+	for (int i = 0; i < num_jobs; i++)
 	{
-		byte* pvs = BSP_GetPvs(bsp, cluster);
+		int last = (int)((int64_t)count * (i + 1) / num_jobs);
+		if (i < num_jobs - 1)
+			last = min(ALIGN(last, align), count);
+		else
+			last = count;
 
-		FOREACH_BIT_BEGIN(pvs, bsp->visrowsize, vis_cluster)
-			if (vis_cluster != cluster)
-			{
-				byte* vis_pvs = BSP_GetPvs(bsp, vis_cluster);
-				Q_SetBit(vis_pvs, cluster);
-			}
-		FOREACH_BIT_END
+		jobs[i].bsp = bsp;
+		jobs[i].wm = wm;
+		jobs[i].first = first;
+		jobs[i].last = last;
+		first = last;
 	}
+
+	return num_jobs;
 }
 
-static void build_pvs2(bsp_t* bsp)
+static void run_load_jobs(jobfunc_t func, load_job_t* jobs, int num_jobs)
+{
+	jobcounter_t counter = { 0 };
+
+	for (int i = 0; i < num_jobs; i++)
+		Com_QueueJob(func, &jobs[i], &counter, NULL);
+
+	Com_WaitJobs(&counter);
+}
+
+// Writes columns [first, last) of the PVS matrix as rows of job->matrix.
+// Ranges are aligned to 8 clusters, so each job reads its own bytes of every row.
+static void transpose_pvs_job(void* arg)
 {
+	load_job_t* job = arg;
+	bsp_t* bsp = job->bsp;
+
+	size_t size = (job->last + 7) >> 3;
+
+	for (int other = 0; other < bsp->vis->numclusters; other++)
+	{
+		const byte* pvs = BSP_GetPvs(bsp, other);
+		int cluster;
+
+		for (cluster = BitSet_Next(pvs, size, job->first); cluster != -1 && cluster < job->last;
+			cluster = BitSet_Next(pvs, size, cluster + 1))
+		{
+			Q_SetBit(job->matrix + bsp->visrowsize * cluster, other);
+		}
+	}
+}
+
+static void merge_transposed_pvs_job(void* arg)
+{
+	load_job_t* job = arg;
+	bsp_t* bsp = job->bsp;
+
+	for (int cluster = job->first; cluster < job->last; cluster++)
+		merge_pvs_rows(bsp, job->matrix + bsp->visrowsize * cluster, BSP_GetPvs(bsp, cluster));
+}
+
+// Sets PVS to the union of itself and its transpose, so that every cluster
+// sees the clusters it is visible from.
+static void make_pvs_symmetric(bsp_t* bsp)
+{
+	load_job_t jobs[MAX_LOAD_JOBS];
 	size_t matrix_size = bsp->visrowsize * bsp->vis->numclusters;
+	byte* transposed = Z_Mallocz(matrix_size);
 
-	bsp->pvs2_matrix = Z_Mallocz(matrix_size);
+	int num_jobs = split_load_jobs(jobs, NULL, bsp, bsp->vis->numclusters, 8);
+	for (int i = 0; i < num_jobs; i++)
+		jobs[i].matrix = transposed;
 
-	for (int cluster = 0; cluster < bsp->vis->numclusters; cluster++)
+	run_load_jobs(transpose_pvs_job, jobs, num_jobs);
+	run_load_jobs(merge_transposed_pvs_job, jobs, num_jobs);
+
+	Z_Free(transposed);
+}
+
+static void build_pvs2_job(void* arg)
+{
+	load_job_t* job = arg;
+	bsp_t* bsp = job->bsp;
+
+	for (int cluster = job->first; cluster < job->last; cluster++)
 	{
 		byte* pvs = BSP_GetPvs(bsp, cluster);
 		byte* dest_pvs = BSP_GetPvs2(bsp, cluster);
@@ -621,7 +699,17 @@ static void build_pvs2(bsp_t* bsp)
 			merge_pvs_rows(bsp, pvs2, dest_pvs);
 		FOREACH_BIT_END
 	}
+}
+
+static void build_pvs2(bsp_t* bsp)
+{
+	load_job_t jobs[MAX_LOAD_JOBS];
+	size_t matrix_size = bsp->visrowsize * bsp->vis->numclusters;
+
+	bsp->pvs2_matrix = Z_Mallocz(matrix_size);
 
+	int num_jobs = split_load_jobs(jobs, NULL, bsp, bsp->vis->numclusters, 1);
+	run_load_jobs(build_pvs2_job, jobs, num_jobs);
 }
 
 // Provides an upper estimate (not counting the collinear edge removal, invisible materials etc.)
@@ -1631,25 +1719,28 @@ get_aabb_corner(const aabb_t* aabb, int corner_idx, vec3_t corner)
 	corner[2] = (corner_idx & 4) ? aabb->maxs[2] : aabb->mins[2];
 }
 
-static bool
-light_affects_cluster(light_poly_t* light, const aabb_t* aabb)
+static void
+get_light_plane(const light_poly_t* light, vec3_t normal, float* plane_distance)
 {
-	// Empty cluster, nothing is visible
-	if (aabb->mins[0] > aabb->maxs[0])
-		return false;
-
 	const float* v0 = light->positions + 0;
 	const float* v1 = light->positions + 3;
 	const float* v2 = light->positions + 6;
-	
-	// Get the light plane equation
-	vec3_t e1, e2, normal;
+
+	vec3_t e1, e2;
 	VectorSubtract(v1, v0, e1);
 	VectorSubtract(v2, v0, e2);
 	CrossProduct(e1, e2, normal);
 	VectorNormalize(normal);
-	
-	float plane_distance = -DotProduct(normal, v0);
+
+	*plane_distance = -DotProduct(normal, v0);
+}
+
+static bool
+light_affects_cluster(const vec3_t normal, float plane_distance, const aabb_t* aabb)
+{
+	// Empty cluster, nothing is visible
+	if (aabb->mins[0] > aabb->maxs[0])
+		return false;
 
 	bool all_culled = true;
 
@@ -1672,71 +1763,245 @@ light_affects_cluster(light_poly_t* light, const aabb_t* aabb)
 	return true;
 }
 
-static void
-collect_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp)
-{
 #define MAX_LIGHTS_PER_CLUSTER 1024
-	int* cluster_lights = Z_Malloc(MAX_LIGHTS_PER_CLUSTER * wm->num_clusters * sizeof(int));
-	int* cluster_light_counts = Z_Mallocz(wm->num_clusters * sizeof(int));
 
-	// Construct an array of visible lights for each cluster.
-	// The array is in `cluster_lights`, with MAX_LIGHTS_PER_CLUSTER stride.
+// Finds clusters affected by lights [first, last). Counts them in the first pass,
+// stores them in the second pass when cluster_offsets are known.
+static void cluster_lights_job(void* arg)
+{
+	load_job_t* job = arg;
+	bsp_mesh_t* wm = job->wm;
+	bsp_t* bsp = job->bsp;
+
+	memset(job->counts, 0, wm->num_clusters * sizeof(int));
 
-	for (int nlight = 0; nlight < wm->num_light_polys; nlight++)
+	for (int nlight = job->first; nlight < job->last; nlight++)
 	{
-		light_poly_t* light = wm->light_polys + nlight;
+		const light_poly_t* light = wm->light_polys + nlight;
 
 		if(light->cluster < 0)
 			continue;
 
+		// same plane for all clusters
+		vec3_t normal;
+		float plane_distance;
+		get_light_plane(light, normal, &plane_distance);
+
 		const byte* pvs = (const byte*)BSP_GetPvs(bsp, light->cluster);
 
 		FOREACH_BIT_BEGIN(pvs, bsp->visrowsize, other_cluster)
-			aabb_t* cluster_aabb = wm->cluster_aabbs + other_cluster;
-			if (light_affects_cluster(light, cluster_aabb))
+			if (light_affects_cluster(normal, plane_distance, wm->cluster_aabbs + other_cluster))
 			{
-				int* num_cluster_lights = cluster_light_counts + other_cluster;
-				if (*num_cluster_lights < MAX_LIGHTS_PER_CLUSTER)
+				if (job->cluster_offsets)
 				{
-					cluster_lights[other_cluster * MAX_LIGHTS_PER_CLUSTER + *num_cluster_lights] = nlight;
-					(*num_cluster_lights)++;
+					// lights of earlier jobs go first, keep the first MAX_LIGHTS_PER_CLUSTER
+					int index = job->offsets[other_cluster] + job->counts[other_cluster];
+					if (index < MAX_LIGHTS_PER_CLUSTER)
+						wm->cluster_lights[job->cluster_offsets[other_cluster] + index] = nlight;
 				}
+				job->counts[other_cluster]++;
 			}
 		FOREACH_BIT_END
 	}
+}
 
-	// Count the total number of cluster <-> light relations to allocate memory
+static void
+compute_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp)
+{
+	load_job_t jobs[MAX_LOAD_JOBS];
+	int num_jobs = split_load_jobs(jobs, wm, bsp, wm->num_light_polys, 1);
+	int* counts = Z_Malloc(num_jobs * 2 * wm->num_clusters * sizeof(int));
 
-	wm->num_cluster_lights = 0;
-	for (int cluster = 0; cluster < wm->num_clusters; cluster++)
+	for (int i = 0; i < num_jobs; i++)
 	{
-		wm->num_cluster_lights += cluster_light_counts[cluster];
+		jobs[i].counts = counts + (i * 2) * wm->num_clusters;
+		jobs[i].offsets = counts + (i * 2 + 1) * wm->num_clusters;
 	}
 
-	wm->cluster_lights = Z_Mallocz(wm->num_cluster_lights * sizeof(int));
-	wm->cluster_light_offsets = Z_Mallocz((wm->num_clusters + 1) * sizeof(int));
+	// Count the number of cluster <-> light relations from each job
 
-	// Com_Printf("Total interactions: %d, culled bbox: %d, culled proj: %d\n", wm->num_cluster_lights, lights_culled_bbox, lights_culled_proj);
+	run_load_jobs(cluster_lights_job, jobs, num_jobs);
 
-	// Compact the previously constructed array into wm->cluster_lights
+	wm->cluster_light_offsets = Z_Mallocz((wm->num_clusters + 1) * sizeof(int));
 
 	int list_offset = 0;
 	for (int cluster = 0; cluster < wm->num_clusters; cluster++)
 	{
-		assert(list_offset >= 0);
+		int count = 0;
+		for (int i = 0; i < num_jobs; i++)
+		{
+			jobs[i].offsets[cluster] = count;
+			count += jobs[i].counts[cluster];
+		}
+
 		wm->cluster_light_offsets[cluster] = list_offset;
-		int count = cluster_light_counts[cluster];
-		memcpy(
-			wm->cluster_lights + list_offset, 
-			cluster_lights + MAX_LIGHTS_PER_CLUSTER * cluster, 
-			count * sizeof(int));
-		list_offset += count;
+		list_offset += min(count, MAX_LIGHTS_PER_CLUSTER);
 	}
 	wm->cluster_light_offsets[wm->num_clusters] = list_offset;
 
-	Z_Free(cluster_lights);
-	Z_Free(cluster_light_counts);
-#undef MAX_LIGHTS_PER_CLUSTER
+	wm->num_cluster_lights = list_offset;
+	wm->cluster_lights = Z_Mallocz(wm->num_cluster_lights * sizeof(int));
+
+	// Store the lights, in the same order as a single pass over all lights would
+
+	for (int i = 0; i < num_jobs; i++)
+		jobs[i].cluster_offsets = wm->cluster_light_offsets;
+
+	run_load_jobs(cluster_lights_job, jobs, num_jobs);
+
+	Z_Free(counts);
+}
+
+// Cluster light lists only depend on light polygons, cluster bounds and PVS,
+// so they are cached in `maps/pvs/<mapname>.lights` under a checksum of those.
+#define CLUSTER_LIGHTS_IDENT    MakeLittleLong('C','L','I','T')
+#define CLUSTER_LIGHTS_VERSION  1
+
+typedef struct {
+	uint32_t ident;
+	uint32_t version;
+	uint32_t bsp_checksum;
+	uint32_t input_checksum;
+	int32_t num_clusters;
+	int32_t num_cluster_lights;
+} cluster_lights_header_t;
+
+static uint32_t
+cluster_lights_checksum(bsp_mesh_t *wm, bsp_t *bsp)
+{
+	uint32_t checksums[3];
+
+	// light polygons contain pointers, so only hash the relevant fields
+	size_t light_size = wm->num_light_polys * 10 * sizeof(float);
+	float* lights = Z_Malloc(light_size + 1);
+	for (int i = 0; i < wm->num_light_polys; i++)
+	{
+		memcpy(lights + i * 10, wm->light_polys[i].positions, 9 * sizeof(float));
+		lights[i * 10 + 9] = (float)wm->light_polys[i].cluster;
+	}
+
+	checksums[0] = Com_BlockChecksum(lights, light_size);
+	checksums[1] = Com_BlockChecksum(wm->cluster_aabbs, wm->num_clusters * sizeof(aabb_t));
+	checksums[2] = Com_BlockChecksum(bsp->pvs_matrix, bsp->visrowsize * bsp->vis->numclusters);
+
+	Z_Free(lights);
+
+	return Com_BlockChecksum(checksums, sizeof(checksums));
+}
+
+static void
+get_cluster_lights_path(const char* map_name, char* path, size_t size)
+{
+	Q_snprintf(path, size, "maps/pvs/%s.lights", map_name);
+}
+
+static bool
+load_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name, uint32_t checksum)
+{
+	char path[MAX_QPATH];
+	cluster_lights_header_t* header;
+	byte* data = NULL;
+
+	get_cluster_lights_path(map_name, path, sizeof(path));
+
+	int len = FS_LoadFile(path, (void**)&data);
+	if (!data)
+		return false;
+
+	header = (cluster_lights_header_t*)data;
+	if (len < (int)sizeof(*header)
+		|| header->ident != CLUSTER_LIGHTS_IDENT
+		|| header->version != CLUSTER_LIGHTS_VERSION
+		|| header->bsp_checksum != bsp->checksum
+		|| header->input_checksum != checksum
+		|| header->num_clusters != wm->num_clusters
+		|| header->num_cluster_lights < 0
+		|| (size_t)header->num_cluster_lights > (size_t)wm->num_clusters * MAX_LIGHTS_PER_CLUSTER
+		|| (size_t)len != sizeof(*header) + ((size_t)wm->num_clusters + 1 + header->num_cluster_lights) * sizeof(int))
+	{
+		FS_FreeFile(data);
+		return false;
+	}
+
+	const int* offsets = (const int*)(header + 1);
+	const int* lights = offsets + wm->num_clusters + 1;
+
+	// don't trust the file too much
+	for (int cluster = 0; cluster < wm->num_clusters; cluster++)
+	{
+		if (offsets[cluster] < 0 || offsets[cluster] > offsets[cluster + 1])
+		{
+			FS_FreeFile(data);
+			return false;
+		}
+	}
+	for (int i = 0; i < header->num_cluster_lights; i++)
+	{
+		if (lights[i] < 0 || lights[i] >= wm->num_light_polys)
+		{
+			FS_FreeFile(data);
+			return false;
+		}
+	}
+	if (offsets[0] != 0 || offsets[wm->num_clusters] != header->num_cluster_lights)
+	{
+		FS_FreeFile(data);
+		return false;
+	}
+
+	wm->num_cluster_lights = header->num_cluster_lights;
+	wm->cluster_light_offsets = Z_Malloc((wm->num_clusters + 1) * sizeof(int));
+	wm->cluster_lights = Z_Mallocz(wm->num_cluster_lights * sizeof(int));
+	memcpy(wm->cluster_light_offsets, offsets, (wm->num_clusters + 1) * sizeof(int));
+	memcpy(wm->cluster_lights, lights, wm->num_cluster_lights * sizeof(int));
+
+	FS_FreeFile(data);
+	return true;
+}
+
+static void
+save_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name, uint32_t checksum)
+{
+	char path[MAX_QPATH];
+	cluster_lights_header_t header = {
+		.ident = CLUSTER_LIGHTS_IDENT,
+		.version = CLUSTER_LIGHTS_VERSION,
+		.bsp_checksum = bsp->checksum,
+		.input_checksum = checksum,
+		.num_clusters = wm->num_clusters,
+		.num_cluster_lights = wm->num_cluster_lights
+	};
+
+	size_t offsets_size = (wm->num_clusters + 1) * sizeof(int);
+	size_t lights_size = wm->num_cluster_lights * sizeof(int);
+	byte* data = Z_Malloc(sizeof(header) + offsets_size + lights_size);
+
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + sizeof(header), wm->cluster_light_offsets, offsets_size);
+	memcpy(data + sizeof(header) + offsets_size, wm->cluster_lights, lights_size);
+
+	get_cluster_lights_path(map_name, path, sizeof(path));
+
+	if (FS_WriteFile(path, data, sizeof(header) + offsets_size + lights_size) < 0)
+		Com_DPrintf("Couldn't save cluster lights to %s\n", path);
+
+	Z_Free(data);
+}
+
+static void
+collect_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
+{
+	// Construct an array of visible lights for each cluster.
+	// The lists are in `cluster_lights`, starting at `cluster_light_offsets`.
+
+	uint32_t checksum = cluster_lights_checksum(wm, bsp);
+
+	if (load_cluster_lights(wm, bsp, map_name, checksum))
+		return;
+
+	compute_cluster_lights(wm, bsp);
+
+	save_cluster_lights(wm, bsp, map_name, checksum);
 }
 
 static tinyobj_attrib_t custom_sky_attrib;
@@ -1975,7 +2240,7 @@ bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
 		model->masked = is_model_masked(wm, model);
 	}
 
-	collect_cluster_lights(wm, bsp);
+	collect_cluster_lights(wm, bsp, map_name);
 
 	compute_sky_visibility(wm, bsp);
 }
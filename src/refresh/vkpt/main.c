@@ -1954,7 +1954,7 @@ static void fill_model_instance(ModelInstance* instance, const entity_t* entity,
 {
 	int cluster = -1;
 	if (bsp_world_model)
-		cluster = BSP_PointLeaf(bsp_world_model->nodes, entity->origin)->cluster;
+		cluster = BSP_GridPointLeaf(bsp_world_model, entity->origin)->cluster;
 	
 	int frame = entity->frame;
 	int oldframe = entity->oldframe;
@@ -2059,7 +2059,7 @@ static void instance_model_lights(int num_light_polys, const light_poly_t* light
 		transform_point(src_light->off_center, transform, dst_light->off_center);
 
 		// Find the cluster based on the center. Maybe it's OK to use the model's cluster, need to test.
-		dst_light->cluster = BSP_PointLeaf(bsp_world_model->nodes, dst_light->off_center)->cluster;
+		dst_light->cluster = BSP_GridPointLeaf(bsp_world_model, dst_light->off_center)->cluster;
 
 		// We really need to map these lights to a cluster
 		if (dst_light->cluster < 0)
@@ -2100,7 +2100,7 @@ static void process_bsp_entity(const entity_t* entity, int* instance_count)
 
 	vec3_t origin;
 	transform_point(model->center, transform, origin);
-	int cluster = BSP_PointLeaf(bsp_world_model->nodes, origin)->cluster;
+	int cluster = BSP_GridPointLeaf(bsp_world_model, origin)->cluster;
 
 	if (cluster < 0)
 	{
@@ -2120,7 +2120,7 @@ static void process_bsp_entity(const entity_t* entity, int* instance_count)
 			vec3_t corner_pt_world;
 			transform_point(corner_pt, transform, corner_pt_world);
 
-			cluster = BSP_PointLeaf(bsp_world_model->nodes, corner_pt_world)->cluster;
+			cluster = BSP_GridPointLeaf(bsp_world_model, corner_pt_world)->cluster;
 
 			if(cluster >= 0)
 			{
@@ -3509,7 +3509,7 @@ void R_RenderFrame_RTX(refdef_t *fd)
 		}
 	}
 
-	mleaf_t* viewleaf = bsp_world_model ? BSP_PointLeaf(bsp_world_model->nodes, fd->vieworg) : NULL;
+	mleaf_t* viewleaf = bsp_world_model ? BSP_GridPointLeaf(bsp_world_model, fd->vieworg) : NULL;
 	
 	bool sun_visible_prev = false;
 	static float prev_adapted_luminance = 0.f;
@@ -1760,6 +1760,14 @@ static const cmdreg_t c_server[] = {
 #endif
     { "gamemap", SV_GameMap_f, SV_Map_c },
     { "dumpents", SV_DumpEnts_f },
+    { "framebench", SV_FrameBench_f },
+    { "packbench", SV_PackBench_f },
+    { "visstats", SV_VisStats_f },
+    { "deltastats", SV_DeltaStats_f },
+    { "deltabench", SV_DeltaBench_f },
+    { "areabench", SV_AreaBench_f },
+    { "tracebench", SV_TraceBench_f },
+    { "mcstats", SV_MulticastStats_f },
     { "setmaster", SV_SetMaster_f },
     { "listmasters", SV_ListMasters_f },
     { "killserver", SV_KillServer_f },
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "server.h"
+#include "common/mdfour.h"
 
 /*
 =============================================================================
@@ -31,6 +32,225 @@ Encode a client frame onto the network channel
 #define Q2PRO_OPTIMIZE(c) \
     ((c)->protocol == PROTOCOL_VERSION_Q2PRO && !(c)->settings[CLS_RECORDING])
 
+/*
+=============================================================================
+
+Delta entity cache
+
+Clients in lockstep delta the same entities from the same states, so
+encoded deltas are remembered for the duration of SV_SendClientMessages
+and copied into the message directly. Each thread has its own cache, so
+no locking is needed.
+
+=============================================================================
+*/
+
+#define DELTA_HASH_SIZE     4096
+#define DELTA_HASH_MASK     (DELTA_HASH_SIZE - 1)
+#define DELTA_MAX_ENTRIES   4096
+#define DELTA_ARENA_SIZE    0x40000
+
+typedef struct {
+    entity_packed_t from;
+    entity_packed_t to;
+    msgEsFlags_t    flags;
+    unsigned        hash;
+    int             next;
+    unsigned        ofs;
+    unsigned        len;
+} delta_entry_t;
+
+typedef struct delta_cache_s {
+    unsigned        generation;
+    unsigned        hits;
+    unsigned        misses;
+    int             num_entries;
+    unsigned        arena_used;
+    int             hash[DELTA_HASH_SIZE];
+    delta_entry_t   entries[DELTA_MAX_ENTRIES];
+    byte            arena[DELTA_ARENA_SIZE];
+} delta_cache_t;
+
+// recorded (from, to, flags) stream for deltabench
+typedef struct {
+    entity_packed_t from;
+    entity_packed_t to;
+    msgEsFlags_t    flags;
+} delta_record_t;
+
+static delta_record_t   *delta_record;
+static int              delta_record_count;
+static int              delta_record_max;
+
+static unsigned delta_hash(const void *data, size_t len, unsigned hash)
+{
+    const byte *p = data;
+    uint32_t v;
+
+    for (; len >= 4; p += 4, len -= 4) {
+        memcpy(&v, p, 4);
+        hash = (hash ^ v) * 0x01000193;
+    }
+    for (; len; p++, len--)
+        hash = (hash ^ *p) * 0x01000193;
+
+    return hash;
+}
+
+static void delta_reset(delta_cache_t *cache)
+{
+    cache->generation = svs.delta_generation;
+    cache->num_entries = 0;
+    cache->arena_used = 0;
+    memset(cache->hash, -1, sizeof(cache->hash));
+}
+
+/*
+=============
+SV_BeginDeltaCache
+
+Invalidates cached deltas from the previous frame and makes sure each
+thread has a cache. Called on the main thread before building frames.
+=============
+*/
+void SV_BeginDeltaCache(void)
+{
+    int i;
+
+    svs.delta_generation++;
+
+    if (!sv_delta_cache->integer) {
+        SV_ShutdownDeltaCache();
+        return;
+    }
+
+    for (i = 0; i <= SV_NumThreads(); i++) {
+        if (!svs.delta_cache[i]) {
+            svs.delta_cache[i] = SV_Malloc(sizeof(delta_cache_t));
+            svs.delta_cache[i]->hits = svs.delta_cache[i]->misses = 0;
+            delta_reset(svs.delta_cache[i]);
+        }
+    }
+}
+
+/*
+=============
+SV_DeltaStats_f
+=============
+*/
+void SV_DeltaStats_f(void)
+{
+    delta_cache_t *cache;
+    unsigned hits = 0, misses = 0, total;
+    int i, caches = 0;
+
+    if (!svs.initialized) {
+        Com_Printf("No server running.\n");
+        return;
+    }
+
+    for (i = 0; i <= MAX_THREADS; i++) {
+        cache = svs.delta_cache[i];
+        if (!cache)
+            continue;
+        if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset")) {
+            cache->hits = cache->misses = 0;
+            continue;
+        }
+        hits += cache->hits;
+        misses += cache->misses;
+        caches++;
+    }
+
+    if (Cmd_Argc() > 1)
+        return;
+
+    total = hits + misses;
+    Com_Printf("Delta cache: %u hits, %u misses (%.1f%% hit rate), %d caches allocated\n",
+               hits, misses, total ? hits * 100.0 / total : 0.0, caches);
+}
+
+void SV_ShutdownDeltaCache(void)
+{
+    int i;
+
+    for (i = 0; i <= MAX_THREADS; i++)
+        Z_Freep((void **)&svs.delta_cache[i]);
+}
+
+/*
+=============
+SV_WriteDeltaEntity
+
+Writes the same data as MSG_WriteDeltaEntity, reusing encoded delta if
+another client on this thread has already sent it this frame.
+=============
+*/
+static void SV_WriteDeltaEntity(const entity_packed_t *from,
+                                const entity_packed_t *to,
+                                msgEsFlags_t          flags)
+{
+    delta_cache_t   *cache;
+    delta_entry_t   *entry;
+    unsigned        hash, start, len;
+    int             i;
+
+    if (q_unlikely(delta_record) && to && delta_record_count < delta_record_max) {
+        delta_record[delta_record_count].from = *from;
+        delta_record[delta_record_count].to = *to;
+        delta_record[delta_record_count].flags = flags;
+        delta_record_count++;
+    }
+
+    // removals are trivial to encode
+    cache = svs.delta_cache[SV_ThreadIndex()];
+    if (!cache || !to) {
+        MSG_WriteDeltaEntity(from, to, flags);
+        return;
+    }
+
+    if (cache->generation != svs.delta_generation)
+        delta_reset(cache);
+
+    hash = delta_hash(from, sizeof(*from), 0x811c9dc5);
+    hash = delta_hash(to, sizeof(*to), hash);
+    hash = delta_hash(&flags, sizeof(flags), hash);
+
+    for (i = cache->hash[hash & DELTA_HASH_MASK]; i != -1; i = entry->next) {
+        entry = &cache->entries[i];
+        if (entry->hash == hash && entry->flags == flags &&
+            !memcmp(&entry->from, from, sizeof(*from)) &&
+            !memcmp(&entry->to, to, sizeof(*to))) {
+            MSG_WriteData(cache->arena + entry->ofs, entry->len);
+            cache->hits++;
+            return;
+        }
+    }
+
+    start = msg_write.cursize;
+    MSG_WriteDeltaEntity(from, to, flags);
+    len = msg_write.cursize - start;
+    cache->misses++;
+
+    if (cache->num_entries == DELTA_MAX_ENTRIES)
+        return;
+    if (cache->arena_used + len > DELTA_ARENA_SIZE)
+        return;
+
+    entry = &cache->entries[cache->num_entries];
+    entry->from = *from;
+    entry->to = *to;
+    entry->flags = flags;
+    entry->hash = hash;
+    entry->ofs = cache->arena_used;
+    entry->len = len;
+    entry->next = cache->hash[hash & DELTA_HASH_MASK];
+    memcpy(cache->arena + entry->ofs, msg_write.data + start, len);
+
+    cache->hash[hash & DELTA_HASH_MASK] = cache->num_entries++;
+    cache->arena_used += len;
+}
+
 /*
 =============
 SV_EmitPacketEntities
@@ -58,7 +278,8 @@ static void SV_EmitPacketEntities(client_t         *client,
     oldent = newent = NULL;
     while (newindex < to->num_entities || oldindex < from_num_entities) {
         if (msg_write.cursize + MAX_PACKETENTITY_BYTES > msg_write.maxsize) {
-            Com_WPrintf("%s: frame got too large, aborting.\n", __func__);
+            // may be running on worker thread, warning is printed later
+            client->frame_truncated = true;
             break;
         }
 
@@ -96,7 +317,7 @@ static void SV_EmitPacketEntities(client_t         *client,
             if (Q2PRO_SHORTANGLES(client, newnum)) {
                 flags |= MSG_ES_SHORTANGLES;
             }
-            MSG_WriteDeltaEntity(oldent, newent, flags);
+            SV_WriteDeltaEntity(oldent, newent, flags);
             oldindex++;
             newindex++;
             continue;
@@ -119,14 +340,14 @@ static void SV_EmitPacketEntities(client_t         *client,
             if (Q2PRO_SHORTANGLES(client, newnum)) {
                 flags |= MSG_ES_SHORTANGLES;
             }
-            MSG_WriteDeltaEntity(oldent, newent, flags);
+            SV_WriteDeltaEntity(oldent, newent, flags);
             newindex++;
             continue;
         }
 
         if (newnum > oldnum) {
             // the old entity isn't present in the new message
-            MSG_WriteDeltaEntity(oldent, NULL, MSG_ES_FORCE);
+            SV_WriteDeltaEntity(oldent, NULL, MSG_ES_FORCE);
             oldindex++;
             continue;
         }
@@ -185,7 +406,7 @@ void SV_WriteFrameToClient_Default(client_t *client)
     frame = &client->frames[client->framenum & UPDATE_MASK];
 
     // this is the frame we are delta'ing from
-    oldframe = get_last_frame(client);
+    oldframe = client->deltaframe;
     if (oldframe) {
         oldstate = &oldframe->ps;
         lastframe = client->lastframe;
@@ -233,7 +454,7 @@ void SV_WriteFrameToClient_Enhanced(client_t *client)
     frame = &client->frames[client->framenum & UPDATE_MASK];
 
     // this is the frame we are delta'ing from
-    oldframe = get_last_frame(client);
+    oldframe = client->deltaframe;
 
     if (oldframe) 
     {
@@ -397,12 +618,12 @@ static void fix_old_origin(client_t *client, entity_packed_t *state, edict_t *en
 }
 #endif
 
-static bool SV_EntityVisible(client_t *client, edict_t *ent, byte *mask)
+static bool SV_EntityVisible(cm_t *cm, edict_t *ent, byte *mask)
 {
     if(ent->num_clusters == -1)
     {
         // too many leafs for individual check, go by headnode
-        return CM_HeadnodeVisible(CM_NodeNum(client->cm, ent->headnode), mask);
+        return CM_HeadnodeVisible(CM_NodeNum(cm, ent->headnode), mask);
     }
 
     // check individual leafs
@@ -428,38 +649,48 @@ static bool SV_EntityAttenuatedAway(vec3_t org, edict_t *ent)
     return (dist - SOUND_FULLVOLUME) * dist_mult > 1.0f;
 }
 
+// entity filters that don't depend on the client
+static bool SV_EntityRelevant(edict_t *ent)
+{
+    // ignore entities not in use
+    if (!ent->inuse && (g_features->integer & GMF_PROPERINUSE)) 
+    {
+        return false;
+    }
+
+    // ignore ents without visible models
+    if(ent->svflags & SVF_NOCLIENT)
+    {
+        return false;
+    }
+
+    // ignore ents without visible models unless they have an effect
+    if (!HAS_EFFECTS(ent)) 
+    {
+        return false;
+    }
+
+    return true;
+}
+
 /*
 =============
-SV_BuildClientFrame
+SV_BeginClientFrame
 
-Decides which entities are going to be visible to the client, and
-copies off the playerstat and areabits.
+Sets up the frame header and clientNum. Returns false if client is not in
+game yet. Not thread safe.
 =============
 */
-void SV_BuildClientFrame(client_t *client)
+static bool SV_BeginClientFrame(client_t *client)
 {
-    int         e;
-    vec3_t      org;
-    edict_t     *ent;
-    edict_t     *clent;
+    edict_t         *clent;
     client_frame_t  *frame;
-    entity_packed_t *state;
-    player_state_t  *ps;
-	entity_state_t  es;
-    int         clientarea, clientcluster;
-    mleaf_t     *leaf;
-    byte        clientphs[VIS_MAX_BYTES];
-    byte        clientpvs[VIS_MAX_BYTES];
-    bool    ent_visible;
-    int cull_nonvisible_entities = Cvar_Get("sv_cull_nonvisible_entities", "1", CVAR_CHEAT)->integer;
-    bool        need_clientnum_fix;
-    int         max_packet_entities;
 
     clent = client->edict;
 
     if(!clent->client)
     {
-        return;        // not in game yet
+        return false;        // not in game yet
     }
 
     // this is the frame we are creating
@@ -470,26 +701,6 @@ void SV_BuildClientFrame(client_t *client)
 
     client->frames_sent++;
 
-    // find the client's PVS
-    ps = &clent->client->ps;
-    VectorMA(ps->viewoffset, 0.125f, ps->pmove.origin, org);
-
-    leaf = CM_PointLeaf(client->cm, org);
-    clientarea = leaf->area;
-    clientcluster = leaf->cluster;
-
-    // calculate the visible areas
-    frame->areabytes = CM_WriteAreaBits(client->cm, frame->areabits, clientarea);
-
-    if (!frame->areabytes && client->protocol != PROTOCOL_VERSION_Q2PRO) 
-    {
-        frame->areabits[0] = 255;
-        frame->areabytes = 1;
-    }
-
-    // grab the current player_state_t
-    MSG_PackPlayer(&frame->ps, ps);
-
     // grab the current clientNum
     if (g_features->integer & GMF_CLIENTNUM) 
     {
@@ -506,133 +717,465 @@ void SV_BuildClientFrame(client_t *client)
         frame->clientNum = client->number;
     }
 
-    // fix clientNum if out of range for older version of Q2PRO protocol
-    need_clientnum_fix = client->protocol == PROTOCOL_VERSION_Q2PRO
+    return true;
+}
+
+// fix clientNum if out of range for older version of Q2PRO protocol
+static bool SV_NeedClientNumFix(client_t *client, client_frame_t *frame)
+{
+    return client->protocol == PROTOCOL_VERSION_Q2PRO
         && client->version < PROTOCOL_VERSION_Q2PRO_CLIENTNUM_SHORT
         && frame->clientNum >= CLIENTNUM_NONE;
+}
 
-    // limit maximum number of entities in client frame
-    max_packet_entities =
-        sv_max_packet_entities->integer > 0 ? sv_max_packet_entities->integer :
-        client->csr->extended ? MAX_PACKET_ENTITIES : MAX_PACKET_ENTITIES_OLD;
+/*
+=============================================================================
 
-	if (clientcluster >= 0)
-	{
-		CM_FatPVS(client->cm, clientpvs, org, DVIS_PVS2);
-		client->last_valid_cluster = clientcluster;
-	}
-	else
-	{
-		BSP_ClusterVis(client->cm->cache, clientpvs, client->last_valid_cluster, DVIS_PVS2);
-	}
+Visibility cache
 
-    BSP_ClusterVis(client->cm->cache, clientphs, clientcluster, DVIS_PHS);
+Clients standing in the same spot share fat PVS, PHS, area bits and the
+list of potentially visible entities. Entries are valid until the end of
+SV_SendClientMessages, or until area portals change or game DLL is
+called into.
 
-    // build up the list of visible entities
-    frame->num_entities = 0;
-    frame->first_entity = svs.next_entity;
+=============================================================================
+*/
 
-    for (e = 1; e < client->ge->num_edicts; e++) 
-    {
-        ent = EDICT_NUM2(client->ge, e);
+void SV_InvalidateVisCache(void)
+{
+    svs.vis_generation++;
+}
 
-        // ignore entities not in use
-        if (!ent->inuse && (g_features->integer & GMF_PROPERINUSE)) 
-        {
+/*
+=============
+SV_VisStats_f
+=============
+*/
+void SV_VisStats_f(void)
+{
+    unsigned total = svs.vis_hits + svs.vis_misses;
+    int i, entries = 0;
+
+    if (!svs.vis_cache) {
+        Com_Printf("No server running.\n");
+        return;
+    }
+
+    if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset")) {
+        svs.vis_hits = svs.vis_misses = 0;
+        return;
+    }
+
+    for (i = 0; i < sv_maxclients->integer; i++)
+        if (svs.vis_cache[i])
+            entries++;
+
+    Com_Printf("Visibility cache: %u hits, %u misses (%.1f%% hit rate), %d entries allocated\n",
+               svs.vis_hits, svs.vis_misses, total ? svs.vis_hits * 100.0 / total : 0.0, entries);
+}
+
+void SV_ShutdownVisCache(void)
+{
+    int i;
+
+    if (!svs.vis_cache)
+        return;
+
+    for (i = 0; i < sv_maxclients->integer; i++)
+        Z_Free(svs.vis_cache[i]);
+    Z_Freep((void **)&svs.vis_cache);
+}
+
+static void SV_ClientViewOrigin(client_t *client, vec3_t org)
+{
+    player_state_t *ps = &client->edict->client->ps;
+
+    VectorMA(ps->viewoffset, 0.125f, ps->pmove.origin, org);
+}
+
+/*
+=============
+SV_FindVisCache
+
+Returns cache entry for the client view position. If there is no entry yet,
+allocates a new one and sets *miss, and the caller must build it with
+SV_BuildVisCache. Not thread safe.
+=============
+*/
+static vis_cache_t *SV_FindVisCache(client_t *client, bool *miss)
+{
+    vis_cache_t *vis, **slot;
+    vec3_t      org;
+    mleaf_t     *leaf;
+    int         clusters[MAX_FAT_CLUSTERS];
+    int         numclusters, last_valid_cluster;
+    int         i;
+
+    SV_ClientViewOrigin(client, org);
+
+    leaf = CM_PointLeaf(client->cm, org);
+
+    if (leaf->cluster >= 0) {
+        // clusters are sorted, so that lists can be compared
+        numclusters = CM_FatClusters(client->cm, org, clusters);
+        last_valid_cluster = -1;
+        client->last_valid_cluster = leaf->cluster;
+    } else {
+        numclusters = 0;
+        last_valid_cluster = client->last_valid_cluster;
+    }
+
+    slot = NULL;
+    for (i = 0; i < sv_maxclients->integer; i++) {
+        vis = svs.vis_cache[i];
+        if (!vis || vis->generation != svs.vis_generation) {
+            if (!slot)
+                slot = &svs.vis_cache[i];
             continue;
         }
+        if (vis->cm != client->cm || vis->ge != client->ge)
+            continue;
+        if (vis->area != leaf->area || vis->cluster != leaf->cluster)
+            continue;
+        if (vis->last_valid_cluster != last_valid_cluster)
+            continue;
+        if (vis->numclusters != numclusters)
+            continue;
+        if (memcmp(vis->clusters, clusters, sizeof(clusters[0]) * numclusters))
+            continue;
+        svs.vis_hits++;
+        *miss = false;
+        return vis;
+    }
+
+    // each client uses at most one entry, so there is always a free slot
+    Q_assert(slot);
+    if (!*slot)
+        *slot = SV_Malloc(sizeof(**slot));
+
+    vis = *slot;
+    vis->generation = svs.vis_generation;
+    vis->cm = client->cm;
+    vis->ge = client->ge;
+    vis->area = leaf->area;
+    vis->cluster = leaf->cluster;
+    vis->last_valid_cluster = last_valid_cluster;
+    vis->numclusters = numclusters;
+    memcpy(vis->clusters, clusters, sizeof(clusters[0]) * numclusters);
+    vis->num_entities = 0;
+
+    svs.vis_misses++;
+    *miss = true;
+    return vis;
+}
+
+/*
+=============
+SV_BuildVisCache
+
+Calculates visibility for the cache entry and builds the list of entities
+that can potentially be visible from it. Entities that fail area and
+PVS/PHS checks are dropped unless some client may still see them.
+Thread safe.
+=============
+*/
+static void SV_BuildVisCache(vis_cache_t *vis)
+{
+    cm_t        *cm = vis->cm;
+    edict_t     *ent;
+    int         e, flags;
+    int         cull_nonvisible_entities = sv_cull_nonvisible_entities->integer;
+
+    // calculate the visible areas
+    vis->areabytes = CM_WriteAreaBits(cm, vis->areabits, vis->area);
+
+    if (vis->cluster >= 0)
+    {
+        CM_ClustersVis(cm, vis->pvs, vis->clusters, vis->numclusters, DVIS_PVS2);
+    }
+    else
+    {
+        BSP_ClusterVis(cm->cache, vis->pvs, vis->last_valid_cluster, DVIS_PVS2);
+    }
+
+    BSP_ClusterVis(cm->cache, vis->phs, vis->cluster, DVIS_PHS);
 
-        // ignore ents without visible models
-        if(ent->svflags & SVF_NOCLIENT)
+    vis->num_entities = 0;
+
+    for (e = 1; e < vis->ge->num_edicts; e++)
+    {
+        ent = EDICT_NUM2(vis->ge, e);
+
+        if (!SV_EntityRelevant(ent))
         {
             continue;
         }
 
-        // ignore ents without visible models unless they have an effect
-        if (!HAS_EFFECTS(ent)) 
+        flags = 0;
+
+        // check area, doors can legally straddle two areas
+        if (vis->cluster < 0 || CM_AreasConnected(cm, vis->area, ent->areanum)
+            || CM_AreasConnected(cm, vis->area, ent->areanum2))
         {
-            continue;
+            flags |= VIS_AREA;
         }
 
-        if ((ent->s.effects & EF_GIB) && client->settings[CLS_NOGIBS]) 
+        if (SV_EntityVisible(cm, ent, vis->pvs))
         {
-            continue;
+            flags |= VIS_PVS;
         }
 
-        ent_visible = true;
-
-        // ignore if not touching a PV leaf
-        if (ent != clent && !(client->csr->extended && ent->svflags & SVF_NOCULL)) 
+        if (SV_EntityVisible(cm, ent, vis->phs))
         {
-            // check area
-			if (clientcluster >= 0 && !CM_AreasConnected(client->cm, clientarea, ent->areanum)) 
-            {
-                // doors can legally straddle two areas, so
-                // we may need to check another one
-                if (!CM_AreasConnected(client->cm, clientarea, ent->areanum2)) 
-                {
-                    ent_visible = false;        // blocked by a door
-                }
-            }
-
-            // beams just check one point for PHS
-            // remaster uses different sound culling rules
-            bool beam_cull = ent->s.renderfx & RF_BEAM;
-            bool sound_cull = client->csr->extended && ent->s.sound;
+            flags |= VIS_PHS;
+        }
 
-            if (beam_cull || cull_nonvisible_entities) 
+        // keep everything that may pass per-client filters
+        if (!ent->client && !(ent->svflags & SVF_NOCULL)
+            && !(sv_novis->integer && ent->s.modelindex))
+        {
+            if (!(flags & VIS_AREA))
             {
-                if (!SV_EntityVisible(client, ent, (beam_cull || sound_cull) ? clientphs : clientpvs))
-                    ent_visible = false;       // not visible
+                continue;
             }
 
-            // don't send sounds if they will be attenuated away
-            if (sound_cull) 
-            {
-                if (SV_EntityAttenuatedAway(org, ent)) 
-                {
-                    if(!ent->s.modelindex)
-                    {
-                        ent_visible = false;
-                    }
-                    
-                    if(ent_visible && !beam_cull && !SV_EntityVisible(client, ent, clientpvs))
-                    {
-                        ent_visible = false;
-                    }
-                }
-            } 
-            else if (!ent->s.modelindex) 
+            if (cull_nonvisible_entities && !(flags & (VIS_PVS | VIS_PHS)))
             {
-                if(Distance(org, ent->s.origin) > 400)
-                {
-                    ent_visible = false;
-                }
+                continue;
             }
         }
 
-        if(!ent_visible && (!sv_novis->integer || !ent->s.modelindex))
-        {
-            continue;
-        }
-        
-		if (ent->s.number != e) 
-        {
-			Com_WPrintf("%s: fixing ent->s.number: %d to %d\n", __func__, ent->s.number, e);
-			ent->s.number = e;
-		}
+        vis->entities[vis->num_entities].number = e;
+        vis->entities[vis->num_entities].flags = flags;
+        vis->num_entities++;
+    }
+}
 
-		memcpy(&es, &ent->s, sizeof(entity_state_t));
+/*
+=============
+SV_CullClientFrame
+
+Decides which entities are going to be visible to the client, and
+copies off the playerstat and areabits. Fills in the list of visible
+entity numbers and returns the number of entities. Thread safe.
+=============
+*/
+static int SV_CullClientFrame(client_t *client, const vis_cache_t *vis, uint16_t *entities)
+{
+    int         i, e, flags;
+    vec3_t      org;
+    edict_t     *ent;
+    edict_t     *clent;
+    client_frame_t  *frame;
+    bool    ent_visible;
+    int cull_nonvisible_entities = sv_cull_nonvisible_entities->integer;
+    int         max_packet_entities;
+    int         num_entities;
+
+    clent = client->edict;
+
+    // this is the frame we are creating
+    frame = &client->frames[client->framenum & UPDATE_MASK];
+
+    SV_ClientViewOrigin(client, org);
+
+    // copy the visible areas
+    frame->areabytes = vis->areabytes;
+    memcpy(frame->areabits, vis->areabits, vis->areabytes);
+
+    if (!frame->areabytes && client->protocol != PROTOCOL_VERSION_Q2PRO) 
+    {
+        frame->areabits[0] = 255;
+        frame->areabytes = 1;
+    }
+
+    // grab the current player_state_t
+    MSG_PackPlayer(&frame->ps, &clent->client->ps);
+
+    // limit maximum number of entities in client frame
+    max_packet_entities =
+        sv_max_packet_entities->integer > 0 ? sv_max_packet_entities->integer :
+        client->csr->extended ? MAX_PACKET_ENTITIES : MAX_PACKET_ENTITIES_OLD;
+    max_packet_entities = min(max_packet_entities, MAX_PACKET_ENTITIES);
+
+    // build up the list of visible entities
+    num_entities = 0;
+
+    for (i = 0; i < vis->num_entities; i++) 
+    {
+        e = vis->entities[i].number;
+        flags = vis->entities[i].flags;
+        ent = EDICT_NUM2(client->ge, e);
+
+        if ((ent->s.effects & EF_GIB) && client->settings[CLS_NOGIBS]) 
+        {
+            continue;
+        }
+
+        ent_visible = true;
+
+        // ignore if not touching a PV leaf
+        if (ent != clent && !(client->csr->extended && ent->svflags & SVF_NOCULL)) 
+        {
+            // check area
+            if (!(flags & VIS_AREA)) 
+            {
+                ent_visible = false;        // blocked by a door
+            }
+
+            // beams just check one point for PHS
+            // remaster uses different sound culling rules
+            bool beam_cull = ent->s.renderfx & RF_BEAM;
+            bool sound_cull = client->csr->extended && ent->s.sound;
+
+            if (beam_cull || cull_nonvisible_entities) 
+            {
+                if (!(flags & ((beam_cull || sound_cull) ? VIS_PHS : VIS_PVS)))
+                    ent_visible = false;       // not visible
+            }
+
+            // don't send sounds if they will be attenuated away
+            if (sound_cull) 
+            {
+                if (SV_EntityAttenuatedAway(org, ent)) 
+                {
+                    if(!ent->s.modelindex)
+                    {
+                        ent_visible = false;
+                    }
+                    
+                    if(ent_visible && !beam_cull && !(flags & VIS_PVS))
+                    {
+                        ent_visible = false;
+                    }
+                }
+            } 
+            else if (!ent->s.modelindex) 
+            {
+                if(Distance(org, ent->s.origin) > 400)
+                {
+                    ent_visible = false;
+                }
+            }
+        }
 
-		if (!ent_visible) 
+        if(!ent_visible && (!sv_novis->integer || !ent->s.modelindex))
+        {
+            continue;
+        }
+
+        entities[num_entities] = e;
+
+        if (++num_entities == max_packet_entities) 
+        {
+            break;
+        }
+    }
+
+    return num_entities;
+}
+
+/*
+=============
+SV_PackEntities
+
+Packs states of all entities that may be sent to clients once per server
+frame. Client frames copy them and apply per-client changes on top.
+Not thread safe.
+=============
+*/
+static bool pack_shared = true;    // can be disabled by packbench
+
+static void SV_PackEntities(void)
+{
+    edict_t     *ent;
+    int         e;
+
+    for (e = 1; e < ge->num_edicts; e++)
+    {
+        ent = EDICT_NUM(e);
+
+        if (!SV_EntityRelevant(ent))
+        {
+            continue;
+        }
+
+        if (ent->s.number != e) 
+        {
+            Com_WPrintf("%s: fixing ent->s.number: %d to %d\n", __func__, ent->s.number, e);
+            ent->s.number = e;
+        }
+
+        MSG_PackEntity(&sv.entities[e].packed, &ent->s, ENT_EXTENSION(&svs.csr, ent));
+    }
+
+    sv.entities_packed = true;
+}
+
+/*
+=============
+SV_AllocClientFrame
+
+Reserves space for frame entities in the circular client_entities array
+and picks the frame to delta from. Frames must be allocated in the same
+order as they are written. Not thread safe.
+=============
+*/
+static void SV_AllocClientFrame(client_t *client, int num_entities)
+{
+    client_frame_t  *frame;
+
+    frame = &client->frames[client->framenum & UPDATE_MASK];
+    frame->num_entities = num_entities;
+    frame->first_entity = svs.next_entity;
+
+    svs.next_entity += num_entities;
+}
+
+/*
+=============
+SV_PackClientFrame
+
+Copies entity states into the circular client_entities array.
+Thread safe if entity numbers have been fixed up before.
+=============
+*/
+static void SV_PackClientFrame(client_t *client, const uint16_t *entities)
+{
+    int         i, e;
+    edict_t     *ent;
+    edict_t     *clent;
+    client_frame_t  *frame;
+    entity_packed_t *state;
+    bool        need_clientnum_fix;
+    bool        shared;
+
+    clent = client->edict;
+
+    frame = &client->frames[client->framenum & UPDATE_MASK];
+
+    need_clientnum_fix = SV_NeedClientNumFix(client, frame);
+
+    // MVD clients have their own entities
+    shared = pack_shared && sv.entities_packed && client->ge == ge && client->csr == &svs.csr;
+
+    for (i = 0; i < frame->num_entities; i++)
+    {
+        e = entities[i];
+        ent = EDICT_NUM2(client->ge, e);
+
+		if (ent->s.number != e) 
         {
-			// if the entity is invisible, kill its sound
-			es.sound = 0;
+			Com_WPrintf("%s: fixing ent->s.number: %d to %d\n", __func__, ent->s.number, e);
+			ent->s.number = e;
 		}
 
         // add it to the circular client_entities array
-        state = &svs.entities[svs.next_entity % svs.num_entities];
-        MSG_PackEntity(state, &ent->s, ENT_EXTENSION(client->csr, ent));
+        state = &svs.entities[(frame->first_entity + i) % svs.num_entities];
+        if (shared)
+            *state = sv.entities[e].packed;
+        else
+            MSG_PackEntity(state, &ent->s, ENT_EXTENSION(client->csr, ent));
 
 #if USE_FPS
         // fix old entity origins for clients not running at
@@ -675,18 +1218,543 @@ void SV_BuildClientFrame(client_t *client)
         {
             state->solid = sv.entities[e].solid32;
         }
+    }
 
-        svs.next_entity++;
+    if(need_clientnum_fix)
+    {
+        frame->clientNum = client->slot;
+    }
+}
+
+/*
+=============
+SV_BuildClientFrame
 
-        if (++frame->num_entities == max_packet_entities) 
+Builds the frame for a single client on the main thread.
+=============
+*/
+void SV_BuildClientFrame(client_t *client)
+{
+    static uint16_t entities[MAX_PACKET_ENTITIES];
+    int num_entities;
+    vis_cache_t *vis;
+    bool miss;
+
+    if (SV_BeginClientFrame(client))
+    {
+        vis = SV_FindVisCache(client, &miss);
+        if (miss)
+            SV_BuildVisCache(vis);
+        num_entities = SV_CullClientFrame(client, vis, entities);
+        SV_AllocClientFrame(client, num_entities);
+        if (!sv.entities_packed && pack_shared)
+            SV_PackEntities();
+        SV_PackClientFrame(client, entities);
+    }
+
+    client->deltaframe = get_last_frame(client);
+}
+
+/*
+=============================================================================
+
+Build client frames on worker threads
+
+=============================================================================
+*/
+
+static void SV_BuildVisCache_Job(void *arg)
+{
+    SV_BuildVisCache(arg);
+}
+
+static void SV_CullClientFrame_Job(void *arg)
+{
+    client_t *client = arg;
+    frame_work_t *work = client->frame_work;
+
+    if (work->ingame)
+        work->num_entities = SV_CullClientFrame(client, work->vis, work->entities);
+}
+
+static void SV_WriteClientFrame_Job(void *arg)
+{
+    client_t *client = arg;
+    frame_work_t *work = client->frame_work;
+    sizebuf_t saved = msg_write;
+
+    if (work->ingame)
+        SV_PackClientFrame(client, work->entities);
+
+    // encode the frame into client's own buffer
+    SZ_TagInit(&msg_write, work->data, sizeof(work->data), "frame_work");
+    MSG_BeginWriting();
+    client->WriteFrame(client);
+    work->cursize = msg_write.cursize;
+    work->ready = true;
+
+    msg_write = saved;
+}
+
+static void SV_FixEntityNumbers(const game_export_t *game)
+{
+    edict_t     *ent;
+    int         e;
+
+    for (e = 1; e < game->num_edicts; e++)
+    {
+        ent = EDICT_NUM2(game, e);
+        if (ent->s.number != e && SV_EntityRelevant(ent))
         {
-            break;
+            Com_WPrintf("%s: fixing ent->s.number: %d to %d\n", __func__, ent->s.number, e);
+            ent->s.number = e;
         }
     }
+}
 
-    if(need_clientnum_fix)
+/*
+=============
+SV_BuildClientFrames
+
+Builds and encodes frames for the given clients using worker threads.
+Encoded frames are picked up by WriteDatagram. Output is identical to
+calling SV_BuildClientFrame for each client in order, given that clients
+are in the same order as in the client list.
+=============
+*/
+void SV_BuildClientFrames(client_t **clients, int count)
+{
+    static void *misses[MAX_CLIENTS];
+    client_t    *client;
+    int         i, j, nummisses;
+    bool        miss;
+
+    // pack entity states and fix up entity numbers now
+    // so that workers won't have to
+    if (!sv.entities_packed && pack_shared)
+        SV_PackEntities();
+
+    for (i = 0; i < count; i++)
     {
-        frame->clientNum = client->slot;
+        if (clients[i]->ge == ge && sv.entities_packed)
+            continue;
+        for (j = 0; j < i; j++)
+        {
+            if (clients[j]->ge == clients[i]->ge)
+                break;
+        }
+        if (j == i)
+            SV_FixEntityNumbers(clients[i]->ge);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        client = clients[i];
+        if (!client->frame_work)
+            client->frame_work = SV_Malloc(sizeof(*client->frame_work));
+        client->frame_work->ingame = SV_BeginClientFrame(client);
+        client->frame_work->ready = false;
+    }
+
+    // find visibility cache entries, building missing ones in parallel
+    nummisses = 0;
+    for (i = 0; i < count; i++)
+    {
+        client = clients[i];
+        if (client->frame_work->ingame)
+        {
+            client->frame_work->vis = SV_FindVisCache(client, &miss);
+            if (miss)
+                misses[nummisses++] = client->frame_work->vis;
+        }
     }
+
+    SV_RunJobs(SV_BuildVisCache_Job, misses, nummisses);
+
+    SV_RunJobs(SV_CullClientFrame_Job, (void **)clients, count);
+
+    for (i = 0; i < count; i++)
+    {
+        client = clients[i];
+        if (client->frame_work->ingame)
+            SV_AllocClientFrame(client, client->frame_work->num_entities);
+        client->deltaframe = get_last_frame(client);
+    }
+
+    SV_RunJobs(SV_WriteClientFrame_Job, (void **)clients, count);
 }
 
+// frame building benchmark
+static client_t **bench_clients;
+static client_t *bench_saved;
+static uint32_t *bench_sums;
+
+static void bench_save(int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        bench_saved[i] = *bench_clients[i];
+}
+
+static void bench_restore(int count, unsigned next_entity)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        frame_work_t *work = bench_clients[i]->frame_work;
+        *bench_clients[i] = bench_saved[i];
+        bench_clients[i]->frame_work = work;
+        if (work)
+            work->ready = false;
+    }
+    svs.next_entity = next_entity;
+    SV_InvalidateVisCache();
+    SV_BeginDeltaCache();
+}
+
+static uint64_t bench_serial(int count, bool verify)
+{
+    uint64_t start = Sys_Microseconds();
+    int i;
+
+    for (i = 0; i < count; i++) {
+        client_t *client = bench_clients[i];
+        SV_BuildClientFrame(client);
+        MSG_BeginWriting();
+        client->WriteFrame(client);
+        if (verify)
+            bench_sums[i] = Com_BlockChecksum(msg_write.data, msg_write.cursize);
+    }
+    SZ_Clear(&msg_write);
+
+    return Sys_Microseconds() - start;
+}
+
+static uint64_t bench_parallel(int count, int *mismatch)
+{
+    uint64_t start = Sys_Microseconds(), time;
+    int i;
+
+    SV_BuildClientFrames(bench_clients, count);
+    time = Sys_Microseconds() - start;
+
+    for (i = 0; mismatch && i < count; i++) {
+        frame_work_t *work = bench_clients[i]->frame_work;
+        if (Com_BlockChecksum(work->data, work->cursize) != bench_sums[i])
+            (*mismatch)++;
+    }
+
+    return time;
+}
+
+/*
+=============
+SV_FrameBench_f
+
+Measures time needed to build and encode frames for increasing number of
+active clients, serially and using worker threads, and checks that both
+methods produce identical output. Server state is restored after each run.
+=============
+*/
+void SV_FrameBench_f(void)
+{
+    client_t    *client;
+    unsigned    next_entity, vis_hits, vis_misses;
+    uint64_t    serial, parallel;
+    int         i, n, total, iterations, mismatch;
+
+    if (!svs.initialized || sv.state != ss_game) {
+        Com_Printf("No server running.\n");
+        return;
+    }
+
+    if (!SV_NumThreads()) {
+        Com_Printf("Worker threads are disabled, set sv_threads first.\n");
+        return;
+    }
+
+    iterations = Cmd_Argc() > 1 ? Q_clip(atoi(Cmd_Argv(1)), 1, 10000) : 100;
+
+    bench_clients = SV_Malloc(sizeof(bench_clients[0]) * sv_maxclients->integer);
+    bench_saved = SV_Malloc(sizeof(bench_saved[0]) * sv_maxclients->integer);
+    bench_sums = SV_Malloc(sizeof(bench_sums[0]) * sv_maxclients->integer);
+
+    total = 0;
+    FOR_EACH_CLIENT(client) {
+        if (client->state == cs_spawned && client->edict->client)
+            bench_clients[total++] = client;
+    }
+
+    if (!total) {
+        Com_Printf("No active clients.\n");
+        goto done;
+    }
+
+    next_entity = svs.next_entity;
+    vis_hits = svs.vis_hits;
+    vis_misses = svs.vis_misses;
+    bench_save(total);
+    SV_InvalidateVisCache();
+
+    Com_Printf("%d threads, %d iterations\n", SV_NumThreads() + 1, iterations);
+    Com_Printf("clients   serial   parallel  speedup\n"
+               "------- --------- --------- -------\n");
+
+    for (n = 1; ; n = min(n * 2, total)) {
+        mismatch = 0;
+        serial = parallel = 0;
+
+        for (i = 0; i < iterations; i++) {
+            serial += bench_serial(n, true);
+            bench_restore(n, next_entity);
+            parallel += bench_parallel(n, &mismatch);
+            bench_restore(n, next_entity);
+        }
+
+        Com_Printf("%7d %7.1fus %7.1fus %6.2fx%s\n", n,
+                   (double)serial / iterations, (double)parallel / iterations,
+                   parallel ? (double)serial / parallel : 0.0,
+                   mismatch ? " MISMATCH" : "");
+
+        if (n == total)
+            break;
+    }
+
+    svs.vis_hits = vis_hits;
+    svs.vis_misses = vis_misses;
+
+done:
+    Z_Freep((void **)&bench_clients);
+    Z_Freep((void **)&bench_saved);
+    Z_Freep((void **)&bench_sums);
+}
+
+// runs one tick worth of frame building for virtual clients
+static uint64_t packbench_run(client_t *clones, int count, int *packed)
+{
+    uint64_t start = Sys_Microseconds();
+    int i;
+
+    SV_InvalidateVisCache();
+    sv.entities_packed = false;
+    svs.next_entity = 0;
+
+    for (i = 0; i < count; i++) {
+        SV_BuildClientFrame(&clones[i]);
+        *packed += clones[i].frames[clones[i].framenum & UPDATE_MASK].num_entities;
+    }
+
+    return Sys_Microseconds() - start;
+}
+
+/*
+=============
+SV_PackBench_f
+
+Compares per-client entity packing with shared per-frame packing for 32, 64
+and 128 virtual clients cloned from active ones. Frames are built into a
+temporary entity ring, so real client state is left intact.
+=============
+*/
+void SV_PackBench_f(void)
+{
+    static const int counts[] = { 32, 64, 128 };
+    client_t    *client, *clones;
+    client_t    *active[MAX_CLIENTS];
+    entity_packed_t *entities;
+    unsigned    num_entities, next_entity, vis_hits, vis_misses;
+    uint64_t    time[2];
+    size_t      ring, table;
+    int         i, j, k, n, total, iterations, relevant, packed[2];
+
+    if (!svs.initialized || sv.state != ss_game) {
+        Com_Printf("No server running.\n");
+        return;
+    }
+
+    iterations = Cmd_Argc() > 1 ? Q_clip(atoi(Cmd_Argv(1)), 1, 10000) : 100;
+
+    total = 0;
+    FOR_EACH_CLIENT(client) {
+        if (client->state == cs_spawned && client->edict->client && client->ge == ge)
+            active[total++] = client;
+    }
+
+    if (!total) {
+        Com_Printf("No active clients.\n");
+        return;
+    }
+
+    relevant = 0;
+    for (i = 1; i < ge->num_edicts; i++)
+        if (SV_EntityRelevant(EDICT_NUM(i)))
+            relevant++;
+
+    n = counts[q_countof(counts) - 1];
+    clones = SV_Malloc(sizeof(clones[0]) * n);
+    for (i = 0; i < n; i++) {
+        clones[i] = *active[i % total];
+        clones[i].frame_work = NULL;
+    }
+
+    // swap in temporary ring large enough for one frame of every clone
+    entities = svs.entities;
+    num_entities = svs.num_entities;
+    next_entity = svs.next_entity;
+    vis_hits = svs.vis_hits;
+    vis_misses = svs.vis_misses;
+    svs.num_entities = n * MAX_PACKET_ENTITIES;
+    svs.entities = SV_Malloc(sizeof(svs.entities[0]) * svs.num_entities);
+
+    Com_Printf("%d entities, %d iterations, clients cloned from %d active\n",
+               relevant, iterations, total);
+    Com_Printf("clients per-client    shared  speedup  packs/tick   ring bytes  table bytes\n"
+               "------- ---------- --------- -------- ----------- ------------ ------------\n");
+
+    for (i = 0; i < q_countof(counts); i++) {
+        n = counts[i];
+        for (k = 0; k < 2; k++) {
+            pack_shared = k;
+            time[k] = 0;
+            packed[k] = 0;
+            for (j = 0; j < iterations; j++)
+                time[k] += packbench_run(clones, n, &packed[k]);
+        }
+
+        ring = sizeof(entity_packed_t) * n * MAX_PACKET_ENTITIES * UPDATE_BACKUP;
+        table = sizeof(entity_packed_t) * MAX_EDICTS;
+        Com_Printf("%7d %8.1fus %7.1fus %7.2fx %5d/%-5d %12zu %12zu\n", n,
+                   (double)time[0] / iterations, (double)time[1] / iterations,
+                   time[1] ? (double)time[0] / time[1] : 0.0,
+                   packed[0] / iterations, relevant, ring, table);
+    }
+
+    pack_shared = true;
+
+    Z_Free(svs.entities);
+    Z_Free(clones);
+    svs.entities = entities;
+    svs.num_entities = num_entities;
+    svs.next_entity = next_entity;
+    svs.vis_hits = vis_hits;
+    svs.vis_misses = vis_misses;
+    SV_InvalidateVisCache();
+    sv.entities_packed = false;
+}
+
+/*
+=============
+SV_DeltaBench_f
+
+Records entity deltas sent to active clients in the current frame and
+replays them through MSG_WriteDeltaEntity and through the delta cache,
+checking that both produce identical data.
+=============
+*/
+void SV_DeltaBench_f(void)
+{
+    client_t    *client;
+    delta_record_t *rec;
+    unsigned    next_entity;
+    uint64_t    start, time[2];
+    size_t      len;
+    byte        direct[MAX_PACKETENTITY_BYTES * 4];
+    int         i, j, k, total, iterations, mismatch;
+
+    if (!svs.initialized || sv.state != ss_game) {
+        Com_Printf("No server running.\n");
+        return;
+    }
+
+    if (!sv_delta_cache->integer) {
+        Com_Printf("Delta cache is disabled, set sv_delta_cache first.\n");
+        return;
+    }
+
+    iterations = Cmd_Argc() > 1 ? Q_clip(atoi(Cmd_Argv(1)), 1, 10000) : 100;
+
+    bench_clients = SV_Malloc(sizeof(bench_clients[0]) * sv_maxclients->integer);
+    bench_saved = SV_Malloc(sizeof(bench_saved[0]) * sv_maxclients->integer);
+
+    total = 0;
+    FOR_EACH_CLIENT(client) {
+        if (client->state == cs_spawned && client->edict->client)
+            bench_clients[total++] = client;
+    }
+
+    if (!total) {
+        Com_Printf("No active clients.\n");
+        goto done;
+    }
+
+    // record deltas of the current frame
+    delta_record_max = total * MAX_PACKET_ENTITIES;
+    delta_record_count = 0;
+    delta_record = SV_Malloc(sizeof(delta_record[0]) * delta_record_max);
+
+    next_entity = svs.next_entity;
+    bench_save(total);
+    SV_InvalidateVisCache();
+    SV_BeginDeltaCache();
+    bench_serial(total, false);
+    bench_restore(total, next_entity);
+
+    rec = delta_record;
+    delta_record = NULL;
+
+    if (!delta_record_count) {
+        Com_Printf("No entity deltas to replay.\n");
+        Z_Free(rec);
+        goto done;
+    }
+
+    // check that both methods produce identical data
+    mismatch = 0;
+    SV_BeginDeltaCache();
+    for (i = 0; i < delta_record_count; i++) {
+        MSG_BeginWriting();
+        MSG_WriteDeltaEntity(&rec[i].from, &rec[i].to, rec[i].flags);
+        len = min(msg_write.cursize, sizeof(direct));
+        memcpy(direct, msg_write.data, len);
+
+        MSG_BeginWriting();
+        SV_WriteDeltaEntity(&rec[i].from, &rec[i].to, rec[i].flags);
+        if (msg_write.cursize != len || memcmp(msg_write.data, direct, len))
+            mismatch++;
+    }
+
+    // time both methods, cache is cleared for every replayed frame
+    for (k = 0; k < 2; k++) {
+        start = Sys_Microseconds();
+        for (j = 0; j < iterations; j++) {
+            if (k)
+                SV_BeginDeltaCache();
+            MSG_BeginWriting();
+            for (i = 0; i < delta_record_count; i++) {
+                if (msg_write.cursize + MAX_PACKETENTITY_BYTES > msg_write.maxsize)
+                    MSG_BeginWriting();
+                if (k)
+                    SV_WriteDeltaEntity(&rec[i].from, &rec[i].to, rec[i].flags);
+                else
+                    MSG_WriteDeltaEntity(&rec[i].from, &rec[i].to, rec[i].flags);
+            }
+        }
+        time[k] = Sys_Microseconds() - start;
+    }
+    SZ_Clear(&msg_write);
+    SV_BeginDeltaCache();
+
+    Com_Printf("%d deltas from %d clients, %d iterations%s\n",
+               delta_record_count, total, iterations, mismatch ? ", MISMATCH" : "");
+    Com_Printf("encoder: %.1fus per frame, %.1fns per delta\n",
+               (double)time[0] / iterations, time[0] * 1000.0 / iterations / delta_record_count);
+    Com_Printf("cached:  %.1fus per frame, %.1fns per delta\n",
+               (double)time[1] / iterations, time[1] * 1000.0 / iterations / delta_record_count);
+
+    Z_Free(rec);
+
+done:
+    Z_Freep((void **)&bench_clients);
+    Z_Freep((void **)&bench_saved);
+}
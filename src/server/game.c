@@ -406,6 +406,8 @@ static void PF_configstring(int index, const char *val)
     memcpy(dst, val, len);
     dst[len] = 0;
 
+    SV_InvalidateGamestate();
+
     if (sv.state == ss_loading) {
         return;
     }
@@ -618,7 +620,15 @@ static void SV_StartSound(const vec3_t origin, edict_t *edict,
         }
 
         // PHS cull this sound
-        if (!(channel & CHAN_NO_PHS_ADD)) {
+        if (!(channel & CHAN_NO_PHS_ADD) && sv_multicast_cache->integer) {
+            const mcast_client_t *c = SV_ClientCluster(client);
+            if (!CM_AreasConnected(&sv.cm, leaf1->area, c->area))
+                continue;
+            if (c->cluster == -1)
+                continue;
+            if (!Q_IsBitSet(mask, c->cluster))
+                continue;
+        } else if (!(channel & CHAN_NO_PHS_ADD)) {
             leaf2 = CM_PointLeaf(&sv.cm, client->edict->s.origin);
             if (!CM_AreasConnected(&sv.cm, leaf1->area, leaf2->area))
                 continue;
@@ -714,6 +724,7 @@ static void PF_SetAreaPortalState(int portalnum, qboolean open)
         Com_Error(ERR_DROP, "%s: no map loaded", __func__);
     }
     CM_SetAreaPortalState(&sv.cm, portalnum, open);
+    SV_InvalidateVisCache();
 }
 
 static qboolean PF_AreasConnected(int area1, int area2)
@@ -836,6 +847,8 @@ static const game_import_ex_t game_import_ex = {
 
     .ErrorString = Q_ErrorString,
     .TagRealloc = PF_TagRealloc,
+
+    .TraceBatch = SV_TraceBatch,
 };
 
 static void *game_library;
@@ -199,6 +199,9 @@ void SV_SpawnServer(const mapcmd_t *cmd)
     // check for a savegame
     SV_CheckForSavegame(cmd);
 
+    // entities are in place now, adjust area tree for them
+    SV_RebalanceWorld();
+
     // all precaches are complete
     sv.state = cmd->state;
 
@@ -451,6 +454,10 @@ void SV_InitGame(unsigned mvd_spawn)
     max_packet_entities = svs.csr.extended ? MAX_PACKET_ENTITIES : MAX_PACKET_ENTITIES_OLD;
     svs.num_entities = sv_maxclients->integer * max_packet_entities * UPDATE_BACKUP;
     svs.entities = SV_Mallocz(sizeof(svs.entities[0]) * svs.num_entities);
+    svs.vis_cache = SV_Mallocz(sizeof(svs.vis_cache[0]) * sv_maxclients->integer);
+
+    // start worker threads if enabled
+    SV_InitThreads();
 
     // send heartbeat very soon
     svs.last_heartbeat = -(HEARTBEAT_SECONDS - 5) * 1000;
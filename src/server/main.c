@@ -83,6 +83,13 @@ cvar_t  *sv_calcpings_method;
 cvar_t  *sv_changemapcmd;
 cvar_t  *sv_max_download_size;
 cvar_t  *sv_max_packet_entities;
+cvar_t  *sv_cull_nonvisible_entities;
+cvar_t  *sv_delta_cache;
+cvar_t  *sv_area_tree;
+cvar_t  *sv_trace_jobs;
+cvar_t  *sv_multicast_cache;
+cvar_t  *sv_gamestate_cache;
+cvar_t  *sv_download_cache;
 
 cvar_t  *sv_strafejump_hack;
 cvar_t  *sv_waterjump_hack;
@@ -235,6 +242,10 @@ void SV_DropClient(client_t *client, const char *reason)
         // call the prog function for removing a client
         // this will remove the body, among other things
         ge->ClientDisconnect(client->edict);
+
+        // entities may have changed
+        SV_InvalidateVisCache();
+        sv.entities_packed = false;
     }
 
     AC_ClientDisconnect(client);
@@ -1779,14 +1790,18 @@ SV_RunGameFrame
 static void SV_RunGameFrame(void)
 {
     // save the entire world state if recording a serverdemo
+    SV_TickBegin(TICK_MVD);
     SV_MvdBeginFrame();
+    SV_TickEnd(TICK_MVD);
 
 #if USE_CLIENT
     if (host_speeds->integer)
         time_before_game = Sys_Milliseconds();
 #endif
 
+    SV_TickBegin(TICK_GAME);
     ge->RunFrame();
+    SV_TickEnd(TICK_GAME);
 
 #if USE_CLIENT
     if (host_speeds->integer)
@@ -1801,7 +1816,9 @@ static void SV_RunGameFrame(void)
     }
 
     // save the entire world state if recording a serverdemo
+    SV_TickBegin(TICK_MVD);
     SV_MvdEndFrame();
+    SV_TickEnd(TICK_MVD);
 }
 
 /*
@@ -1888,17 +1905,7 @@ static void SV_MasterShutdown(void)
     }
 }
 
-/*
-==================
-SV_Frame
-
-Some things like MVD client connections and command buffer
-processing are run even when server is not yet initalized.
-
-Returns amount of extra frametime available for sleeping on IO.
-==================
-*/
-unsigned SV_Frame(unsigned msec)
+static unsigned SV_RunFrame(unsigned msec)
 {
 #if USE_CLIENT
     time_before_game = time_after_game = 0;
@@ -1918,17 +1925,23 @@ unsigned SV_Frame(unsigned msec)
 #endif
 
     // read packets from UDP clients
+    SV_TickBegin(TICK_PACKETS);
     NET_GetPackets(NS_SERVER, SV_PacketEvent);
+    SV_TickEnd(TICK_PACKETS);
 
     if (svs.initialized) {
         // run connection to the anticheat server
         AC_Run();
 
         // run connections from MVD/GTV clients
+        SV_TickBegin(TICK_MVD);
         SV_MvdRunClients();
+        SV_TickEnd(TICK_MVD);
 
         // deliver fragments and reliable messages for connecting clients
+        SV_TickBegin(TICK_ASYNC);
         SV_SendAsyncPackets();
+        SV_TickEnd(TICK_ASYNC);
     }
 
     // move autonomous things around if enough time has passed
@@ -1954,7 +1967,9 @@ unsigned SV_Frame(unsigned msec)
         SV_RunGameFrame();
 
         // send messages back to the UDP clients
+        SV_TickBegin(TICK_SEND);
         SV_SendClientMessages();
+        SV_TickEnd(TICK_SEND);
 
         // send a heartbeat to the master if needed
         SV_MasterHeartbeat();
@@ -1990,6 +2005,32 @@ unsigned SV_Frame(unsigned msec)
     return 0;
 }
 
+/*
+==================
+SV_Frame
+
+Some things like MVD client connections and command buffer
+processing are run even when server is not yet initalized.
+
+Returns amount of extra frametime available for sleeping on IO.
+==================
+*/
+unsigned SV_Frame(unsigned msec)
+{
+    int framenum = sv.framenum;
+    unsigned ret;
+
+    SV_TickBegin(TICK_TOTAL);
+    ret = SV_RunFrame(msec);
+    SV_TickEnd(TICK_TOTAL);
+
+    // record time spent since the previous game frame
+    if (sv.framenum != framenum)
+        SV_TickFinish();
+
+    return ret;
+}
+
 //============================================================================
 
 /*
@@ -2174,6 +2215,8 @@ void SV_Init(void)
 
     SV_MvdRegister();
 
+    SV_InitTickStats();
+
 #if USE_MVD_CLIENT
     MVD_Register();
 #endif
@@ -2246,6 +2289,13 @@ void SV_Init(void)
     sv_changemapcmd = Cvar_Get("sv_changemapcmd", "", 0);
     sv_max_download_size = Cvar_Get("sv_max_download_size", "8388608", 0);
     sv_max_packet_entities = Cvar_Get("sv_max_packet_entities", "0", 0);
+    sv_cull_nonvisible_entities = Cvar_Get("sv_cull_nonvisible_entities", "1", CVAR_CHEAT);
+    sv_delta_cache = Cvar_Get("sv_delta_cache", "1", 0);
+    sv_area_tree = Cvar_Get("sv_area_tree", "1", 0);
+    sv_trace_jobs = Cvar_Get("sv_trace_jobs", "32", 0);
+    sv_multicast_cache = Cvar_Get("sv_multicast_cache", "1", 0);
+    sv_gamestate_cache = Cvar_Get("sv_gamestate_cache", "1", 0);
+    sv_download_cache = Cvar_Get("sv_download_cache", "64", 0);
 
     sv_strafejump_hack = Cvar_Get("sv_strafejump_hack", "1", CVAR_LATCH);
     sv_waterjump_hack = Cvar_Get("sv_waterjump_hack", "1", CVAR_LATCH);
@@ -2382,6 +2432,10 @@ void SV_Shutdown(const char *finalmsg, error_type_t type)
 
     R_ClearDebugLines();    // for local system
 
+    // Com_Error may have longjmp'd out of SV_SendClientMessages with
+    // batching still enabled. Flush it so the final message goes out.
+    NET_EndBatch();
+
 #if USE_MVD_CLIENT
     if (ge != &mvd_ge && !(type & MVD_SPAWN_INTERNAL)) {
         // shutdown MVD client now if not already running the built-in MVD game module
@@ -2398,6 +2452,8 @@ void SV_Shutdown(const char *finalmsg, error_type_t type)
     SV_FinalMessage(finalmsg, type);
     SV_MasterShutdown();
     SV_ShutdownGameProgs();
+    SV_ShutdownThreads();
+    SV_ShutdownTickStats();
 
     // free current level
     CM_FreeMap(&sv.cm);
@@ -2406,6 +2462,11 @@ void SV_Shutdown(const char *finalmsg, error_type_t type)
     // free server static data
     Z_Free(svs.client_pool);
     Z_Free(svs.entities);
+    SV_ShutdownVisCache();
+    SV_ShutdownDeltaCache();
+    SV_ShutdownMulticastCache();
+    SV_ShutdownGamestateCache();
+    SV_ShutdownDownloadCache();
 #if USE_ZLIB
     deflateEnd(&svs.z);
     Z_Free(svs.z_buffer);
@@ -477,6 +477,8 @@ static int read_level_file(void)
             Com_Error(ERR_DROP, "Savegame configstring too long");
     }
 
+    SV_InvalidateGamestate();
+
     SV_ClearWorld();
 
     len = MSG_ReadByte();
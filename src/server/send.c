@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // sv_send.c
 
 #include "server.h"
+#include "common/bitset.h"
 
 /*
 =============================================================================
@@ -49,20 +50,20 @@ void SV_FlushRedirect(int redirected, char *outputbuf, size_t len)
 
 /*
 =======================
-SV_RateDrop
+SV_RateExceeded
 
-Returns true if the client is over its current
-bandwidth estimation and should not be sent another packet
+Returns total size of recent messages if the client is over its
+current bandwidth estimation, 0 otherwise. Has no side effects.
 =======================
 */
-static bool SV_RateDrop(client_t *client)
+static size_t SV_RateExceeded(client_t *client)
 {
     size_t  total;
     int     i;
 
     // never drop over the loopback
     if (!client->rate) {
-        return false;
+        return 0;
     }
 
     total = 0;
@@ -75,6 +76,25 @@ static bool SV_RateDrop(client_t *client)
 #endif
 
     if (total > client->rate) {
+        return total;
+    }
+
+    return 0;
+}
+
+/*
+=======================
+SV_RateDrop
+
+Returns true if the client is over its current
+bandwidth estimation and should not be sent another packet
+=======================
+*/
+static bool SV_RateDrop(client_t *client)
+{
+    size_t  total = SV_RateExceeded(client);
+
+    if (total) {
         SV_DPrintf(0, "Frame %d suppressed for %s (total = %zu)\n",
                    client->framenum, client->name, total);
         client->frameflags |= FF_SUPPRESSED;
@@ -239,6 +259,169 @@ void SV_BroadcastCommand(const char *fmt, ...)
 }
 
 
+/*
+=============================================================================
+
+MULTICAST CACHE
+
+Client leafs are looked up once and reused by multicasts until client origin
+changes, which normally happens once per frame. Clients are also kept in
+per-cluster sets, so that finding multicast recipients is reduced to
+intersecting PVS/PHS row with the set of occupied clusters.
+
+=============================================================================
+*/
+
+static void mcast_reset(void)
+{
+    mcast_cache_t *mc = &svs.mcast;
+    bsp_t *bsp = sv.cm.cache;
+    int i;
+
+    Z_Freep((void**)&mc->clusters);
+    Z_Freep((void**)&mc->occupied);
+    Z_Freep((void**)&mc->clients);
+
+    mc->spawncount = sv.spawncount;
+    mc->bsp = bsp;
+    mc->numclusters = bsp && bsp->vis ? bsp->vis->numclusters : 0;
+    mc->clientbytes = (sv_maxclients->integer + 7) >> 3;
+    mc->clusters = SV_Mallocz(mc->numclusters * mc->clientbytes);
+    mc->occupied = SV_Mallocz((mc->numclusters + 7) >> 3);
+    mc->clients = SV_Mallocz(sizeof(mc->clients[0]) * sv_maxclients->integer);
+
+    for (i = 0; i < sv_maxclients->integer; i++)
+        mc->clients[i].cluster = -1;
+}
+
+// reallocates the cache for the current map
+static void mcast_check(void)
+{
+    if (svs.mcast.spawncount != sv.spawncount || svs.mcast.bsp != sv.cm.cache || !svs.mcast.clients)
+        mcast_reset();
+}
+
+static void mcast_add(int cluster, int index)
+{
+    mcast_cache_t *mc = &svs.mcast;
+    byte *set = &mc->clusters[cluster * mc->clientbytes];
+
+    Q_SetBit(set, index);
+    Q_SetBit(mc->occupied, cluster);
+}
+
+static void mcast_remove(int cluster, int index)
+{
+    mcast_cache_t *mc = &svs.mcast;
+    byte *set = &mc->clusters[cluster * mc->clientbytes];
+
+    Q_ClearBit(set, index);
+
+    if (!BitSet_Count(set, mc->clientbytes))
+        Q_ClearBit(mc->occupied, cluster);
+}
+
+/*
+=================
+SV_ClientCluster
+
+Returns cluster and area client is standing in, looking them up only if
+client has moved since the last call.
+=================
+*/
+const mcast_client_t *SV_ClientCluster(client_t *client)
+{
+    mcast_cache_t *mc = &svs.mcast;
+    const float *org = client->edict->s.origin;
+    int index = client - svs.client_pool;
+    mcast_client_t *c;
+    mleaf_t *leaf;
+
+    mcast_check();
+
+    c = &mc->clients[index];
+    if (c->valid && VectorCompare(c->origin, org)) {
+        mc->hits++;
+        return c;
+    }
+
+    leaf = CM_PointLeaf(&sv.cm, org);
+    mc->lookups++;
+
+    if (leaf->cluster != c->cluster) {
+        if (c->cluster >= 0 && c->cluster < mc->numclusters)
+            mcast_remove(c->cluster, index);
+        if (leaf->cluster >= 0 && leaf->cluster < mc->numclusters)
+            mcast_add(leaf->cluster, index);
+    }
+
+    VectorCopy(org, c->origin);
+    c->cluster = leaf->cluster;
+    c->area = leaf->area;
+    c->valid = true;
+    return c;
+}
+
+// fills the set of clients standing in clusters visible in mask
+static void mcast_find_clients(const byte *mask, byte *clients)
+{
+    mcast_cache_t *mc = &svs.mcast;
+    byte visible[VIS_MAX_BYTES];
+    client_t *client;
+    size_t rowsize;
+    int cluster;
+
+    mcast_check();
+
+    // bring cluster sets up to date
+    FOR_EACH_CLIENT(client)
+        if (client->state >= cs_primed)
+            SV_ClientCluster(client);
+
+    // no vis, every client is a candidate
+    if (!mc->numclusters) {
+        memset(clients, 0xff, mc->clientbytes);
+        return;
+    }
+
+    memset(clients, 0, mc->clientbytes);
+
+    // visible clusters with clients in them
+    rowsize = (mc->numclusters + 7) >> 3;
+    memcpy(visible, mask, rowsize);
+    BitSet_And(visible, mc->occupied, rowsize);
+
+    BITSET_FOR_EACH(visible, rowsize, cluster)
+        BitSet_Or(clients, &mc->clusters[cluster * mc->clientbytes], mc->clientbytes);
+}
+
+void SV_MulticastStats_f(void)
+{
+    mcast_cache_t *mc = &svs.mcast;
+    unsigned total = mc->lookups + mc->hits;
+
+    if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset")) {
+        mc->multicasts = mc->lookups = mc->hits = 0;
+        mc->usec = 0;
+        return;
+    }
+
+    Com_Printf("%u multicasts, %.2f usec per multicast\n", mc->multicasts,
+               mc->multicasts ? (double)mc->usec / mc->multicasts : 0.0);
+    Com_Printf("%u client leaf lookups, %u avoided (%.1f%% hit rate)\n",
+               mc->lookups, mc->hits, total ? mc->hits * 100.0 / total : 0.0);
+}
+
+void SV_ShutdownMulticastCache(void)
+{
+    mcast_cache_t *mc = &svs.mcast;
+
+    Z_Freep((void**)&mc->clusters);
+    Z_Freep((void**)&mc->occupied);
+    Z_Freep((void**)&mc->clients);
+    memset(mc, 0, sizeof(*mc));
+}
+
 /*
 =================
 SV_Multicast
@@ -257,9 +440,13 @@ void SV_Multicast(const vec3_t origin, multicast_t to)
 {
     client_t    *client;
     byte        mask[VIS_MAX_BYTES];
+    byte        clients[MAX_CLIENTS / 8];
     mleaf_t     *leaf1 = NULL, *leaf2;
+    const mcast_client_t *c;
     int         leafnum q_unused = 0;
-    int         flags = 0;
+    int         i, flags = 0;
+    bool        cached = sv_multicast_cache->integer;
+    uint64_t    start = Sys_Microseconds();
 
     if (!sv.cm.cache) {
         Com_Error(ERR_DROP, "%s: no map loaded", __func__);
@@ -291,6 +478,10 @@ void SV_Multicast(const vec3_t origin, multicast_t to)
         Com_Error(ERR_DROP, "SV_Multicast: bad to: %i", to);
     }
 
+    // find clients in visible clusters at once
+    if (leaf1 && cached)
+        mcast_find_clients(mask, clients);
+
     // send the data to all relevent clients
     FOR_EACH_CLIENT(client) {
         if (client->state < cs_primed) {
@@ -301,8 +492,20 @@ void SV_Multicast(const vec3_t origin, multicast_t to)
             continue;
         }
 
-        if (leaf1) {
+        if (leaf1 && cached) {
+            i = client - svs.client_pool;
+            if (!Q_IsBitSet(clients, i))
+                continue;
+            c = &svs.mcast.clients[i];
+            if (!CM_AreasConnected(&sv.cm, leaf1->area, c->area))
+                continue;
+            if (c->cluster == -1)
+                continue;
+            if (!Q_IsBitSet(mask, c->cluster))
+                continue;
+        } else if (leaf1) {
             leaf2 = CM_PointLeaf(&sv.cm, client->edict->s.origin);
+            svs.mcast.lookups++;
             if (!CM_AreasConnected(&sv.cm, leaf1->area, leaf2->area))
                 continue;
             if (leaf2->cluster == -1)
@@ -319,6 +522,9 @@ void SV_Multicast(const vec3_t origin, multicast_t to)
 
     // clear the buffer
     SZ_Clear(&msg_write);
+
+    svs.mcast.multicasts++;
+    svs.mcast.usec += Sys_Microseconds() - start;
 }
 
 #if USE_ZLIB
@@ -386,6 +592,24 @@ static byte *get_compressed_data(void)
 #define get_compressed_data()   NULL
 #endif
 
+/*
+=======================
+SV_CompressMessage
+
+Compresses contents of the current write buffer for the client. Returns
+compressed packet and its length, or NULL if client doesn't support
+compression or compressed packet isn't smaller.
+=======================
+*/
+byte *SV_CompressMessage(client_t *client, int *len)
+{
+    *len = compress_message(client);
+    if (*len && *len < msg_write.cursize)
+        return get_compressed_data();
+
+    return NULL;
+}
+
 /*
 =======================
 SV_ClientAddMessage
@@ -397,6 +621,7 @@ unless told otherwise.
 */
 void SV_ClientAddMessage(client_t *client, int flags)
 {
+    byte *data;
     int len;
 
     if (!msg_write.cursize) {
@@ -407,8 +632,8 @@ void SV_ClientAddMessage(client_t *client, int flags)
         flags |= MSG_COMPRESS;
     }
 
-    if ((flags & MSG_COMPRESS) && (len = compress_message(client)) && len < msg_write.cursize) {
-        client->AddMessage(client, get_compressed_data(), len, flags & MSG_RELIABLE);
+    if ((flags & MSG_COMPRESS) && (data = SV_CompressMessage(client, &len))) {
+        client->AddMessage(client, data, len, flags & MSG_RELIABLE);
         SV_DPrintf(0, "Compressed %sreliable message to %s: %zu into %d\n",
                    (flags & MSG_RELIABLE) ? "" : "un", client->name, msg_write.cursize, len);
     } else {
@@ -714,6 +939,24 @@ static void repack_unreliables(client_t *client, size_t maxsize)
     }
 }
 
+// writes frame prebuilt by SV_BuildClientFrames, or builds it now
+static void write_frame(client_t *client)
+{
+    frame_work_t *work = client->frame_work;
+
+    if (work && work->ready) {
+        MSG_WriteData(work->data, work->cursize);
+        work->ready = false;
+    } else {
+        client->WriteFrame(client);
+    }
+
+    if (client->frame_truncated) {
+        Com_WPrintf("Frame got too large for %s, aborting.\n", client->name);
+        client->frame_truncated = false;
+    }
+}
+
 static void write_datagram_old(client_t *client)
 {
     message_packet_t *msg;
@@ -736,7 +979,7 @@ static void write_datagram_old(client_t *client)
 
     // send over all the relevant entity_state_t
     // and the player_state_t
-    client->WriteFrame(client);
+    write_frame(client);
     if (msg_write.cursize > maxsize) {
         size_t size = msg_write.cursize;
         int len = 0;
@@ -820,7 +1063,7 @@ static void write_datagram_new(client_t *client)
 
     // send over all the relevant entity_state_t
     // and the player_state_t
-    client->WriteFrame(client);
+    write_frame(client);
 
     if (msg_write.overflowed) {
         // should never really happen
@@ -877,6 +1120,10 @@ static void finish_frame(client_t *client)
         free_msg_packet(client, msg);
     }
     client->msg_unreliable_bytes = 0;
+
+    if (client->frame_work) {
+        client->frame_work->ready = false;
+    }
 }
 
 #if USE_DEBUG && USE_FPS
@@ -894,6 +1141,46 @@ static void check_key_sync(client_t *client)
 }
 #endif
 
+/*
+=======================
+build_frames
+
+Builds frames for all clients that are going to receive one this frame
+on worker threads. Falls back to building frames one by one in
+SV_SendClientMessages if any client is about to be dropped, since that
+calls into game DLL and may modify entities.
+=======================
+*/
+static void build_frames(void)
+{
+    static client_t *clients[MAX_CLIENTS];
+    client_t    *client;
+    int         count;
+
+    if (!SV_NumThreads())
+        return;
+
+    count = 0;
+    FOR_EACH_CLIENT(client) {
+        if (!CLIENT_ACTIVE(client))
+            continue;
+        if (!SV_CLIENTSYNC(client))
+            continue;
+        if (client->netchan.message.overflowed)
+            return;
+        if (SV_RateExceeded(client))
+            continue;
+        if (client->netchan.fragment_pending)
+            continue;
+        clients[count++] = client;
+    }
+
+    if (count < 2)
+        return;
+
+    SV_BuildClientFrames(clients, count);
+}
+
 /*
 =======================
 SV_SendClientMessages
@@ -907,6 +1194,17 @@ void SV_SendClientMessages(void)
     client_t    *client;
     size_t      cursize;
 
+    // entities have moved since last time
+    SV_InvalidateVisCache();
+    sv.entities_packed = false;
+    SV_BeginDeltaCache();
+
+    // build frames in parallel if enabled
+    build_frames();
+
+    // coalesce outgoing datagrams into as few syscalls as possible
+    NET_BeginBatch(NS_SERVER);
+
     // send a message to each connected client
     FOR_EACH_CLIENT(client) {
         if (!CLIENT_ACTIVE(client))
@@ -941,7 +1239,8 @@ void SV_SendClientMessages(void)
         }
 
         // build the new frame and write it
-        SV_BuildClientFrame(client);
+        if (!(client->frame_work && client->frame_work->ready))
+            SV_BuildClientFrame(client);
         client->WriteDatagram(client);
 
 advance:
@@ -952,6 +1251,8 @@ finish:
         // clear all unreliable messages still left
         finish_frame(client);
     }
+
+    NET_EndBatch();
 }
 
 static void write_pending_download(client_t *client)
@@ -1081,6 +1382,7 @@ void SV_ShutdownClientSend(client_t *client)
     free_all_messages(client);
 
     Z_Freep((void**)&client->msg_pool);
+    Z_Freep((void**)&client->frame_work);
     List_Init(&client->msg_free_list);
 }
 
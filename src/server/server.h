@@ -92,7 +92,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
                      GMF_WANT_ALL_DISCONNECTS | GMF_ENHANCED_SAVEGAMES | \
                      SV_GMF_VARIABLE_FPS | GMF_EXTRA_USERINFO | \
                      GMF_IPV6_ADDRESS_AWARE | GMF_ALLOW_INDEX_OVERFLOW | \
-                     GMF_PROTOCOL_EXTENSIONS)
+                     GMF_PROTOCOL_EXTENSIONS | GMF_BATCH_TRACES)
+
+// max number of worker threads
+#define MAX_THREADS     32
 
 // ugly hack for SV_Shutdown
 #define MVD_SPAWN_DISABLED  0
@@ -112,8 +115,49 @@ typedef struct {
     int         latency;
 } client_frame_t;
 
+// visibility info shared by clients viewing from the same spot
+#define VIS_AREA    1   // entity area is connected to viewer area
+#define VIS_PVS     2   // entity is in fat PVS
+#define VIS_PHS     4   // entity is in PHS
+
+typedef struct {
+    uint16_t    number;
+    uint16_t    flags;
+} vis_entity_t;
+
+typedef struct {
+    unsigned            generation;     // valid if equals svs.vis_generation
+    cm_t                *cm;
+    const game_export_t *ge;
+    int                 area;
+    int                 cluster;
+    int                 last_valid_cluster;     // only if cluster < 0
+    int                 numclusters;
+    int                 clusters[MAX_FAT_CLUSTERS]; // sorted
+
+    int                 areabytes;
+    byte                areabits[MAX_MAP_AREA_BYTES];
+    byte                pvs[VIS_MAX_BYTES];
+    byte                phs[VIS_MAX_BYTES];
+
+    int                 num_entities;
+    vis_entity_t        entities[MAX_EDICTS];
+} vis_cache_t;
+
+// scratch space for building client frames on worker threads
+typedef struct {
+    bool        ingame;         // frame header was set up
+    vis_cache_t *vis;
+    bool        ready;          // data holds encoded frame for current framenum
+    int         num_entities;
+    uint16_t    entities[MAX_PACKET_ENTITIES];
+    size_t      cursize;
+    byte        data[MAX_MSGLEN];
+} frame_work_t;
+
 typedef struct {
     int         solid32;
+    entity_packed_t packed;     // valid if sv.entities_packed is set
 
 #if USE_FPS
 
@@ -171,6 +215,7 @@ typedef struct {
     configstring_t  configstrings[MAX_CONFIGSTRINGS];
 
     server_entity_t entities[MAX_EDICTS];
+    bool            entities_packed;    // cleared when entities may have changed
 } server_t;
 
 #define EDICT_NUM2(ge, n) ((edict_t *)((byte *)(ge)->edicts + (ge)->edict_size*(n)))
@@ -317,8 +362,11 @@ typedef struct client_s {
 
     // frame encoding
     client_frame_t  frames[UPDATE_BACKUP];    // updates can be delta'd from here
+    client_frame_t  *deltaframe;    // frame being delta'd from, NULL if none
     unsigned        frames_sent, frames_acked, frames_nodelta;
     int             framenum;
+    bool            frame_truncated;
+    frame_work_t    *frame_work;    // allocated if frames are built in parallel
 #if USE_FPS
     int             framediv;
 #endif
@@ -330,6 +378,7 @@ typedef struct client_s {
     unsigned        send_time, send_delta;          // used to rate drop async packets
 
     // current download
+    struct sv_download_s *downloadref;  // shared download cache entry
     byte            *download;      // file being downloaded
     int             downloadsize;   // total bytes (can't use EOF because of paks)
     int             downloadcount;  // bytes sent
@@ -470,6 +519,29 @@ typedef struct {
     cm_t            cm;
 } mapcmd_t;
 
+typedef struct {
+    bool        valid;
+    vec3_t      origin;     // client origin leaf was looked up for
+    int         cluster;
+    int         area;
+} mcast_client_t;
+
+typedef struct {
+    int             spawncount;     // sv.spawncount this cache is valid for
+    bsp_t           *bsp;
+    int             numclusters;
+    int             clientbytes;    // size of client set in bytes
+    byte            *clusters;      // [numclusters][clientbytes] client sets
+    byte            *occupied;      // clusters with non-empty client sets
+    mcast_client_t  *clients;       // [maxclients]
+
+    // statistics
+    unsigned        multicasts;
+    unsigned        lookups;        // client leaf lookups done
+    unsigned        hits;           // client leaf lookups avoided
+    uint64_t        usec;
+} mcast_cache_t;
+
 typedef struct server_static_s {
     bool        initialized;        // sv_init has completed
     unsigned    realtime;           // always increasing, no clamping, etc
@@ -480,6 +552,16 @@ typedef struct server_static_s {
     unsigned        next_entity;    // next state to use
     entity_packed_t *entities;      // [num_entities]
 
+    vis_cache_t     **vis_cache;    // [maxclients], allocated on demand
+    unsigned        vis_generation; // bumped when cached entries become stale
+    unsigned        vis_hits;
+    unsigned        vis_misses;
+
+    struct delta_cache_s    *delta_cache[MAX_THREADS + 1];  // per thread
+    unsigned                delta_generation;
+
+    mcast_cache_t   mcast;
+
 #if USE_ZLIB
     z_stream        z;  // for compressing messages at once
     byte            *z_buffer;
@@ -537,6 +619,13 @@ extern cvar_t       *sv_debug;
 extern cvar_t       *sv_pad_packets;
 #endif
 extern cvar_t       *sv_novis;
+extern cvar_t       *sv_cull_nonvisible_entities;
+extern cvar_t       *sv_delta_cache;
+extern cvar_t       *sv_area_tree;
+extern cvar_t       *sv_trace_jobs;
+extern cvar_t       *sv_multicast_cache;
+extern cvar_t       *sv_gamestate_cache;
+extern cvar_t       *sv_download_cache;
 extern cvar_t       *sv_lan_force_rate;
 extern cvar_t       *sv_calcpings_method;
 extern cvar_t       *sv_changemapcmd;
@@ -631,10 +720,14 @@ void SV_SendClientMessages(void);
 void SV_SendAsyncPackets(void);
 
 void SV_Multicast(const vec3_t origin, multicast_t to);
+const mcast_client_t *SV_ClientCluster(client_t *client);
+void SV_MulticastStats_f(void);
+void SV_ShutdownMulticastCache(void);
 void SV_ClientPrintf(client_t *cl, int level, const char *fmt, ...) q_printf(3, 4);
 void SV_BroadcastPrintf(int level, const char *fmt, ...) q_printf(2, 3);
 void SV_ClientCommand(client_t *cl, const char *fmt, ...) q_printf(2, 3);
 void SV_BroadcastCommand(const char *fmt, ...) q_printf(1, 2);
+byte *SV_CompressMessage(client_t *client, int *len);
 void SV_ClientAddMessage(client_t *client, int flags);
 void SV_ShutdownClientSend(client_t *client);
 void SV_InitClientSend(client_t *newcl);
@@ -727,6 +820,9 @@ void AC_Info_f(void);
 // sv_user.c
 //
 void SV_New_f(void);
+void SV_InvalidateGamestate(void);
+void SV_ShutdownGamestateCache(void);
+void SV_ShutdownDownloadCache(void);
 void SV_Begin_f(void);
 void SV_ExecuteClientMessage(client_t *cl);
 void SV_CloseDownload(client_t *client);
@@ -758,8 +854,47 @@ void SV_PrintMiscInfo(void);
     ((ent)->s.modelindex || (ent)->s.effects || (ent)->s.sound || (ent)->s.event)
 
 void SV_BuildClientFrame(client_t *client);
+void SV_BuildClientFrames(client_t **clients, int count);
 void SV_WriteFrameToClient_Default(client_t *client);
 void SV_WriteFrameToClient_Enhanced(client_t *client);
+void SV_FrameBench_f(void);
+void SV_PackBench_f(void);
+void SV_InvalidateVisCache(void);
+void SV_VisStats_f(void);
+void SV_BeginDeltaCache(void);
+void SV_ShutdownDeltaCache(void);
+void SV_DeltaStats_f(void);
+void SV_DeltaBench_f(void);
+void SV_ShutdownVisCache(void);
+
+//
+// sv_threads.c
+//
+void SV_InitThreads(void);
+void SV_ShutdownThreads(void);
+int SV_NumThreads(void);
+int SV_ThreadIndex(void);
+void SV_RunJobs(void (*func)(void *), void **args, int count);
+
+//
+// sv_tick.c
+//
+typedef enum {
+    TICK_PACKETS,   // SV_PacketEvent
+    TICK_ASYNC,     // SV_SendAsyncPackets
+    TICK_GAME,      // ge->RunFrame
+    TICK_MVD,       // MVD recording and clients
+    TICK_SEND,      // SV_SendClientMessages
+    TICK_TOTAL,     // everything done in SV_Frame
+
+    TICK_MAX
+} tickphase_t;
+
+void SV_InitTickStats(void);
+void SV_ShutdownTickStats(void);
+void SV_TickBegin(tickphase_t phase);
+void SV_TickEnd(tickphase_t phase);
+void SV_TickFinish(void);
 
 //
 // sv_game.c
@@ -792,6 +927,12 @@ bool SV_NoSaveGames(void);
 void SV_ClearWorld(void);
 // called after the world model has been loaded, before linking any entities
 
+void SV_RebalanceWorld(void);
+// called after entities have been spawned, may rebuild the area tree
+
+void SV_AreaBench_f(void);
+void SV_TraceBench_f(void);
+
 void PF_UnlinkEdict(edict_t *ent);
 // call before removing an entity, and before trying to move one,
 // so it doesn't clip against itself
@@ -826,6 +967,9 @@ trace_t q_gameabi SV_Trace(const vec3_t start, const vec3_t mins,
                            edict_t *passedict, int contentmask);
 // mins and maxs are relative
 
+void SV_TraceBatch(const trace_request_t *requests, trace_t *results, int count);
+// same as SV_Trace for each request, large batches are split across workers
+
 // if the entire move stays in a solid volume, trace.allsolid will be set,
 // trace.startsolid will be set, and trace.fraction will be 0
 
@@ -0,0 +1,198 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+// sv_threads.c -- worker threads for per-client jobs
+
+#include "server.h"
+#include "system/pthread.h"
+
+static cvar_t   *sv_threads;
+
+static pthread_t        threads[MAX_THREADS];
+static int              numthreads;
+static q_thread_local int   thread_index;   // 0 for main thread
+static pthread_mutex_t  job_lock;
+static pthread_cond_t   job_start;
+static pthread_cond_t   job_done;
+static bool             job_terminate;
+static unsigned         job_generation;
+
+static void     (*job_func)(void *);
+static void     **job_args;
+static int      job_count;
+static int      job_next;
+static int      job_finished;
+
+// must be called with job_lock held
+static void run_jobs(void)
+{
+    while (job_next < job_count) {
+        int i = job_next++;
+
+        pthread_mutex_unlock(&job_lock);
+        job_func(job_args[i]);
+        pthread_mutex_lock(&job_lock);
+
+        if (++job_finished == job_count)
+            pthread_cond_signal(&job_done);
+    }
+}
+
+static void *thread_func(void *arg)
+{
+    unsigned generation = 0;
+
+    thread_index = (intptr_t)arg;
+
+    pthread_mutex_lock(&job_lock);
+    while (1) {
+        while (generation == job_generation && !job_terminate)
+            pthread_cond_wait(&job_start, &job_lock);
+
+        if (job_terminate)
+            break;
+
+        generation = job_generation;
+        run_jobs();
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    return NULL;
+}
+
+static void stop_threads(void)
+{
+    int i;
+
+    if (!numthreads)
+        return;
+
+    pthread_mutex_lock(&job_lock);
+    job_terminate = true;
+    pthread_mutex_unlock(&job_lock);
+
+    pthread_cond_broadcast(&job_start);
+
+    for (i = 0; i < numthreads; i++)
+        Q_assert(!pthread_join(threads[i], NULL));
+
+    pthread_mutex_destroy(&job_lock);
+    pthread_cond_destroy(&job_start);
+    pthread_cond_destroy(&job_done);
+    numthreads = 0;
+}
+
+static void start_threads(int count)
+{
+    int i;
+
+    if (count <= 0)
+        return;
+
+    pthread_mutex_init(&job_lock, NULL);
+    pthread_cond_init(&job_start, NULL);
+    pthread_cond_init(&job_done, NULL);
+    job_terminate = false;
+    job_generation = 0;
+    job_count = job_next = job_finished = 0;
+
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, thread_func, (void *)(intptr_t)(i + 1))) {
+            Com_WPrintf("Couldn't create server worker thread\n");
+            break;
+        }
+    }
+
+    numthreads = i;
+    if (!numthreads) {
+        pthread_mutex_destroy(&job_lock);
+        pthread_cond_destroy(&job_start);
+        pthread_cond_destroy(&job_done);
+    }
+}
+
+static void sv_threads_changed(cvar_t *self)
+{
+    int count = Cvar_ClampInteger(self, 0, MAX_THREADS);
+
+    if (count != numthreads) {
+        stop_threads();
+        start_threads(count);
+    }
+}
+
+/*
+==================
+SV_RunJobs
+
+Calls func for each of the args, distributing calls between worker threads
+and the main thread. Returns when all calls are finished. Jobs must not
+print, allocate memory or throw errors.
+==================
+*/
+void SV_RunJobs(void (*func)(void *), void **args, int count)
+{
+    int i;
+
+    if (!numthreads || count < 2) {
+        for (i = 0; i < count; i++)
+            func(args[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&job_lock);
+    job_func = func;
+    job_args = args;
+    job_count = count;
+    job_next = 0;
+    job_finished = 0;
+    job_generation++;
+    pthread_mutex_unlock(&job_lock);
+
+    pthread_cond_broadcast(&job_start);
+
+    // main thread helps out
+    pthread_mutex_lock(&job_lock);
+    run_jobs();
+    while (job_finished < job_count)
+        pthread_cond_wait(&job_done, &job_lock);
+    pthread_mutex_unlock(&job_lock);
+}
+
+int SV_NumThreads(void)
+{
+    return numthreads;
+}
+
+// returns index of calling thread, 0 for main thread and 1..numthreads for
+// worker threads
+int SV_ThreadIndex(void)
+{
+    return thread_index;
+}
+
+void SV_InitThreads(void)
+{
+    sv_threads = Cvar_Get("sv_threads", "0", 0);
+    sv_threads->changed = sv_threads_changed;
+    sv_threads_changed(sv_threads);
+}
+
+void SV_ShutdownThreads(void)
+{
+    stop_threads();
+}
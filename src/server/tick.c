@@ -0,0 +1,252 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+// tick.c -- server tick time telemetry
+
+#include "server.h"
+
+#define TICK_SAMPLES    1024    // must be power of two
+
+typedef struct {
+    int         framenum;
+    int         clients;
+    int         edicts;
+    unsigned    usec[TICK_MAX];
+} ticksample_t;
+
+static cvar_t   *sv_tick_budget;
+static cvar_t   *sv_tick_log;
+
+static const char *const tick_names[TICK_MAX] = {
+    "packets", "async", "game", "mvd", "send", "total"
+};
+
+static ticksample_t tick_samples[TICK_SAMPLES];
+static unsigned     tick_head;      // total number of samples recorded
+static ticksample_t tick_current;   // being accumulated
+static uint64_t     tick_start[TICK_MAX];
+static unsigned     tick_slow;
+static qhandle_t    tick_logfile;
+
+void SV_TickBegin(tickphase_t phase)
+{
+    tick_start[phase] = Sys_Microseconds();
+}
+
+void SV_TickEnd(tickphase_t phase)
+{
+    tick_current.usec[phase] += Sys_Microseconds() - tick_start[phase];
+}
+
+static int count_clients(void)
+{
+    client_t *cl;
+    int count = 0;
+
+    FOR_EACH_CLIENT(cl) {
+        if (cl->state > cs_zombie)
+            count++;
+    }
+
+    return count;
+}
+
+static void close_tick_log(void)
+{
+    if (tick_logfile) {
+        FS_CloseFile(tick_logfile);
+        tick_logfile = 0;
+    }
+}
+
+static void sv_tick_log_changed(cvar_t *self)
+{
+    close_tick_log();
+}
+
+static void log_slow_tick(const ticksample_t *s)
+{
+    char buffer[MAX_OSPATH], date[MAX_QPATH];
+    int i;
+
+    tick_slow++;
+
+    Com_DPrintf("Slow server frame %d: %.1f msec\n", s->framenum, s->usec[TICK_TOTAL] * 0.001f);
+
+    if (!sv_tick_log->string[0])
+        return;
+
+    if (!tick_logfile) {
+        tick_logfile = FS_EasyOpenFile(buffer, sizeof(buffer),
+                                       FS_MODE_APPEND | FS_FLAG_TEXT | FS_BUF_LINE,
+                                       "logs/", sv_tick_log->string, ".log");
+        if (!tick_logfile) {
+            Cvar_Set("sv_tick_log", "");
+            return;
+        }
+    }
+
+    if (!Com_FormatLocalTime(date, sizeof(date), "%Y-%m-%d %H:%M:%S"))
+        strcpy(date, "-");
+
+    FS_FPrintf(tick_logfile, "%s %s frame %d clients %d edicts %d",
+               date, sv.name, s->framenum, s->clients, s->edicts);
+    for (i = 0; i < TICK_MAX; i++)
+        FS_FPrintf(tick_logfile, " %s %u", tick_names[i], s->usec[i]);
+    FS_FPrintf(tick_logfile, "\n");
+}
+
+/*
+==================
+SV_TickFinish
+
+Called once per game frame to record time spent in each phase since the
+previous game frame.
+==================
+*/
+void SV_TickFinish(void)
+{
+    ticksample_t *s = &tick_current;
+
+    s->framenum = sv.framenum;
+    s->clients = svs.initialized ? count_clients() : 0;
+    s->edicts = ge ? ge->num_edicts : 0;
+
+    tick_samples[tick_head++ & (TICK_SAMPLES - 1)] = *s;
+
+    if (sv_tick_budget->value > 0 && s->usec[TICK_TOTAL] > sv_tick_budget->value * 1000)
+        log_slow_tick(s);
+
+    memset(s, 0, sizeof(*s));
+}
+
+static int numsamples(void)
+{
+    return min(tick_head, TICK_SAMPLES);
+}
+
+static int uintcmp(const void *p1, const void *p2)
+{
+    unsigned a = *(const unsigned *)p1;
+    unsigned b = *(const unsigned *)p2;
+
+    return a < b ? -1 : a > b;
+}
+
+static unsigned percentile(const unsigned *sorted, int count, int p)
+{
+    int i = (count * p + 99) / 100 - 1;
+
+    return sorted[max(i, 0)];
+}
+
+static void SV_TickStats_f(void)
+{
+    unsigned sorted[TICK_SAMPLES];
+    uint64_t total;
+    int i, j, count = numsamples();
+
+    if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset")) {
+        tick_head = tick_slow = 0;
+        return;
+    }
+
+    if (!count) {
+        Com_Printf("No server frames recorded.\n");
+        return;
+    }
+
+    Com_Printf("Last %d frames, usec:\n"
+               "phase      p50     p95     p99     max     avg\n"
+               "------- ------- ------- ------- ------- -------\n", count);
+
+    for (i = 0; i < TICK_MAX; i++) {
+        total = 0;
+        for (j = 0; j < count; j++) {
+            sorted[j] = tick_samples[j].usec[i];
+            total += sorted[j];
+        }
+
+        qsort(sorted, count, sizeof(sorted[0]), uintcmp);
+
+        Com_Printf("%-7s %7u %7u %7u %7u %7u\n", tick_names[i],
+                   percentile(sorted, count, 50), percentile(sorted, count, 95),
+                   percentile(sorted, count, 99), sorted[count - 1],
+                   (unsigned)(total / count));
+    }
+
+    if (sv_tick_budget->value > 0)
+        Com_Printf("%u frames over %.1f msec budget\n", tick_slow, sv_tick_budget->value);
+}
+
+static void SV_TickDump_f(void)
+{
+    char buffer[MAX_OSPATH];
+    const ticksample_t *s;
+    qhandle_t f;
+    int i, j, count = numsamples();
+
+    if (Cmd_Argc() != 2) {
+        Com_Printf("Usage: %s <filename>\n", Cmd_Argv(0));
+        return;
+    }
+
+    f = FS_EasyOpenFile(buffer, sizeof(buffer), FS_MODE_WRITE | FS_FLAG_TEXT,
+                        "stats/", Cmd_Argv(1), ".csv");
+    if (!f)
+        return;
+
+    FS_FPrintf(f, "framenum,clients,edicts");
+    for (i = 0; i < TICK_MAX; i++)
+        FS_FPrintf(f, ",%s", tick_names[i]);
+    FS_FPrintf(f, "\n");
+
+    // oldest first
+    for (i = 0; i < count; i++) {
+        s = &tick_samples[(tick_head - count + i) & (TICK_SAMPLES - 1)];
+        FS_FPrintf(f, "%d,%d,%d", s->framenum, s->clients, s->edicts);
+        for (j = 0; j < TICK_MAX; j++)
+            FS_FPrintf(f, ",%u", s->usec[j]);
+        FS_FPrintf(f, "\n");
+    }
+
+    if (FS_CloseFile(f))
+        Com_EPrintf("Error writing %s\n", buffer);
+    else
+        Com_Printf("Dumped %d frames to %s\n", count, buffer);
+}
+
+static const cmdreg_t c_tick[] = {
+    { "tickstats", SV_TickStats_f },
+    { "tickdump", SV_TickDump_f },
+
+    { NULL }
+};
+
+void SV_InitTickStats(void)
+{
+    sv_tick_budget = Cvar_Get("sv_tick_budget", "0", 0);
+    sv_tick_log = Cvar_Get("sv_tick_log", "slowframes", 0);
+    sv_tick_log->changed = sv_tick_log_changed;
+
+    Cmd_Register(c_tick);
+}
+
+void SV_ShutdownTickStats(void)
+{
+    close_tick_log();
+}
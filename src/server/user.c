@@ -19,7 +19,6 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "server.h"
 
-#define MSG_GAMESTATE   (MSG_RELIABLE | MSG_CLEAR | MSG_COMPRESS)
 
 /*
 ============================================================
@@ -89,6 +88,256 @@ static void SV_CreateBaselines(void)
     }
 }
 
+/*
+============================================================
+
+GAMESTATE CACHE
+
+Configstrings and baselines sent to connecting clients are identical for
+all clients using the same protocol variant. The first client to connect
+has its gamestate messages and baselines recorded, clients connecting
+later get a copy. Cached entries become stale on configstring changes.
+
+============================================================
+*/
+
+#define MAX_CACHED_GAMESTATES   4
+
+typedef struct {
+    bool            valid;
+    unsigned        generation;
+    unsigned        lastused;
+
+    // protocol variant
+    int             spawncount;
+    int             protocol;
+    int             version;
+    netchan_type_t  nctype;
+    size_t          maxpacketlen;
+    msgEsFlags_t    esFlags;
+    const cs_remap_t *csr;
+    bool            has_zlib;
+
+    // sequence of messages, each one is raw and compressed lengths
+    // followed by raw and compressed data
+    byte            *data;
+    size_t          size;
+    size_t          maxsize;
+
+    entity_packed_t *baselines[SV_BASELINES_CHUNKS];
+} gamestate_t;
+
+static gamestate_t  gamestates[MAX_CACHED_GAMESTATES];
+static unsigned     gamestate_generation;
+static unsigned     gamestate_sequence;
+static gamestate_t  *gamestate_record;  // entry being recorded
+
+static bool gamestate_match(const gamestate_t *gs)
+{
+    return gs->valid
+        && gs->generation == gamestate_generation
+        && gs->spawncount == sv.spawncount
+        && gs->protocol == sv_client->protocol
+        && gs->version == sv_client->version
+        && gs->nctype == sv_client->netchan.type
+        && gs->maxpacketlen == sv_client->netchan.maxpacketlen
+        && gs->esFlags == sv_client->esFlags
+        && gs->csr == sv_client->csr
+        && gs->has_zlib == sv_client->has_zlib;
+}
+
+static bool gamestate_cacheable(void)
+{
+    return sv_gamestate_cache->integer
+        && sv.state == ss_game
+        && sv_client->configstrings == sv.configstrings
+        && sv_client->ge == ge;
+}
+
+static gamestate_t *find_gamestate(void)
+{
+    gamestate_t *gs;
+    int i;
+
+    if (!gamestate_cacheable())
+        return NULL;
+
+    for (i = 0, gs = gamestates; i < MAX_CACHED_GAMESTATES; i++, gs++) {
+        if (gamestate_match(gs)) {
+            gs->lastused = ++gamestate_sequence;
+            return gs;
+        }
+    }
+
+    return NULL;
+}
+
+static void gamestate_write(gamestate_t *gs, const void *data, size_t len)
+{
+    if (!len)
+        return;
+
+    if (gs->size + len > gs->maxsize) {
+        gs->maxsize = ALIGN(gs->size + len, 0x10000);
+        gs->data = Z_Realloc(gs->data, gs->maxsize);
+    }
+    memcpy(gs->data + gs->size, data, len);
+    gs->size += len;
+}
+
+// starts recording gamestate sent to sv_client
+static void begin_gamestate(void)
+{
+    gamestate_t *gs, *oldest = NULL;
+    int i;
+
+    gamestate_record = NULL;
+
+    if (!gamestate_cacheable())
+        return;
+
+    for (i = 0, gs = gamestates; i < MAX_CACHED_GAMESTATES; i++, gs++) {
+        if (!gs->valid || gs->generation != gamestate_generation || gs->spawncount != sv.spawncount) {
+            oldest = gs;
+            break;
+        }
+        if (!oldest || gs->lastused < oldest->lastused)
+            oldest = gs;
+    }
+
+    gs = oldest;
+    gs->valid = false;
+    gs->size = 0;
+    gamestate_record = gs;
+}
+
+static void end_gamestate(void)
+{
+    gamestate_t *gs = gamestate_record;
+    int i;
+
+    if (!gs)
+        return;
+
+    gamestate_record = NULL;
+
+    // save baselines client got
+    for (i = 0; i < SV_BASELINES_CHUNKS; i++) {
+        if (!sv_client->baselines[i]) {
+            Z_Freep((void**)&gs->baselines[i]);
+            continue;
+        }
+        if (!gs->baselines[i])
+            gs->baselines[i] = SV_Malloc(sizeof(entity_packed_t) * SV_BASELINES_PER_CHUNK);
+        memcpy(gs->baselines[i], sv_client->baselines[i], sizeof(entity_packed_t) * SV_BASELINES_PER_CHUNK);
+    }
+
+    gs->valid = true;
+    gs->generation = gamestate_generation;
+    gs->lastused = ++gamestate_sequence;
+    gs->spawncount = sv.spawncount;
+    gs->protocol = sv_client->protocol;
+    gs->version = sv_client->version;
+    gs->nctype = sv_client->netchan.type;
+    gs->maxpacketlen = sv_client->netchan.maxpacketlen;
+    gs->esFlags = sv_client->esFlags;
+    gs->csr = sv_client->csr;
+    gs->has_zlib = sv_client->has_zlib;
+
+    Com_DPrintf("Cached %zu bytes of gamestate for protocol %d\n",
+                gs->size, gs->protocol);
+}
+
+static void copy_baselines(const gamestate_t *gs)
+{
+    entity_packed_t **chunk;
+    int i;
+
+    for (i = 0; i < SV_BASELINES_CHUNKS; i++) {
+        chunk = &sv_client->baselines[i];
+        if (!gs->baselines[i]) {
+            if (*chunk)
+                memset(*chunk, 0, sizeof(entity_packed_t) * SV_BASELINES_PER_CHUNK);
+            continue;
+        }
+        if (!*chunk)
+            *chunk = SV_Malloc(sizeof(entity_packed_t) * SV_BASELINES_PER_CHUNK);
+        memcpy(*chunk, gs->baselines[i], sizeof(entity_packed_t) * SV_BASELINES_PER_CHUNK);
+    }
+}
+
+static void replay_gamestate(const gamestate_t *gs)
+{
+    const byte *data = gs->data, *end = gs->data + gs->size;
+    uint32_t len[2];
+
+    while (data < end) {
+        memcpy(len, data, sizeof(len));
+        data += sizeof(len);
+        if (len[1])
+            sv_client->AddMessage(sv_client, (byte *)data + len[0], len[1], true);
+        else
+            sv_client->AddMessage(sv_client, (byte *)data, len[0], true);
+        data += len[0] + len[1];
+    }
+}
+
+// adds gamestate message to the client, compressing it if possible
+static void add_gamestate(void)
+{
+    gamestate_t *gs = gamestate_record;
+    uint32_t len[2];
+    byte *data;
+    int zlen;
+
+    if (!msg_write.cursize)
+        return;
+
+    data = SV_CompressMessage(sv_client, &zlen);
+
+    if (gs) {
+        len[0] = msg_write.cursize;
+        len[1] = data ? zlen : 0;
+        gamestate_write(gs, len, sizeof(len));
+        gamestate_write(gs, msg_write.data, len[0]);
+        gamestate_write(gs, data, len[1]);
+    }
+
+    if (data)
+        sv_client->AddMessage(sv_client, data, zlen, true);
+    else
+        sv_client->AddMessage(sv_client, msg_write.data, msg_write.cursize, true);
+
+    SZ_Clear(&msg_write);
+}
+
+/*
+================
+SV_InvalidateGamestate
+
+Called when configstrings change.
+================
+*/
+void SV_InvalidateGamestate(void)
+{
+    gamestate_generation++;
+}
+
+void SV_ShutdownGamestateCache(void)
+{
+    gamestate_t *gs;
+    int i, j;
+
+    for (i = 0, gs = gamestates; i < MAX_CACHED_GAMESTATES; i++, gs++) {
+        Z_Free(gs->data);
+        for (j = 0; j < SV_BASELINES_CHUNKS; j++)
+            Z_Free(gs->baselines[j]);
+    }
+
+    memset(gamestates, 0, sizeof(gamestates));
+    gamestate_record = NULL;
+}
+
 static void maybe_flush_msg(size_t size)
 {
     size += msg_write.cursize;
@@ -97,7 +346,7 @@ static void maybe_flush_msg(size_t size)
         size = ZPACKET_HEADER + deflateBound(&svs.z, size);
 #endif
     if (size > sv_client->netchan.maxpacketlen)
-        SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+        add_gamestate();
 }
 
 static void write_configstrings(void)
@@ -123,7 +372,7 @@ static void write_configstrings(void)
         MSG_WriteByte(0);
     }
 
-    SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+    add_gamestate();
 }
 
 static void write_baseline(entity_packed_t *base)
@@ -160,7 +409,7 @@ static void write_baselines(void)
         }
     }
 
-    SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+    add_gamestate();
 }
 
 static void write_configstring_stream(void)
@@ -182,7 +431,7 @@ static void write_configstring_stream(void)
         // check if this configstring will overflow
         if (msg_write.cursize + length + 4 > msg_write.maxsize) {
             MSG_WriteShort(sv_client->csr->end);
-            SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+            add_gamestate();
             MSG_WriteByte(svc_configstringstream);
         }
 
@@ -192,7 +441,7 @@ static void write_configstring_stream(void)
     }
 
     MSG_WriteShort(sv_client->csr->end);
-    SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+    add_gamestate();
 }
 
 static void write_baseline_stream(void)
@@ -215,7 +464,7 @@ static void write_baseline_stream(void)
             // check if this baseline will overflow
             if (msg_write.cursize + MAX_PACKETENTITY_BYTES > msg_write.maxsize) {
                 MSG_WriteShort(0);
-                SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+                add_gamestate();
                 MSG_WriteByte(svc_baselinestream);
             }
             write_baseline(base);
@@ -223,7 +472,7 @@ static void write_baseline_stream(void)
     }
 
     MSG_WriteShort(0);
-    SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+    add_gamestate();
 }
 
 static void write_gamestate(void)
@@ -263,7 +512,7 @@ static void write_gamestate(void)
     }
     MSG_WriteShort(0);   // end of baselines
 
-    SV_ClientAddMessage(sv_client, MSG_GAMESTATE);
+    add_gamestate();
 }
 
 static void stuff_cmds(list_t *list)
@@ -353,6 +602,7 @@ This will be sent on the initial connection and upon each server load.
 void SV_New_f(void)
 {
     clstate_t oldstate;
+    gamestate_t *gs;
 
     Com_DPrintf("New() from %s\n", sv_client->name);
 
@@ -383,8 +633,13 @@ void SV_New_f(void)
     // to make sure the protocol is right, and to set the gamedir
     //
 
-    // create baselines for this client
-    SV_CreateBaselines();
+    // create baselines for this client, or copy them from the cached
+    // gamestate that will be sent
+    gs = find_gamestate();
+    if (gs)
+        copy_baselines(gs);
+    else
+        SV_CreateBaselines();
 
     // send the serverdata
     MSG_WriteByte(svc_serverdata);
@@ -466,17 +721,23 @@ void SV_New_f(void)
     if (sv.state == ss_pic || sv.state == ss_cinematic)
         return;
 
-    // send gamestate
-    if (sv_client->netchan.type == NETCHAN_NEW) {
-        if (sv_client->version >= PROTOCOL_VERSION_Q2PRO_EXTENDED_LIMITS) {
-            write_configstring_stream();
-            write_baseline_stream();
+    // send gamestate, using cached copy if still valid
+    if (gs && gs == find_gamestate()) {
+        replay_gamestate(gs);
+    } else {
+        begin_gamestate();
+        if (sv_client->netchan.type == NETCHAN_NEW) {
+            if (sv_client->version >= PROTOCOL_VERSION_Q2PRO_EXTENDED_LIMITS) {
+                write_configstring_stream();
+                write_baseline_stream();
+            } else {
+                write_gamestate();
+            }
         } else {
-            write_gamestate();
+            write_configstrings();
+            write_baselines();
         }
-    } else {
-        write_configstrings();
-        write_baselines();
+        end_gamestate();
     }
 
     // send next command
@@ -546,9 +807,195 @@ void SV_Begin_f(void)
 
 //=============================================================================
 
+/*
+============================================================
+
+DOWNLOAD CACHE
+
+Downloaded files are read (or memory mapped, if stored uncompressed in a
+pack) once and shared by all clients fetching the same file. Files served to
+clients supporting compressed downloads are deflated once as well. Entries
+are keyed by file size and modification time, so that updated files are
+picked up. Unreferenced entries are kept around until sv_download_cache
+megabytes are exceeded.
+============================================================
+*/
+
+typedef enum {
+    DL_RAW,         // file contents
+    DL_PACKED,      // raw deflate stream from .pkz
+    DL_DEFLATE      // file contents, deflated by server if worth it
+} dltype_t;
+
+typedef struct sv_download_s {
+    list_t          entry;
+    int             refcount;
+
+    // key
+    dltype_t        type;
+    int64_t         filesize;
+    time_t          mtime;
+
+    int             cmd;        // svc_(z)download
+    fs_mapping_t    map;
+    byte            *data;
+    int             size;
+    char            name[1];
+} sv_download_t;
+
+static LIST_DECL(sv_downloads);
+static size_t   sv_download_bytes;
+
+static void free_download(sv_download_t *dl)
+{
+    List_Remove(&dl->entry);
+    sv_download_bytes -= dl->size;
+
+    if (dl->map.data)
+        FS_UnmapFile(&dl->map);
+    else
+        Z_Free(dl->data);
+    Z_Free(dl);
+}
+
+// frees least recently used entries that are not being downloaded
+static void trim_downloads(void)
+{
+    sv_download_t *dl, *next;
+    size_t limit = (size_t)Cvar_ClampInteger(sv_download_cache, 0, 4096) << 20;
+
+    LIST_FOR_EACH_SAFE(sv_download_t, dl, next, &sv_downloads, entry) {
+        if (sv_download_bytes <= limit)
+            break;
+        if (!dl->refcount)
+            free_download(dl);
+    }
+}
+
+static sv_download_t *find_download(const char *name, dltype_t type, const file_info_t *info)
+{
+    sv_download_t *dl, *next;
+
+    LIST_FOR_EACH_SAFE(sv_download_t, dl, next, &sv_downloads, entry) {
+        if (dl->type != type || FS_pathcmp(dl->name, name))
+            continue;
+
+        if (dl->filesize == info->size && dl->mtime == info->mtime) {
+            // move to the end of LRU list
+            List_Remove(&dl->entry);
+            List_Append(&sv_downloads, &dl->entry);
+            return dl;
+        }
+
+        // file changed on disk
+        if (!dl->refcount)
+            free_download(dl);
+    }
+
+    return NULL;
+}
+
+#if USE_ZLIB
+// replaces download data with deflated version, if it is smaller
+static void deflate_download(sv_download_t *dl)
+{
+    z_streamp z = &svs.z;
+    byte *buf;
+    size_t len;
+    int ret;
+
+    len = deflateBound(z, dl->size);
+    buf = SV_Malloc(len);
+
+    z->next_in = dl->data;
+    z->avail_in = dl->size;
+    z->next_out = buf;
+    z->avail_out = len;
+
+    ret = deflate(z, Z_FINISH);
+    len = z->total_out;
+
+    deflateReset(z);
+
+    if (ret != Z_STREAM_END || len >= dl->size) {
+        Z_Free(buf);
+        return;
+    }
+
+    if (dl->map.data)
+        FS_UnmapFile(&dl->map);
+    else
+        Z_Free(dl->data);
+
+    dl->data = Z_Realloc(buf, len);
+    dl->size = len;
+    dl->cmd = svc_zdownload;
+}
+#endif
+
+static sv_download_t *load_download(const char *name, dltype_t type,
+                                    const file_info_t *info, qhandle_t f)
+{
+    sv_download_t *dl;
+    size_t len = strlen(name);
+    int ret;
+
+    dl = SV_Mallocz(sizeof(*dl) + len);
+    memcpy(dl->name, name, len + 1);
+    dl->type = type;
+    dl->filesize = info->size;
+    dl->mtime = info->mtime;
+    dl->cmd = type == DL_PACKED ? svc_zdownload : svc_download;
+    dl->size = info->size;
+
+    if (FS_MapHandle(f, &dl->map) == Q_ERR_SUCCESS) {
+        dl->data = dl->map.data;
+    } else {
+        dl->data = SV_Malloc(dl->size);
+        ret = FS_Read(dl->data, dl->size, f);
+        if (ret != dl->size) {
+            Z_Free(dl->data);
+            Z_Free(dl);
+            return NULL;
+        }
+    }
+
+#if USE_ZLIB
+    if (type == DL_DEFLATE)
+        deflate_download(dl);
+#endif
+
+    List_Append(&sv_downloads, &dl->entry);
+    sv_download_bytes += dl->size;
+    return dl;
+}
+
+static void release_download(sv_download_t *dl)
+{
+    Q_assert(dl->refcount > 0);
+    dl->refcount--;
+    trim_downloads();
+}
+
+void SV_ShutdownDownloadCache(void)
+{
+    sv_download_t *dl, *next;
+
+    LIST_FOR_EACH_SAFE(sv_download_t, dl, next, &sv_downloads, entry)
+        free_download(dl);
+
+    Q_assert(!sv_download_bytes);
+}
+
+//=============================================================================
+
 void SV_CloseDownload(client_t *client)
 {
-    Z_Freep((void**)&client->download);
+    if (client->downloadref) {
+        release_download(client->downloadref);
+        client->downloadref = NULL;
+    }
+    client->download = NULL;
     Z_Freep((void**)&client->downloadname);
     client->downloadsize = 0;
     client->downloadcount = 0;
@@ -577,13 +1024,14 @@ SV_BeginDownload_f
 static void SV_BeginDownload_f(void)
 {
     char    name[MAX_QPATH];
-    byte    *download;
-    int     downloadcmd;
+    sv_download_t *download;
+    dltype_t downloadtype;
     int64_t downloadsize;
-    int     maxdownloadsize, result, offset = 0;
+    int     maxdownloadsize, offset = 0;
     cvar_t  *allow;
     size_t  len;
     qhandle_t f;
+    file_info_t info;
 
     if (Cmd_ArgvBuffer(1, name, sizeof(name)) >= sizeof(name)) {
         goto fail1;
@@ -648,7 +1096,7 @@ static void SV_BeginDownload_f(void)
     }
 
     f = 0;
-    downloadcmd = svc_download;
+    downloadtype = DL_RAW;
 
 #if USE_ZLIB
     // prefer raw deflate stream from .pkz if supported
@@ -658,7 +1106,10 @@ static void SV_BeginDownload_f(void)
         downloadsize = FS_OpenFile(name, &f, FS_MODE_READ | FS_FLAG_DEFLATE);
         if (f) {
             Com_DPrintf("Serving compressed download to %s\n", sv_client->name);
-            downloadcmd = svc_zdownload;
+            downloadtype = DL_PACKED;
+        } else {
+            // otherwise deflate it ourselves
+            downloadtype = DL_DEFLATE;
         }
     }
 #endif
@@ -705,27 +1156,36 @@ static void SV_BeginDownload_f(void)
         return;
     }
 
-    download = SV_Malloc(downloadsize);
-    result = FS_Read(download, downloadsize, f);
-    if (result != downloadsize) {
-        Com_DPrintf("Couldn't download %s to %s\n", name, sv_client->name);
-        goto fail3;
+    if (FS_GetFileInfo(f, &info)) {
+        info.size = downloadsize;
+        info.mtime = 0;
+    }
+
+    download = find_download(name, downloadtype, &info);
+    if (!download) {
+        download = load_download(name, downloadtype, &info, f);
+        if (!download) {
+            Com_DPrintf("Couldn't download %s to %s\n", name, sv_client->name);
+            goto fail2;
+        }
     }
 
     FS_CloseFile(f);
 
-    sv_client->download = download;
-    sv_client->downloadsize = downloadsize;
+    download->refcount++;
+    trim_downloads();
+
+    sv_client->downloadref = download;
+    sv_client->download = download->data;
+    sv_client->downloadsize = download->size;
     sv_client->downloadcount = offset;
     sv_client->downloadname = SV_CopyString(name);
-    sv_client->downloadcmd = downloadcmd;
+    sv_client->downloadcmd = download->cmd;
     sv_client->downloadpending = true;
 
     Com_DPrintf("Downloading %s to %s\n", name, sv_client->name);
     return;
 
-fail3:
-    Z_Free(download);
 fail2:
     FS_CloseFile(f);
 fail1:
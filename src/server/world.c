@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // world.c -- world query functions
 
 #include "server.h"
+#include "common/async.h"
 
 /*
 ===============================================================================
@@ -36,10 +37,20 @@ typedef struct areanode_s {
     list_t  solid_edicts;
 } areanode_t;
 
-#define    AREA_DEPTH    4
-#define    AREA_NODES    32
+#define    AREA_DEPTH       4       // depth of classic tree
+#define    AREA_MAX_DEPTH   10
+#define    AREA_MAX_NODES   (2 << AREA_MAX_DEPTH)
+#define    AREA_MIN_SIZE    256     // adaptive tree stops splitting below twice this
+#define    AREA_LEAF_EDICTS 16      // target number of edicts per leaf
 
-static areanode_t   sv_areanodes[AREA_NODES];
+// sv_area_tree modes
+enum {
+    AREA_CLASSIC,       // uniform tree of fixed depth
+    AREA_ADAPTIVE,      // depth sized from map bounds and edict count
+    AREA_BALANCED,      // like adaptive, split at entity medians after spawn
+};
+
+static areanode_t   sv_areanodes[AREA_MAX_NODES];
 static int          sv_numareanodes;
 
 static const vec_t  *area_mins, *area_maxs;
@@ -47,14 +58,74 @@ static edict_t      **area_list;
 static int          area_count, area_maxcount;
 static int          area_type;
 
+// entity centers used for picking split planes in balanced mode
+static vec3_t       *area_centers;
+static int          area_numcenters;
+
+// box queries recorded for areabench
+typedef struct {
+    vec3_t  mins, maxs;
+    int     type;
+} area_query_t;
+
+static area_query_t *area_record;
+static int          area_record_count;
+static int          area_record_max;
+
+/*
+===============
+SV_AreaSplitDist
+
+Returns median of entity centers inside the node along the axis, or node
+midpoint if there are too few entities to balance.
+===============
+*/
+static float SV_AreaSplitDist(int axis, const vec3_t mins, const vec3_t maxs)
+{
+    float   mid = 0.5f * (maxs[axis] + mins[axis]);
+    float   *values, v;
+    int     i, j, count;
+
+    if (!area_numcenters)
+        return mid;
+
+    values = Z_Malloc(sizeof(values[0]) * area_numcenters);
+    count = 0;
+    for (i = 0; i < area_numcenters; i++) {
+        for (j = 0; j < 3; j++)
+            if (area_centers[i][j] < mins[j] || area_centers[i][j] > maxs[j])
+                break;
+        if (j == 3)
+            values[count++] = area_centers[i][axis];
+    }
+
+    if (count >= AREA_LEAF_EDICTS) {
+        // insertion sort is fine, only done once per map
+        for (i = 1; i < count; i++) {
+            v = values[i];
+            for (j = i; j > 0 && values[j - 1] > v; j--)
+                values[j] = values[j - 1];
+            values[j] = v;
+        }
+        v = values[count / 2];
+
+        // keep both halves reasonably sized
+        if (v - mins[axis] >= AREA_MIN_SIZE / 2 && maxs[axis] - v >= AREA_MIN_SIZE / 2)
+            mid = v;
+    }
+
+    Z_Free(values);
+    return mid;
+}
+
 /*
 ===============
 SV_CreateAreaNode
 
-Builds a uniformly subdivided tree for the given world size
+Builds a subdivided tree for the given world size
 ===============
 */
-static areanode_t *SV_CreateAreaNode(int depth, const vec3_t mins, const vec3_t maxs)
+static areanode_t *SV_CreateAreaNode(int depth, int maxdepth, const vec3_t mins, const vec3_t maxs)
 {
     areanode_t  *anode;
     vec3_t      size;
@@ -66,19 +137,21 @@ static areanode_t *SV_CreateAreaNode(int depth, const vec3_t mins, const vec3_t
     List_Init(&anode->trigger_edicts);
     List_Init(&anode->solid_edicts);
 
-    if (depth == AREA_DEPTH) {
+    VectorSubtract(maxs, mins, size);
+
+    if (depth == maxdepth || (maxdepth > AREA_DEPTH &&
+        size[0] < AREA_MIN_SIZE * 2 && size[1] < AREA_MIN_SIZE * 2)) {
         anode->axis = -1;
         anode->children[0] = anode->children[1] = NULL;
         return anode;
     }
 
-    VectorSubtract(maxs, mins, size);
     if (size[0] > size[1])
         anode->axis = 0;
     else
         anode->axis = 1;
 
-    anode->dist = 0.5f * (maxs[anode->axis] + mins[anode->axis]);
+    anode->dist = SV_AreaSplitDist(anode->axis, mins, maxs);
     VectorCopy(mins, mins1);
     VectorCopy(mins, mins2);
     VectorCopy(maxs, maxs1);
@@ -86,12 +159,41 @@ static areanode_t *SV_CreateAreaNode(int depth, const vec3_t mins, const vec3_t
 
     maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
 
-    anode->children[0] = SV_CreateAreaNode(depth + 1, mins2, maxs2);
-    anode->children[1] = SV_CreateAreaNode(depth + 1, mins1, maxs1);
+    anode->children[0] = SV_CreateAreaNode(depth + 1, maxdepth, mins2, maxs2);
+    anode->children[1] = SV_CreateAreaNode(depth + 1, maxdepth, mins1, maxs1);
 
     return anode;
 }
 
+// picks tree depth for the given mode
+static int SV_AreaDepth(int mode)
+{
+    int depth, leafs;
+
+    if (mode == AREA_CLASSIC)
+        return AREA_DEPTH;
+
+    leafs = ge->max_edicts / AREA_LEAF_EDICTS;
+    for (depth = AREA_DEPTH; depth < AREA_MAX_DEPTH; depth++)
+        if ((1 << depth) >= leafs)
+            break;
+
+    return depth;
+}
+
+static void SV_CreateAreaNodes(int mode)
+{
+    mmodel_t *cm;
+
+    memset(sv_areanodes, 0, sizeof(sv_areanodes));
+    sv_numareanodes = 0;
+
+    if (sv.cm.cache) {
+        cm = &sv.cm.cache->models[0];
+        SV_CreateAreaNode(0, SV_AreaDepth(mode), cm->mins, cm->maxs);
+    }
+}
+
 /*
 ===============
 SV_ClearWorld
@@ -100,17 +202,15 @@ SV_ClearWorld
 */
 void SV_ClearWorld(void)
 {
-    mmodel_t *cm;
     edict_t *ent;
     int i;
 
-    memset(sv_areanodes, 0, sizeof(sv_areanodes));
-    sv_numareanodes = 0;
+    // recorded queries are only meaningful for one map
+    Z_Freep((void **)&area_record);
+    area_record_count = area_record_max = 0;
 
-    if (sv.cm.cache) {
-        cm = &sv.cm.cache->models[0];
-        SV_CreateAreaNode(0, cm->mins, cm->maxs);
-    }
+    // balanced tree is built by SV_RebalanceWorld when entities are spawned
+    SV_CreateAreaNodes(Cvar_ClampInteger(sv_area_tree, AREA_CLASSIC, AREA_BALANCED));
 
     // make sure all entities are unlinked
     for (i = 0; i < ge->max_edicts; i++) {
@@ -119,6 +219,64 @@ void SV_ClearWorld(void)
     }
 }
 
+static void SV_LinkToAreaNode(edict_t *ent);
+
+/*
+===============
+SV_RebuildAreaNodes
+
+Rebuilds the tree and relinks all linked entities into it. If balance is
+set, split planes are placed at medians of entity positions.
+===============
+*/
+static void SV_RebuildAreaNodes(int mode)
+{
+    static edict_t *linked[MAX_EDICTS];
+    edict_t *ent;
+    int i, count;
+
+    if (!sv.cm.cache)
+        return;
+
+    // unlink everything
+    count = 0;
+    for (i = 1; i < ge->num_edicts; i++) {
+        ent = EDICT_NUM(i);
+        if (!ent->area.prev)
+            continue;
+        PF_UnlinkEdict(ent);
+        linked[count++] = ent;
+    }
+
+    if (mode == AREA_BALANCED && count) {
+        area_centers = Z_Malloc(sizeof(area_centers[0]) * count);
+        for (i = 0; i < count; i++)
+            VectorAvg(linked[i]->absmin, linked[i]->absmax, area_centers[i]);
+        area_numcenters = count;
+    }
+
+    SV_CreateAreaNodes(mode);
+
+    Z_Freep((void **)&area_centers);
+    area_numcenters = 0;
+
+    for (i = 0; i < count; i++)
+        SV_LinkToAreaNode(linked[i]);
+}
+
+/*
+===============
+SV_RebalanceWorld
+
+Called after entities are spawned and settled.
+===============
+*/
+void SV_RebalanceWorld(void)
+{
+    if (sv_area_tree->integer == AREA_BALANCED)
+        SV_RebuildAreaNodes(AREA_BALANCED);
+}
+
 /*
 ===============
 SV_LinkEdict
@@ -266,7 +424,6 @@ static uint32_t SV_PackSolid32(edict_t *ent)
 
 void PF_LinkEdict(edict_t *ent)
 {
-    areanode_t *node;
     server_entity_t *sent;
     int entnum;
 #if USE_FPS
@@ -338,6 +495,13 @@ void PF_LinkEdict(edict_t *ent)
     if (ent->solid == SOLID_NOT)
         return;
 
+    SV_LinkToAreaNode(ent);
+}
+
+static void SV_LinkToAreaNode(edict_t *ent)
+{
+    areanode_t *node;
+
 // find the first node that the ent's box crosses
     node = sv_areanodes;
     while (1) {
@@ -414,6 +578,13 @@ SV_AreaEdicts
 int SV_AreaEdicts(const vec3_t mins, const vec3_t maxs,
                   edict_t **list, int maxcount, int areatype)
 {
+    if (q_unlikely(area_record) && area_record_count < area_record_max) {
+        area_query_t *q = &area_record[area_record_count++];
+        VectorCopy(mins, q->mins);
+        VectorCopy(maxs, q->maxs);
+        q->type = areatype;
+    }
+
     area_mins = mins;
     area_maxs = maxs;
     area_list = list;
@@ -427,6 +598,95 @@ int SV_AreaEdicts(const vec3_t mins, const vec3_t maxs,
 }
 
 
+/*
+================
+SV_AreaBench_f
+
+Records box queries made by the game and replays them against area trees
+built in each sv_area_tree mode, checking that all modes return the same
+entities. The tree is rebuilt in the configured mode when done.
+================
+*/
+void SV_AreaBench_f(void)
+{
+    static edict_t *list[MAX_EDICTS];
+    static const char *const modes[] = { "classic", "adaptive", "balanced" };
+    uint32_t    sums[q_countof(modes)];
+    uint64_t    start, time;
+    const char  *cmd = Cmd_Argv(1);
+    int         i, j, k, num, mode, iterations, results;
+    uint32_t    sum;
+
+    if (!sv.cm.cache || sv.state != ss_game) {
+        Com_Printf("No map loaded.\n");
+        return;
+    }
+
+    if (!strcmp(cmd, "record")) {
+        Z_Free(area_record);
+        area_record_max = Cmd_Argc() > 2 ? Q_clip(atoi(Cmd_Argv(2)), 1, 1000000) : 100000;
+        area_record_count = 0;
+        area_record = Z_Malloc(sizeof(area_record[0]) * area_record_max);
+        Com_Printf("Recording %d area queries.\n", area_record_max);
+        return;
+    }
+
+    if (strcmp(cmd, "replay")) {
+        Com_Printf("Usage: %s <record [count]|replay [iterations]>\n", Cmd_Argv(0));
+        if (area_record)
+            Com_Printf("%d of %d queries recorded.\n", area_record_count, area_record_max);
+        return;
+    }
+
+    if (!area_record_count) {
+        Com_Printf("No area queries recorded.\n");
+        return;
+    }
+
+    // stop recording
+    area_record_max = area_record_count;
+
+    iterations = Cmd_Argc() > 2 ? Q_clip(atoi(Cmd_Argv(2)), 1, 10000) : 10;
+
+    Com_Printf("%d queries, %d iterations\n", area_record_count, iterations);
+    Com_Printf("mode     depth nodes    time/replay results  match\n"
+               "-------- ----- ----- -------------- ------- -----\n");
+
+    for (mode = 0; mode < q_countof(modes); mode++) {
+        SV_RebuildAreaNodes(mode);
+
+        // order of results depends on the tree, so compare them as sets
+        sums[mode] = 0;
+        results = 0;
+        for (i = 0; i < area_record_count; i++) {
+            area_query_t *q = &area_record[i];
+            num = SV_AreaEdicts(q->mins, q->maxs, list, MAX_EDICTS, q->type);
+            sum = 0;
+            for (j = 0; j < num; j++)
+                sum += (NUM_FOR_EDICT(list[j]) + 1) * 2654435761u;
+            sums[mode] = (sums[mode] ^ sum) * 0x01000193;
+            results += num;
+        }
+
+        start = Sys_Microseconds();
+        for (k = 0; k < iterations; k++) {
+            for (i = 0; i < area_record_count; i++) {
+                area_query_t *q = &area_record[i];
+                SV_AreaEdicts(q->mins, q->maxs, list, MAX_EDICTS, q->type);
+            }
+        }
+        time = Sys_Microseconds() - start;
+
+        Com_Printf("%-8s %5d %5d %12.1fus %7.2f %5s\n", modes[mode],
+                   SV_AreaDepth(mode), sv_numareanodes, (double)time / iterations,
+                   (double)results / area_record_count,
+                   sums[mode] == sums[0] ? "yes" : "NO");
+    }
+
+    // entities may have moved since recording, but that doesn't matter
+    SV_RebuildAreaNodes(Cvar_ClampInteger(sv_area_tree, AREA_CLASSIC, AREA_BALANCED));
+}
+
 //===========================================================================
 
 /*
@@ -469,7 +729,7 @@ int SV_PointContents(const vec3_t p)
     }
 
     // get base contents from world
-    contents = CM_PointContents(p, sv.cm.cache->nodes);
+    contents = CM_PointLeaf(&sv.cm, p)->contents;
 
     // or in contents from all the other entities
     num = SV_AreaEdicts(p, p, touch, MAX_EDICTS, AREA_SOLID);
@@ -578,3 +838,308 @@ trace_t q_gameabi SV_Trace(const vec3_t start, const vec3_t mins,
     return trace;
 }
 
+
+/*
+===============================================================================
+
+BATCHED TRACES
+
+===============================================================================
+*/
+
+#define MAX_TRACE_JOBS  8
+
+typedef struct {
+    const trace_request_t   *requests;
+    trace_t                 *results;
+    int                     count;
+    cm_trace_ctx_t          *ctx;
+} tracejob_t;
+
+// solid edicts touched by any move in the batch, with hulls
+static edict_t          *batch_edicts[MAX_EDICTS];
+static mnode_t          *batch_hulls[MAX_EDICTS];  // NULL for boxes
+static int              batch_count;
+
+static cm_trace_ctx_t   batch_ctx[MAX_TRACE_JOBS];
+static bool             batch_ctx_ready;
+
+static void SV_MoveBounds(const trace_request_t *req, vec3_t boxmins, vec3_t boxmaxs)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (req->end[i] > req->start[i]) {
+            boxmins[i] = req->start[i] + req->mins[i] - 1;
+            boxmaxs[i] = req->end[i] + req->maxs[i] + 1;
+        } else {
+            boxmins[i] = req->end[i] + req->mins[i] - 1;
+            boxmaxs[i] = req->start[i] + req->maxs[i] + 1;
+        }
+    }
+}
+
+// does the same as SV_Trace, using edicts gathered for the batch. Since area
+// nodes are walked in the same order, edicts are clipped in the same order.
+// May be called from worker threads, so must not throw errors.
+static void SV_BatchTrace(cm_trace_ctx_t *ctx, const trace_request_t *req, trace_t *tr)
+{
+    vec3_t      boxmins, boxmaxs;
+    int         i;
+    edict_t     *touch, *passedict = req->passent;
+    mnode_t     *hull;
+    trace_t     trace;
+
+    // clip to world
+    CM_BoxTraceCtx(ctx, tr, req->start, req->end, req->mins, req->maxs,
+                   sv.cm.cache->nodes, req->contentmask);
+    tr->ent = ge->edicts;
+    if (tr->fraction == 0) {
+        return;     // blocked by the world
+    }
+
+    SV_MoveBounds(req, boxmins, boxmaxs);
+
+    for (i = 0; i < batch_count; i++) {
+        touch = batch_edicts[i];
+        if (touch->absmin[0] > boxmaxs[0]
+            || touch->absmin[1] > boxmaxs[1]
+            || touch->absmin[2] > boxmaxs[2]
+            || touch->absmax[0] < boxmins[0]
+            || touch->absmax[1] < boxmins[1]
+            || touch->absmax[2] < boxmins[2])
+            continue;        // not touching this move
+        if (touch == passedict)
+            continue;
+        if (tr->allsolid)
+            return;
+        if (passedict) {
+            if (touch->owner == passedict)
+                continue;    // don't clip against own missiles
+            if (passedict->owner == touch)
+                continue;    // don't clip against owner
+        }
+
+        if (!(req->contentmask & CONTENTS_DEADMONSTER)
+            && (touch->svflags & SVF_DEADMONSTER))
+            continue;
+
+        hull = batch_hulls[i];
+        if (!hull)
+            hull = CM_HeadnodeForBoxCtx(ctx, touch->mins, touch->maxs);
+
+        // might intersect, so do an exact clip
+        CM_TransformedBoxTraceCtx(ctx, &trace, req->start, req->end,
+                                  req->mins, req->maxs, hull, req->contentmask,
+                                  touch->s.origin, touch->s.angles);
+
+        CM_ClipEntity(tr, &trace, touch);
+    }
+}
+
+static void SV_TraceJob(void *arg)
+{
+    tracejob_t *job = arg;
+
+    for (int i = 0; i < job->count; i++)
+        SV_BatchTrace(job->ctx, &job->requests[i], &job->results[i]);
+}
+
+/*
+==================
+SV_TraceBatch
+
+Same as calling SV_Trace for each request. Solid edicts touched by any
+of the moves are gathered once, and batches of at least sv_trace_jobs
+moves are split across worker threads.
+==================
+*/
+void SV_TraceBatch(const trace_request_t *requests, trace_t *results, int count)
+{
+    tracejob_t  jobs[MAX_TRACE_JOBS];
+    jobcounter_t counter;
+    vec3_t      mins, maxs, boxmins, boxmaxs;
+    edict_t     *touch;
+    int         i, j, numjobs;
+
+    if (!sv.cm.cache) {
+        Com_Error(ERR_DROP, "%s: no map loaded", __func__);
+    }
+
+    if (count <= 0)
+        return;
+
+    // gather edicts for bounds of all moves
+    SV_MoveBounds(&requests[0], mins, maxs);
+    for (i = 1; i < count; i++) {
+        SV_MoveBounds(&requests[i], boxmins, boxmaxs);
+        for (j = 0; j < 3; j++) {
+            mins[j] = min(mins[j], boxmins[j]);
+            maxs[j] = max(maxs[j], boxmaxs[j]);
+        }
+    }
+
+    batch_count = 0;
+    j = SV_AreaEdicts(mins, maxs, batch_edicts, MAX_EDICTS, AREA_SOLID);
+
+    // hulls are looked up here, so that errors are thrown on main thread
+    for (i = 0; i < j; i++) {
+        touch = batch_edicts[i];
+        if (touch->solid == SOLID_NOT)
+            continue;
+        batch_edicts[batch_count] = touch;
+        batch_hulls[batch_count] = touch->solid == SOLID_BSP ? SV_HullForEntity(touch) : NULL;
+        batch_count++;
+    }
+
+    if (!batch_ctx_ready) {
+        for (i = 0; i < MAX_TRACE_JOBS; i++)
+            CM_InitTraceCtx(&batch_ctx[i]);
+        batch_ctx_ready = true;
+    }
+
+    numjobs = 1;
+    if (sv_trace_jobs->integer > 0 && count >= sv_trace_jobs->integer)
+        numjobs = Q_clip(Com_NumWorkers(), 1, MAX_TRACE_JOBS);
+
+    for (i = 0; i < numjobs; i++) {
+        jobs[i].requests = requests + count * i / numjobs;
+        jobs[i].results = results + count * i / numjobs;
+        jobs[i].count = count * (i + 1) / numjobs - count * i / numjobs;
+        jobs[i].ctx = &batch_ctx[i];
+    }
+
+    if (numjobs == 1) {
+        SV_TraceJob(&jobs[0]);
+        return;
+    }
+
+    memset(&counter, 0, sizeof(counter));
+    for (i = 0; i < numjobs; i++)
+        Com_QueueJob(SV_TraceJob, &jobs[i], &counter, NULL);
+    Com_WaitJobs(&counter);
+}
+
+static bool SV_TraceEqual(const trace_t *a, const trace_t *b)
+{
+    return a->allsolid == b->allsolid && a->startsolid == b->startsolid
+        && a->fraction == b->fraction && VectorCompare(a->endpos, b->endpos)
+        && VectorCompare(a->plane.normal, b->plane.normal)
+        && a->plane.dist == b->plane.dist && a->surface == b->surface
+        && a->contents == b->contents && a->ent == b->ent;
+}
+
+/*
+================
+SV_TraceBench_f
+
+Traces random moves between solid edicts one by one and in batches of
+the given size, checking both against the scalar trace code. Every fourth
+batch does position tests. Usage:
+tracebench [count] [batch size]
+================
+*/
+void SV_TraceBench_f(void)
+{
+    static const vec3_t sizes[][2] = {
+        { { 0, 0, 0 }, { 0, 0, 0 } },
+        { { -16, -16, -24 }, { 16, 16, 32 } },
+        { { -4, -4, -4 }, { 4, 4, 4 } },
+    };
+    trace_request_t *req;
+    trace_t     *scalar, *serial, *batch;
+    edict_t     *solid[MAX_EDICTS], *ent;
+    char        fastmode[MAX_QPATH];
+    uint64_t    start, time_scalar, time_serial, time_batch;
+    int         i, j, k, count, size, numsolid, failures[2];
+
+    if (!sv.cm.cache || sv.state != ss_game) {
+        Com_Printf("No map loaded.\n");
+        return;
+    }
+
+    count = Cmd_Argc() > 1 ? Q_clip(atoi(Cmd_Argv(1)), 1, 1000000) : 10000;
+    size = Cmd_Argc() > 2 ? Q_clip(atoi(Cmd_Argv(2)), 1, count) : 8;
+
+    numsolid = 0;
+    for (i = 1; i < ge->num_edicts; i++) {
+        ent = EDICT_NUM(i);
+        if (ent->inuse && ent->solid != SOLID_NOT)
+            solid[numsolid++] = ent;
+    }
+
+    req = Z_Malloc(sizeof(*req) * count);
+    scalar = Z_Malloc(sizeof(*scalar) * count);
+    serial = Z_Malloc(sizeof(*serial) * count);
+    batch = Z_Malloc(sizeof(*batch) * count);
+
+    // moves in each batch go from one spot towards another, like pellets
+    for (i = 0; i < count; i++) {
+        trace_request_t *r = &req[i];
+
+        if (i % size) {
+            *r = req[i - 1];
+        } else {
+            VectorClear(r->start);
+            VectorClear(r->end);
+            if (numsolid) {
+                VectorCopy(solid[Q_rand_uniform(numsolid)]->s.origin, r->start);
+                VectorCopy(solid[Q_rand_uniform(numsolid)]->s.origin, r->end);
+            }
+            for (j = 0; j < 3; j++)
+                r->start[j] += crand() * 64;
+
+            k = Q_rand_uniform(q_countof(sizes));
+            VectorCopy(sizes[k][0], r->mins);
+            VectorCopy(sizes[k][1], r->maxs);
+            r->passent = numsolid && Q_rand() & 1 ? solid[Q_rand_uniform(numsolid)] : NULL;
+            r->contentmask = Q_rand() & 1 ? MASK_SHOT : MASK_MONSTERSOLID;
+        }
+
+        for (j = 0; j < 3; j++)
+            r->end[j] += crand() * 64;
+    }
+
+    for (i = 0; i < count; i++)
+        if (i / size % 4 == 3)
+            VectorCopy(req[i].start, req[i].end);
+
+    // reference results from scalar code
+    Q_strlcpy(fastmode, Cvar_VariableString("map_fast_trace"), sizeof(fastmode));
+    Cvar_Set("map_fast_trace", "0");
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i++) {
+        scalar[i] = SV_Trace(req[i].start, req[i].mins, req[i].maxs,
+                             req[i].end, req[i].passent, req[i].contentmask);
+    }
+    time_scalar = Sys_Microseconds() - start;
+    Cvar_Set("map_fast_trace", fastmode);
+
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i++) {
+        serial[i] = SV_Trace(req[i].start, req[i].mins, req[i].maxs,
+                             req[i].end, req[i].passent, req[i].contentmask);
+    }
+    time_serial = Sys_Microseconds() - start;
+
+    start = Sys_Microseconds();
+    for (i = 0; i < count; i += size)
+        SV_TraceBatch(req + i, batch + i, min(size, count - i));
+    time_batch = Sys_Microseconds() - start;
+
+    failures[0] = failures[1] = 0;
+    for (i = 0; i < count; i++) {
+        failures[0] += !SV_TraceEqual(&scalar[i], &serial[i]);
+        failures[1] += !SV_TraceEqual(&scalar[i], &batch[i]);
+    }
+
+    Com_Printf("%d traces, %d solid edicts, batches of %d\n", count, numsolid, size);
+    Com_Printf("scalar %.1f ms, serial %.1f ms, batched %.1f ms\n",
+               time_scalar * 0.001, time_serial * 0.001, time_batch * 0.001);
+    Com_Printf("%d serial and %d batched mismatches\n", failures[0], failures[1]);
+
+    Z_Free(req);
+    Z_Free(scalar);
+    Z_Free(serial);
+    Z_Free(batch);
+}
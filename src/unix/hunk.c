@@ -17,6 +17,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "shared/shared.h"
+#include "common/zone.h"
 #include "system/hunk.h"
 #include <sys/mman.h>
 #include <errno.h>
@@ -30,7 +31,7 @@ void Hunk_Init(void)
     Q_assert(pagesize && !(pagesize & (pagesize - 1)));
 }
 
-void Hunk_Begin(memhunk_t *hunk, size_t maxsize)
+void Hunk_BeginAt(memhunk_t *hunk, size_t maxsize, const char *file, int line)
 {
     void *buf;
 
@@ -46,6 +47,8 @@ void Hunk_Begin(memhunk_t *hunk, size_t maxsize)
                   __func__, hunk->maxsize, strerror(errno));
     hunk->base = buf;
     hunk->mapped = hunk->maxsize;
+    hunk->site = Z_ProfileSite(file, line);
+    Z_ProfileAlloc(hunk->site, TAG_FREE, 0, 1);
 }
 
 void *Hunk_TryAlloc(memhunk_t *hunk, size_t size)
@@ -62,6 +65,7 @@ void *Hunk_TryAlloc(memhunk_t *hunk, size_t size)
 
     buf = (byte *)hunk->base + hunk->cursize;
     hunk->cursize += size;
+    Z_ProfileAlloc(hunk->site, TAG_FREE, size, 0);
     return buf;
 }
 
@@ -100,6 +104,9 @@ void Hunk_End(memhunk_t *hunk)
 
 void Hunk_Free(memhunk_t *hunk)
 {
+    if (hunk->base)
+        Z_ProfileFree(hunk->site, hunk->cursize, 1);
+
     if (hunk->base && munmap(hunk->base, hunk->mapped))
         Com_Error(ERR_FATAL, "%s: munmap failed: %s",
                   __func__, strerror(errno));
@@ -80,6 +80,13 @@ unsigned Sys_Milliseconds(void)
     return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
 }
 
+uint64_t Sys_Microseconds(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
 /*
 =================
 Sys_Quit
@@ -128,6 +135,13 @@ void Sys_Sleep(int msec)
     nanosleep(&req, NULL);
 }
 
+int Sys_NumCpus(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? count : 1;
+}
+
 const char *Sys_ErrorString(int err)
 {
     return strerror(err);
@@ -415,6 +429,35 @@ MISC
 ===============================================================================
 */
 
+/*
+=================
+Sys_MapFile
+=================
+*/
+void *Sys_MapFile(int fd, int64_t offset, size_t len, void **base, size_t *size)
+{
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(page - 1);
+    size_t delta = offset - start;
+    void *p;
+
+    if (!len)
+        return NULL;
+
+    p = mmap(NULL, delta + len, PROT_READ, MAP_PRIVATE, fd, start);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    *base = p;
+    *size = delta + len;
+    return (byte *)p + delta;
+}
+
+void Sys_UnmapFile(void *base, size_t size)
+{
+    munmap(base, size);
+}
+
 /*
 =================
 Sys_ListFiles_r
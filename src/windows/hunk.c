@@ -17,6 +17,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "shared/shared.h"
+#include "common/zone.h"
 #include "system/hunk.h"
 #include <windows.h>
 
@@ -31,7 +32,7 @@ void Hunk_Init(void)
     Q_assert(pagesize && !(pagesize & (pagesize - 1)));
 }
 
-void Hunk_Begin(memhunk_t *hunk, size_t maxsize)
+void Hunk_BeginAt(memhunk_t *hunk, size_t maxsize, const char *file, int line)
 {
     Q_assert(maxsize <= SIZE_MAX - (pagesize - 1));
 
@@ -43,6 +44,8 @@ void Hunk_Begin(memhunk_t *hunk, size_t maxsize)
         Com_Error(ERR_FATAL,
                   "VirtualAlloc reserve %zu bytes failed with error %lu",
                   hunk->maxsize, GetLastError());
+    hunk->site = Z_ProfileSite(file, line);
+    Z_ProfileAlloc(hunk->site, TAG_FREE, 0, 1);
 }
 
 void *Hunk_TryAlloc(memhunk_t *hunk, size_t size)
@@ -66,6 +69,7 @@ void *Hunk_TryAlloc(memhunk_t *hunk, size_t size)
                   "VirtualAlloc commit %zu bytes failed with error %lu",
                   hunk->cursize, GetLastError());
 
+    Z_ProfileAlloc(hunk->site, TAG_FREE, size, 0);
     return (byte *)hunk->base + hunk->cursize - size;
 }
 
@@ -87,6 +91,9 @@ void Hunk_End(memhunk_t *hunk)
 
 void Hunk_Free(memhunk_t *hunk)
 {
+    if (hunk->base)
+        Z_ProfileFree(hunk->site, hunk->cursize, 1);
+
     if (hunk->base && !VirtualFree(hunk->base, 0, MEM_RELEASE))
         Com_Error(ERR_FATAL, "VirtualFree failed with error %lu", GetLastError());
 
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <winsvc.h>
 #include <setjmp.h>
 #endif
+#include <io.h>
 
 HINSTANCE                       hGlobalInstance;
 
@@ -876,6 +877,54 @@ unsigned Sys_Milliseconds(void)
     return tm.QuadPart * 1000ULL / timer_freq.QuadPart;
 }
 
+uint64_t Sys_Microseconds(void)
+{
+    LARGE_INTEGER tm;
+    QueryPerformanceCounter(&tm);
+    return (tm.QuadPart / timer_freq.QuadPart) * 1000000ULL +
+           (tm.QuadPart % timer_freq.QuadPart) * 1000000ULL / timer_freq.QuadPart;
+}
+
+/*
+=================
+Sys_MapFile
+=================
+*/
+void *Sys_MapFile(int fd, int64_t offset, size_t len, void **base, size_t *size)
+{
+    SYSTEM_INFO si;
+    HANDLE mapping;
+    int64_t start;
+    size_t delta;
+    void *p;
+
+    if (!len)
+        return NULL;
+
+    GetSystemInfo(&si);
+    start = offset & ~(int64_t)(si.dwAllocationGranularity - 1);
+    delta = offset - start;
+
+    mapping = CreateFileMappingA((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+        return NULL;
+
+    // view keeps the mapping object alive
+    p = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, delta + len);
+    CloseHandle(mapping);
+    if (!p)
+        return NULL;
+
+    *base = p;
+    *size = delta + len;
+    return (byte *)p + delta;
+}
+
+void Sys_UnmapFile(void *base, size_t size)
+{
+    UnmapViewOfFile(base);
+}
+
 void Sys_AddDefaultConfig(void)
 {
 }
@@ -885,6 +934,14 @@ void Sys_Sleep(int msec)
     Sleep(msec);
 }
 
+int Sys_NumCpus(void)
+{
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return max(si.dwNumberOfProcessors, 1);
+}
+
 const char *Sys_ErrorString(int err)
 {
     static char buf[256];